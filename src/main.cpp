@@ -3,13 +3,25 @@
 #include <WiFiClientSecure.h>
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
+#include <AsyncMqttClient.h>
 #include <Adafruit_NeoPixel.h>
 #include <UniversalTelegramBot.h>
 #include <ArduinoJson.h>
 #include <SPI.h>
 #include <MFRC522.h>
 #include <SD.h>
+#include <HTTPClient.h>
 #include <time.h>
+#include <esp_system.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <hal/gpio_ll.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
 
 // Configuración WiFi
 const char* ssid = "xxxx";
@@ -19,6 +31,14 @@ const char* password = "xxxx";
 #define BOT_TOKEN "xxxx"
 #define CHAT_ID "xxxx"
 
+// Configuración MQTT (host vacío = sin flujo de eventos)
+const char* MQTT_HOST = "xxxx";
+const uint16_t MQTT_PORT = 1883;
+const char* MQTT_USER = "";
+const char* MQTT_PASSWORD = "";
+const char* MQTT_CLIENT_ID = "control-acceso";
+const uint8_t MQTT_QOS = 1; // 0: sin confirmación, 1: al menos una vez
+
 // Configuración NTP
 const char* ntpServer = "pool.ntp.org";
 const long gmtOffset_sec = 3600; // +1 hora (CEST)
@@ -32,6 +52,7 @@ const int RGB_LED_PIN = 21;         // LED RGB WS2812
 const int NUM_LEDS = 1;
 const int RFID_SS_PIN = 15;         // RFID RC522 SS (SDA)
 const int RFID_RST_PIN = 27;        // RFID RC522 RST
+const int RFID_IRQ_PIN = 34;        // RFID RC522 IRQ (-1: sondeo por SPI cada 50 ms)
 const int SD_CS_PIN = 16;           // Lector SD CS
 
 // Pines SPI para RFID (VSPI)
@@ -56,27 +77,603 @@ MFRC522 rfid(RFID_SS_PIN, RFID_RST_PIN);
 
 // Configuración SD
 #define SD_FILE "/access_log.txt"
+#define LOG_HEADER "Fecha y Hora,Método,ID,Usuario,Estado"
 #define USER_FILE "/users.txt"
-String accessHistory[15]; // Máximo 15 registros en memoria
+const int LOG_LINE_MAX = 256;
+const size_t UID_TEXT_SIZE = 32;  // "04 A3 1B 7F ..." para UIDs de hasta 10 bytes
+const size_t USER_NAME_SIZE = 32;
+const size_t MESSAGE_SIZE = 160;
+char accessHistory[15][LOG_LINE_MAX]; // Máximo 15 registros en memoria
 int historyCount = 0;
 
+// Lector de archivos de texto por bloques: una lectura de SD_READ_BLOCK bytes
+// (una orden de varios sectores) en vez de una llamada por byte, y cada línea
+// se entrega como vista sobre el bloque, sin copiarla ni reservar memoria. La
+// vista (sin "\r\n" y terminada en '\0') vale hasta la siguiente llamada a
+// next() y se puede partir en el sitio con splitFields(). Lo usan los archivos
+// de usuarios, horarios y réplica, y el registro de accesos a través de logRead
+const size_t SD_READ_BLOCK = 4096;
+
+class LineReader {
+ public:
+  typedef std::function<size_t(uint32_t offset, uint8_t* out, size_t length)> Source;
+  // Desde una posición cualquiera: si from cae a mitad de una línea, esa línea se salta
+  LineReader(const Source& source, uint32_t from, uint32_t to);
+  // Un archivo abierto desde el principio de una línea hasta el final
+  explicit LineReader(File& file, uint32_t from = 0);
+  ~LineReader() { delete[] block; }
+  LineReader(const LineReader&) = delete;
+  LineReader& operator=(const LineReader&) = delete;
+
+  bool next();
+  void trim();
+
+  char* line = nullptr;
+  int length = 0;
+  uint32_t offset = 0;    // Posición del primer byte de la línea
+  bool complete = false;  // false: última línea sin '\n' (escritura cortada)
+  bool truncated = false; // Línea más larga que SD_READ_BLOCK: solo su principio
+  bool failed = false;    // Falló una lectura o no hubo memoria para el bloque
+
+ private:
+  void emit(size_t from, size_t to, bool terminated);
+
+  Source source;
+  uint8_t* block;
+  uint32_t position;      // Siguiente byte que se pedirá a source
+  uint32_t end;           // Donde termina la lectura (UINT32_MAX: fin del archivo)
+  uint32_t blockOffset;   // Posición de block[0]
+  size_t head = 0, tail = 0; // Bytes del bloque aún sin entregar: [head, tail)
+  bool eof = false;
+  bool skipping = false;  // Descartando hasta el siguiente '\n'
+};
+
+// Horarios de acceso: reglas compiladas en mapas de bits semanales con
+// franjas de 15 minutos (7 x 96 bits) más un mapa diario para festivos
+#define SCHEDULE_FILE "/schedules.txt"
+#define HOLIDAY_FILE "/holidays.txt"
+const int SCHEDULE_SLOT_MINUTES = 15;
+const int SCHEDULE_SLOTS_PER_DAY = 24 * 60 / SCHEDULE_SLOT_MINUTES;
+const int SCHEDULE_WORDS = 7 * SCHEDULE_SLOTS_PER_DAY / 32;
+const int MAX_SCHEDULES = 16;
+const uint8_t SCHEDULE_UNKNOWN = 0xFF; // Nombre que no corresponde a ningún horario: deniega siempre
+const int MAX_HOLIDAYS = 64;
+
+struct Schedule {
+  char name[16];
+  char rules[48];
+  uint32_t week[SCHEDULE_WORDS];                 // Índice: tm_wday * 96 + franja
+  uint32_t holiday[SCHEDULE_SLOTS_PER_DAY / 32]; // Franjas permitidas en festivos
+};
+
+Schedule schedules[MAX_SCHEDULES]; // 0 = "siempre"
+int numSchedules = 0;
+uint32_t holidays[MAX_HOLIDAYS];   // AAAAMMDD
+int numHolidays = 0;
+volatile int currentScheduleSlot = -1;
+volatile bool todayIsHoliday = false;
+int currentScheduleDay = -1;
+
 // Estructura para usuarios
 struct User {
   String name;
   String pin;
   String uid;
+  uint8_t schedule = 0; // Índice en schedules[] o SCHEDULE_UNKNOWN
+  String scheduleText;  // Con SCHEDULE_UNKNOWN, el nombre tal como venía, para no perderlo al guardar
+
+  bool requiresPin() const { return pin.length() == 4; }
+  bool requiresRFID() const { return uid.length() > 0; }
+};
+
+const int MAX_USERS = 500; // Máximo 500 usuarios (importación masiva)
+
+// Tabla de usuarios publicada como instantánea inmutable (read-copy-update).
+// Los lectores (checkRFID, Telegram, handlers web) fijan la instantánea activa
+// y nunca ven una tabla a medio editar; los escritores trabajan sobre una copia,
+// la publican con un intercambio atómico y retiran la anterior.
+struct UserTable {
+  std::vector<User> users;
+  std::vector<uint16_t> uidIndex; // Posiciones de usuarios con UID, ordenadas por UID
+  std::atomic<int> refs{0}; // Lectores que mantienen esta instantánea
+
+  int size() const { return (int)users.size(); }
+
+  // Reconstruye el índice por UID en una sola pasada de ordenación
+  void rebuildIndex() {
+    uidIndex.clear();
+    for (int i = 0; i < size(); i++) {
+      if (users[i].uid.length() > 0) uidIndex.push_back(i);
+    }
+    std::sort(uidIndex.begin(), uidIndex.end(), [this](uint16_t a, uint16_t b) {
+      return strcmp(users[a].uid.c_str(), users[b].uid.c_str()) < 0;
+    });
+  }
+
+  // Búsqueda binaria por UID; devuelve la posición del usuario o -1
+  int findByUid(const char* uid) const {
+    int lo = 0, hi = (int)uidIndex.size() - 1;
+    while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      int cmp = strcmp(users[uidIndex[mid]].uid.c_str(), uid);
+      if (cmp == 0) return uidIndex[mid];
+      if (cmp < 0) lo = mid + 1; else hi = mid - 1;
+    }
+    return -1;
+  }
+};
+
+std::atomic<UserTable*> activeUserTable{nullptr};
+SemaphoreHandle_t usersWriteMutex = nullptr; // Serializa a los escritores
+
+// Periodo de gracia: los lectores solo permanecen en su época mientras fijan
+// el puntero, por lo que la espera del escritor es siempre muy corta
+std::atomic<uint32_t> userTableEpoch{0};
+std::atomic<int> userTableEpochReaders[2];
+
+// Instantáneas retiradas pendientes de liberar (protegidas por usersWriteMutex).
+// Sin límite: esperar a que se vacíe obligaría a soltar el cerrojo del escritor
+std::vector<UserTable*> retiredUserTables;
+
+UserTable* acquireUserTable();
+void releaseUserTable(UserTable* table);
+
+// Referencia de solo lectura a la instantánea activa durante su ámbito
+class UserSnapshot {
+ public:
+  UserSnapshot() : table(acquireUserTable()) {}
+  ~UserSnapshot() { releaseUserTable(table); }
+  UserSnapshot(const UserSnapshot&) = delete;
+  UserSnapshot& operator=(const UserSnapshot&) = delete;
+
+  int size() const { return table->size(); }
+  const User& operator[](int i) const { return table->users[i]; }
+  const UserTable* get() const { return table; }
+
+ private:
+  UserTable* table;
+};
+
+// Réplica de la base de usuarios entre controladores. Cada cambio publicado se
+// apunta en /users.log con una versión consecutiva ("A,versión,Nombre,PIN,UID,Horario"
+// para altas y cambios, "B,versión,Nombre" para bajas; el nombre es la clave, como
+// en la importación) y otro nodo pide solo lo posterior a la última versión que
+// aplicó (POST /api/users/changes). Si el diario ya no llega tan atrás, o es otro
+// diario, la respuesta es la tabla completa. El par del que copia cada nodo se
+// configura con POST /api/users/sync y se guarda en /users.sync. La clave del par
+// va en el cuerpo de la petición, nunca en la URL, pero sin TLS: viaja en claro
+// por la red y también se guarda sin cifrar en /users.sync
+#define USERS_LOG_FILE "/users.log"
+#define USERS_SYNC_FILE "/users.sync"
+const int USERS_LOG_MAX = 1024;       // Registros antes de compactar el diario
+const int USERS_LOG_KEEP = 512;       // Registros que quedan tras compactar
+const int USERS_LOG_MARK_EVERY = 32;  // Desplazamiento en RAM cada 32 registros
+const int USERS_SYNC_BATCH = 128;     // Cambios por respuesta
+const int USERS_SYNC_ROUNDS = 8;      // Respuestas seguidas como mucho por consulta
+const unsigned long USERS_SYNC_INTERVAL_MS = 5000;
+const uint16_t USERS_SYNC_TIMEOUT_MS = 1500;
+
+// Protegido por usersWriteMutex
+uint32_t usersLogId = 0;    // Identidad del diario: cambia si se crea de nuevo
+uint32_t usersLogBase = 0;  // Versión anterior al primer registro del diario
+uint32_t usersVersion = 0;  // Versión de la tabla activa
+uint32_t usersLogMarks[USERS_LOG_MAX / USERS_LOG_MARK_EVERY + 1];
+
+struct UserChange {
+  uint32_t version;
+  bool erase;
+  User user;
+};
+
+// Respuesta de /api/users/changes: se analiza línea a línea mientras llega
+class UserSyncSink : public Stream {
+ public:
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* data, size_t size) override;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+
+  bool header = false;  // Llegó "#usersync,id,hasta,actual,modo"
+  bool bad = false;
+  bool full = false;    // Tabla completa: sustituye a la local
+  uint32_t id = 0;
+  uint32_t through = 0; // Versión del par tras aplicar esta respuesta
+  uint32_t current = 0; // Versión actual del par
+  std::vector<UserChange> changes;
+
+ private:
+  void parseLine();
+  char line[LOG_LINE_MAX];
+  int length = 0;
+};
+
+struct UserSyncState {
+  String peer;          // "http://10.0.0.20" (vacío = sin réplica)
+  String password;
+  uint32_t peerId = 0;
+  uint32_t cursor = 0;  // Última versión del par aplicada
+  bool failing = false; // La última consulta falló: no se repite el aviso
+  uint32_t pulls = 0;
+  uint32_t changes = 0;
+  uint32_t errors = 0;
+  uint32_t bytes = 0;
+  int lastCode = 0;
+  unsigned long lastMs = 0;
+  bool dirty = false;   // Par cambiado desde la web: loop() guarda /users.sync
+};
+UserSyncState userSync; // Protegido por usersWriteMutex
+TaskHandle_t userSyncTaskHandle = nullptr;
+
+// Respuesta del par ya leída por userSyncTask, a la espera de que loop() la
+// aplique: la tarea no toca la SD, que comparte el bus SPI con el lector
+struct UserSyncPull {
+  String peer;
+  UserSyncSink sink;
+  int code = -1;
+  int received = 0;
+  unsigned long elapsed = 0;
+};
+UserSyncPull* userSyncPending = nullptr; // Protegido por usersWriteMutex
+bool userSyncMore = false;               // El par tenía más cambios tras el último lote
+
+// Índice de tarjetas en SD: B+tree de páginas de 512 bytes indexado por UID,
+// con caché LRU de páginas y filtro de Bloom en RAM
+#define CARD_INDEX_FILE "/cards.idx"
+const uint32_t CARD_INDEX_MAGIC = 0x58444943; // "CIDX"
+const uint16_t CARD_INDEX_VERSION = 2;
+const int CARD_PAGE_SIZE = 512;
+const int CARD_LEAF_MAX = 15;          // Registros por hoja
+const int CARD_INNER_MAX = 41;         // Claves por nodo interno
+const int CARD_CACHE_PAGES = 8;        // Caché LRU (4 KB)
+const int CARD_HEADER_SYNC_EVERY = 32;
+const uint32_t CARD_BLOOM_MIN_BYTES = 4096;
+const uint32_t CARD_BLOOM_MAX_BYTES = 65536; // ~8% falsos positivos con 100k tarjetas
+const uint32_t CARD_BLOOM_BITS_PER_KEY = 10;  // ~2% falsos positivos mientras no llega al máximo
+const int CARD_BLOOM_REBUILD_PAGES = 32;      // Hojas por vuelta de loop() al repoblar el filtro ampliado
+const int CARD_BLOOM_HASHES = 3;
+const int CARD_LATENCY_BUCKETS = 88;   // Histograma logarítmico (4 cubetas por potencia de 2)
+const int CARD_SIZE_CLASSES = 4;
+const uint32_t CARD_SIZE_CLASS_FROM[CARD_SIZE_CLASSES] = {0, 1000, 10000, 100000};
+const uint8_t CARD_FLAG_USER = 0x01;   // Tarjeta de /users.txt (no de importación masiva)
+
+struct CardRecord {
+  uint64_t key;
+  char name[22];
+  uint8_t schedule; // Índice en schedules[]
+  uint8_t flags;
+};
+
+struct CardPage {
+  uint8_t leaf;
+  uint8_t reserved;
+  uint16_t count;
+  uint32_t next; // Hoja siguiente (0 = última)
+  uint8_t pad[8];
+  union {
+    CardRecord records[CARD_LEAF_MAX];
+    struct {
+      uint64_t keys[CARD_INNER_MAX];
+      uint32_t children[CARD_INNER_MAX + 1];
+    } inner;
+  };
+};
+static_assert(sizeof(CardPage) == CARD_PAGE_SIZE, "CardPage debe ocupar una página");
+
+struct CardIndexHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t height;
+  uint32_t root;
+  uint32_t numPages;
+  uint32_t numKeys;
+};
+
+struct CardCacheSlot {
+  uint32_t pageNo;
+  uint32_t lastUse;
+  bool valid;
+  CardPage page;
+};
+
+struct CardIndexStats {
+  uint32_t lookups;
+  uint32_t bloomRejects;
+  uint32_t cacheHits;
+  uint32_t cacheMisses;
+  uint32_t latency[CARD_SIZE_CLASSES][CARD_LATENCY_BUCKETS]; // Por tamaño de la base de datos
+};
+
+File cardIndexFile;
+CardIndexHeader cardIndexHeader;
+int cardIndexHeaderDirty = 0;
+CardCacheSlot cardCache[CARD_CACHE_PAGES];
+uint32_t cardCacheClock = 0;
+uint32_t* cardBloom = nullptr;
+uint32_t cardBloomBits = 0;
+uint32_t cardBloomWanted = 0; // Último tamaño pedido: si no cupo, no se reintenta con cada alta
+bool cardBloomFilling = false; // Repoblando: mientras tanto el filtro no descarta nada
+uint32_t cardBloomNextLeaf = 0;
+CardIndexStats cardIndexStats;
+SemaphoreHandle_t cardIndexMutex = nullptr;
+bool cardIndexReady = false;
+
+// Importación de tarjetas (target=cards): las filas validadas se apuntan en
+// CARD_IMPORT_FILE mientras llega el cuerpo y loop() las inserta en el índice de
+// CARD_IMPORT_BATCH en CARD_IMPORT_BATCH (updateCardIndex), como la compresión
+// del registro. Insertarlas desde la tarea de AsyncTCP la retendría minutos
+// escribiendo en el árbol con 100k tarjetas
+#define CARD_IMPORT_FILE "/cards.imp"
+const int CARD_IMPORT_FLUSH = 64;  // Filas que se acumulan antes de escribirlas en la cola
+const int CARD_IMPORT_BATCH = 16;  // Inserciones por vuelta de loop()
+
+struct CardImportState {
+  volatile bool busy = false;  // Desde que empieza la subida hasta insertar la última fila
+  volatile bool ready = false; // Subida terminada: loop() puede vaciar la cola
+  File output;                 // Escritura, durante la subida
+  File input;                  // Lectura, desde loop()
+  uint32_t queued = 0;
+  uint32_t applied = 0;
+  unsigned long startMs = 0;
+};
+CardImportState cardImport;
+
+// Índices secundarios del registro de accesos: listas de entradas de tamaño fijo
+// en orden de escritura (todas, por usuario y por estado) que apuntan a la
+// línea correspondiente de /access_log.txt
+#define LOG_INDEX_DIR "/logidx"
+#define LOG_INDEX_ALL LOG_INDEX_DIR "/all.idx"
+const int LOG_USER_BUCKETS = 32;
+const int LOG_QUERY_MAX = 200;
+enum LogMethod : uint8_t { LOG_METHOD_RFID, LOG_METHOD_PIN, LOG_METHOD_TELEGRAM, LOG_METHOD_WEB, LOG_METHOD_SENSOR, LOG_METHOD_OTHER, LOG_METHOD_COUNT };
+enum LogStatus : uint8_t { LOG_STATUS_GRANTED, LOG_STATUS_DENIED, LOG_STATUS_INTRUSION, LOG_STATUS_OTHER, LOG_STATUS_COUNT };
+const char* const LOG_METHOD_NAMES[LOG_METHOD_COUNT] = {"RFID", "PIN", "TELEGRAM", "WEB", "SENSOR", "OTRO"};
+const char* const LOG_STATUS_NAMES[LOG_STATUS_COUNT] = {"concedido", "denegado", "intrusion", "otro"};
+
+struct LogPosting {
+  uint32_t offset;   // Posición lógica de la línea en el registro (ver LOG_ARCHIVE_DIR)
+  uint32_t time;     // Segundos desde 1970 en hora local (0 si no había hora NTP)
+  uint32_t userHash; // FNV-1a del nombre de usuario en minúsculas
+  uint16_t length;   // Longitud de la línea sin el salto
+  uint8_t method;
+  uint8_t status;
+};
+static_assert(sizeof(LogPosting) == 16, "LogPosting debe ocupar 16 bytes");
+
+struct LogQuery {
+  String user;
+  int method = -1;
+  int status = -1;
+  uint32_t from = 0;
+  uint32_t to = UINT32_MAX;
+  int limit = 50;
+  int32_t cursor = -1; // Entrada de la lista desde la que continuar (hacia atrás)
+};
 
-  bool requiresPin() { return pin.length() == 4; }
-  bool requiresRFID() { return uid.length() > 0; }
+SemaphoreHandle_t logMutex = nullptr; // Serializa escrituras y consultas del registro
+bool logIndexReady = false;
+
+// Estadísticas de accesos: contadores fijos que logAccess() actualiza y que se
+// guardan en la SD cada minuto; al arrancar se completan con lo registrado después
+#define STATS_FILE "/stats.bin"
+const uint32_t STATS_MAGIC = 0x54415453; // "STAT"
+const uint16_t STATS_VERSION = 2;
+// La tabla se llena hasta 3/4: cabe MAX_USERS más la casilla de "N/A"
+const int STATS_USER_SLOTS = MAX_USERS * 4 / 3 + 8;
+const unsigned long STATS_CHECKPOINT_MS = 60000;
+
+struct AccessCounters {
+  uint16_t todayGranted, todayDenied;
+  uint16_t weekGranted, weekDenied;
+  uint32_t allGranted, allDenied;
+};
+
+struct UserCounters {
+  uint32_t hash; // logUserHash del nombre; 0 = libre
+  char name[USER_NAME_SIZE];
+  AccessCounters counters;
+};
+
+struct AccessStats {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t usedSlots;
+  uint32_t logEnd; // Posición lógica del registro cubierta por estas cifras
+  uint32_t day;    // Día local (desde 1970) de los contadores "hoy"
+  uint32_t week;   // Semana de lunes a domingo de los contadores "semana"
+  AccessCounters methods[LOG_METHOD_COUNT];
+  AccessCounters overflow; // Nombres sin casilla: usuarios borrados o inexistentes
+  uint32_t hourToday[24];
+  uint32_t hourAll[24];
+  uint32_t intrusionsToday, intrusionsWeek, intrusionsAll;
+  UserCounters users[STATS_USER_SLOTS];
+};
+
+AccessStats accessStats;
+bool accessStatsDirty = false;
+unsigned long lastStatsCheckpoint = 0;
+
+// Registro de trazas en memoria RTC lenta. RTC_NOINIT_ATTR no se inicializa al
+// arrancar, así que sobrevive a reinicios por pánico, watchdog o software.
+const uint32_t TRACE_MAGIC = 0x45434154; // "TACE"
+const int TRACE_CAPACITY = 256;          // Potencia de dos
+enum TraceId : uint8_t {
+  TRACE_BOOT, TRACE_RFID_READ, TRACE_ACCESS_GRANTED, TRACE_ACCESS_DENIED,
+  TRACE_RELAY_ON, TRACE_RELAY_OFF, TRACE_DOOR_OPEN, TRACE_DOOR_CLOSED,
+  TRACE_SD_WRITE_START, TRACE_SD_WRITE_END,
+  TRACE_TELEGRAM_SEND_START, TRACE_TELEGRAM_SEND_END,
+  TRACE_TELEGRAM_POLL_START, TRACE_TELEGRAM_POLL_END,
+  TRACE_ID_COUNT
+};
+const char* const TRACE_NAMES[TRACE_ID_COUNT] = {
+  "ARRANQUE", "RFID_LECTURA", "ACCESO_CONCEDIDO", "ACCESO_DENEGADO",
+  "RELE_ON", "RELE_OFF", "PUERTA_ABIERTA", "PUERTA_CERRADA",
+  "SD_ESCRITURA_INICIO", "SD_ESCRITURA_FIN",
+  "TELEGRAM_ENVIO_INICIO", "TELEGRAM_ENVIO_FIN",
+  "TELEGRAM_CONSULTA_INICIO", "TELEGRAM_CONSULTA_FIN"
+};
+// Argumento de TRACE_SD_WRITE_*: qué archivo se escribe
+enum TraceSdFile : uint16_t { TRACE_SD_LOG = 1, TRACE_SD_LOG_INDEX, TRACE_SD_USERS, TRACE_SD_STATS, TRACE_SD_CARDS, TRACE_SD_ARCHIVE };
+
+struct TraceEvent {
+  uint32_t ms;   // millis() del arranque en que se registró
+  uint8_t id;
+  uint8_t boot;  // 8 bits bajos del número de arranque
+  uint16_t arg;
+};
+
+struct TraceRing {
+  uint32_t magic;
+  uint32_t head;  // Total de eventos escritos; la posición es head % TRACE_CAPACITY
+  uint32_t boots;
+  TraceEvent events[TRACE_CAPACITY];
+};
+
+RTC_NOINIT_ATTR TraceRing traceRing;
+portMUX_TYPE traceMux = portMUX_INITIALIZER_UNLOCKED;
+esp_reset_reason_t lastResetReason = ESP_RST_UNKNOWN;
+
+// Compresor deflate en flujo (RFC 1951) con memoria fija: LZ77 con ventana de
+// 4 KB y un único bloque con los códigos Huffman fijos
+const int DEFLATE_WINDOW = 4096;
+const int DEFLATE_HASH_BITS = 11;
+const int DEFLATE_MIN_MATCH = 3;
+const int DEFLATE_MAX_MATCH = 258;
+const int DEFLATE_MAX_CHAIN = 32;
+const int DEFLATE_OUT_SIZE = 2048;
+const int DEFLATE_IN_MAX = 1024; // Entrada máxima entre dos vaciados de out, para que la salida quepa
+
+const uint16_t DEFLATE_LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t DEFLATE_LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DEFLATE_DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                        513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t DEFLATE_DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+struct Deflater {
+  uint8_t window[2 * DEFLATE_WINDOW]; // Ventana de historia + datos pendientes
+  int16_t head[1 << DEFLATE_HASH_BITS]; // Última posición de cada hash de 3 bytes (-1: ninguna)
+  int16_t prev[DEFLATE_WINDOW];         // Posición anterior con el mismo hash
+  int fill;                           // Bytes válidos en window
+  int pos;                            // Siguiente byte por codificar
+  uint32_t bits;
+  int bitCount;
+  uint8_t out[DEFLATE_OUT_SIZE];      // Salida que quien llama debe vaciar
+  int outLen;
+};
+
+// Archivo del registro: cuando /access_log.txt pasa de LOG_SEGMENT_BYTES se
+// cierra como segmento (/logarc/sNNNN.txt) y después se comprime en segundo
+// plano a sNNNN.lz, en bloques deflate independientes de hasta 4 KB de líneas
+// completas con una tabla de bloques al final. Las posiciones del índice son
+// lógicas (la concatenación de todos los segmentos y el registro vivo), así que
+// no cambian al archivar y las lecturas no distinguen dónde está cada línea.
+#define LOG_ARCHIVE_DIR "/logarc"
+const uint32_t LOG_SEGMENT_BYTES = 128 * 1024;
+const int LOG_ARCHIVE_MAX_SEGMENTS = 128;
+const int LOG_ARCHIVE_BLOCK = 4096;
+const int LOG_ARCHIVE_INPUT = 256;            // Búfer de lectura del descompresor
+const uint32_t LOG_ARCHIVE_MAGIC = 0x4352414C; // "LARC"
+const unsigned long LOG_ARCHIVE_RETRY_MS = 60000;
+
+struct LogArchiveHeader {
+  uint32_t magic;
+  uint32_t rawSize;     // Tamaño del segmento sin comprimir
+  uint32_t blockCount;
+  uint32_t tableOffset; // La tabla de bloques va al final del archivo
+};
+
+struct LogArchiveBlock {
+  uint32_t rawOffset;   // Dentro del segmento
+  uint32_t fileOffset;
+  uint16_t rawLength;
+  uint16_t compressedLength;
+  uint32_t crc;         // CRC-32 de los datos sin comprimir
 };
+static_assert(sizeof(LogArchiveBlock) == 16, "LogArchiveBlock debe ocupar 16 bytes");
 
-User authorizedUsers[10]; // Máximo 10 usuarios
-int numAuthorizedUsers = 0;
+struct LogSegment {
+  uint32_t start;       // Posición lógica del primer byte
+  uint32_t rawSize;
+  uint32_t storedSize;  // Ocupación en la SD
+  bool compressed;
+};
+LogSegment logSegments[LOG_ARCHIVE_MAX_SEGMENTS];
+int logSegmentCount = 0;
+uint32_t logLiveBase = 0; // Posición lógica del primer byte de /access_log.txt
+uint32_t logLiveSize = 0;
+
+// Lectura por posiciones lógicas; guarda el último bloque descomprimido, así
+// que leer líneas seguidas del mismo bloque solo lo descomprime una vez
+struct LogReader {
+  File file;
+  int segment = -2;          // Archivo abierto: segmento, -1 el registro vivo, -2 ninguno
+  bool compressed = false;
+  LogArchiveHeader header;
+  uint8_t* block = nullptr;  // LOG_ARCHIVE_BLOCK de salida + LOG_ARCHIVE_INPUT de entrada
+  uint32_t blockStart = 0, blockLength = 0;
+  int inLength = 0, inPos = 0;
+  uint32_t inRemaining = 0, bits = 0;
+  int bitCount = 0;
+  ~LogReader();
+};
+
+// Compresión de un segmento en curso; se reserva solo mientras dura (~28 KB)
+struct LogCompactor {
+  Deflater deflater;
+  File source, target;
+  int segment = 0;
+  uint32_t position = 0;      // Dentro del segmento
+  uint32_t stored = 0;        // Bytes escritos en el destino
+  LogArchiveBlock* blocks = nullptr;
+  uint32_t blockCount = 0, blockCapacity = 0;
+  uint32_t cpuUs = 0;
+  uint8_t raw[LOG_ARCHIVE_BLOCK];
+  ~LogCompactor() { delete[] blocks; }
+};
+LogCompactor* logCompactor = nullptr;
+unsigned long logArchiveRetryAt = 0;
+uint32_t logArchiveDeflateUs = 0, logArchiveDeflateBytes = 0; // Desde el arranque
+uint32_t logArchiveInflateUs = 0, logArchiveInflateBytes = 0;
+
+// Exportación comprimida del registro (/api/export): una a la vez, ~24 KB
+struct LogExport {
+  Deflater deflater;
+  LogReader reader;
+  bool gzip = true;                 // gzip (RFC 1952) o zlib (RFC 1950)
+  uint32_t from = 0, to = UINT32_MAX;
+  uint32_t position = 0;            // Siguiente posición lógica del registro por leer
+  uint32_t end = 0;                 // Final del registro al empezar
+  uint8_t buffer[DEFLATE_IN_MAX];
+  char line[LOG_LINE_MAX + 3];
+  int lineLength = 0;
+  uint32_t crc = 0, adlerA = 1, adlerB = 0, inputBytes = 0, outputBytes = 0;
+  int outPos = 0;
+  bool stopped = false;             // Pasada la fecha final o error de lectura
+  bool finished = false;
+  unsigned long started = 0;
+  ~LogExport();
+};
+std::atomic<bool> logExportActive(false);
 
 // Variables del sensor
 bool doorOpen = false;
 bool relayState = false;
 
+// Caché de páginas: cada cambio de estado que se ve en una página incrementa
+// su contador de generación, y la copia guardada solo se reutiliza si se
+// generó con el valor actual. El panel depende del registro, la puerta y el
+// relé; la lista de usuarios, solo de la tabla de usuarios. Solo los handlers
+// web (tarea de AsyncTCP) leen y escriben las cachés.
+struct RenderCache {
+  uint32_t generation = 0; // 0 = vacía
+  String html;
+};
+std::atomic<uint32_t> dashboardGeneration(1);
+std::atomic<uint32_t> usersGeneration(1);
+RenderCache rootPageCache;
+RenderCache usersPageCache;
+
 // Temporizador del relé
 unsigned long relayTimerEnd = 0;
 
@@ -84,10 +681,38 @@ unsigned long relayTimerEnd = 0;
 enum LEDState { RED, GREEN, YELLOW, BLINKING_RED };
 LEDState currentLEDState = RED;
 
-// Variables para el parpadeo
-unsigned long previousMillis = 0;
+// Animaciones del LED: cada estado se describe como un patrón y una tarea
+// propia las reproduce, enviando píxeles solo cuando cambian
 const long BLINK_INTERVAL_RED = 200; // Intervalo de parpadeo rápido para rojo (ms)
 const long BLINK_INTERVAL_GREEN = 300; // Intervalo de parpadeo moderado para verde (ms)
+const TickType_t LED_FRAME_MS = 10;
+
+struct LedPattern {
+  uint32_t colorOn;
+  uint32_t colorOff;
+  uint16_t onMs;  // 0 = color fijo
+  uint16_t offMs;
+  uint8_t step;   // Desfase entre LEDs consecutivos en ms/8 (0 = todos a la vez)
+};
+
+// Indexado por LEDState
+const LedPattern LED_PATTERNS[] = {
+  {0xFF0000, 0x000000, 0, 0, 0},                                          // RED
+  {0x00FF00, 0x000000, BLINK_INTERVAL_GREEN, BLINK_INTERVAL_GREEN, 0},   // GREEN
+  {0xFFFF00, 0x000000, 0, 0, 0},                                          // YELLOW
+  {0xFF0000, 0x000000, BLINK_INTERVAL_RED, BLINK_INTERVAL_RED, 0},       // BLINKING_RED
+};
+
+// Tramo de la tira asignado a una puerta
+struct LedSegment {
+  uint16_t first;
+  uint16_t count;
+  volatile uint8_t pattern;
+  volatile uint32_t since; // millis() al entrar en el patrón, para empezar encendido
+};
+
+const int NUM_DOORS = 1;
+LedSegment ledSegments[NUM_DOORS] = {{0, NUM_LEDS, RED, 0}};
 
 // Variables para parpadeo del LED integrado
 unsigned long lastBlink = 0;
@@ -102,9 +727,66 @@ AsyncWebServer server(80);
 // Variables para alta de usuarios
 bool waitingForRFID = false;
 String tempName, tempPin, tempUID;
+uint8_t tempSchedule = 0;
 unsigned long rfidTimeout = 0;
 const unsigned long RFID_TIMEOUT_MS = 30000; // 30 segundos
 
+// Modos de energía. Activo: loop() gira sin pausas, como siempre. Modem: la WiFi
+// duerme entre balizas (DTIM1) y loop() se bloquea hasta el próximo plazo o hasta
+// que una interrupción o la web la despiertan. Sueño ligero: además, el ESP32 se
+// duerme solo mientras todas las tareas esperan, y la WiFi escucha cada 3 balizas
+enum PowerMode { POWER_ACTIVE, POWER_MODEM_SLEEP, POWER_LIGHT_SLEEP };
+const PowerMode POWER_MODE = POWER_ACTIVE;
+const char* const POWER_MODE_NAMES[] = {"activo", "modem", "ligero"};
+const unsigned long POWER_MAX_SLEEP_MS = 1000;      // Tope de cada espera: avisos, estadísticas, horarios
+const unsigned long POWER_TELEGRAM_CHECK_MS = 5000; // Consulta a Telegram en los modos de ahorro (1 s en activo)
+const unsigned long POWER_RFID_WINDOW_MS = 100;     // Ventana del REQA en los modos de ahorro (25 ms en activo)
+TaskHandle_t loopTaskHandle = nullptr;              // Solo en los modos de ahorro
+TaskHandle_t ledTaskHandle = nullptr;
+unsigned long powerSleptMs = 0;                     // Tiempo que loop() ha pasado esperando
+
+// En los modos de ahorro, la puerta y la IRQ del RC522 usan interrupciones por nivel
+// que se invierten en cada disparo: equivalen a CHANGE pero, a diferencia de los
+// flancos, también despiertan al chip del sueño ligero
+void IRAM_ATTR powerRearmFromISR(int pin, bool high) {
+  gpio_ll_wakeup_enable(&GPIO, (gpio_num_t)pin, high ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+}
+
+void IRAM_ATTR powerWakeFromISR() {
+  if (!loopTaskHandle) return;
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(loopTaskHandle, &woken);
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+void IRAM_ATTR doorIsr() {
+  powerRearmFromISR(DOOR_SENSOR_PIN, digitalRead(DOOR_SENSOR_PIN) == HIGH);
+  powerWakeFromISR();
+}
+
+// Detección por interrupción: el firmware envía un REQA y el RC522 avisa por su
+// pin IRQ cuando responde una tarjeta (RxIRq) o cuando su temporizador cierra la
+// ventana de espera (TimerIRq: 25 ms tras PCD_Init, POWER_RFID_WINDOW_MS en los
+// modos de ahorro). Mientras tanto no hay SPI
+const byte RFID_IRQ_RX = 0x20;
+const byte RFID_IRQ_TIMER = 0x01;
+const unsigned long RFID_IRQ_WATCHDOG_MS = 1000; // Rearme si la IRQ no llega (pin suelto, flanco perdido)
+volatile bool rfidIrqPending = false;
+unsigned long rfidArmedAt = 0;
+const unsigned long RFID_HOLD_MS = 1000; // Pausa del lector tras cada tarjeta; loop() sigue atendiendo lo demás
+bool rfidHolding = false;
+unsigned long rfidHoldUntil = 0;
+
+void IRAM_ATTR rfidIrqHandler() {
+  bool high = digitalRead(RFID_IRQ_PIN) == HIGH; // Activa a nivel bajo
+  if (POWER_MODE != POWER_ACTIVE) powerRearmFromISR(RFID_IRQ_PIN, high);
+  if (high) return;
+  rfidIrqPending = true;
+  powerWakeFromISR();
+}
+
 // Variables para manejo de Telegram
 enum TelegramState { IDLE, WAITING_FOR_NAME, WAITING_FOR_PIN };
 TelegramState telegramState = IDLE;
@@ -113,35 +795,267 @@ String telegramChatId;
 unsigned long telegramTimeout = 0;
 const unsigned long TELEGRAM_TIMEOUT_MS = 60000; // 1 minuto para responder
 
+// Consultas por Telegram (/log, /who, /stats, /status, /users)
+const unsigned int TELEGRAM_MESSAGE_MAX = 4000; // Telegram admite 4096 caracteres por mensaje
+const int TELEGRAM_LOG_DEFAULT = 10;
+const int TELEGRAM_LOG_PAGE = 5;
+const int TELEGRAM_USERS_PAGE = 10;
+
+// Agrupación de notificaciones: las intrusiones salen al momento, las
+// denegaciones repetidas se resumen por ventana y los accesos concedidos
+// van a un resumen periódico
+enum NotifyPriority : uint8_t { NOTIFY_URGENT, NOTIFY_NORMAL, NOTIFY_LOW };
+const unsigned long NOTIFY_COALESCE_MS = 60000;      // Ventana de agrupación por tipo y origen
+const unsigned long NOTIFY_DIGEST_MS = 15 * 60000UL; // Periodo del resumen
+const unsigned long NOTIFY_SEND_INTERVAL_MS = 1000;  // Telegram limita a ~1 mensaje/s por chat
+const int NOTIFY_GROUPS = 8;
+const int NOTIFY_OUTBOX = 8;
+const int NOTIFY_DIGEST_LINES = 20;
+
+struct NotifyGroup {
+  char key[UID_TEXT_SIZE + 8];  // Tipo y origen, p. ej. "RFID DE AD BE EF"
+  char summary[MESSAGE_SIZE / 2]; // "intentos denegados por RFID de DE AD BE EF"; cabe en el resumen con el recuento
+  unsigned long since;
+  uint16_t repeats;             // Eventos que no se enviaron dentro de la ventana
+  bool active;
+};
+
+struct NotifyMessage {
+  char text[MESSAGE_SIZE];
+  NotifyPriority priority;
+  uint32_t seq;
+  bool used;
+};
+
+NotifyGroup notifyGroups[NOTIFY_GROUPS];
+NotifyMessage notifyOutbox[NOTIFY_OUTBOX];
+uint32_t notifySeq = 0;
+uint32_t notifyDropped = 0;
+char notifyDigest[NOTIFY_DIGEST_LINES][MESSAGE_SIZE];
+char notifyDigestText[NOTIFY_DIGEST_LINES * MESSAGE_SIZE + 128]; // Resumen listo para enviar (solo loop())
+int notifyDigestCount = 0;
+int notifyDigestOverflow = 0;
+unsigned long notifyDigestSince = 0;
+unsigned long notifyLastSend = 0;
+SemaphoreHandle_t notifyMutex = nullptr; // checkRFID (loop) y /enterPin (AsyncTCP) notifican a la vez
+
+// Flujo de eventos por MQTT: accesos, puerta y relé en JSON compacto. Los eventos
+// esperan en un anillo en RAM (también mientras no hay conexión) y salen agrupados
+// en arrays de hasta MQTT_BATCH_BYTES, con varios mensajes en vuelo a la vez. Con
+// QoS 1 un evento solo sale del anillo cuando el broker confirma su mensaje; tras
+// una desconexión se reenvía lo no confirmado y el consumidor descarta por "seq"
+enum MqttKind : uint8_t { MQTT_ACCESS, MQTT_DOOR, MQTT_RELAY, MQTT_KIND_COUNT };
+const char* const MQTT_KIND_NAMES[MQTT_KIND_COUNT] = {"acceso", "puerta", "rele"};
+const char* const MQTT_TOPICS[MQTT_KIND_COUNT] = {"control-acceso/eventos/acceso", "control-acceso/eventos/puerta",
+                                                  "control-acceso/eventos/rele"};
+const char* MQTT_STATUS_TOPIC = "control-acceso/estado"; // "online" / "offline" (testamento), retenido
+const uint32_t MQTT_BUFFER_BYTES = 16384; // Potencia de 2: ~120 accesos o ~250 cambios de puerta
+const int MQTT_BATCH_BYTES = 1024;
+const int MQTT_EVENT_MAX = 256;           // El anillo guarda la longitud en un byte
+const int MQTT_FIELDS_MAX = MQTT_EVENT_MAX - 80; // Lo que queda tras seq, arranque, ts y tipo
+const int MQTT_INFLIGHT = 8;
+const unsigned long MQTT_RETRY_MIN_MS = 2000;
+const unsigned long MQTT_RETRY_MAX_MS = 60000;
+
+struct MqttInflight {
+  uint16_t packetId;
+  uint32_t end;  // Posición del anillo tras el último evento del mensaje
+  bool acked;
+};
+
+AsyncMqttClient mqttClient;
+char mqttRing[MQTT_BUFFER_BYTES];   // Cada evento: tipo (1 B), longitud (1 B) y el JSON
+uint32_t mqttHead = 0;              // Posiciones absolutas; en el anillo, módulo MQTT_BUFFER_BYTES
+uint32_t mqttSent = 0;
+uint32_t mqttAcked = 0;
+MqttInflight mqttInflight[MQTT_INFLIGHT];
+int mqttInflightFirst = 0;
+int mqttInflightCount = 0;
+char mqttBatch[MQTT_BATCH_BYTES];   // Solo lo usa loop()
+uint32_t mqttSeq = 0;
+uint32_t mqttSession = 0;           // Cambia al desconectar: anula el envío que estuviera a medias
+bool mqttConnected = false;
+bool mqttConnecting = false;
+bool mqttAnnounce = false;
+unsigned long mqttRetryAt = 0;
+unsigned long mqttRetryMs = MQTT_RETRY_MIN_MS;
+uint32_t mqttMessages = 0;
+uint32_t mqttEventsSent = 0;
+uint32_t mqttDropped = 0;
+uint32_t mqttReconnects = 0;
+SemaphoreHandle_t mqttMutex = nullptr; // Eventos desde loop() y AsyncTCP; confirmaciones desde el cliente
+
+// Tubería de accesos: la decisión acciona el relé en la misma llamada y deja el
+// acceso como evento en una cola que loop() vacía en orden de prioridad: primero
+// el registro en la SD y después el aviso (notifyEvent o la respuesta al chat de
+// /abrir). Ni la SD ni la red se interponen entre la decisión y el relé, y cada
+// etapa se mide desde el final de la anterior
+enum AccessStage : uint8_t { ACCESS_STAGE_RELAY, ACCESS_STAGE_LOG, ACCESS_STAGE_NOTIFY, ACCESS_STAGE_COUNT };
+const char* const ACCESS_STAGE_NAMES[ACCESS_STAGE_COUNT] = {"rele", "registro", "aviso"};
+const int ACCESS_QUEUE = 16; // Potencia de 2: las posiciones absolutas dan la vuelta sin saltos
+const unsigned long RELAY_OPEN_MS = 10000;
+
+struct AccessEvent {
+  char timestamp[20];          // Hora de la decisión, no la de la escritura
+  char id[UID_TEXT_SIZE];
+  char user[USER_NAME_SIZE];
+  char status[40];
+  char message[MESSAGE_SIZE];  // Aviso; vacío si no hay
+  char key[UID_TEXT_SIZE + 8]; // Grupo de notifyEvent; vacío si no se agrupa
+  char summary[MESSAGE_SIZE];
+  char chatId[24];             // Si no está vacío, el aviso es la respuesta a ese chat
+  LogMethod method;
+  NotifyPriority priority;
+  bool opened;
+  uint32_t relayUs;            // De la decisión al relé
+  uint32_t logUs;              // Del relé (o la decisión) al registro, incluida la espera en la cola
+  uint32_t stageAt;            // micros() al terminar la última etapa
+};
+
+struct AccessStageStats {
+  uint32_t count;
+  uint32_t maxUs;
+  uint64_t totalUs;
+};
+
+AccessEvent accessQueue[ACCESS_QUEUE];
+uint32_t accessHead = 0;   // Posiciones absolutas; en la cola, módulo ACCESS_QUEUE
+uint32_t accessLogged = 0; // Hasta aquí ya están en la SD y esperan el aviso
+uint32_t accessTail = 0;
+uint32_t accessOverflow = 0;
+AccessStageStats accessStages[ACCESS_STAGE_COUNT];
+SemaphoreHandle_t accessMutex = nullptr; // Decisiones desde loop() (RFID, Telegram) y AsyncTCP (PIN, temporizador)
+
 // Prototipos de funciones
 void setLEDColor(uint32_t color);
 void initSDCard();
+int splitFields(char* text, char** fields, int max);
+void loadSchedules();
+void updateScheduleClock();
+bool scheduleAllows(uint8_t id);
+int findSchedule(const char* name);
+const char* scheduleName(uint8_t id);
+String scheduleOptionsHtml(uint8_t selected);
+void initUserTable();
 void loadUsers();
 void loadAccessHistory();
+bool modifyUsers(const std::function<bool(std::vector<User>&)>& mutate,
+                 const std::function<void(const UserTable*)>& persist);
+void publishUserTable(UserTable* table);
+void reclaimUserTables();
+void reclaimUserTablesLocked();
+void saveUsersFile(const UserTable* table);
+void initUsersLog();
+void usersLogAppend(const UserTable* before, const UserTable* after);
+void handleUsersChanges(AsyncWebServerRequest *request);
+void handleUsersSync(AsyncWebServerRequest *request);
+void initUserSync();
+void updateUserSync();
 void blinkLED(int times);
+void sendTelegramNotification(const char* message, const char* chatId = CHAT_ID);
 void sendTelegramNotification(const String& message, const String& chatId = CHAT_ID);
+void sendTelegramChunked(const String& chatId, const String& text, const String& keyboard = "", int messageId = 0);
+bool handleTelegramQuery(const String& chatId, const String& text);
+void initNotifications();
+void notifyEvent(NotifyPriority priority, const char* message, const char* key = nullptr, const char* summary = nullptr);
+void updateNotifications();
+void initMqtt();
+void updateMqtt();
+void mqttField(char* out, size_t size, int& length, const char* key, const char* value);
+void mqttEvent(MqttKind kind, const char* fields);
+void mqttRelayEvent(bool on, const char* method = nullptr);
+String mqttStatsJson();
+void handleTelegramCallback(const telegramMessage& message);
 void handleTelegramMessages();
 void checkDoorStatus();
 void checkRelayTimer();
 void checkRFID();
+void rfidArmReqa();
+bool rfidCardDetected();
+void initPowerMode();
+void powerIdle(unsigned long telegramDue);
+void powerWake();
 void updateRGBStatus();
-String getCurrentTime();
-void logAccess(const String& method, const String& id, const String& status, const String& userName = "N/A");
+void initLedEngine();
+void ledSetPattern(int door, LEDState state);
+void getCurrentTime(char* out, size_t size);
+void logAccess(const char* method, const char* id, const char* status, const char* userName = "N/A");
+void logAccessAt(const char* timestamp, const char* method, const char* id, const char* status, const char* userName);
+void initAccessPipeline();
+void accessDecide(LogMethod method, const char* id, const char* user, const char* status, unsigned long openMs,
+                  const char* message, NotifyPriority priority = NOTIFY_LOW, const char* key = nullptr,
+                  const char* summary = nullptr);
+void accessDecideReply(LogMethod method, const char* id, const char* user, const char* status, unsigned long openMs,
+                       const char* chatId, const char* reply);
+void updateAccessPipeline();
+String accessPipelineJson();
 void handleRoot(AsyncWebServerRequest *request);
+const String& renderCached(RenderCache& cache, const std::atomic<uint32_t>& source, void (*render)(String&));
+void renderRootPage(String& html);
+void renderUsersPage(String& html);
 void handleSetTimer(AsyncWebServerRequest *request);
 void handleAddUser(AsyncWebServerRequest *request);
 void handleAddUserPost(AsyncWebServerRequest *request);
 void handleEditUserGet(AsyncWebServerRequest *request);
 void handleEditUserPost(AsyncWebServerRequest *request);
 void handleDeleteUser(AsyncWebServerRequest *request);
+String urlEncode(const String& value);
+String htmlEscape(const String& value);
 void handleEnterPin(AsyncWebServerRequest *request);
 void handleEnterPinPost(AsyncWebServerRequest *request);
 void handleUsers(AsyncWebServerRequest *request);
 void handleUsersPost(AsyncWebServerRequest *request);
+void handleImportUsers(AsyncWebServerRequest *request);
+void handleImportUsersUpload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final);
+void handleImportUsersBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total);
+void handleExportUsers(AsyncWebServerRequest *request);
+void initCardIndex();
+bool cardIndexPut(const String& uid, const String& name, uint8_t schedule, uint8_t flags);
+CardRecord cardMakeRecord(const String& uid, const String& name, uint8_t schedule, uint8_t flags);
+bool cardIndexPutRecord(const CardRecord& record);
+void updateCardIndex();
+bool cardIndexRemove(const String& uid);
+bool cardIndexLookup(uint64_t key, CardRecord& out);
+void cardIndexSync(const UserTable* before, const UserTable* after);
+uint64_t cardKeyFromBytes(const byte* uid, byte size);
+void handleCardIndexStats(AsyncWebServerRequest *request);
+void initLogIndex();
+LogPosting logMakePosting(uint32_t offset, uint16_t length, const char* timestamp, const char* method,
+                          const char* userName, const char* status);
+int logMethodCode(const char* method);
+void logIndexAppend(const LogPosting& posting);
+int32_t runLogQuery(const LogQuery& query, const std::function<void(const String&)>& emit);
+void handleLogQuery(AsyncWebServerRequest *request);
+void handleLogApi(AsyncWebServerRequest *request);
+void initAccessStats();
+void statsRecord(const LogPosting& posting, const char* userName);
+void statsSyncUsers(const UserTable* users);
+void updateAccessStats();
+void handleStats(AsyncWebServerRequest *request);
+void handleStatsApi(AsyncWebServerRequest *request);
+void initTrace();
+void trace(TraceId id, uint16_t arg = 0);
+void handleDebugTrace(AsyncWebServerRequest *request);
+void deflateBegin(Deflater& d);
+void deflateWrite(Deflater& d, const uint8_t* data, int length);
+void deflateFinish(Deflater& d);
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length);
+void handleLogExport(AsyncWebServerRequest *request);
+void initLogArchive();
+void updateLogArchive();
+uint32_t logLogicalEnd();
+int logArchiveTotals(uint32_t& raw, uint32_t& stored);
+String logArchiveJson();
+bool logIsHeader(const char* line);
+size_t logRead(LogReader& reader, uint32_t offset, uint8_t* out, size_t length);
+void logReaderClose(LogReader& reader);
+bool logForEachLine(LogReader& reader, uint32_t from, uint32_t to,
+                    const std::function<bool(uint32_t, char*, int)>& visit);
 void configureSPIPins(int sck, int miso, int mosi, int cs);
 
 void setup() {
   Serial.begin(115200);
+  initTrace();
 
   // Configura pines
   pinMode(DOOR_SENSOR_PIN, INPUT_PULLUP);
@@ -156,6 +1070,7 @@ void setup() {
   strip.show();
   Serial.println("[SISTEMA] Estado LED: Rojo (Inicializando)");
   delay(300);
+  initLedEngine();
 
   // Inicializa SPI para RFID
   configureSPIPins(RFID_SCK_PIN, RFID_MISO_PIN, RFID_MOSI_PIN, RFID_SS_PIN);
@@ -167,14 +1082,40 @@ void setup() {
   } else {
     Serial.println("[RFID] Esperando tarjetas...");
   }
+  if (RFID_IRQ_PIN >= 0) {
+    // GPIO 34 no tiene pull-up: la IRQ en contrafase e invertida queda alta en reposo
+    pinMode(RFID_IRQ_PIN, INPUT);
+    rfid.PCD_WriteRegister(MFRC522::DivIEnReg, 0x80);                              // IRQPushPull
+    rfid.PCD_WriteRegister(MFRC522::ComIEnReg, 0x80 | RFID_IRQ_RX | RFID_IRQ_TIMER); // IRqInv, RxIEn, TimerIEn
+    if (POWER_MODE != POWER_ACTIVE) {
+      // Ventana larga: el REQA se repite a ese ritmo y el lector despierta menos al ESP32
+      uint16_t reload = POWER_RFID_WINDOW_MS * 40; // 25 µs por cuenta con el TPrescaler de PCD_Init
+      rfid.PCD_WriteRegister(MFRC522::TReloadRegH, reload >> 8);
+      rfid.PCD_WriteRegister(MFRC522::TReloadRegL, reload & 0xFF);
+    }
+    attachInterrupt(digitalPinToInterrupt(RFID_IRQ_PIN), rfidIrqHandler, POWER_MODE == POWER_ACTIVE ? FALLING : ONLOW);
+    rfidArmReqa();
+    Serial.printf("[RFID] Detección por IRQ en GPIO %d\n", RFID_IRQ_PIN);
+  }
 
   // Inicializa SPI para SD
   configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
   initSDCard();
 
   // Carga usuarios y historial desde SD
+  loadSchedules();
+  initUserTable();
   loadUsers();
+  initCardIndex();
+  {
+    UserSnapshot users;
+    cardIndexSync(nullptr, users.get());
+  }
+  initUsersLog();
+  initLogArchive();
   loadAccessHistory();
+  initLogIndex();
+  initAccessStats();
 
   // Conecta WiFi
   WiFi.begin(ssid, password);
@@ -194,6 +1135,10 @@ void setup() {
 
   // Configura cliente seguro para Telegram
   client.setCACert(TELEGRAM_CERTIFICATE_ROOT);
+  initNotifications();
+  initMqtt();
+  initAccessPipeline();
+  initUserSync();
   sendTelegramNotification("[BOT] Sistema de control de acceso iniciado");
 
   // Configura rutas del servidor web
@@ -208,8 +1153,24 @@ void setup() {
   server.on("/editUser", HTTP_GET, handleEditUserGet);
   server.on("/editUser", HTTP_POST, handleEditUserPost);
   server.on("/deleteUser", HTTP_GET, handleDeleteUser);
+  server.on("/api/users/import", HTTP_POST, handleImportUsers, handleImportUsersUpload, handleImportUsersBody);
+  server.on("/api/users/export", HTTP_GET, handleExportUsers);
+  server.on("/api/users/changes", HTTP_POST, handleUsersChanges);
+  server.on("/api/users/sync", HTTP_GET, handleUsersSync);
+  server.on("/api/users/sync", HTTP_POST, handleUsersSync);
+  server.on("/api/cards/stats", HTTP_GET, handleCardIndexStats);
+  server.on("/log", HTTP_GET, handleLogQuery);
+  server.on("/log", HTTP_POST, handleLogQuery);
+  server.on("/api/log", HTTP_GET, handleLogApi);
+  server.on("/stats", HTTP_GET, handleStats);
+  server.on("/stats", HTTP_POST, handleStats);
+  server.on("/api/stats", HTTP_GET, handleStatsApi);
+  server.on("/debug/trace", HTTP_GET, handleDebugTrace);
+  server.on("/api/export", HTTP_GET, handleLogExport);
   server.begin();
   Serial.println("[WEB] Servidor iniciado");
+
+  initPowerMode();
 }
 
 void loop() {
@@ -217,17 +1178,34 @@ void loop() {
   static unsigned long lastLoop = 0;
   const long LOOP_INTERVAL = 50;
   static unsigned long lastTelegramCheck = 0;
-  const long TELEGRAM_CHECK_INTERVAL = 1000; // Revisar mensajes cada 1 segundo
+  const unsigned long TELEGRAM_CHECK_INTERVAL = POWER_MODE == POWER_ACTIVE ? 1000 : POWER_TELEGRAM_CHECK_MS;
 
-  if (currentMillis - lastLoop >= LOOP_INTERVAL) {
+  // En los modos de ahorro cada vuelta es un despertar: se atiende todo
+  if (currentMillis - lastLoop >= LOOP_INTERVAL || POWER_MODE != POWER_ACTIVE) {
+    updateScheduleClock();
     checkDoorStatus();
     checkRelayTimer();
     checkRFID();
     updateRGBStatus();
-    strip.show();
+    reclaimUserTables();
+    updateAccessStats();
+    updateLogArchive();
+    updateCardIndex();
+    updateUserSync();
+    updateNotifications();
     lastLoop = currentMillis;
   }
 
+  // Con la IRQ, la tarjeta se atiende en cuanto responde y el siguiente REQA sale
+  // al cerrarse la ventana del anterior, sin esperar a la vuelta de 50 ms
+  if (rfidIrqPending) checkRFID();
+
+  // Cada vuelta: lo que se decidió (aquí o desde la web) se registra y se avisa ya
+  updateAccessPipeline();
+
+  // Cada vuelta: los eventos salen en cuanto hay hueco en la ventana de envío
+  updateMqtt();
+
   if (currentMillis - lastTelegramCheck >= TELEGRAM_CHECK_INTERVAL) {
     handleTelegramMessages();
     lastTelegramCheck = currentMillis;
@@ -251,6 +1229,8 @@ void loop() {
       digitalWrite(STATUS_LED, LOW);
     }
   }
+
+  if (POWER_MODE != POWER_ACTIVE) powerIdle(lastTelegramCheck + TELEGRAM_CHECK_INTERVAL);
 }
 
 // === FUNCIONES PRINCIPALES ===
@@ -261,7 +1241,7 @@ void configureSPIPins(int sck, int miso, int mosi, int cs) {
 }
 
 void setLEDColor(uint32_t color) {
-  strip.setPixelColor(0, color);
+  for (int i = 0; i < NUM_LEDS; i++) strip.setPixelColor(i, color);
 }
 
 void initSDCard() {
@@ -275,7 +1255,7 @@ void initSDCard() {
   if (!SD.exists(SD_FILE)) {
     File file = SD.open(SD_FILE, FILE_WRITE);
     if (file) {
-      file.println("Fecha y Hora,Método,ID,Usuario,Estado");
+      file.println(LOG_HEADER);
       file.close();
       Serial.println("[SD] Archivo de log creado");
     }
@@ -284,878 +1264,5807 @@ void initSDCard() {
   if (!SD.exists(USER_FILE)) {
     File file = SD.open(USER_FILE, FILE_WRITE);
     if (file) {
-      file.println("Nombre,PIN,UID");
+      file.println("Nombre,PIN,UID,Horario");
       file.close();
       Serial.println("[SD] Archivo de usuarios creado");
     }
   }
 }
 
-void loadUsers() {
-  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
-  File file = SD.open(USER_FILE, FILE_READ);
-  if (!file) {
-    Serial.println("[SD] Error al abrir archivo de usuarios");
-    return;
-  }
+// === LECTURA DE ARCHIVOS POR BLOQUES ===
+
+LineReader::LineReader(const Source& source, uint32_t from, uint32_t to)
+    : source(source), block(new (std::nothrow) uint8_t[SD_READ_BLOCK + 1]), end(to) {
+  // Se lee desde el byte anterior para saber si from empieza línea
+  skipping = from > 0;
+  position = skipping ? from - 1 : 0;
+  blockOffset = position;
+  failed = block == nullptr;
+}
+
+LineReader::LineReader(File& file, uint32_t from)
+    : LineReader([&file](uint32_t, uint8_t* out, size_t length) { return file.read(out, length); }, 0, UINT32_MAX) {
+  // Lectura secuencial: la posición solo se fija una vez
+  skipping = false;
+  position = blockOffset = from;
+  if (!file.seek(from)) failed = true;
+}
 
-  if (file.available()) file.readStringUntil('\n');
+void LineReader::emit(size_t from, size_t to, bool terminated) {
+  line = (char*)block + from;
+  length = to - from;
+  if (length > 0 && line[length - 1] == '\r') length--;
+  line[length] = '\0'; // Pisa el '\n' ya consumido (o el byte de reserva del bloque)
+  offset = blockOffset + from;
+  complete = terminated;
+  truncated = false;
+}
 
-  while (file.available() && numAuthorizedUsers < 10) {
-    String line = file.readStringUntil('\n');
-    line.trim();
-    if (line.length() > 0) {
-      int comma1 = line.indexOf(',');
-      int comma2 = line.indexOf(',', comma1 + 1);
-      String name = line.substring(0, comma1);
-      String pin = line.substring(comma1 + 1, comma2);
-      String uid = line.substring(comma2 + 1);
-      authorizedUsers[numAuthorizedUsers++] = {name, pin, uid};
+bool LineReader::next() {
+  while (!failed) {
+    uint8_t* newline = (uint8_t*)memchr(block + head, '\n', tail - head);
+    if (newline != nullptr) {
+      size_t from = head;
+      head = newline - block + 1;
+      if (skipping) {
+        skipping = false;
+        continue;
+      }
+      emit(from, newline - block, true);
+      return true;
+    }
+    if (eof) {
+      if (head == tail || skipping) return false;
+      emit(head, tail, false);
+      head = tail;
+      return true;
+    }
+    if (head == 0 && tail == SD_READ_BLOCK) {
+      // Línea más larga que el bloque: se entrega cortada, marcada, y se descarta el resto
+      emit(0, tail, true);
+      truncated = true;
+      head = tail;
+      skipping = true;
+      return true;
+    }
+    // Lo que queda de la línea actual pasa al principio y se rellena el bloque
+    memmove(block, block + head, tail - head);
+    blockOffset += head;
+    tail -= head;
+    head = 0;
+    size_t wanted = min<uint32_t>(SD_READ_BLOCK - tail, end - position);
+    size_t n = wanted > 0 ? source(position, block + tail, wanted) : 0;
+    if (n == 0) {
+      // Con un final conocido, quedarse corto es un error de lectura
+      if (end != UINT32_MAX && position < end) failed = true;
+      eof = true;
+      continue;
     }
+    position += n;
+    tail += n;
   }
-  file.close();
-  Serial.println("[SD] Usuarios cargados (" + String(numAuthorizedUsers) + " usuarios)");
+  return false;
 }
 
-void loadAccessHistory() {
-  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
-  File file = SD.open(SD_FILE, FILE_READ);
-  if (!file) {
-    Serial.println("[SD] Error al abrir archivo de historial");
-    return;
+// Quita los espacios de los extremos de la línea actual (como String::trim)
+void LineReader::trim() {
+  while (length > 0 && isspace((unsigned char)line[length - 1])) length--;
+  line[length] = '\0';
+  while (length > 0 && isspace((unsigned char)*line)) {
+    line++;
+    length--;
+  }
+}
+
+// Parte text por comas en el mismo búfer; el último campo se queda con el resto
+int splitFields(char* text, char** fields, int max) {
+  int count = 0;
+  fields[count++] = text;
+  while (count < max && (text = strchr(text, ',')) != nullptr) {
+    *text++ = '\0';
+    fields[count++] = text;
   }
+  return count;
+}
+
+// === HORARIOS DE ACCESO ===
 
-  if (file.available()) file.readStringUntil('\n'); // Skip header
+void scheduleSetSlots(uint32_t* bits, int from, int to) {
+  for (int slot = from; slot < to; slot++) bits[slot >> 5] |= 1UL << (slot & 31);
+}
+
+// Convierte "HH:MM" en franja de 15 minutos; roundUp redondea hacia arriba
+int parseScheduleTime(const String& text, bool roundUp) {
+  int colon = text.indexOf(':');
+  if (colon < 0) return -1;
+  int hours = text.substring(0, colon).toInt();
+  int minutes = text.substring(colon + 1).toInt();
+  int total = hours * 60 + minutes;
+  if (hours < 0 || minutes < 0 || minutes > 59 || total > 24 * 60) return -1;
+  return roundUp ? (total + SCHEDULE_SLOT_MINUTES - 1) / SCHEDULE_SLOT_MINUTES : total / SCHEDULE_SLOT_MINUTES;
+}
+
+// Compila reglas como "L-V 08:00-18:00;S 09:00-14:00;F" en el mapa de bits
+// semanal. Días: L M X J V S D, rangos con '-', listas con ','; F = festivo.
+// Sin franja horaria la regla cubre el día completo.
+bool compileSchedule(const String& rules, Schedule& schedule, String& error) {
+  memset(schedule.week, 0, sizeof(schedule.week));
+  memset(schedule.holiday, 0, sizeof(schedule.holiday));
+  const char* DAYS = "LMXJVSD"; // Lunes primero; tm_wday = (posición + 1) % 7
 
-  // Store lines in a temporary array to get the last 15
-  String tempHistory[15];
-  int tempCount = 0;
+  int start = 0;
+  while (start <= (int)rules.length()) {
+    int end = rules.indexOf(';', start);
+    if (end < 0) end = rules.length();
+    String rule = rules.substring(start, end);
+    rule.trim();
+    start = end + 1;
+    if (rule.length() == 0) continue;
 
-  while (file.available() && tempCount < 15) {
-    String line = file.readStringUntil('\n');
-    line.trim();
-    if (line.length() > 0) {
-      tempHistory[tempCount] = line;
-      tempCount++;
+    int space = rule.indexOf(' ');
+    String days = space < 0 ? rule : rule.substring(0, space);
+    int fromSlot = 0, toSlot = SCHEDULE_SLOTS_PER_DAY;
+    if (space >= 0) {
+      String range = rule.substring(space + 1);
+      range.trim();
+      int dash = range.indexOf('-');
+      fromSlot = dash < 0 ? -1 : parseScheduleTime(range.substring(0, dash), false);
+      toSlot = dash < 0 ? -1 : parseScheduleTime(range.substring(dash + 1), true);
+      if (fromSlot < 0 || toSlot < 0) {
+        error = "Franja horaria inválida: " + range;
+        return false;
+      }
     }
-  }
 
-  // If more lines are available, keep reading to get the last 15
-  if (file.available()) {
-    while (file.available()) {
-      String line = file.readStringUntil('\n');
-      line.trim();
-      if (line.length() > 0) {
-        // Shift array and add new line
-        for (int i = 0; i < 14; i++) {
-          tempHistory[i] = tempHistory[i + 1];
+    bool selected[8] = {false}; // 0..6 = L..D, 7 = festivo
+    for (unsigned int i = 0; i < days.length(); i++) {
+      char c = toupper(days[i]);
+      if (c == ',') continue;
+      if (c == 'F') {
+        selected[7] = true;
+        continue;
+      }
+      const char* pos = strchr(DAYS, c);
+      if (pos == nullptr) {
+        error = String("Día inválido: ") + c;
+        return false;
+      }
+      int first = pos - DAYS, last = first;
+      if (i + 2 < days.length() && days[i + 1] == '-') {
+        const char* lastPos = strchr(DAYS, toupper(days[i + 2]));
+        if (lastPos == nullptr) {
+          error = "Rango de días inválido: " + days;
+          return false;
         }
-        tempHistory[14] = line;
+        last = lastPos - DAYS;
+        i += 2;
       }
+      for (int n = 0; n <= (last - first + 7) % 7; n++) selected[(first + n) % 7] = true;
     }
-  }
 
-  // Copy to accessHistory
-  historyCount = min(tempCount, 15);
-  for (int i = 0; i < historyCount; i++) {
-    accessHistory[i] = tempHistory[i];
+    for (int d = 0; d < 8; d++) {
+      if (!selected[d]) continue;
+      if (d == 7) {
+        // Festivo: sin desbordamiento al día siguiente
+        scheduleSetSlots(schedule.holiday, fromSlot, toSlot > fromSlot ? toSlot : SCHEDULE_SLOTS_PER_DAY);
+        continue;
+      }
+      int base = ((d + 1) % 7) * SCHEDULE_SLOTS_PER_DAY;
+      if (toSlot > fromSlot) {
+        scheduleSetSlots(schedule.week, base + fromSlot, base + toSlot);
+      } else {
+        // Franja nocturna (p. ej. 22:00-06:00): continúa en el día siguiente
+        int next = ((d + 2) % 7) * SCHEDULE_SLOTS_PER_DAY;
+        scheduleSetSlots(schedule.week, base + fromSlot, base + SCHEDULE_SLOTS_PER_DAY);
+        scheduleSetSlots(schedule.week, next, next + toSlot);
+      }
+    }
   }
-
-  file.close();
-  Serial.println("[SD] Historial cargado (" + String(historyCount) + " registros)");
+  return true;
 }
 
-String getTagUID() {
-  String tagUID = "";
-  for (byte i = 0; i < rfid.uid.size; i++) {
-    tagUID += (rfid.uid.uidByte[i] < 0x10 ? "0" : "");
-    tagUID += String(rfid.uid.uidByte[i], HEX);
-    if (i < rfid.uid.size - 1) tagUID += " ";
+int findSchedule(const char* name) {
+  if (name[0] == '\0') return 0;
+  for (int i = 0; i < numSchedules; i++) {
+    if (strcasecmp(name, schedules[i].name) == 0) return i;
   }
-  tagUID.toUpperCase();
-  return tagUID;
+  return -1;
 }
 
-void addUser(const String& name, const String& pin, const String& uid) {
-  if (numAuthorizedUsers >= 10) {
-    Serial.println("[USER] Error: Límite de usuarios alcanzado");
-    return;
-  }
+const char* scheduleName(uint8_t id) {
+  return id < numSchedules ? schedules[id].name : "desconocido";
+}
 
-  if (pin.length() != 4 && uid.length() == 0) {
-    Serial.println("[USER] Error: Se debe proporcionar al menos un PIN o un UID");
-    return;
-  }
+void loadSchedules() {
+  // Horario 0 integrado: acceso permanente
+  strcpy(schedules[0].name, "siempre");
+  memset(schedules[0].week, 0xFF, sizeof(schedules[0].week));
+  memset(schedules[0].holiday, 0xFF, sizeof(schedules[0].holiday));
+  strcpy(schedules[0].rules, "");
+  numSchedules = 1;
 
-  authorizedUsers[numAuthorizedUsers++] = {name, pin, uid};
   configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
-  File file = SD.open(USER_FILE, FILE_APPEND);
-  if (file) {
-    file.println(name + "," + pin + "," + uid);
-    file.close();
-    Serial.println("[USER] Usuario añadido: " + name + ", PIN: " + pin + ", UID: " + uid);
-  } else {
-    Serial.println("[SD] Error al escribir en archivo de usuarios");
-  }
-}
-
-void deleteUser(int index) {
-  if (index >= 0 && index < numAuthorizedUsers) {
-    for (int i = index; i < numAuthorizedUsers - 1; i++) {
-      authorizedUsers[i] = authorizedUsers[i + 1];
-    }
-    numAuthorizedUsers--;
-    configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
-    File file = SD.open(USER_FILE, FILE_WRITE);
+  if (!SD.exists(SCHEDULE_FILE)) {
+    File file = SD.open(SCHEDULE_FILE, FILE_WRITE);
     if (file) {
-      file.println("Nombre,PIN,UID");
-      for (int i = 0; i < numAuthorizedUsers; i++) {
-        file.println(authorizedUsers[i].name + "," + authorizedUsers[i].pin + "," + authorizedUsers[i].uid);
-      }
+      file.println("Nombre,Reglas");
+      file.println("laboral,L-V 08:00-18:00");
+      file.println("fines,S-D");
       file.close();
+      Serial.println("[SD] Archivo de horarios creado");
     }
   }
-}
 
-void updateUser(int index, const String& name, const String& pin, const String& uid) {
-  if (index >= 0 && index < numAuthorizedUsers) {
-    authorizedUsers[index] = {name, pin, uid};
-    configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
-    File file = SD.open(USER_FILE, FILE_WRITE);
-    if (file) {
-      file.println("Nombre,PIN,UID");
-      for (int i = 0; i < numAuthorizedUsers; i++) {
-        file.println(authorizedUsers[i].name + "," + authorizedUsers[i].pin + "," + authorizedUsers[i].uid);
+  File file = SD.open(SCHEDULE_FILE, FILE_READ);
+  if (file) {
+    LineReader reader(file);
+    reader.next(); // Cabecera
+    while (numSchedules < MAX_SCHEDULES && reader.next()) {
+      if (reader.truncated) continue;
+      reader.trim();
+      char* fields[2];
+      if (splitFields(reader.line, fields, 2) < 2 || fields[0][0] == '\0') continue;
+      Schedule& schedule = schedules[numSchedules];
+      String error;
+      if (!compileSchedule(fields[1], schedule, error)) {
+        Serial.printf("[HORARIO] Error en horario %s: %s\n", fields[0], error.c_str());
+        continue;
       }
-      file.close();
+      strlcpy(schedule.name, fields[0], sizeof(schedule.name));
+      strlcpy(schedule.rules, fields[1], sizeof(schedule.rules));
+      numSchedules++;
     }
+    file.close();
   }
-}
 
-void checkRFID() {
-  configureSPIPins(RFID_SCK_PIN, RFID_MISO_PIN, RFID_MOSI_PIN, RFID_SS_PIN);
-  if (rfid.PICC_IsNewCardPresent() && rfid.PICC_ReadCardSerial()) {
-    String tagUID = getTagUID();
-    Serial.println("[RFID] Tarjeta detectada - UID: " + tagUID);
-    String userName = "N/A";
-    bool authorized = false;
-    for (int i = 0; i < numAuthorizedUsers; i++) {
-      if (tagUID == authorizedUsers[i].uid) {
-        authorized = true;
-        userName = authorizedUsers[i].name;
-        break;
+  numHolidays = 0;
+  file = SD.open(HOLIDAY_FILE, FILE_READ);
+  if (file) {
+    LineReader reader(file);
+    while (numHolidays < MAX_HOLIDAYS && reader.next()) {
+      if (reader.truncated) continue;
+      reader.trim();
+      const char* line = reader.line;
+      // AAAA-MM-DD -> AAAAMMDD
+      if (reader.length == 10 && line[4] == '-' && line[7] == '-') {
+        holidays[numHolidays++] = atoi(line) * 10000 + atoi(line + 5) * 100 + atoi(line + 8);
       }
     }
+    file.close();
+  }
+  Serial.println("[HORARIO] " + String(numSchedules) + " horarios y " + String(numHolidays) + " festivos cargados");
+}
 
-    if (waitingForRFID) {
-      if (millis() > rfidTimeout) {
-        waitingForRFID = false;
-        Serial.println("[RFID] Tiempo de espera para escaneo RFID expirado");
-      } else {
-        tempUID = tagUID;
-        addUser(tempName, tempPin, tempUID);
-        waitingForRFID = false;
-        sendTelegramNotification("[USER] Nuevo usuario añadido: " + tempName + " (UID: " + tagUID + ")");
-      }
-    } else if (authorized) {
-      relayState = true;
-      digitalWrite(RELAY_PIN, HIGH);
-      relayTimerEnd = millis() + 10000;
-      logAccess("RFID", tagUID, "Acceso concedido", userName);
-      sendTelegramNotification("[ACCESO] Concedido por RFID: " + tagUID + " (" + userName + ")");
-    } else {
-      logAccess("RFID", tagUID, "Acceso denegado", userName);
-      sendTelegramNotification("[ACCESO] Denegado por RFID: " + tagUID);
-    }
+// Actualiza la franja semanal actual y si hoy es festivo. Se llama desde
+// loop(), de modo que la comprobación en cada acceso es un simple test de bit.
+void updateScheduleClock() {
+  time_t now = time(nullptr);
+  if (now < 1600000000) {
+    currentScheduleSlot = -1; // Hora NTP aún no disponible
+    return;
+  }
+  struct tm timeinfo;
+  localtime_r(&now, &timeinfo);
+  int slot = timeinfo.tm_wday * SCHEDULE_SLOTS_PER_DAY + (timeinfo.tm_hour * 60 + timeinfo.tm_min) / SCHEDULE_SLOT_MINUTES;
+  int yday = timeinfo.tm_year * 1000 + timeinfo.tm_yday;
+  if (yday != currentScheduleDay) {
+    uint32_t today = (timeinfo.tm_year + 1900) * 10000 + (timeinfo.tm_mon + 1) * 100 + timeinfo.tm_mday;
+    bool holiday = false;
+    for (int i = 0; i < numHolidays && !holiday; i++) holiday = holidays[i] == today;
+    todayIsHoliday = holiday;
+    currentScheduleDay = yday;
+  }
+  currentScheduleSlot = slot;
+}
 
-    rfid.PICC_HaltA();
-    rfid.PCD_StopCrypto1();
-    delay(1000);
+// Test de bit sobre el mapa precompilado; sin hora conocida solo se admite
+// el horario permanente. Un horario sin resolver (SCHEDULE_UNKNOWN, o uno que
+// dejó de existir al recargar) deniega: una errata no debe abrir la puerta
+bool scheduleAllows(uint8_t id) {
+  if (id == 0) return true;
+  if (id >= numSchedules) return false;
+  int slot = currentScheduleSlot;
+  if (slot < 0) return false;
+  if (todayIsHoliday) {
+    int daySlot = slot % SCHEDULE_SLOTS_PER_DAY;
+    return schedules[id].holiday[daySlot >> 5] & (1UL << (daySlot & 31));
   }
+  return schedules[id].week[slot >> 5] & (1UL << (slot & 31));
 }
 
-void sendTelegramNotification(const String& message, const String& chatId) {
-  if (bot.sendMessage(chatId, message, "Markdown")) {
-    Serial.println("[TELEGRAM] Notificación enviada: " + message);
+String scheduleOptionsHtml(uint8_t selected) {
+  String html;
+  for (int i = 0; i < numSchedules; i++) {
+    html += "<option value='" + String(schedules[i].name) + "'" + (i == selected ? " selected" : "") + ">" +
+            schedules[i].name + (strlen(schedules[i].rules) > 0 ? String(" (") + schedules[i].rules + ")" : String("")) +
+            "</option>";
+  }
+  return html;
+}
+
+// Usuario leído de /users.txt o del par. Si el horario no existe (errata en
+// schedules.txt, horario que no compila) queda como SCHEDULE_UNKNOWN con su nombre
+User userFromFields(const char* name, const char* pin, const char* uid, const char* scheduleText) {
+  User user = {name, pin, uid, 0};
+  int schedule = findSchedule(scheduleText);
+  if (schedule < 0) {
+    Serial.printf("[HORARIO] Horario desconocido para %s: %s (acceso denegado)\n", name, scheduleText);
+    user.schedule = SCHEDULE_UNKNOWN;
+    user.scheduleText = scheduleText;
   } else {
-    Serial.println("[TELEGRAM] Error al enviar notificación a chat: " + chatId);
+    user.schedule = schedule;
   }
+  return user;
 }
 
-void handleTelegramMessages() {
-  int numNewMessages = bot.getUpdates(bot.last_message_received + 1);
-  for (int i = 0; i < numNewMessages; i++) {
-    String chat_id = String(bot.messages[i].chat_id);
-    String text = bot.messages[i].text;
+// Nombre del horario para guardar o mostrar: vacío para "siempre"
+String userScheduleName(const User& user) {
+  if (user.schedule == 0) return "";
+  return user.schedule == SCHEDULE_UNKNOWN ? user.scheduleText : String(scheduleName(user.schedule));
+}
 
-    // Handle /ip command
-    if (text == "/ip" && chat_id == CHAT_ID) {
-      String ip = WiFi.localIP().toString();
-      sendTelegramNotification("Dirección IP del ESP32: *" + ip + "*", chat_id);
-      Serial.println("[TELEGRAM] Solicitud de IP enviada: " + ip);
-      continue;
+void initUserTable() {
+  usersWriteMutex = xSemaphoreCreateMutex();
+  activeUserTable.store(new UserTable());
+}
+
+UserTable* acquireUserTable() {
+  while (true) {
+    // Entra en la época actual solo el tiempo necesario para fijar el puntero
+    uint32_t epoch = userTableEpoch.load();
+    userTableEpochReaders[epoch & 1]++;
+    if (userTableEpoch.load() != epoch) {
+      userTableEpochReaders[epoch & 1]--;
+      continue;
+    }
+    UserTable* table = activeUserTable.load();
+    table->refs++;
+    userTableEpochReaders[epoch & 1]--;
+    return table;
+  }
+}
+
+void releaseUserTable(UserTable* table) {
+  table->refs--;
+}
+
+// Publica una nueva instantánea y retira la anterior (requiere usersWriteMutex)
+void publishUserTable(UserTable* table) {
+  UserTable* old = activeUserTable.exchange(table);
+
+  // Cambia de época y espera a que salgan los lectores que aún podían
+  // estar fijando el puntero anterior
+  uint32_t epoch = userTableEpoch.fetch_add(1);
+  while (userTableEpochReaders[epoch & 1].load() > 0) {
+    vTaskDelay(1);
+  }
+
+  if (old == nullptr) return;
+  retiredUserTables.push_back(old);
+  reclaimUserTablesLocked();
+}
+
+// Libera las instantáneas retiradas que ya no tienen lectores
+void reclaimUserTablesLocked() {
+  size_t kept = 0;
+  for (size_t i = 0; i < retiredUserTables.size(); i++) {
+    if (retiredUserTables[i]->refs.load() == 0) {
+      delete retiredUserTables[i];
+    } else {
+      retiredUserTables[kept++] = retiredUserTables[i];
+    }
+  }
+  retiredUserTables.resize(kept);
+}
+
+void reclaimUserTables() {
+  if (retiredUserTables.empty()) return;
+  if (xSemaphoreTake(usersWriteMutex, 0) == pdTRUE) {
+    reclaimUserTablesLocked();
+    xSemaphoreGive(usersWriteMutex);
+  }
+}
+
+// Copia la tabla activa, aplica la modificación, la publica y la persiste en SD
+// sin soltar el cerrojo, de modo que el archivo sigue el orden de publicación.
+// Devuelve false (sin publicar nada) si la modificación se rechaza.
+bool modifyUsers(const std::function<bool(std::vector<User>&)>& mutate,
+                 const std::function<void(const UserTable*)>& persist) {
+  xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+  UserTable* previous = activeUserTable.load();
+  UserTable* next = new UserTable();
+  next->users = previous->users;
+  if (!mutate(next->users)) {
+    delete next;
+    xSemaphoreGive(usersWriteMutex);
+    return false;
+  }
+  next->rebuildIndex();
+  previous->refs++;
+  next->refs++;
+  publishUserTable(next);
+  usersGeneration++; // addUser, updateUser, deleteUser e importaciones pasan por aquí
+  persist(next);
+  usersLogAppend(previous, next);
+  cardIndexSync(previous, next);
+  if (logMutex) xSemaphoreTake(logMutex, portMAX_DELAY);
+  statsSyncUsers(next);
+  if (logMutex) xSemaphoreGive(logMutex);
+  next->refs--;
+  previous->refs--;
+  xSemaphoreGive(usersWriteMutex);
+  return true;
+}
+
+void loadUsers() {
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  unsigned long start = millis();
+  File file = SD.open(USER_FILE, FILE_READ);
+  if (!file) {
+    Serial.println("[SD] Error al abrir archivo de usuarios");
+    return;
+  }
+  uint32_t bytes = file.size();
+
+  LineReader reader(file);
+  reader.next(); // Cabecera
+  UserTable* table = new UserTable();
+  while (table->size() < MAX_USERS && reader.next()) {
+    if (reader.truncated) {
+      Serial.printf("[SD] Línea de usuarios demasiado larga en el byte %lu; se ignora\n", (unsigned long)reader.offset);
+      continue;
+    }
+    reader.trim();
+    if (reader.length == 0) continue;
+    // Nombre,PIN,UID[,Horario]: los campos que falten quedan vacíos
+    char* fields[4];
+    int count = splitFields(reader.line, fields, 4);
+    table->users.push_back(userFromFields(fields[0], count > 1 ? fields[1] : "", count > 2 ? fields[2] : "",
+                                          count > 3 ? fields[3] : ""));
+  }
+  if (reader.failed) Serial.println("[SD] Error al leer archivo de usuarios");
+  file.close();
+
+  table->rebuildIndex();
+  int loaded = table->size();
+  xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+  publishUserTable(table);
+  xSemaphoreGive(usersWriteMutex);
+  unsigned long elapsed = max(1UL, millis() - start);
+  Serial.printf("[SD] Usuarios cargados (%d usuarios, %lu B en %lu ms, %.2f MB/s)\n", loaded, (unsigned long)bytes,
+                elapsed, bytes / 1000.0 / elapsed);
+}
+
+// Carga las 15 últimas líneas leyendo solo el final del registro, que tras
+// una rotación puede empezar en el último segmento archivado
+void loadAccessHistory() {
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  uint32_t end = logLogicalEnd();
+  uint32_t tail = 16 * (LOG_LINE_MAX + 2);
+  LogReader reader;
+  historyCount = 0;
+  bool ok = logForEachLine(reader, end > tail ? end - tail : 0, end, [](uint32_t offset, const char* line, int length) {
+    if (length == 0 || logIsHeader(line)) return true;
+    if (historyCount == 15) {
+      memmove(accessHistory[0], accessHistory[1], sizeof(accessHistory[0]) * 14);
+      historyCount--;
+    }
+    strlcpy(accessHistory[historyCount++], line, LOG_LINE_MAX);
+    return true;
+  });
+  logReaderClose(reader);
+  if (!ok) {
+    Serial.println("[SD] Error al abrir archivo de historial");
+    return;
+  }
+  Serial.println("[SD] Historial cargado (" + String(historyCount) + " registros)");
+}
+
+// Escribe el UID como "04 A3 1B 7F" en el búfer recibido, sin usar el heap
+void getTagUID(char* out, size_t size) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t pos = 0;
+  for (byte i = 0; i < rfid.uid.size && pos + 3 < size; i++) {
+    if (i > 0) out[pos++] = ' ';
+    out[pos++] = hex[rfid.uid.uidByte[i] >> 4];
+    out[pos++] = hex[rfid.uid.uidByte[i] & 0x0F];
+  }
+  out[pos] = '\0';
+}
+
+String userFileLine(const User& user) {
+  return user.name + "," + user.pin + "," + user.uid + "," + userScheduleName(user);
+}
+
+void saveUsersFile(const UserTable* table) {
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  trace(TRACE_SD_WRITE_START, TRACE_SD_USERS);
+  File file = SD.open(USER_FILE, FILE_WRITE);
+  if (file) {
+    file.println("Nombre,PIN,UID,Horario");
+    for (const User& user : table->users) {
+      file.println(userFileLine(user));
+    }
+    file.close();
+    trace(TRACE_SD_WRITE_END, TRACE_SD_USERS);
+  } else {
+    Serial.println("[SD] Error al escribir en archivo de usuarios");
+  }
+}
+
+void addUser(const String& name, const String& pin, const String& uid, uint8_t schedule = 0) {
+  if (pin.length() != 4 && uid.length() == 0) {
+    Serial.println("[USER] Error: Se debe proporcionar al menos un PIN o un UID");
+    return;
+  }
+
+  bool added = modifyUsers([&](std::vector<User>& users) {
+    if ((int)users.size() >= MAX_USERS) return false;
+    users.push_back({name, pin, uid, schedule});
+    return true;
+  }, [&](const UserTable* table) {
+    configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+    trace(TRACE_SD_WRITE_START, TRACE_SD_USERS);
+    File file = SD.open(USER_FILE, FILE_APPEND);
+    if (file) {
+      file.println(userFileLine(table->users.back()));
+      file.close();
+      trace(TRACE_SD_WRITE_END, TRACE_SD_USERS);
+      Serial.println("[USER] Usuario añadido: " + name + ", PIN: " + pin + ", UID: " + uid + ", Horario: " + scheduleName(schedule));
+    } else {
+      Serial.println("[SD] Error al escribir en archivo de usuarios");
+    }
+  });
+  if (!added) {
+    Serial.println("[USER] Error: Límite de usuarios alcanzado");
+  }
+}
+
+// Elimina el usuario y devuelve su nombre en deletedName. El índice viene de una
+// página que puede estar desfasada: solo se actúa si en esa posición sigue el
+// usuario que se mostró (comprobado bajo el cerrojo, sobre la tabla que se modifica)
+bool deleteUser(int index, const String& expectedName, String* deletedName = nullptr) {
+  bool deleted = modifyUsers([&](std::vector<User>& users) {
+    if (index < 0 || index >= (int)users.size() || users[index].name != expectedName) return false;
+    if (deletedName) *deletedName = users[index].name;
+    users.erase(users.begin() + index);
+    return true;
+  }, saveUsersFile);
+  return deleted;
+}
+
+bool updateUser(int index, const String& expectedName, const String& name, const String& pin, const String& uid,
+                uint8_t schedule) {
+  return modifyUsers([&](std::vector<User>& users) {
+    if (index < 0 || index >= (int)users.size() || users[index].name != expectedName) return false;
+    String scheduleText = schedule == SCHEDULE_UNKNOWN ? users[index].scheduleText : "";
+    users[index] = {name, pin, uid, schedule, scheduleText};
+    return true;
+  }, saveUsersFile);
+}
+
+// === ÍNDICE DE TARJETAS EN SD (B+TREE) ===
+
+// Clave de 64 bits a partir de los bytes del UID: UIDs de 4 y 7 bytes se
+// empaquetan tal cual (longitud en el byte alto); los de 10 bytes se resumen
+// con FNV-1a, ya que no caben en 56 bits
+uint64_t cardKeyFromBytes(const byte* uid, byte size) {
+  uint64_t key = 0;
+  if (size <= 7) {
+    for (byte i = 0; i < size; i++) key = (key << 8) | uid[i];
+  } else {
+    key = 1469598103934665603ULL;
+    for (byte i = 0; i < size; i++) key = (key ^ uid[i]) * 1099511628211ULL;
+    key &= 0x00FFFFFFFFFFFFFFULL;
+  }
+  return key | ((uint64_t)size << 56);
+}
+
+uint64_t cardKeyFromUID(const String& uid) {
+  byte bytes[10];
+  byte size = 0;
+  for (unsigned int i = 0; i + 1 < uid.length() && size < sizeof(bytes); ) {
+    if (uid[i] == ' ') { i++; continue; }
+    char hex[3] = { uid[i], uid[i + 1], '\0' };
+    bytes[size++] = (byte)strtoul(hex, nullptr, 16);
+    i += 2;
+  }
+  return cardKeyFromBytes(bytes, size);
+}
+
+bool cardIndexLock() {
+  return xSemaphoreTake(cardIndexMutex, portMAX_DELAY) == pdTRUE;
+}
+
+void cardIndexUnlock() {
+  xSemaphoreGive(cardIndexMutex);
+}
+
+bool cardIndexReadRaw(uint32_t pageNo, CardPage& page) {
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  if (!cardIndexFile.seek(pageNo * CARD_PAGE_SIZE)) return false;
+  return cardIndexFile.read((uint8_t*)&page, CARD_PAGE_SIZE) == CARD_PAGE_SIZE;
+}
+
+bool cardIndexWriteRaw(uint32_t pageNo, const void* data) {
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  if (!cardIndexFile.seek(pageNo * CARD_PAGE_SIZE)) return false;
+  trace(TRACE_SD_WRITE_START, TRACE_SD_CARDS);
+  bool ok = cardIndexFile.write((const uint8_t*)data, CARD_PAGE_SIZE) == CARD_PAGE_SIZE;
+  cardIndexFile.flush();
+  trace(TRACE_SD_WRITE_END, TRACE_SD_CARDS);
+  return ok;
+}
+
+// Devuelve la página desde la caché LRU, leyéndola de SD si no está
+const CardPage* cardIndexFetch(uint32_t pageNo) {
+  cardCacheClock++;
+  int victim = 0;
+  for (int i = 0; i < CARD_CACHE_PAGES; i++) {
+    if (cardCache[i].valid && cardCache[i].pageNo == pageNo) {
+      cardCache[i].lastUse = cardCacheClock;
+      cardIndexStats.cacheHits++;
+      return &cardCache[i].page;
+    }
+    if (!cardCache[i].valid || (cardCache[victim].valid && cardCache[i].lastUse < cardCache[victim].lastUse)) {
+      victim = i;
+    }
+  }
+
+  cardIndexStats.cacheMisses++;
+  CardCacheSlot& slot = cardCache[victim];
+  slot.valid = cardIndexReadRaw(pageNo, slot.page);
+  if (!slot.valid) return nullptr;
+  slot.pageNo = pageNo;
+  slot.lastUse = cardCacheClock;
+  return &slot.page;
+}
+
+bool cardIndexLoad(uint32_t pageNo, CardPage& page) {
+  const CardPage* cached = cardIndexFetch(pageNo);
+  if (cached == nullptr) return false;
+  page = *cached;
+  return true;
+}
+
+// Escritura inmediata en SD; la copia en caché se actualiza si está presente
+bool cardIndexStore(uint32_t pageNo, const CardPage& page) {
+  for (int i = 0; i < CARD_CACHE_PAGES; i++) {
+    if (cardCache[i].valid && cardCache[i].pageNo == pageNo) {
+      cardCache[i].page = page;
+      break;
+    }
+  }
+  return cardIndexWriteRaw(pageNo, &page);
+}
+
+bool cardIndexStoreHeader() {
+  uint8_t raw[CARD_PAGE_SIZE] = {0};
+  memcpy(raw, &cardIndexHeader, sizeof(cardIndexHeader));
+  return cardIndexWriteRaw(0, raw);
+}
+
+uint32_t cardIndexAllocPage() {
+  cardIndexHeaderDirty = CARD_HEADER_SYNC_EVERY; // Fuerza la escritura de la cabecera
+  return cardIndexHeader.numPages++;
+}
+
+// La cabecera se escribe siempre que cambian las páginas o la raíz; si solo
+// cambia el contador de claves, cada CARD_HEADER_SYNC_EVERY modificaciones
+void cardIndexTouchHeader() {
+  if (++cardIndexHeaderDirty >= CARD_HEADER_SYNC_EVERY) {
+    cardIndexStoreHeader();
+    cardIndexHeaderDirty = 0;
+  }
+}
+
+// --- Filtro de Bloom: descarta tarjetas desconocidas sin acceder a la SD ---
+
+uint64_t cardBloomMix(uint64_t key) {
+  key += 0x9E3779B97F4A7C15ULL;
+  key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+  return key ^ (key >> 31);
+}
+
+void cardBloomAdd(uint64_t key) {
+  if (cardBloom == nullptr) return;
+  uint64_t h = cardBloomMix(key);
+  uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+  for (int i = 0; i < CARD_BLOOM_HASHES; i++) {
+    uint32_t bit = (h1 + i * h2) & (cardBloomBits - 1);
+    cardBloom[bit >> 5] |= 1UL << (bit & 31);
+  }
+}
+
+bool cardBloomMayContain(uint64_t key) {
+  if (cardBloom == nullptr || cardBloomFilling) return true;
+  uint64_t h = cardBloomMix(key);
+  uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+  for (int i = 0; i < CARD_BLOOM_HASHES; i++) {
+    uint32_t bit = (h1 + i * h2) & (cardBloomBits - 1);
+    if (!(cardBloom[bit >> 5] & (1UL << (bit & 31)))) return false;
+  }
+  return true;
+}
+
+// ~10 bits por tarjeta redondeados a potencia de 2 (la máscara de los índices),
+// entre 4 KB y CARD_BLOOM_MAX_BYTES
+uint32_t cardBloomBytesFor(uint32_t keys) {
+  uint32_t bytes = CARD_BLOOM_MIN_BYTES;
+  while (bytes < CARD_BLOOM_MAX_BYTES && (uint64_t)bytes * 8 < (uint64_t)keys * CARD_BLOOM_BITS_PER_KEY) bytes *= 2;
+  return bytes;
+}
+
+// Reserva el filtro para "keys" tarjetas; hay que poblarlo después con
+// cardBloomRebuild(). El anterior se libera antes para que el nuevo quepa
+void cardBloomAllocate(uint32_t keys) {
+  cardBloomWanted = cardBloomBytesFor(keys);
+  free(cardBloom);
+  cardBloom = nullptr;
+  cardBloomBits = 0;
+  // Reduce el tamaño a la mitad hasta que quepa en el heap disponible
+  for (uint32_t bytes = cardBloomWanted; bytes >= CARD_BLOOM_MIN_BYTES; bytes /= 2) {
+    cardBloom = (uint32_t*)calloc(bytes / 4, 4);
+    if (cardBloom != nullptr) {
+      cardBloomBits = bytes * 8;
+      return;
+    }
+  }
+  Serial.println("[INDICE] Sin memoria para el filtro de Bloom");
+}
+
+// Empieza a poblar el filtro recorriendo la cadena de hojas desde la primera.
+// Las altas de mientras se añaden al filtro nuevo y, si parten una hoja aún sin
+// recorrer, la mitad que se mueve queda por delante en la cadena
+void cardBloomRebuildBegin() {
+  if (cardBloom == nullptr) return;
+  memset(cardBloom, 0, cardBloomBits / 8);
+  uint32_t pageNo = cardIndexHeader.root;
+  CardPage page;
+  while (cardIndexLoad(pageNo, page) && !page.leaf) {
+    pageNo = page.inner.children[0];
+  }
+  cardBloomNextLeaf = pageNo;
+  cardBloomFilling = true;
+}
+
+// Recorre hasta "pages" hojas; devuelve true cuando el filtro está completo
+bool cardBloomRebuildStep(int pages) {
+  CardPage page;
+  for (; cardBloomFilling && pages > 0; pages--) {
+    if (cardBloomNextLeaf == 0) {
+      cardBloomFilling = false;
+    } else if (!cardIndexReadRaw(cardBloomNextLeaf, page)) {
+      // Un filtro a medias rechazaría tarjetas válidas: mejor ninguno
+      Serial.println("[INDICE] Error de lectura al poblar el filtro de Bloom; se desactiva");
+      free(cardBloom);
+      cardBloom = nullptr;
+      cardBloomBits = 0;
+      cardBloomFilling = false;
+    } else {
+      for (int i = 0; i < page.count; i++) cardBloomAdd(page.records[i].key);
+      cardBloomNextLeaf = page.next;
+    }
+  }
+  return !cardBloomFilling;
+}
+
+// --- Operaciones del árbol (requieren cardIndexMutex) ---
+
+int cardLeafLowerBound(const CardPage& page, uint64_t key) {
+  int lo = 0, hi = page.count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (page.records[mid].key < key) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+int cardInnerChild(const CardPage& page, uint64_t key) {
+  int lo = 0, hi = page.count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (page.inner.keys[mid] <= key) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+// Inserta recursivamente; si el nodo se divide devuelve true con la clave
+// separadora y la nueva página derecha en splitKey/splitPage
+bool cardIndexInsertAt(uint32_t pageNo, const CardRecord& record, bool& added, uint64_t& splitKey, uint32_t& splitPage) {
+  CardPage page;
+  if (!cardIndexLoad(pageNo, page)) return false;
+
+  if (page.leaf) {
+    int pos = cardLeafLowerBound(page, record.key);
+    if (pos < page.count && page.records[pos].key == record.key) {
+      page.records[pos] = record;
+      cardIndexStore(pageNo, page);
+      return false;
+    }
+    added = true;
+
+    CardRecord all[CARD_LEAF_MAX + 1];
+    memcpy(all, page.records, pos * sizeof(CardRecord));
+    all[pos] = record;
+    memcpy(all + pos + 1, page.records + pos, (page.count - pos) * sizeof(CardRecord));
+    int total = page.count + 1;
+
+    if (total <= CARD_LEAF_MAX) {
+      memcpy(page.records, all, total * sizeof(CardRecord));
+      page.count = total;
+      cardIndexStore(pageNo, page);
+      return false;
+    }
+
+    CardPage right = {};
+    right.leaf = 1;
+    int leftCount = total / 2;
+    page.count = leftCount;
+    right.count = total - leftCount;
+    memcpy(page.records, all, leftCount * sizeof(CardRecord));
+    memcpy(right.records, all + leftCount, right.count * sizeof(CardRecord));
+    splitPage = cardIndexAllocPage();
+    right.next = page.next;
+    page.next = splitPage;
+    splitKey = right.records[0].key;
+    cardIndexStore(splitPage, right);
+    cardIndexStore(pageNo, page);
+    return true;
+  }
+
+  int idx = cardInnerChild(page, record.key);
+  uint64_t childKey;
+  uint32_t childPage;
+  if (!cardIndexInsertAt(page.inner.children[idx], record, added, childKey, childPage)) return false;
+
+  uint64_t keys[CARD_INNER_MAX + 1];
+  uint32_t children[CARD_INNER_MAX + 2];
+  memcpy(keys, page.inner.keys, idx * sizeof(uint64_t));
+  keys[idx] = childKey;
+  memcpy(keys + idx + 1, page.inner.keys + idx, (page.count - idx) * sizeof(uint64_t));
+  memcpy(children, page.inner.children, (idx + 1) * sizeof(uint32_t));
+  children[idx + 1] = childPage;
+  memcpy(children + idx + 2, page.inner.children + idx + 1, (page.count - idx) * sizeof(uint32_t));
+  int total = page.count + 1;
+
+  if (total <= CARD_INNER_MAX) {
+    memcpy(page.inner.keys, keys, total * sizeof(uint64_t));
+    memcpy(page.inner.children, children, (total + 1) * sizeof(uint32_t));
+    page.count = total;
+    cardIndexStore(pageNo, page);
+    return false;
+  }
+
+  // División de nodo interno: la clave central sube al padre
+  int mid = total / 2;
+  CardPage right = {};
+  right.leaf = 0;
+  page.count = mid;
+  right.count = total - mid - 1;
+  memcpy(page.inner.keys, keys, mid * sizeof(uint64_t));
+  memcpy(page.inner.children, children, (mid + 1) * sizeof(uint32_t));
+  memcpy(right.inner.keys, keys + mid + 1, right.count * sizeof(uint64_t));
+  memcpy(right.inner.children, children + mid + 1, (right.count + 1) * sizeof(uint32_t));
+  splitKey = keys[mid];
+  splitPage = cardIndexAllocPage();
+  cardIndexStore(splitPage, right);
+  cardIndexStore(pageNo, page);
+  return true;
+}
+
+bool cardIndexPutLocked(const CardRecord& record) {
+  bool added = false;
+  uint64_t splitKey;
+  uint32_t splitPage;
+  if (cardIndexInsertAt(cardIndexHeader.root, record, added, splitKey, splitPage)) {
+    CardPage root = {};
+    root.leaf = 0;
+    root.count = 1;
+    root.inner.keys[0] = splitKey;
+    root.inner.children[0] = cardIndexHeader.root;
+    root.inner.children[1] = splitPage;
+    cardIndexHeader.root = cardIndexAllocPage();
+    cardIndexHeader.height++;
+    cardIndexStore(cardIndexHeader.root, root);
+  }
+  if (added) {
+    cardIndexHeader.numKeys++;
+    if (cardBloomBytesFor(cardIndexHeader.numKeys) > cardBloomWanted) {
+      // Cruza el siguiente tamaño: filtro el doble de grande, que loop() repuebla
+      // desde las hojas (ya incluyen la nueva) en updateCardIndex(). Como cada
+      // vez se duplica, todos esos recorridos juntos no pasan de leer las hojas
+      // una vez más
+      cardBloomAllocate(cardIndexHeader.numKeys);
+      cardBloomRebuildBegin();
+      Serial.println("[INDICE] Filtro de Bloom ampliado a " + String(cardBloomBits / 8192) + " KB");
+    } else {
+      cardBloomAdd(record.key);
+    }
+  }
+  cardIndexTouchHeader();
+  return added;
+}
+
+bool cardIndexFindLocked(uint64_t key, CardRecord& out) {
+  uint32_t pageNo = cardIndexHeader.root;
+  while (true) {
+    const CardPage* page = cardIndexFetch(pageNo);
+    if (page == nullptr) return false;
+    if (page->leaf) {
+      int pos = cardLeafLowerBound(*page, key);
+      if (pos < page->count && page->records[pos].key == key) {
+        out = page->records[pos];
+        return true;
+      }
+      return false;
+    }
+    pageNo = page->inner.children[cardInnerChild(*page, key)];
+  }
+}
+
+// Borrado perezoso: se elimina el registro de la hoja sin fusionar nodos.
+// Las hojas pueden quedar poco ocupadas, lo que no afecta a la corrección.
+bool cardIndexRemoveLocked(uint64_t key) {
+  uint32_t pageNo = cardIndexHeader.root;
+  CardPage page;
+  while (cardIndexLoad(pageNo, page) && !page.leaf) {
+    pageNo = page.inner.children[cardInnerChild(page, key)];
+  }
+  if (!page.leaf) return false;
+  int pos = cardLeafLowerBound(page, key);
+  if (pos >= page.count || page.records[pos].key != key) return false;
+  memmove(page.records + pos, page.records + pos + 1, (page.count - pos - 1) * sizeof(CardRecord));
+  page.count--;
+  cardIndexStore(pageNo, page);
+  cardIndexHeader.numKeys--;
+  cardIndexTouchHeader();
+  return true;
+}
+
+// --- Estadísticas de latencia por tamaño de la base de datos ---
+
+int cardLatencyBucket(uint32_t us) {
+  if (us < 4) return us;
+  int log2 = 31 - __builtin_clz(us);
+  int bucket = (log2 - 1) * 4 + ((us >> (log2 - 2)) & 3);
+  return min(bucket, CARD_LATENCY_BUCKETS - 1);
+}
+
+uint32_t cardLatencyBucketValue(int bucket) {
+  if (bucket < 4) return bucket;
+  int log2 = bucket / 4 + 1;
+  return (4 + (bucket & 3)) << (log2 - 2);
+}
+
+int cardSizeClass(uint32_t keys) {
+  int sizeClass = 0;
+  while (sizeClass < CARD_SIZE_CLASSES - 1 && keys >= CARD_SIZE_CLASS_FROM[sizeClass + 1]) {
+    sizeClass++;
+  }
+  return sizeClass;
+}
+
+uint32_t cardLatencyPercentile(int sizeClass, float percentile) {
+  const uint32_t* hist = cardIndexStats.latency[sizeClass];
+  uint32_t total = 0;
+  for (int i = 0; i < CARD_LATENCY_BUCKETS; i++) total += hist[i];
+  if (total == 0) return 0;
+  uint32_t target = (uint32_t)(total * percentile);
+  uint32_t seen = 0;
+  for (int i = 0; i < CARD_LATENCY_BUCKETS; i++) {
+    seen += hist[i];
+    if (seen > target) return cardLatencyBucketValue(i);
+  }
+  return cardLatencyBucketValue(CARD_LATENCY_BUCKETS - 1);
+}
+
+// --- API pública ---
+
+void initCardIndex() {
+  cardIndexMutex = xSemaphoreCreateMutex();
+
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  bool valid = false;
+  if (SD.exists(CARD_INDEX_FILE)) {
+    cardIndexFile = SD.open(CARD_INDEX_FILE, "r+");
+    uint8_t raw[CARD_PAGE_SIZE];
+    if (cardIndexFile && cardIndexFile.read(raw, CARD_PAGE_SIZE) == CARD_PAGE_SIZE) {
+      memcpy(&cardIndexHeader, raw, sizeof(cardIndexHeader));
+      valid = cardIndexHeader.magic == CARD_INDEX_MAGIC && cardIndexHeader.version == CARD_INDEX_VERSION;
+    }
+    if (!valid && cardIndexFile) cardIndexFile.close();
+  }
+
+  if (!valid) {
+    // Índice nuevo: cabecera + hoja raíz vacía
+    File file = SD.open(CARD_INDEX_FILE, FILE_WRITE);
+    if (file) file.close();
+    cardIndexFile = SD.open(CARD_INDEX_FILE, "r+");
+    if (!cardIndexFile) {
+      Serial.println("[INDICE] Error al crear índice de tarjetas");
+      return;
+    }
+    cardIndexHeader = {CARD_INDEX_MAGIC, CARD_INDEX_VERSION, 1, 1, 2, 0};
+    CardPage root = {};
+    root.leaf = 1;
+    cardIndexStoreHeader();
+    cardIndexStore(1, root);
+    Serial.println("[INDICE] Índice de tarjetas creado");
+  }
+
+  // Cola de una importación que un reinicio dejó a medias: no se sabe hasta dónde llegó
+  if (SD.exists(CARD_IMPORT_FILE)) SD.remove(CARD_IMPORT_FILE);
+
+  unsigned long start = millis();
+  cardBloomAllocate(cardIndexHeader.numKeys);
+  cardBloomRebuildBegin();
+  while (!cardBloomRebuildStep(CARD_BLOOM_REBUILD_PAGES)) {
+  }
+  cardIndexReady = true;
+  Serial.println("[INDICE] Índice de tarjetas listo (" + String(cardIndexHeader.numKeys) + " tarjetas, altura " +
+                 String(cardIndexHeader.height) + ", Bloom " + String(cardBloomBits / 8192) + " KB, " +
+                 String(millis() - start) + " ms)");
+}
+
+bool cardIndexPut(const String& uid, const String& name, uint8_t schedule, uint8_t flags) {
+  return cardIndexPutRecord(cardMakeRecord(uid, name, schedule, flags));
+}
+
+CardRecord cardMakeRecord(const String& uid, const String& name, uint8_t schedule, uint8_t flags) {
+  CardRecord record = {};
+  record.key = cardKeyFromUID(uid);
+  strncpy(record.name, name.c_str(), sizeof(record.name) - 1);
+  record.schedule = schedule;
+  record.flags = flags;
+  return record;
+}
+
+bool cardIndexPutRecord(const CardRecord& record) {
+  if (!cardIndexReady) return false;
+  cardIndexLock();
+  uint32_t before = cardIndexHeader.numKeys;
+  bool added = cardIndexPutLocked(record);
+  uint32_t after = cardIndexHeader.numKeys;
+  cardIndexUnlock();
+
+  // Informe de latencia cada vez que la base de datos cambia de orden de magnitud
+  if (added && cardSizeClass(after) != cardSizeClass(before)) {
+    int sizeClass = cardSizeClass(before);
+    Serial.println("[INDICE] " + String(after) + " tarjetas; búsquedas con " + String(CARD_SIZE_CLASS_FROM[sizeClass]) +
+                   "+ tarjetas: p50 " + String(cardLatencyPercentile(sizeClass, 0.50f)) + " us, p99 " +
+                   String(cardLatencyPercentile(sizeClass, 0.99f)) + " us");
+  }
+  return added;
+}
+
+bool cardIndexRemove(const String& uid) {
+  if (!cardIndexReady) return false;
+  cardIndexLock();
+  bool removed = cardIndexRemoveLocked(cardKeyFromUID(uid));
+  cardIndexUnlock();
+  return removed;
+}
+
+// Llamado desde loop(): repuebla el filtro de Bloom tras ampliarlo y vacía la
+// cola de importación de tarjetas, unas pocas páginas o filas por vuelta
+void updateCardIndex() {
+  if (!cardIndexReady) return;
+  if (cardBloomFilling) {
+    cardIndexLock();
+    if (cardBloomRebuildStep(CARD_BLOOM_REBUILD_PAGES)) {
+      Serial.println("[INDICE] Filtro de Bloom repoblado (" + String(cardIndexHeader.numKeys) + " tarjetas)");
+    }
+    cardIndexUnlock();
+    return;
+  }
+  if (!cardImport.ready) return;
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  if (!cardImport.input) cardImport.input = SD.open(CARD_IMPORT_FILE, FILE_READ);
+  CardRecord batch[CARD_IMPORT_BATCH];
+  int count = cardImport.input ? cardImport.input.read((uint8_t*)batch, sizeof(batch)) / sizeof(CardRecord) : 0;
+  for (int i = 0; i < count; i++) cardIndexPutRecord(batch[i]);
+  cardImport.applied += count;
+  if (count == CARD_IMPORT_BATCH) return;
+
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  cardImport.input.close();
+  SD.remove(CARD_IMPORT_FILE);
+  cardImport.ready = false;
+  cardImport.busy = false;
+  char message[MESSAGE_SIZE];
+  snprintf(message, sizeof(message), "[WEB] Importación de tarjetas: %lu de %lu indexadas en %lu s",
+           (unsigned long)cardImport.applied, (unsigned long)cardImport.queued, (millis() - cardImport.startMs) / 1000);
+  Serial.println(message);
+  notifyEvent(NOTIFY_NORMAL, message);
+}
+
+// Búsqueda de una tarjeta: filtro de Bloom y, si pasa, descenso por el árbol
+bool cardIndexLookup(uint64_t key, CardRecord& out) {
+  unsigned long start = micros();
+  bool found = false;
+  if (!cardBloomMayContain(key)) {
+    cardIndexStats.bloomRejects++;
+  } else {
+    cardIndexLock();
+    found = cardIndexFindLocked(key, out);
+    cardIndexUnlock();
+  }
+  uint32_t elapsed = micros() - start;
+  cardIndexStats.lookups++;
+  cardIndexStats.latency[cardSizeClass(cardIndexHeader.numKeys)][cardLatencyBucket(elapsed)]++;
+  return found;
+}
+
+// Arranque: quita las tarjetas de usuario (CARD_FLAG_USER) que ya no están en
+// /users.txt. Quedan si se editó el archivo con el equipo apagado o si hubo un
+// reinicio entre persist() y cardIndexSync() en modifyUsers(); como checkRFID()
+// solo consulta el índice, una tarjeta revocada seguiría abriendo
+void cardIndexPruneUsers(const UserTable* users) {
+  std::vector<uint64_t> keys;
+  keys.reserve(users->uidIndex.size());
+  for (size_t i = 0; i < users->uidIndex.size(); i++) keys.push_back(cardKeyFromUID(users->users[users->uidIndex[i]].uid));
+  std::sort(keys.begin(), keys.end());
+
+  std::vector<uint64_t> stale;
+  uint32_t total = 0;
+  cardIndexLock();
+  uint32_t pageNo = cardIndexHeader.root;
+  CardPage page;
+  while (cardIndexLoad(pageNo, page) && !page.leaf) {
+    pageNo = page.inner.children[0];
+  }
+  while (pageNo != 0 && cardIndexLoad(pageNo, page)) {
+    total += page.count;
+    for (int i = 0; i < page.count; i++) {
+      const CardRecord& record = page.records[i];
+      if ((record.flags & CARD_FLAG_USER) && !std::binary_search(keys.begin(), keys.end(), record.key)) {
+        stale.push_back(record.key);
+      }
+    }
+    pageNo = page.next;
+  }
+  for (uint64_t key : stale) cardIndexRemoveLocked(key);
+  // La cabecera se guarda cada CARD_HEADER_SYNC_EVERY cambios: tras un corte el
+  // recuento puede ir por detrás de las hojas, así que se toma del recorrido
+  cardIndexHeader.numKeys = total - stale.size();
+  cardIndexTouchHeader();
+  cardIndexUnlock();
+  if (!stale.empty()) Serial.printf("[INDICE] Quitadas %u tarjetas de usuarios que ya no están en /users.txt\n", (unsigned)stale.size());
+}
+
+// Refleja en el índice los cambios entre dos instantáneas de usuarios
+// (recorrido simultáneo de ambos índices ordenados por UID)
+void cardIndexSync(const UserTable* before, const UserTable* after) {
+  if (!cardIndexReady) return;
+  size_t i = 0, j = 0;
+  size_t beforeCount = before ? before->uidIndex.size() : 0;
+  while (i < beforeCount || j < after->uidIndex.size()) {
+    const User* oldUser = i < beforeCount ? &before->users[before->uidIndex[i]] : nullptr;
+    const User* newUser = j < after->uidIndex.size() ? &after->users[after->uidIndex[j]] : nullptr;
+    int cmp = !oldUser ? 1 : (!newUser ? -1 : strcmp(oldUser->uid.c_str(), newUser->uid.c_str()));
+    if (cmp < 0) {
+      cardIndexRemove(oldUser->uid);
+      i++;
+    } else if (cmp > 0) {
+      if (before != nullptr) {
+        cardIndexPut(newUser->uid, newUser->name, newUser->schedule, CARD_FLAG_USER);
+      } else {
+        // Arranque: solo se escribe si el índice no coincide con /users.txt
+        CardRecord existing;
+        bool found = cardIndexLookup(cardKeyFromUID(newUser->uid), existing);
+        if (!found || existing.schedule != newUser->schedule ||
+            strncmp(existing.name, newUser->name.c_str(), sizeof(existing.name) - 1) != 0) {
+          cardIndexPut(newUser->uid, newUser->name, newUser->schedule, CARD_FLAG_USER);
+        }
+      }
+      j++;
+    } else {
+      if (oldUser->name != newUser->name || oldUser->schedule != newUser->schedule) {
+        cardIndexPut(newUser->uid, newUser->name, newUser->schedule, CARD_FLAG_USER);
+      }
+      i++;
+      j++;
+    }
+  }
+  if (before == nullptr) cardIndexPruneUsers(after);
+}
+
+void handleCardIndexStats(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /api/cards/stats");
+  String json = "{\"tarjetas\":" + String(cardIndexHeader.numKeys);
+  json += ",\"paginas\":" + String(cardIndexHeader.numPages);
+  json += ",\"altura\":" + String(cardIndexHeader.height);
+  json += ",\"bloom_bytes\":" + String(cardBloomBits / 8);
+  json += ",\"importacion_pendiente\":" + String(cardImport.ready ? cardImport.queued - cardImport.applied : 0);
+  json += ",\"busquedas\":" + String(cardIndexStats.lookups);
+  json += ",\"rechazos_bloom\":" + String(cardIndexStats.bloomRejects);
+  json += ",\"cache_aciertos\":" + String(cardIndexStats.cacheHits);
+  json += ",\"cache_fallos\":" + String(cardIndexStats.cacheMisses);
+  json += ",\"latencia\":[";
+  for (int c = 0; c < CARD_SIZE_CLASSES; c++) {
+    if (c > 0) json += ",";
+    json += "{\"desde\":" + String(CARD_SIZE_CLASS_FROM[c]);
+    json += ",\"p50_us\":" + String(cardLatencyPercentile(c, 0.50f));
+    json += ",\"p99_us\":" + String(cardLatencyPercentile(c, 0.99f)) + "}";
+  }
+  json += "]}";
+  request->send(200, "application/json", json);
+}
+
+// Envía un REQA y deja al RC522 esperando la respuesta: el resultado llega por la IRQ.
+// El chip no repite el REQA por sí solo, así que cada ventana cuesta seis escrituras
+void rfidArmReqa() {
+  rfid.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Idle);
+  rfid.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);     // Borra las banderas
+  rfid.PCD_WriteRegister(MFRC522::FIFOLevelReg, 0x80);  // Vacía la FIFO
+  rfid.PCD_WriteRegister(MFRC522::FIFODataReg, MFRC522::PICC_CMD_REQA);
+  rfid.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Transceive);
+  rfid.PCD_WriteRegister(MFRC522::BitFramingReg, 0x87); // StartSend, trama corta de 7 bits
+  rfidArmedAt = millis();
+}
+
+// Sondeo: REQA y espera activa de hasta 25 ms en cada vuelta. Con IRQ: SPI solo
+// cuando el lector avisa (o si el aviso no llega en RFID_IRQ_WATCHDOG_MS)
+bool rfidCardDetected() {
+  if (RFID_IRQ_PIN < 0) {
+    configureSPIPins(RFID_SCK_PIN, RFID_MISO_PIN, RFID_MOSI_PIN, RFID_SS_PIN);
+    return rfid.PICC_IsNewCardPresent() && rfid.PICC_ReadCardSerial();
+  }
+  if (!rfidIrqPending) {
+    if (millis() - rfidArmedAt < RFID_IRQ_WATCHDOG_MS) return false;
+    configureSPIPins(RFID_SCK_PIN, RFID_MISO_PIN, RFID_MOSI_PIN, RFID_SS_PIN);
+    rfidArmReqa();
+    return false;
+  }
+  rfidIrqPending = false;
+  configureSPIPins(RFID_SCK_PIN, RFID_MISO_PIN, RFID_MOSI_PIN, RFID_SS_PIN);
+  byte irq = rfid.PCD_ReadRegister(MFRC522::ComIrqReg);
+  // La tarjeta ya respondió al REQA: la librería sigue con la anticolisión y la selección
+  if ((irq & RFID_IRQ_RX) && rfid.PICC_ReadCardSerial()) return true;
+  rfidArmReqa();
+  return false;
+}
+
+void checkRFID() {
+  if (rfidHolding) {
+    if ((long)(millis() - rfidHoldUntil) < 0) return;
+    rfidHolding = false;
+    // La tarjeta queda en HALT y no responde al REQA: no se vuelve a leer aunque siga delante
+    if (RFID_IRQ_PIN >= 0) {
+      configureSPIPins(RFID_SCK_PIN, RFID_MISO_PIN, RFID_MOSI_PIN, RFID_SS_PIN);
+      rfidArmReqa();
+    }
+  }
+  if (rfidCardDetected()) {
+    trace(TRACE_RFID_READ, (uint16_t)cardKeyFromBytes(rfid.uid.uidByte, rfid.uid.size));
+    // Todo el camino de una lectura usa búferes en la pila: nada de String
+    char tagUID[UID_TEXT_SIZE];
+    getTagUID(tagUID, sizeof(tagUID));
+    Serial.printf("[RFID] Tarjeta detectada - UID: %s\n", tagUID);
+    char userName[USER_NAME_SIZE] = "N/A";
+    char message[MESSAGE_SIZE];
+    bool authorized = false;
+    uint8_t schedule = 0;
+    if (cardIndexReady) {
+      CardRecord card;
+      if (cardIndexLookup(cardKeyFromBytes(rfid.uid.uidByte, rfid.uid.size), card)) {
+        authorized = true;
+        strlcpy(userName, card.name, sizeof(userName));
+        schedule = card.schedule;
+      }
+    } else {
+      UserSnapshot users;
+      int index = users.get()->findByUid(tagUID);
+      if (index >= 0) {
+        authorized = true;
+        strlcpy(userName, users[index].name.c_str(), sizeof(userName));
+        schedule = users[index].schedule;
+      }
+    }
+    bool inSchedule = scheduleAllows(schedule);
+
+    if (waitingForRFID) {
+      if (millis() > rfidTimeout) {
+        waitingForRFID = false;
+        Serial.println("[RFID] Tiempo de espera para escaneo RFID expirado");
+      } else {
+        tempUID = tagUID;
+        addUser(tempName, tempPin, tempUID, tempSchedule);
+        waitingForRFID = false;
+        sendTelegramNotification("[USER] Nuevo usuario añadido: " + tempName + " (UID: " + tagUID + ")");
+      }
+    } else if (authorized && inSchedule) {
+      snprintf(message, sizeof(message), "[ACCESO] Concedido por RFID: %s (%s)", tagUID, userName);
+      accessDecide(LOG_METHOD_RFID, tagUID, userName, "Acceso concedido", RELAY_OPEN_MS, message);
+    } else if (authorized) {
+      snprintf(message, sizeof(message), "[ACCESO] Denegado por RFID fuera de horario: %s (%s)", tagUID, userName);
+      char key[UID_TEXT_SIZE + 8], summary[MESSAGE_SIZE];
+      snprintf(key, sizeof(key), "RFIDH %s", tagUID);
+      snprintf(summary, sizeof(summary), "intentos por RFID fuera de horario de %s (%s)", tagUID, userName);
+      accessDecide(LOG_METHOD_RFID, tagUID, userName, "Acceso denegado (fuera de horario)", 0, message, NOTIFY_NORMAL, key, summary);
+    } else {
+      snprintf(message, sizeof(message), "[ACCESO] Denegado por RFID: %s", tagUID);
+      char key[UID_TEXT_SIZE + 8], summary[MESSAGE_SIZE];
+      snprintf(key, sizeof(key), "RFID %s", tagUID);
+      snprintf(summary, sizeof(summary), "intentos denegados por RFID de %s", tagUID);
+      accessDecide(LOG_METHOD_RFID, tagUID, userName, "Acceso denegado", 0, message, NOTIFY_NORMAL, key, summary);
+    }
+
+    rfid.PICC_HaltA();
+    rfid.PCD_StopCrypto1();
+    // La pausa ya no es un delay(): el registro y el aviso de esta tarjeta salen en esta misma vuelta
+    rfidHolding = true;
+    rfidHoldUntil = millis() + RFID_HOLD_MS;
+  }
+}
+
+// UniversalTelegramBot solo acepta String, así que las copias se hacen aquí
+// dentro de la llamada y se liberan al volver; quien llama no concatena nada
+void sendTelegramNotification(const char* message, const char* chatId) {
+  trace(TRACE_TELEGRAM_SEND_START);
+  bool sent = bot.sendMessage(chatId, message, "Markdown");
+  trace(TRACE_TELEGRAM_SEND_END, sent);
+  if (sent) {
+    Serial.printf("[TELEGRAM] Notificación enviada: %s\n", message);
+  } else {
+    Serial.printf("[TELEGRAM] Error al enviar notificación a chat: %s\n", chatId);
+  }
+}
+
+void sendTelegramNotification(const String& message, const String& chatId) {
+  sendTelegramNotification(message.c_str(), chatId.c_str());
+}
+
+void handleTelegramMessages() {
+  trace(TRACE_TELEGRAM_POLL_START);
+  int numNewMessages = bot.getUpdates(bot.last_message_received + 1);
+  trace(TRACE_TELEGRAM_POLL_END, numNewMessages);
+  for (int i = 0; i < numNewMessages; i++) {
+    String chat_id = String(bot.messages[i].chat_id);
+    String text = bot.messages[i].text;
+
+    // Pulsaciones en los teclados de paginación
+    if (bot.messages[i].type == "callback_query") {
+      if (chat_id == CHAT_ID) handleTelegramCallback(bot.messages[i]);
+      continue;
+    }
+
+    // Consultas: se responden desde memoria en cualquier estado
+    if (text.startsWith("/") && chat_id == CHAT_ID && handleTelegramQuery(chat_id, text)) continue;
+
+    // Handle /ip command
+    if (text == "/ip" && chat_id == CHAT_ID) {
+      String ip = WiFi.localIP().toString();
+      sendTelegramNotification("Dirección IP del ESP32: *" + ip + "*", chat_id);
+      Serial.println("[TELEGRAM] Solicitud de IP enviada: " + ip);
+      continue;
+    }
+
+    // Handle /abrir command
+    if (telegramState == IDLE && text == "/abrir" && chat_id == CHAT_ID) {
+      telegramState = WAITING_FOR_NAME;
+      telegramChatId = chat_id;
+      telegramTimeout = millis() + TELEGRAM_TIMEOUT_MS;
+      sendTelegramNotification("Por favor, ingresa el nombre de usuario.", chat_id);
+      Serial.println("[TELEGRAM] Solicitud de apertura recibida, esperando nombre");
+    } else if (telegramState == WAITING_FOR_NAME && chat_id == telegramChatId) {
+      telegramUserName = text;
+      bool userFound = false;
+      bool hasPin = false;
+
+      UserSnapshot users;
+      for (int j = 0; j < users.size(); j++) {
+        if (telegramUserName == users[j].name) {
+          userFound = true;
+          hasPin = users[j].requiresPin();
+          break;
+        }
+      }
+
+      if (!userFound) {
+        accessDecideReply(LOG_METHOD_TELEGRAM, "N/A", telegramUserName.c_str(), "Acceso denegado", 0, chat_id.c_str(),
+                          ("Usuario *" + telegramUserName + "* no encontrado.").c_str());
+        telegramState = IDLE;
+      } else if (!hasPin) {
+        accessDecideReply(LOG_METHOD_TELEGRAM, "N/A", telegramUserName.c_str(), "Acceso denegado", 0, chat_id.c_str(),
+                          ("El usuario *" + telegramUserName + "* no tiene un PIN configurado.").c_str());
+        telegramState = IDLE;
+      } else {
+        telegramState = WAITING_FOR_PIN;
+        telegramTimeout = millis() + TELEGRAM_TIMEOUT_MS;
+        sendTelegramNotification("Por favor, ingresa el PIN de 4 dígitos para *" + telegramUserName + "*.", chat_id);
+        Serial.println("[TELEGRAM] Nombre recibido: " + telegramUserName + ", esperando PIN");
+      }
+    } else if (telegramState == WAITING_FOR_PIN && chat_id == telegramChatId) {
+      String enteredPin = text;
+      bool authorized = false;
+      bool inSchedule = true;
+      String userName = telegramUserName;
+
+      if (enteredPin.length() == 4 && enteredPin.toInt() >= 0 && enteredPin.toInt() <= 9999) {
+        UserSnapshot users;
+        for (int j = 0; j < users.size(); j++) {
+          if (telegramUserName == users[j].name && enteredPin == users[j].pin) {
+            authorized = true;
+            inSchedule = scheduleAllows(users[j].schedule);
+            break;
+          }
+        }
+      }
+
+      if (authorized && !inSchedule) {
+        accessDecideReply(LOG_METHOD_TELEGRAM, enteredPin.c_str(), userName.c_str(), "Acceso denegado (fuera de horario)", 0,
+                          chat_id.c_str(), ("El usuario *" + userName + "* no tiene acceso en este horario.").c_str());
+        Serial.println("[TELEGRAM] Acceso fuera de horario para: " + userName);
+      } else if (authorized) {
+        accessDecideReply(LOG_METHOD_TELEGRAM, enteredPin.c_str(), userName.c_str(), "Acceso concedido", RELAY_OPEN_MS,
+                          chat_id.c_str(), ("[ACCESO] Concedido por Telegram para *" + userName + "*.").c_str());
+        Serial.println("[TELEGRAM] Acceso concedido para: " + userName);
+      } else {
+        accessDecideReply(LOG_METHOD_TELEGRAM, enteredPin.c_str(), userName.c_str(), "Acceso denegado", 0, chat_id.c_str(),
+                          ("PIN incorrecto o inválido para *" + userName + "*. Acceso denegado.").c_str());
+        Serial.println("[TELEGRAM] Acceso denegado para: " + userName + ", PIN: " + enteredPin);
+      }
+      telegramState = IDLE;
+    }
+  }
+}
+
+void updateRGBStatus() {
+  static LEDState lastLEDState = RED;
+  LEDState newLEDState;
+
+  if (doorOpen && !relayState) {
+    newLEDState = BLINKING_RED;
+  } else if (!relayState) {
+    newLEDState = RED;
+  } else if (relayState && !doorOpen) {
+    newLEDState = GREEN;
+  } else {
+    newLEDState = YELLOW;
+  }
+
+  if (newLEDState != lastLEDState) {
+    ledSetPattern(0, newLEDState);
+    switch (newLEDState) {
+      case RED:
+        Serial.println("[LED] Estado cambiado a Rojo (Acceso restringido)");
+        break;
+      case GREEN:
+        Serial.println("[LED] Estado cambiado a Verde Parpadeante (Acceso concedido)");
+        break;
+      case YELLOW:
+        Serial.println("[LED] Estado cambiado a Amarillo (Puerta abierta)");
+        break;
+      case BLINKING_RED:
+        Serial.println("[LED] Estado cambiado a Rojo Parpadeante (Intrusión detectada)");
+        break;
+    }
+    lastLEDState = newLEDState;
+    currentLEDState = newLEDState;
+  }
+}
+
+// === ANIMACIÓN DEL LED ===
+
+void ledSetPattern(int door, LEDState state) {
+  LedSegment& segment = ledSegments[door];
+  segment.since = millis();
+  segment.pattern = state;
+  if (ledTaskHandle) xTaskNotifyGive(ledTaskHandle);
+}
+
+uint32_t ledPatternColor(const LedPattern& pattern, uint32_t elapsed) {
+  if (pattern.onMs == 0) return pattern.colorOn;
+  return elapsed % (pattern.onMs + pattern.offMs) < pattern.onMs ? pattern.colorOn : pattern.colorOff;
+}
+
+// Milisegundos hasta que el píxel cambie de color (0: no cambia mientras siga el patrón)
+uint32_t ledNextChange(const LedPattern& pattern, uint32_t elapsed, uint32_t offset) {
+  if (elapsed < offset) return offset - elapsed;
+  if (pattern.onMs == 0) return 0;
+  uint32_t period = pattern.onMs + pattern.offMs;
+  uint32_t phase = (elapsed - offset) % period;
+  return phase < pattern.onMs ? pattern.onMs - phase : period - phase;
+}
+
+// Duerme hasta el próximo cambio de algún píxel o hasta que ledSetPattern() la
+// avise, así el ritmo del parpadeo no depende de lo que tarde loop() y un color
+// fijo no despierta al chip. Solo esta tarea escribe en la tira una vez
+// arrancada, y solo llama a show() si algún píxel ha cambiado.
+void ledTask(void* parameter) {
+  static uint32_t shown[NUM_LEDS];
+  bool first = true;
+  for (;;) {
+    uint32_t now = millis();
+    uint32_t next = 0;
+    bool dirty = first;
+    for (int d = 0; d < NUM_DOORS; d++) {
+      const LedSegment& segment = ledSegments[d];
+      const LedPattern& pattern = LED_PATTERNS[segment.pattern];
+      uint32_t elapsed = now - segment.since;
+      for (int i = 0; i < segment.count; i++) {
+        uint32_t offset = i * pattern.step * 8;
+        uint32_t color = elapsed >= offset ? ledPatternColor(pattern, elapsed - offset) : pattern.colorOff;
+        uint32_t change = ledNextChange(pattern, elapsed, offset);
+        if (change && (!next || change < next)) next = change;
+        int pixel = segment.first + i;
+        if (first || shown[pixel] != color) {
+          shown[pixel] = color;
+          strip.setPixelColor(pixel, color);
+          dirty = true;
+        }
+      }
+    }
+    if (dirty) strip.show();
+    first = false;
+    ulTaskNotifyTake(pdTRUE, next ? pdMS_TO_TICKS(std::max<uint32_t>(next, LED_FRAME_MS)) : portMAX_DELAY);
+  }
+}
+
+void initLedEngine() {
+  for (int d = 0; d < NUM_DOORS; d++) ledSegments[d].since = millis();
+  xTaskCreatePinnedToCore(ledTask, "led", 2048, nullptr, 2, &ledTaskHandle, 1);
+  Serial.println("[LED] Motor de animación iniciado");
+}
+
+// === MODOS DE ENERGÍA ===
+
+void initPowerMode() {
+  if (POWER_MODE == POWER_ACTIVE) {
+    Serial.println("[ENERGIA] Modo activo: loop() sin pausas");
+    return;
+  }
+  bool light = POWER_MODE == POWER_LIGHT_SLEEP;
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  WiFi.setSleep(light ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+  // La CPU baja a 40 MHz mientras espera; con light_sleep_enable, el chip se duerme
+  // cuando ninguna tarea está lista (hace falta CONFIG_PM_ENABLE y tickless idle)
+  esp_pm_config_esp32_t pm = {};
+  pm.max_freq_mhz = 240;
+  pm.min_freq_mhz = 40;
+  pm.light_sleep_enable = light;
+  esp_err_t err = esp_pm_configure(&pm);
+  if (err != ESP_OK) {
+    Serial.printf("[ENERGIA] esp_pm_configure: %s. loop() esperará igualmente, sin DFS ni sueño ligero\n", esp_err_to_name(err));
+  }
+  int door = digitalRead(DOOR_SENSOR_PIN);
+  attachInterrupt(digitalPinToInterrupt(DOOR_SENSOR_PIN), doorIsr, door == HIGH ? ONLOW : ONHIGH);
+  if (light) {
+    gpio_wakeup_enable((gpio_num_t)DOOR_SENSOR_PIN, door == HIGH ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+    if (RFID_IRQ_PIN >= 0) gpio_wakeup_enable((gpio_num_t)RFID_IRQ_PIN, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+  }
+  Serial.printf("[ENERGIA] Modo %s: Telegram cada %lu s, REQA cada %lu ms\n", light ? "sueño ligero" : "modem",
+                POWER_TELEGRAM_CHECK_MS / 1000, RFID_IRQ_PIN >= 0 ? POWER_RFID_WINDOW_MS : 50UL);
+}
+
+// Bloquea loop() hasta el plazo más próximo de lo que solo depende del reloj. Lo
+// demás (puerta, RC522, relé activado desde la web) la despierta con una notificación
+void powerIdle(unsigned long telegramDue) {
+  unsigned long now = millis();
+  unsigned long budget = POWER_MAX_SLEEP_MS;
+  auto until = [&](unsigned long due) {
+    long left = (long)(due - now);
+    budget = std::min(budget, left > 0 ? (unsigned long)left : 0UL);
+  };
+  until(telegramDue);
+  if (relayState && relayTimerEnd > 0) until(relayTimerEnd);
+  if (telegramState != IDLE) until(telegramTimeout + 1);
+  if (targetBlinks > 0) until(lastBlink + 150);
+  if (RFID_IRQ_PIN < 0 || logCompactor) until(now + 50); // Sondeo del lector o compresión en curso
+  else if (rfidHolding) until(rfidHoldUntil);
+  else until(rfidArmedAt + RFID_IRQ_WATCHDOG_MS);
+  if (mqttMutex && !mqttConnected && !mqttConnecting) until(mqttRetryAt);
+  if (budget == 0 || rfidIrqPending) return;
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(budget));
+  powerSleptMs += millis() - now;
+}
+
+// Desde otra tarea (la web): loop() tiene que vigilar un plazo nuevo, p. ej. el del relé
+void powerWake() {
+  if (loopTaskHandle) xTaskNotifyGive(loopTaskHandle);
+}
+
+void checkRelayTimer() {
+  if (relayState && relayTimerEnd > 0 && millis() >= relayTimerEnd) {
+    relayState = false;
+    dashboardGeneration++;
+    digitalWrite(RELAY_PIN, LOW);
+    trace(TRACE_RELAY_OFF);
+    mqttRelayEvent(false);
+    relayTimerEnd = 0;
+    Serial.println("[RELE] Temporizador finalizado - Acceso desactivado");
+  }
+}
+
+void checkDoorStatus() {
+  static bool lastDoorState = false;
+  bool currentState = digitalRead(DOOR_SENSOR_PIN) == HIGH;
+  if (currentState != lastDoorState) {
+    doorOpen = currentState;
+    dashboardGeneration++;
+    trace(doorOpen ? TRACE_DOOR_OPEN : TRACE_DOOR_CLOSED);
+    mqttEvent(MQTT_DOOR, doorOpen ? "\"estado\":\"abierta\"" : "\"estado\":\"cerrada\"");
+    Serial.print("[PUERTA] Estado cambiado a: ");
+    Serial.println(doorOpen ? "ABIERTA" : "CERRADA");
+    if (doorOpen && !relayState) {
+      // Cada apertura queda en el registro, pero los rebotes del sensor o las
+      // aperturas seguidas no repiten la alerta: van al resumen de la ventana
+      notifyEvent(NOTIFY_URGENT, "*🚨 ¡ALERTA DE INTRUSIÓN! 🚨*\nPuerta abierta sin autorización.", "PUERTA",
+                  "aperturas sin autorización");
+      logAccess("SENSOR", "N/A", "Intento de intrusión", "Ladrón");
+    }
+    lastDoorState = currentState;
+  }
+}
+
+void blinkLED(int times) {
+  targetBlinks = times;
+  blinkCount = 0;
+  ledState = false;
+  lastBlink = millis();
+}
+
+// Devuelve la página guardada si sigue siendo de la generación actual; si no,
+// la vuelve a generar. Si el estado cambia mientras se genera, la copia queda
+// marcada con la generación anterior y la siguiente petición la rehace.
+const String& renderCached(RenderCache& cache, const std::atomic<uint32_t>& source, void (*render)(String&)) {
+  uint32_t generation = source.load();
+  if (cache.generation != generation) {
+    unsigned int previousLength = cache.html.length();
+    cache.html = String();
+    cache.html.reserve(previousLength); // Evita realojar varias veces al concatenar
+    render(cache.html);
+    cache.generation = generation;
+  }
+  return cache.html;
+}
+
+void handleRoot(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /");
+  request->send(200, "text/html", renderCached(rootPageCache, dashboardGeneration, renderRootPage));
+}
+
+void renderRootPage(String& html) {
+  html += "<!DOCTYPE html><html lang='es'><head>";
+  html += "<meta charset='UTF-8'>";
+  html += "<title>Panel de Control</title>";
+  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+  html += "<style>body{font-family:Arial; text-align:center;} .card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px; display:inline-block; width:200px;}";
+  html += "input[type=number],input[type=text]{width:100px; padding:5px; margin:5px;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
+  html += "table{border-collapse:collapse; width:80%; margin:20px auto;} th,td{border:1px solid #ddd; padding:8px;} th{background:#4CAF50; color:white;}";
+  html += "</style>";
+  html += "<meta http-equiv='refresh' content='4'></head><body>";
+  html += "<h1>Control de Acceso ESP32</h1>";
+  html += "<div class='card'><h2>Estado de la Puerta</h2><div style='color:" + String(doorOpen ? "red" : "green") + ";font-size:24px;'>" + String(doorOpen ? "ABIERTA" : "CERRADA") + "</div></div>";
+  html += "<div class='card'><h2>Temporizador de Acceso</h2>";
+  html += "<input type='number' id='timerInput' min='1' max='3600' placeholder='Segundos'>";
+  html += "<button onclick=\"window.location.href='/setTimer?time='+document.getElementById('timerInput').value;\">Activar Acceso</button></div>";
+  html += "<div class='card'><h2>Añadir Usuario</h2>";
+  html += "<a href='/addUser'><button>Añadir Nuevo Usuario</button></a></div>";
+  html += "<div class='card'><h2>Ingresar PIN</h2>";
+  html += "<a href='/enterPin'><button>Ingresar PIN</button></a></div>";
+  html += "<div class='card'><h2>Lista de Usuarios</h2>";
+  html += "<a href='/users'><button>Ver Usuarios</button></a></div>";
+  html += "<div class='card'><h2>Consultar Registro</h2>";
+  html += "<a href='/log'><button>Buscar Accesos</button></a></div>";
+  html += "<div class='card'><h2>Estadísticas</h2>";
+  html += "<a href='/stats'><button>Ver Estadísticas</button></a></div>";
+  html += "<div><h2>Últimos Accesos</h2>";
+  html += "<table><tr><th>Fecha y Hora</th><th>Método</th><th>ID</th><th>Usuario</th><th>Estado</th></tr>";
+  int startIndex = max(0, historyCount - 15); // Start from the last 15 entries
+  for (int i = historyCount - 1; i >= startIndex; i--) {
+    String line = accessHistory[i];
+    int comma1 = line.indexOf(',');
+    int comma2 = line.indexOf(',', comma1 + 1);
+    int comma3 = line.indexOf(',', comma2 + 1);
+    int comma4 = line.indexOf(',', comma3 + 1);
+    String timestamp = line.substring(0, comma1);
+    String method = line.substring(comma1 + 1, comma2);
+    String id = line.substring(comma2 + 1, comma3);
+    String user = line.substring(comma3 + 1, comma4);
+    String status = line.substring(comma4 + 1);
+    html += "<tr><td>" + timestamp + "</td><td>" + method + "</td><td>" + id + "</td><td>" + user + "</td><td>" + status + "</td></tr>";
+  }
+  html += "</table></div>";
+  html += "</body></html>";
+}
+
+void handleSetTimer(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /setTimer");
+  if (request->hasParam("time")) {
+    String timeStr = request->getParam("time")->value();
+    int seconds = timeStr.toInt();
+    if (seconds > 0 && seconds <= 3600) {
+      char message[MESSAGE_SIZE];
+      snprintf(message, sizeof(message), "[WEB] Acceso concedido por %d segundos", seconds);
+      accessDecide(LOG_METHOD_WEB, "N/A", "N/A", "Acceso concedido", seconds * 1000UL, message);
+    }
+  }
+  request->redirect("/");
+}
+
+void handleAddUser(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /addUser");
+  String html = "<!DOCTYPE html><html lang='es'><head>";
+  html += "<meta charset='UTF-8'>";
+  html += "<title>Panel de Control</title>";
+  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+  html += "<style>";
+  html += "body { font-family: Arial, sans-serif; text-align: center; margin: 20px; }";
+  html += ".card { background: #f5f5f5; border-radius: 10px; padding: 20px; margin: 20px auto; max-width: 400px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }";
+  html += "label { display: block; margin: 10px 0 5px; font-weight: bold; }";
+  html += "input[type=text], input[type=number] { width: 100%; padding: 8px; margin: 5px 0; border: 1px solid #ccc; border-radius: 4px; box-sizing: border-box; }";
+  html += "input[type=checkbox] { margin: 10px 5px; }";
+  html += "button { padding: 10px 20px; background: #4CAF50; color: white; border: none; border-radius: 5px; cursor: pointer; margin-top: 10px; }";
+  html += "button:hover { background: #45a049; }";
+  html += "p { color: #555; }";
+  html += "</style></head><body>";
+  html += "<h1>Añadir Nuevo Usuario</h1>";
+  html += "<div class='card'>";
+  html += "<form action='/addUser' method='POST'>";
+  html += "<label for='name'>Nombre:</label>";
+  html += "<input type='text' id='name' name='name' placeholder='Nombre del usuario' required><br>";
+  html += "<label>Métodos de autenticación:</label><br>";
+  html += "<input type='checkbox' id='usePin' name='usePin' checked>";
+  html += "<label for='usePin'>Usar PIN</label><br>";
+  html += "<input type='number' id='pinField' name='pin' placeholder='PIN (4 dígitos)' min='0000' max='9999'><br>";
+  html += "<input type='checkbox' id='useRFID' name='useRFID'>";
+  html += "<label for='useRFID'>Usar RFID</label><br>";
+  html += "<p id='rfidInfo' style='display:none;'>Pase la tarjeta RFID después de enviar el formulario.</p>";
+  html += "<label for='schedule'>Horario:</label>";
+  html += "<select id='schedule' name='schedule'>" + scheduleOptionsHtml(0) + "</select><br>";
+  html += "<button type='submit'>Registrar Usuario</button>";
+  html += "</form>";
+  html += "<a href='/'><button type='button'>Volver</button></a>";
+  html += "</div>";
+  html += "<script>";
+  html += "document.getElementById('usePin').addEventListener('change', function() {";
+  html += "  document.getElementById('pinField').disabled = !this.checked;";
+  html += "  if (!this.checked && !document.getElementById('useRFID').checked) {";
+  html += "    document.getElementById('useRFID').checked = true;";
+  html += "    document.getElementById('rfidInfo').style.display = 'block';";
+  html += "  }";
+  html += "});";
+  html += "document.getElementById('useRFID').addEventListener('change', function() {";
+  html += "  document.getElementById('rfidInfo').style.display = this.checked ? 'block' : 'none';";
+  html += "  if (!this.checked && !document.getElementById('usePin').checked) {";
+  html += "    document.getElementById('usePin').checked = true;";
+  html += "    document.getElementById('pinField').disabled = false;";
+  html += "  }";
+  html += "});";
+  html += "</script>";
+  html += "</body></html>";
+  request->send(200, "text/html", html);
+}
+
+void handleAddUserPost(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud POST recibida para /addUser");
+  if (!request->hasParam("name", true)) {
+    Serial.println("[WEB] Error: Nombre no proporcionado");
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: Nombre obligatorio</h1><a href='/addUser'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  String name = request->getParam("name", true)->value();
+  bool usePin = request->hasParam("usePin", true);
+  String pin = usePin ? request->getParam("pin", true)->value() : "";
+  bool useRFID = request->hasParam("useRFID", true);
+  int schedule = request->hasParam("schedule", true) ? findSchedule(request->getParam("schedule", true)->value().c_str()) : 0;
+
+  if (schedule < 0) {
+    Serial.println("[WEB] Error: Horario desconocido");
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: Horario desconocido</h1><a href='/addUser'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  if (!usePin && !useRFID) {
+    Serial.println("[WEB] Error: No se seleccionó ningún método de autenticación");
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: Seleccione al menos un método de autenticación</h1><a href='/addUser'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  if (usePin && (pin.length() != 4 || pin.toInt() < 0 || pin.toInt() > 9999)) {
+    Serial.println("[WEB] Error: PIN inválido");
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: PIN debe ser de 4 dígitos</h1><a href='/addUser'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  tempName = name;
+  tempPin = pin;
+  tempUID = "";
+  tempSchedule = schedule;
+
+  if (useRFID) {
+    waitingForRFID = true;
+    rfidTimeout = millis() + RFID_TIMEOUT_MS;
+    Serial.println("[WEB] Esperando tarjeta RFID para usuario: " + name);
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;}</style>";
+    html += "</head><body><h1>Escanea la tarjeta RFID ahora</h1><p>Tiempo restante: 30 segundos</p><script>setTimeout(() => {window.location.href='/users'}, 30000);</script></body></html>";
+    request->send(200, "text/html", html);
+  } else {
+    addUser(tempName, tempPin, tempUID, tempSchedule);
+    sendTelegramNotification("[WEB] Nuevo usuario registrado: " + tempName);
+    request->redirect("/users");
+  }
+}
+
+void handleEnterPin(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /enterPin");
+  String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+  html += "<title>Panel de Control</title>";
+  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+  html += "<style>body{font-family:Arial; text-align:center;} .card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px; display:inline-block; width:300px;}";
+  html += "input[type=number]{width:200px; padding:5px; margin:5px;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
+  html += "</style></head><body>";
+  html += "<h1>Ingresar PIN</h1>";
+  html += "<div class='card'>";
+  html += "<form action='/enterPin' method='POST'>";
+  html += "<label>PIN (4 dígitos):</label><br><input type='number' name='pin' min='0000' max='9999' placeholder='Ingresar PIN' required><br>";
+  html += "<button type='submit'>Validar PIN</button>";
+  html += "</form>";
+  html += "<a href='/'><button type='button'>Volver</button></a>";
+  html += "</div>";
+  html += "</body></html>";
+  request->send(200, "text/html", html);
+}
+
+void handleEnterPinPost(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud POST recibida para /enterPin");
+  if (request->hasParam("pin", true)) {
+    String enteredPin = request->getParam("pin", true)->value();
+    String userName = "N/A";
+    bool authorized = false;
+    uint8_t schedule = 0;
+
+    if (enteredPin.length() == 4 && enteredPin.toInt() >= 0 && enteredPin.toInt() <= 9999) {
+      {
+        UserSnapshot users;
+        for (int i = 0; i < users.size(); i++) {
+          if (enteredPin == users[i].pin) {
+            authorized = true;
+            userName = users[i].name;
+            schedule = users[i].schedule;
+            break;
+          }
+        }
+      }
+      if (authorized && !scheduleAllows(schedule)) {
+        accessDecide(LOG_METHOD_PIN, enteredPin.c_str(), userName.c_str(), "Acceso denegado (fuera de horario)", 0,
+                     ("[ACCESO] Denegado por PIN fuera de horario: " + userName).c_str(), NOTIFY_NORMAL,
+                     ("PINH " + userName).c_str(), ("intentos por PIN fuera de horario de " + userName).c_str());
+        String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+        html += "<title>Panel de Control</title>";
+        html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+        html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+        html += "</head><body><h1>Acceso denegado</h1><p>Fuera del horario permitido (" + String(scheduleName(schedule)) + ").</p><a href='/enterPin'><button>Volver</button></a></body></html>";
+        request->send(200, "text/html", html);
+      } else if (authorized) {
+        // El registro y el aviso quedan para loop(): la respuesta no espera a la SD ni a Telegram
+        accessDecide(LOG_METHOD_PIN, enteredPin.c_str(), userName.c_str(), "Acceso concedido", RELAY_OPEN_MS,
+                     ("[ACCESO] Concedido por PIN: " + userName).c_str());
+        request->redirect("/"); // Redirect to home page on successful PIN entry
+      } else {
+        accessDecide(LOG_METHOD_PIN, enteredPin.c_str(), userName.c_str(), "Acceso denegado", 0, "[ACCESO] Denegado por PIN",
+                     NOTIFY_NORMAL, "PIN", "intentos con PIN incorrecto");
+        String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+        html += "<title>Panel de Control</title>";
+        html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+        html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+        html += "</head><body><h1>Acceso denegado</h1><p>PIN incorrecto.</p><a href='/enterPin'><button>Volver</button></a></body></html>";
+        request->send(200, "text/html", html);
+      }
+    } else {
+      String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+      html += "<title>Panel de Control</title>";
+      html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+      html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+      html += "</head><body><h1>Error: PIN debe ser de 4 dígitos</h1><a href='/enterPin'><button>Volver</button></a></body></html>";
+      request->send(200, "text/html", html);
+    }
+  } else {
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: PIN no proporcionado</h1><a href='/enterPin'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+  }
+}
+
+void handleUsers(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /users");
+  String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+  html += "<title>Panel de Control</title>";
+  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+  html += "<style>body{font-family:Arial; text-align:center;} .card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px; display:inline-block; width:300px;}";
+  html += "input[type=password]{width:200px; padding:5px; margin:5px;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
+  html += "</style></head><body>";
+  html += "<h1>Acceso a Lista de Usuarios</h1>";
+  html += "<div class='card'>";
+  html += "<form action='/users' method='POST'>";
+  html += "<label>Contraseña:</label><br><input type='password' name='password' required><br>";
+  html += "<button type='submit'>Acceder</button>";
+  html += "</form>";
+  html += "<a href='/'><button>Volver</button></a>";
+  html += "</div></body></html>";
+  request->send(200, "text/html", html);
+}
+
+void handleUsersPost(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud POST recibida para /users");
+  if (request->hasParam("password", true)) {
+    String pwd = request->getParam("password", true)->value();
+    if (pwd == ADMIN_PASSWORD) {
+      request->send(200, "text/html", renderCached(usersPageCache, usersGeneration, renderUsersPage));
+    } else {
+      String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+      html += "<title>Panel de Control</title>";
+      html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+      html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+      html += "</head><body><h1>Contraseña incorrecta</h1><a href='/users'><button>Volver</button></a></body></html>";
+      request->send(200, "text/html", html);
+    }
+  } else {
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: Contraseña no proporcionada</h1><a href='/users'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+  }
+}
+
+void renderUsersPage(String& html) {
+  html += "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+  html += "<title>Panel de Control</title>";
+  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+  html += "<style>body{font-family:Arial; text-align:center;}";
+  html += ".card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px auto; max-width:600px;}";
+  html += "table{border-collapse:collapse; width:100%; margin:20px 0;} th,td{border:1px solid #ddd; padding:8px;}";
+  html += "th{background:#4CAF50; color:white;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
+  html += "button.delete{background:#ff4444;} button.delete:hover{background:#cc0000;}";
+  html += "</style></head><body>";
+  html += "<h1>Lista de Usuarios</h1>";
+  html += "<div class='card'>";
+  html += "<table><tr><th>Nombre</th><th>PIN</th><th>UID RFID</th><th>Horario</th><th>Acciones</th></tr>";
+  UserSnapshot users;
+  for (int i = 0; i < users.size(); i++) {
+    html += "<tr>";
+    html += "<td>" + htmlEscape(users[i].name) + "</td>";
+    html += "<td>" + (users[i].pin.length() > 0 ? users[i].pin : "N/A") + "</td>";
+    html += "<td>" + (users[i].uid.length() > 0 ? users[i].uid : "N/A") + "</td>";
+    html += "<td>" + (users[i].schedule == SCHEDULE_UNKNOWN ? htmlEscape(users[i].scheduleText) + " (desconocido, sin acceso)" : String(scheduleName(users[i].schedule))) + "</td>";
+    html += "<td>";
+    String target = "?index=" + String(i) + "&name=" + urlEncode(users[i].name);
+    html += "<a href='/editUser" + target + "'><button>Editar</button></a> ";
+    html += "<a href='/deleteUser" + target + "'><button class='delete'>Eliminar</button></a>";
+    html += "</td></tr>";
+  }
+  html += "</table>";
+  html += "<a href='/'><button>Volver</button></a>";
+  html += "</div></body></html>";
+}
+
+void handleEditUserGet(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /editUser");
+  if (!request->hasParam("index")) {
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: Índice no proporcionado</h1><a href='/users'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  int index = request->getParam("index")->value().toInt();
+  UserSnapshot users;
+  // La lista pudo cambiar desde que se generó el enlace: el nombre identifica al usuario
+  if (index < 0 || index >= users.size() ||
+      (request->hasParam("name") && request->getParam("name")->value() != users[index].name)) {
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: El usuario no existe o la lista ha cambiado</h1><a href='/users'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  const User& user = users[index];
+  String html = "<!DOCTYPE html><html lang='es'><head>";
+  html += "<meta charset='UTF-8'>";
+  html += "<title>Panel de Control</title>";
+  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+  html += "<style>";
+  html += "body { font-family: Arial, sans-serif; text-align: center; margin: 20px; }";
+  html += ".card { background: #f5f5f5; border-radius: 10px; padding: 20px; margin: 20px auto; max-width: 400px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }";
+  html += "label { display: block; margin: 10px 0 5px; font-weight: bold; }";
+  html += "input[type=text], input[type=number] { width: 100%; padding: 8px; margin: 5px 0; border: 1px solid #ccc; border-radius: 4px; box-sizing: border-box; }";
+  html += "input[type=checkbox] { margin: 10px 5px; }";
+  html += "button { padding: 10px 20px; background: #4CAF50; color: white; border: none; border-radius: 5px; cursor: pointer; margin-top: 10px; }";
+  html += "button:hover { background: #45a049; }";
+  html += "p { color: #555; }";
+  html += "</style></head><body>";
+  html += "<h1>Editar Usuario</h1>";
+  html += "<div class='card'>";
+  html += "<form action='/editUser' method='POST'>";
+  html += "<input type='hidden' name='index' value='" + String(index) + "'>";
+  html += "<input type='hidden' name='original' value='" + htmlEscape(user.name) + "'>";
+  html += "<label for='name'>Nombre:</label>";
+  html += "<input type='text' id='name' name='name' value='" + htmlEscape(user.name) + "' required><br>";
+  html += "<label>Métodos de autenticación:</label><br>";
+  html += "<input type='checkbox' id='usePin' name='usePin' " + String(user.pin.length() > 0 ? "checked" : "") + ">";
+  html += "<label for='usePin'>Usar PIN</label><br>";
+  html += "<input type='number' id='pinField' name='pin' value='" + user.pin + "' placeholder='PIN (4 dígitos)' min='0000' max='9999'><br>";
+  html += "<input type='checkbox' id='useRFID' name='useRFID' " + String(user.uid.length() > 0 ? "checked" : "") + ">";
+  html += "<label for='useRFID'>Usar RFID</label><br>";
+  html += "<p id='rfidInfo' style='display:" + String(user.uid.length() > 0 ? "block" : "none") + ";'>Pase la tarjeta RFID después de enviar el formulario.</p>";
+  html += "<label for='schedule'>Horario:</label>";
+  html += "<select id='schedule' name='schedule'>";
+  if (user.schedule == SCHEDULE_UNKNOWN) {
+    html += "<option value='" + htmlEscape(user.scheduleText) + "' selected>" + htmlEscape(user.scheduleText) + " (desconocido)</option>";
+  }
+  html += scheduleOptionsHtml(user.schedule) + "</select><br>";
+  html += "<button type='submit'>Actualizar Usuario</button>";
+  html += "</form>";
+  html += "<a href='/users'><button type='button'>Volver</button></a>";
+  html += "</div>";
+  html += "<script>";
+  html += "document.getElementById('usePin').addEventListener('change', function() {";
+  html += "  document.getElementById('pinField').disabled = !this.checked;";
+  html += "  if (!this.checked && !document.getElementById('useRFID').checked) {";
+  html += "    document.getElementById('useRFID').checked = true;";
+  html += "    document.getElementById('rfidInfo').style.display = 'block';";
+  html += "  }";
+  html += "});";
+  html += "document.getElementById('useRFID').addEventListener('change', function() {";
+  html += "  document.getElementById('rfidInfo').style.display = this.checked ? 'block' : 'none';";
+  html += "  if (!this.checked && !document.getElementById('usePin').checked) {";
+  html += "    document.getElementById('usePin').checked = true;";
+  html += "    document.getElementById('pinField').disabled = false;";
+  html += "  }";
+  html += "});";
+  html += "</script>";
+  html += "</body></html>";
+  request->send(200, "text/html", html);
+}
+
+void handleEditUserPost(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud POST recibida para /editUser");
+  if (!request->hasParam("index", true) || !request->hasParam("original", true) || !request->hasParam("name", true)) {
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: Parámetros incompletos</h1><a href='/users'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  int index = request->getParam("index", true)->value().toInt();
+  String original = request->getParam("original", true)->value();
+  String name = request->getParam("name", true)->value();
+  bool usePin = request->hasParam("usePin", true);
+  String pin = usePin ? request->getParam("pin", true)->value() : "";
+  bool useRFID = request->hasParam("useRFID", true);
+  String scheduleText = request->hasParam("schedule", true) ? request->getParam("schedule", true)->value() : "";
+  int schedule = findSchedule(scheduleText.c_str());
+  String uid;
+  {
+    UserSnapshot users;
+    if (index < 0 || index >= users.size() || users[index].name != original) {
+      String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+      html += "<title>Panel de Control</title>";
+      html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+      html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+      html += "</head><body><h1>Error: El usuario no existe o la lista ha cambiado</h1><a href='/users'><button>Volver</button></a></body></html>";
+      request->send(400, "text/html", html);
+      return;
+    }
+    uid = users[index].uid; // Preserve existing UID unless RFID is re-scanned
+    // Se puede editar el resto sin resolver el horario: sigue sin resolver (y denegando)
+    if (schedule < 0 && users[index].schedule == SCHEDULE_UNKNOWN && users[index].scheduleText == scheduleText) {
+      schedule = SCHEDULE_UNKNOWN;
+    }
+  }
+
+  if (schedule < 0) {
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: Horario desconocido</h1><a href='/editUser?index=" + String(index) + "&name=" + urlEncode(original) + "'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  if (!usePin && !useRFID) {
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: Seleccione al menos un método de autenticación</h1><a href='/editUser?index=" + String(index) + "&name=" + urlEncode(original) + "'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  if (usePin && (pin.length() != 4 || pin.toInt() < 0 || pin.toInt() > 9999)) {
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: PIN debe ser de 4 dígitos</h1><a href='/editUser?index=" + String(index) + "&name=" + urlEncode(original) + "'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+    return;
+  }
+
+  if (useRFID && uid.length() == 0) {
+    waitingForRFID = true;
+    rfidTimeout = millis() + RFID_TIMEOUT_MS;
+    tempName = name;
+    tempPin = pin;
+    tempUID = "";
+    tempSchedule = schedule;
+    Serial.println("[WEB] Esperando tarjeta RFID para editar usuario: " + name);
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;}</style>";
+    html += "</head><body><h1>Escanea la tarjeta RFID ahora</h1><p>Tiempo restante: 30 segundos</p><script>setTimeout(() => {window.location.href='/users'}, 30000);</script></body></html>";
+    request->send(200, "text/html", html);
+  } else {
+    // updateUser vuelve a comprobar el nombre bajo el cerrojo: otro cambio pudo colarse desde la comprobación anterior
+    if (updateUser(index, original, name, pin, uid, schedule)) {
+      sendTelegramNotification("[WEB] Usuario actualizado: " + name);
+    }
+    request->redirect("/users");
+  }
+}
+
+void handleDeleteUser(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /deleteUser");
+  if (request->hasParam("index") && request->hasParam("name")) {
+    int index = request->getParam("index")->value().toInt();
+    String userName;
+    if (deleteUser(index, request->getParam("name")->value(), &userName)) {
+      sendTelegramNotification("[WEB] Usuario eliminado: " + userName);
+      request->redirect("/users");
+    } else {
+      String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+      html += "<title>Panel de Control</title>";
+      html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+      html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+      html += "</head><body><h1>Error: El usuario no existe o la lista ha cambiado</h1><a href='/users'><button>Volver</button></a></body></html>";
+      request->send(400, "text/html", html);
+    }
+  } else {
+    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+    html += "<title>Panel de Control</title>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
+    html += "</head><body><h1>Error: Índice no proporcionado</h1><a href='/users'><button>Volver</button></a></body></html>";
+    request->send(400, "text/html", html);
+  }
+}
+
+// === IMPORTACIÓN / EXPORTACIÓN MASIVA DE USUARIOS ===
+
+enum ImportFormat { IMPORT_CSV, IMPORT_JSON };
+
+const int IMPORT_MAX_FIELD = 64;   // Longitud máxima de un campo importado
+const int IMPORT_MAX_ERRORS = 10;  // Errores detallados devueltos en la respuesta
+
+// Estado de una importación en curso. El cuerpo se procesa a medida que llega,
+// por lo que nunca se guarda el archivo completo en memoria.
+struct UserImport {
+  AsyncWebServerRequest *request = nullptr;
+  ImportFormat format = IMPORT_CSV;
+  bool replace = false;
+  bool toCards = false; // target=cards: al índice de tarjetas, sin pasar por la tabla en RAM
+  std::vector<CardRecord> cards; // Filas de tarjetas aún sin escribir en CARD_IMPORT_FILE
+  std::vector<User> rows;
+  int records = 0;
+  int rejected = 0;
+  String errors; // Array JSON con los primeros errores
+  int numErrors = 0;
+
+  // Campo en construcción
+  char field[IMPORT_MAX_FIELD + 1];
+  int fieldLen = 0;
+  bool fieldTooLong = false;
+  User current;
+  String currentSchedule; // Nombre de horario del registro en construcción
+
+  // CSV
+  int column = 0;
+  int line = 1;
+
+  // JSON
+  bool inString = false;
+  bool escape = false;
+  bool haveKey = false;
+  bool rowHasFields = false;
+  String key;
+};
+
+UserImport *activeImport = nullptr; // Una sola importación a la vez
+
+// post: la contraseña llega en el cuerpo del formulario en vez de en la URL
+bool checkApiPassword(AsyncWebServerRequest *request, bool post = false) {
+  return request->hasParam("password", post) && request->getParam("password", post)->value() == ADMIN_PASSWORD;
+}
+
+// Para todo lo que se devuelve dentro de una página, también en atributos value='...'
+String htmlEscape(const String& value) {
+  String out;
+  out.reserve(value.length() + 8);
+  for (unsigned int i = 0; i < value.length(); i++) {
+    char c = value[i];
+    switch (c) {
+      case '&': out += "&amp;"; break;
+      case '<': out += "&lt;"; break;
+      case '>': out += "&gt;"; break;
+      case '"': out += "&quot;"; break;
+      case '\'': out += "&#39;"; break;
+      default: out += c;
+    }
+  }
+  return out;
+}
+
+String jsonEscape(const String& value) {
+  String out;
+  out.reserve(value.length() + 2);
+  for (unsigned int i = 0; i < value.length(); i++) {
+    char c = value[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else if ((uint8_t)c >= 0x20) {
+      out += c;
+    }
+  }
+  return out;
+}
+
+// Normaliza un UID a "AA BB CC DD"; devuelve false si no es hexadecimal válido
+bool normalizeUID(String& uid) {
+  String out;
+  int digits = 0;
+  for (unsigned int i = 0; i < uid.length(); i++) {
+    char c = toupper(uid[i]);
+    if (c == ' ' || c == ':' || c == '-') continue;
+    if (!isxdigit(c)) return false;
+    if (digits > 0 && digits % 2 == 0) out += ' ';
+    out += c;
+    digits++;
+  }
+  if (digits % 2 != 0 || digits < 8 || digits > 20) return false;
+  uid = out;
+  return true;
+}
+
+// Valida (y normaliza) un usuario importado; describe el problema en error
+bool validateImportedUser(User& user, String& error) {
+  user.name.trim();
+  user.pin.trim();
+  user.uid.trim();
+  if (user.name.length() == 0) {
+    error = "Nombre vacío";
+    return false;
+  }
+  if (user.name.indexOf(',') >= 0 || user.pin.indexOf(',') >= 0) {
+    error = "Los campos no pueden contener comas";
+    return false;
+  }
+  if (user.pin.length() > 0) {
+    bool digits = user.pin.length() == 4;
+    for (unsigned int i = 0; digits && i < user.pin.length(); i++) {
+      digits = isdigit(user.pin[i]);
+    }
+    if (!digits) {
+      error = "PIN debe ser de 4 dígitos";
+      return false;
+    }
+  }
+  if (user.uid.length() > 0 && !normalizeUID(user.uid)) {
+    error = "UID inválido";
+    return false;
+  }
+  if (!user.requiresPin() && !user.requiresRFID()) {
+    error = "Se debe proporcionar al menos un PIN o un UID";
+    return false;
+  }
+  return true;
+}
+
+void importError(UserImport *imp, int record, const String& message) {
+  imp->rejected++;
+  if (imp->numErrors >= IMPORT_MAX_ERRORS) return;
+  if (imp->numErrors > 0) imp->errors += ",";
+  imp->errors += "{\"registro\":" + String(record) + ",\"error\":\"" + jsonEscape(message) + "\"}";
+  imp->numErrors++;
+}
+
+// Escribe en la cola las filas de tarjetas acumuladas
+void cardImportFlush(UserImport *imp) {
+  if (imp->cards.empty()) return;
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  size_t bytes = imp->cards.size() * sizeof(CardRecord);
+  if (cardImport.output.write((const uint8_t*)imp->cards.data(), bytes) == bytes) {
+    cardImport.queued += imp->cards.size();
+  } else {
+    for (size_t i = 0; i < imp->cards.size(); i++) importError(imp, imp->records, "Error al escribir en la SD");
+  }
+  imp->cards.clear();
+}
+
+// Importación de tarjetas cortada a medias: se descarta lo que había en la cola
+void cardImportAbort() {
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  cardImport.output.close();
+  SD.remove(CARD_IMPORT_FILE);
+  cardImport.busy = false;
+}
+
+void importEmitRow(UserImport *imp) {
+  imp->records++;
+  String error;
+  imp->currentSchedule.trim();
+  int schedule = findSchedule(imp->currentSchedule.c_str());
+  imp->current.schedule = schedule < 0 ? 0 : schedule;
+  if (schedule < 0) {
+    importError(imp, imp->records, "Horario desconocido: " + imp->currentSchedule);
+  } else if (imp->toCards) {
+    if (!validateImportedUser(imp->current, error)) {
+      importError(imp, imp->records, error);
+    } else if (!imp->current.requiresRFID()) {
+      importError(imp, imp->records, "UID obligatorio");
+    } else {
+      imp->cards.push_back(cardMakeRecord(imp->current.uid, imp->current.name, imp->current.schedule, 0));
+      if ((int)imp->cards.size() >= CARD_IMPORT_FLUSH) cardImportFlush(imp);
+    }
+  } else if ((int)imp->rows.size() >= MAX_USERS) {
+    importError(imp, imp->records, "Límite de usuarios alcanzado");
+  } else if (validateImportedUser(imp->current, error)) {
+    imp->rows.push_back(imp->current);
+  } else {
+    importError(imp, imp->records, error);
+  }
+  imp->current = User();
+  imp->currentSchedule = "";
+}
+
+String importTakeField(UserImport *imp) {
+  imp->field[imp->fieldLen] = '\0';
+  String value = imp->field;
+  imp->fieldLen = 0;
+  return value;
+}
+
+void importAppendField(UserImport *imp, char c) {
+  if (imp->fieldLen < IMPORT_MAX_FIELD) {
+    imp->field[imp->fieldLen++] = c;
+  } else {
+    imp->fieldTooLong = true;
+  }
+}
+
+void importEndCsvField(UserImport *imp) {
+  String value = importTakeField(imp);
+  if (imp->column == 0) imp->current.name = value;
+  else if (imp->column == 1) imp->current.pin = value;
+  else if (imp->column == 2) imp->current.uid = value;
+  else if (imp->column == 3) imp->currentSchedule = value;
+  imp->column++;
+}
+
+void importEndCsvLine(UserImport *imp) {
+  bool empty = imp->column == 0 && imp->fieldLen == 0;
+  importEndCsvField(imp);
+  bool header = imp->line == 1 && imp->current.name == "Nombre";
+  if (header) imp->currentSchedule = "";
+  if (!empty && !header) {
+    if (imp->fieldTooLong) {
+      imp->records++;
+      importError(imp, imp->records, "Campo demasiado largo");
+      imp->current = User();
+    } else {
+      importEmitRow(imp);
+    }
+  }
+  imp->current = User();
+  imp->currentSchedule = "";
+  imp->column = 0;
+  imp->fieldTooLong = false;
+  imp->line++;
+}
+
+void importFeedCsv(UserImport *imp, const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    char c = (char)data[i];
+    if (c == '\r') continue;
+    if (c == '\n') {
+      importEndCsvLine(imp);
+    } else if (c == ',') {
+      importEndCsvField(imp);
+    } else {
+      importAppendField(imp, c);
+    }
+  }
+}
+
+// Asigna un valor JSON (cadena o literal) a la clave pendiente del objeto actual
+void importJsonValue(UserImport *imp, const String& value) {
+  if (imp->key == "name" || imp->key == "nombre") imp->current.name = value;
+  else if (imp->key == "pin") imp->current.pin = value;
+  else if (imp->key == "uid") imp->current.uid = value;
+  else if (imp->key == "schedule" || imp->key == "horario") imp->currentSchedule = value;
+  else return;
+  imp->rowHasFields = true;
+}
+
+void importJsonFlushLiteral(UserImport *imp) {
+  if (imp->fieldLen == 0) return;
+  String literal = importTakeField(imp);
+  if (imp->haveKey && literal != "null") importJsonValue(imp, literal);
+  imp->haveKey = false;
+}
+
+// Tokenizador JSON mínimo: acepta [{"name":..,"pin":..,"uid":..}, ...] o el
+// mismo array anidado en un objeto; cada objeto con campos conocidos es una fila
+void importFeedJson(UserImport *imp, const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    char c = (char)data[i];
+    if (imp->inString) {
+      if (imp->escape) {
+        importAppendField(imp, c == 'n' ? '\n' : (c == 't' ? '\t' : c));
+        imp->escape = false;
+      } else if (c == '\\') {
+        imp->escape = true;
+      } else if (c == '"') {
+        imp->inString = false;
+        String value = importTakeField(imp);
+        if (!imp->haveKey) {
+          imp->key = value;
+          imp->haveKey = true;
+        } else {
+          importJsonValue(imp, value);
+          imp->haveKey = false;
+        }
+      } else {
+        importAppendField(imp, c);
+      }
+      continue;
+    }
+
+    switch (c) {
+      case '"':
+        imp->inString = true;
+        imp->fieldLen = 0;
+        break;
+      case '{':
+        imp->current = User();
+        imp->currentSchedule = "";
+        imp->rowHasFields = false;
+        imp->fieldTooLong = false;
+        imp->haveKey = false;
+        break;
+      case '}':
+        importJsonFlushLiteral(imp);
+        if (imp->rowHasFields) {
+          if (imp->fieldTooLong) {
+            imp->records++;
+            importError(imp, imp->records, "Campo demasiado largo");
+            imp->current = User();
+          } else {
+            importEmitRow(imp);
+          }
+        }
+        imp->rowHasFields = false;
+        imp->fieldTooLong = false;
+        imp->haveKey = false;
+        break;
+      case ',':
+      case ']':
+        importJsonFlushLiteral(imp);
+        imp->haveKey = false;
+        break;
+      case ':':
+      case '[':
+      case ' ':
+      case '\t':
+      case '\r':
+      case '\n':
+        break;
+      default:
+        if (imp->haveKey) importAppendField(imp, c); // número, true, null...
+        break;
+    }
+  }
+}
+
+void importFeed(AsyncWebServerRequest *request, size_t index, const String& filename, uint8_t *data, size_t len) {
+  if (index == 0) {
+    bool toCards = request->hasParam("target") && request->getParam("target")->value() == "cards";
+    // Una importación de tarjetas ocupa la cola hasta que loop() la vacía
+    if (!checkApiPassword(request) || activeImport != nullptr || (toCards && cardImport.busy)) return;
+    if (toCards) {
+      configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+      cardImport.output = SD.open(CARD_IMPORT_FILE, FILE_WRITE);
+      if (!cardImport.output) {
+        Serial.println("[SD] Error al crear la cola de importación de tarjetas");
+        return;
+      }
+      cardImport.busy = true;
+      cardImport.queued = 0;
+      cardImport.applied = 0;
+      cardImport.startMs = millis();
+    }
+    activeImport = new UserImport();
+    activeImport->request = request;
+    activeImport->replace = request->hasParam("mode") && request->getParam("mode")->value() == "replace";
+    activeImport->toCards = toCards;
+    bool json = filename.endsWith(".json") || request->contentType().indexOf("json") >= 0 ||
+                (request->hasParam("format") && request->getParam("format")->value() == "json");
+    activeImport->format = json ? IMPORT_JSON : IMPORT_CSV;
+    request->onDisconnect([request]() {
+      if (activeImport != nullptr && activeImport->request == request) {
+        if (activeImport->toCards) cardImportAbort();
+        delete activeImport;
+        activeImport = nullptr;
+      }
+    });
+    Serial.println("[IMPORT] Importación iniciada (" + String(json ? "JSON" : "CSV") + ")");
+  }
+  if (activeImport == nullptr || activeImport->request != request) return;
+
+  if (activeImport->format == IMPORT_JSON) {
+    importFeedJson(activeImport, data, len);
+  } else {
+    importFeedCsv(activeImport, data, len);
+  }
+}
+
+void handleImportUsersUpload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
+  importFeed(request, index, filename, data, len);
+}
+
+void handleImportUsersBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+  importFeed(request, index, "", data, len);
+}
+
+// Aplica las filas importadas sobre la tabla en una única publicación RCU y
+// una única escritura en SD. Falla por completo si el resultado no es válido.
+bool commitUserImport(UserImport *imp, String& error) {
+  return modifyUsers([&](std::vector<User>& users) {
+    // El nombre es la clave: dos filas con el mismo nombre en un archivo no se
+    // sabe cuál vale, así que se rechaza entero como con los UID repetidos
+    std::vector<uint16_t> rowsByName(imp->rows.size());
+    for (size_t i = 0; i < imp->rows.size(); i++) rowsByName[i] = i;
+    std::sort(rowsByName.begin(), rowsByName.end(), [&](uint16_t a, uint16_t b) {
+      return strcmp(imp->rows[a].name.c_str(), imp->rows[b].name.c_str()) < 0;
+    });
+    for (size_t i = 1; i < rowsByName.size(); i++) {
+      if (imp->rows[rowsByName[i]].name == imp->rows[rowsByName[i - 1]].name) {
+        error = "Nombre duplicado en el archivo: " + imp->rows[rowsByName[i]].name;
+        return false;
+      }
+    }
+
+    if (imp->replace) {
+      users = imp->rows;
+    } else {
+      // Índice por nombre de la tabla actual para fusionar en una pasada
+      std::vector<uint16_t> byName(users.size());
+      for (size_t i = 0; i < users.size(); i++) byName[i] = i;
+      std::sort(byName.begin(), byName.end(), [&](uint16_t a, uint16_t b) {
+        return strcmp(users[a].name.c_str(), users[b].name.c_str()) < 0;
+      });
+      size_t existing = users.size();
+      for (const User& row : imp->rows) {
+        auto it = std::lower_bound(byName.begin(), byName.end(), row.name, [&](uint16_t a, const String& name) {
+          return strcmp(users[a].name.c_str(), name.c_str()) < 0;
+        });
+        if (it != byName.end() && *it < existing && users[*it].name == row.name) {
+          users[*it] = row;
+        } else {
+          users.push_back(row);
+        }
+      }
+    }
+
+    if ((int)users.size() > MAX_USERS) {
+      error = "Límite de usuarios alcanzado (" + String(MAX_USERS) + ")";
+      return false;
+    }
+
+    std::vector<uint16_t> byUid;
+    for (size_t i = 0; i < users.size(); i++) {
+      if (users[i].uid.length() > 0) byUid.push_back(i);
+    }
+    std::sort(byUid.begin(), byUid.end(), [&](uint16_t a, uint16_t b) {
+      return strcmp(users[a].uid.c_str(), users[b].uid.c_str()) < 0;
+    });
+    for (size_t i = 1; i < byUid.size(); i++) {
+      if (users[byUid[i]].uid == users[byUid[i - 1]].uid) {
+        error = "UID duplicado: " + users[byUid[i]].uid;
+        return false;
+      }
+    }
+    return true;
+  }, saveUsersFile);
+}
+
+void handleImportUsers(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud POST recibida para /api/users/import");
+  if (!checkApiPassword(request)) {
+    request->send(401, "application/json", "{\"error\":\"Contraseña incorrecta\"}");
+    return;
+  }
+  if (activeImport == nullptr || activeImport->request != request) {
+    request->send(409, "application/json", "{\"error\":\"Cuerpo vacío o importación en curso\"}");
+    return;
+  }
+
+  UserImport *imp = activeImport;
+  if (imp->format == IMPORT_CSV && (imp->column > 0 || imp->fieldLen > 0)) {
+    importEndCsvLine(imp); // Última línea sin salto final
+  }
+
+  if (imp->toCards) {
+    // Las tarjetas quedan en la cola; loop() las inserta y avisa al terminar
+    cardImportFlush(imp);
+    cardImport.output.close();
+    String json = "{\"en_cola\":" + String(cardImport.queued) + ",\"rechazados\":" + String(imp->rejected);
+    json += ",\"registros\":" + String(imp->records) + ",\"errores\":[" + imp->errors + "]}";
+    request->send(202, "application/json", json);
+    Serial.println("[IMPORT] " + String(cardImport.queued) + " tarjetas en cola, " + String(imp->rejected) + " rechazadas");
+    if (cardImport.queued > 0) cardImport.ready = true;
+    else cardImportAbort();
+    delete imp;
+    activeImport = nullptr;
+    return;
+  }
+
+  String error;
+  bool committed = imp->rows.size() > 0 && commitUserImport(imp, error);
+  if (imp->rows.size() == 0) error = "Ningún registro válido";
+
+  String json = "{\"importados\":" + String(committed ? (int)imp->rows.size() : 0);
+  json += ",\"rechazados\":" + String(imp->rejected);
+  json += ",\"registros\":" + String(imp->records);
+  json += ",\"modo\":\"" + String(imp->replace ? "replace" : "merge") + "\"";
+  if (!committed) json += ",\"error\":\"" + jsonEscape(error) + "\"";
+  json += ",\"errores\":[" + imp->errors + "]}";
+  request->send(committed ? 200 : 400, "application/json", json);
+
+  if (committed) {
+    Serial.println("[IMPORT] " + String(imp->rows.size()) + " usuarios importados, " + String(imp->rejected) + " rechazados");
+    sendTelegramNotification("[WEB] Importación de usuarios: " + String(imp->rows.size()) + " importados, " +
+                             String(imp->rejected) + " rechazados");
+  } else {
+    Serial.println("[IMPORT] Importación rechazada: " + error);
+  }
+
+  delete imp;
+  activeImport = nullptr;
+}
+
+// Estado de una exportación: mantiene fija la instantánea mientras dura la respuesta
+struct UserExport {
+  UserSnapshot users;
+  bool json = false;
+  String syncHeader; // No vacío: tabla completa para la réplica, "A,versión,..." por usuario
+  uint32_t syncVersion = 0;
+  int row = -1; // -1: cabecera
+  bool done = false;
+  String pending;
+  size_t offset = 0;
+};
+
+String nextExportChunk(UserExport& exp) {
+  if (exp.row < 0) {
+    exp.row = 0;
+    if (exp.syncHeader.length() > 0) return exp.syncHeader;
+    return exp.json ? "[" : "Nombre,PIN,UID,Horario\n";
+  }
+  if (exp.row >= exp.users.size()) {
+    exp.done = true;
+    return exp.json ? "]\n" : "";
+  }
+  const User& user = exp.users[exp.row];
+  String chunk;
+  if (exp.json) {
+    if (exp.row > 0) chunk += ",";
+    chunk += "{\"name\":\"" + jsonEscape(user.name) + "\",\"pin\":\"" + user.pin + "\",\"uid\":\"" + user.uid +
+             "\",\"schedule\":\"" + jsonEscape(userScheduleName(user)) + "\"}";
+  } else if (exp.syncHeader.length() > 0) {
+    chunk = "A," + String(exp.syncVersion) + "," + userFileLine(user) + "\n";
+  } else {
+    chunk = userFileLine(user) + "\n";
+  }
+  exp.row++;
+  return chunk;
+}
+
+// Respuesta troceada que recorre la instantánea fijada en exp
+AsyncWebServerResponse* beginUserExport(AsyncWebServerRequest *request, std::shared_ptr<UserExport> exp, const char* contentType) {
+  return request->beginChunkedResponse(contentType,
+    [exp](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t written = 0;
+      while (written < maxLen) {
+        if (exp->offset >= exp->pending.length()) {
+          if (exp->done) break;
+          exp->pending = nextExportChunk(*exp);
+          exp->offset = 0;
+          continue;
+        }
+        size_t n = min(maxLen - written, exp->pending.length() - exp->offset);
+        memcpy(buffer + written, exp->pending.c_str() + exp->offset, n);
+        exp->offset += n;
+        written += n;
+      }
+      return written;
+    });
+}
+
+void handleExportUsers(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /api/users/export");
+  if (!checkApiPassword(request)) {
+    request->send(401, "application/json", "{\"error\":\"Contraseña incorrecta\"}");
+    return;
+  }
+
+  std::shared_ptr<UserExport> exp = std::make_shared<UserExport>();
+  exp->json = request->hasParam("format") && request->getParam("format")->value() == "json";
+  AsyncWebServerResponse *response = beginUserExport(request, exp, exp->json ? "application/json" : "text/csv");
+  response->addHeader("Content-Disposition", exp->json ? "attachment; filename=users.json" : "attachment; filename=users.csv");
+  request->send(response);
+}
+
+void getCurrentTime(char* out, size_t size) {
+  struct tm timeinfo;
+  if (!getLocalTime(&timeinfo)) {
+    Serial.println("[NTP] Error al obtener la hora");
+    strlcpy(out, "N/A", size);
+    return;
+  }
+  strftime(out, size, "%Y-%m-%d %H:%M:%S", &timeinfo);
+}
+
+// La línea se compone en la pila y el historial en RAM es de tamaño fijo, así
+// que registrar un acceso no reserva memoria en el heap
+void logAccess(const char* method, const char* id, const char* status, const char* userName) {
+  char timestamp[20];
+  getCurrentTime(timestamp, sizeof(timestamp));
+  logAccessAt(timestamp, method, id, status, userName);
+}
+
+// Con la hora ya fijada: la tubería de accesos registra con la de la decisión
+void logAccessAt(const char* timestamp, const char* method, const char* id, const char* status, const char* userName) {
+  char entry[LOG_LINE_MAX];
+  int length = snprintf(entry, sizeof(entry), "%s,%s,%s,%s,%s", timestamp, method, id, userName, status);
+  length = min(length, LOG_LINE_MAX - 1);
+
+  if (historyCount < 15) {
+    memcpy(accessHistory[historyCount], entry, length + 1);
+    historyCount++;
+  } else {
+    memmove(accessHistory[0], accessHistory[1], sizeof(accessHistory[0]) * 14);
+    memcpy(accessHistory[14], entry, length + 1);
+  }
+  dashboardGeneration++;
+
+  if (mqttMutex) {
+    char fields[MQTT_FIELDS_MAX];
+    int used = 0;
+    mqttField(fields, sizeof(fields), used, "metodo", method);
+    // Solo el UID de las tarjetas: en PIN y Telegram el "id" es el PIN tecleado
+    if (logMethodCode(method) == LOG_METHOD_RFID) mqttField(fields, sizeof(fields), used, "id", id);
+    mqttField(fields, sizeof(fields), used, "usuario", userName);
+    mqttField(fields, sizeof(fields), used, "estado", status);
+    mqttEvent(MQTT_ACCESS, fields);
+  }
+
+  if (logMutex) xSemaphoreTake(logMutex, portMAX_DELAY);
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  trace(TRACE_SD_WRITE_START, TRACE_SD_LOG);
+  File file = SD.open(SD_FILE, FILE_APPEND);
+  if (file) {
+    uint32_t offset = logLiveBase + file.size();
+    file.println(entry);
+    file.close();
+    logLiveSize = offset - logLiveBase + length + 2;
+    trace(TRACE_SD_WRITE_END, TRACE_SD_LOG);
+    LogPosting posting = logMakePosting(offset, length, timestamp, method, userName, status);
+    if (logIndexReady) logIndexAppend(posting);
+    statsRecord(posting, userName);
+    Serial.printf("[LOG] Registro almacenado: %s\n", entry);
+  } else {
+    Serial.println("[SD] Error al escribir en archivo de log");
+  }
+  if (logMutex) xSemaphoreGive(logMutex);
+}
+
+// === TUBERÍA DE ACCESOS ===
+
+void initAccessPipeline() {
+  accessMutex = xSemaphoreCreateMutex();
+}
+
+void accessStageRecord(AccessStage stage, uint32_t us) {
+  xSemaphoreTake(accessMutex, portMAX_DELAY);
+  AccessStageStats& stats = accessStages[stage];
+  stats.count++;
+  stats.totalUs += us;
+  stats.maxUs = std::max(stats.maxUs, us);
+  xSemaphoreGive(accessMutex);
+}
+
+// Primera etapa, en la misma llamada que decide: relé, traza y evento MQTT del
+// relé, todo en RAM. El resto del evento se rellena después de accionar
+void accessBegin(AccessEvent& event, LogMethod method, const char* id, const char* user, const char* status,
+                 unsigned long openMs) {
+  uint32_t decided = micros();
+  event.opened = openMs > 0;
+  event.relayUs = 0;
+  trace(event.opened ? TRACE_ACCESS_GRANTED : TRACE_ACCESS_DENIED, method);
+  if (event.opened) {
+    relayState = true;
+    digitalWrite(RELAY_PIN, HIGH);
+    event.relayUs = micros() - decided;
+    relayTimerEnd = millis() + openMs;
+    dashboardGeneration++;
+    trace(TRACE_RELAY_ON, method);
+    mqttRelayEvent(true, LOG_METHOD_NAMES[method]);
+    accessStageRecord(ACCESS_STAGE_RELAY, event.relayUs);
+  }
+  event.method = method;
+  getCurrentTime(event.timestamp, sizeof(event.timestamp));
+  strlcpy(event.id, id, sizeof(event.id));
+  strlcpy(event.user, user, sizeof(event.user));
+  strlcpy(event.status, status, sizeof(event.status));
+  event.message[0] = event.key[0] = event.summary[0] = event.chatId[0] = '\0';
+  event.priority = NOTIFY_LOW;
+  event.stageAt = micros();
+}
+
+// Segunda etapa: la línea del registro, su entrada en el índice y las estadísticas
+void accessPersist(AccessEvent& event) {
+  logAccessAt(event.timestamp, LOG_METHOD_NAMES[event.method], event.id, event.status, event.user);
+  uint32_t now = micros();
+  event.logUs = now - event.stageAt;
+  event.stageAt = now;
+  accessStageRecord(ACCESS_STAGE_LOG, event.logUs);
+}
+
+// Tercera etapa: notifyEvent solo encola; la respuesta a un chat es un envío a Telegram
+void accessNotify(AccessEvent& event) {
+  if (event.chatId[0] != '\0') {
+    sendTelegramNotification(event.message, event.chatId);
+  } else if (event.message[0] != '\0') {
+    notifyEvent(event.priority, event.message, event.key[0] ? event.key : nullptr, event.summary[0] ? event.summary : nullptr);
+  }
+  uint32_t notifyUs = micros() - event.stageAt;
+  accessStageRecord(ACCESS_STAGE_NOTIFY, notifyUs);
+  Serial.printf("[ACCESO] %s %s: relé %lu us, registro %lu us, aviso %lu us\n", LOG_METHOD_NAMES[event.method],
+                event.opened ? "concedido" : "denegado", (unsigned long)event.relayUs, (unsigned long)event.logUs,
+                (unsigned long)notifyUs);
+}
+
+// Deja el evento para loop(). Con la cola llena se registra aquí mismo: la línea
+// queda por delante de los eventos que aún esperan en la cola, así que el archivo
+// deja de seguir el orden de las decisiones (cada línea conserva la hora de la
+// suya). El aviso no se envía aquí, que puede ser la tarea de AsyncTCP: pasa a la
+// cola de notificaciones sin prioridad urgente (las respuestas a /abrir también,
+// que solo llegan del chat autorizado)
+void accessPush(AccessEvent& event) {
+  xSemaphoreTake(accessMutex, portMAX_DELAY);
+  bool queued = accessHead - accessTail < (uint32_t)ACCESS_QUEUE;
+  if (queued) {
+    accessQueue[accessHead % ACCESS_QUEUE] = event;
+    accessHead++;
+  } else {
+    accessOverflow++;
+  }
+  xSemaphoreGive(accessMutex);
+  if (queued) {
+    powerWake();
+    return;
+  }
+  Serial.println("[ACCESO] Cola llena: registro en la propia llamada y aviso diferido");
+  accessPersist(event);
+  if (event.message[0] == '\0') return;
+  bool reply = event.chatId[0] != '\0';
+  notifyEvent(event.priority == NOTIFY_URGENT || reply ? NOTIFY_NORMAL : event.priority, event.message,
+              !reply && event.key[0] ? event.key : nullptr, !reply && event.summary[0] ? event.summary : nullptr);
+}
+
+// Decisión con aviso por notifyEvent. openMs > 0 concede y abre durante ese tiempo
+void accessDecide(LogMethod method, const char* id, const char* user, const char* status, unsigned long openMs,
+                  const char* message, NotifyPriority priority, const char* key, const char* summary) {
+  AccessEvent event;
+  accessBegin(event, method, id, user, status, openMs);
+  strlcpy(event.message, message, sizeof(event.message));
+  if (key) strlcpy(event.key, key, sizeof(event.key));
+  if (summary) strlcpy(event.summary, summary, sizeof(event.summary));
+  event.priority = priority;
+  accessPush(event);
+}
+
+// Decisión cuyo aviso es la respuesta al chat que la pidió (/abrir)
+void accessDecideReply(LogMethod method, const char* id, const char* user, const char* status, unsigned long openMs,
+                       const char* chatId, const char* reply) {
+  AccessEvent event;
+  accessBegin(event, method, id, user, status, openMs);
+  strlcpy(event.message, reply, sizeof(event.message));
+  strlcpy(event.chatId, chatId, sizeof(event.chatId));
+  accessPush(event);
+}
+
+// En cada vuelta de loop(): primero se registra todo lo pendiente y después se
+// avisa. Una respuesta a Telegram bloquea cientos de ms, así que sale como mucho
+// una por vuelta y la siguiente tarjeta no espera a las demás
+void updateAccessPipeline() {
+  AccessEvent event;
+  for (;;) {
+    xSemaphoreTake(accessMutex, portMAX_DELAY);
+    bool pending = accessLogged != accessHead;
+    if (pending) event = accessQueue[accessLogged % ACCESS_QUEUE];
+    xSemaphoreGive(accessMutex);
+    if (!pending) break;
+    accessPersist(event);
+    xSemaphoreTake(accessMutex, portMAX_DELAY);
+    accessQueue[accessLogged % ACCESS_QUEUE] = event;
+    accessLogged++;
+    xSemaphoreGive(accessMutex);
+  }
+  for (;;) {
+    xSemaphoreTake(accessMutex, portMAX_DELAY);
+    bool pending = accessTail != accessLogged;
+    if (pending) event = accessQueue[accessTail % ACCESS_QUEUE];
+    xSemaphoreGive(accessMutex);
+    if (!pending) break;
+    accessNotify(event);
+    xSemaphoreTake(accessMutex, portMAX_DELAY);
+    accessTail++;
+    xSemaphoreGive(accessMutex);
+    if (event.chatId[0] != '\0') break;
+  }
+}
+
+String accessPipelineJson() {
+  xSemaphoreTake(accessMutex, portMAX_DELAY);
+  String json = "{";
+  for (int i = 0; i < ACCESS_STAGE_COUNT; i++) {
+    const AccessStageStats& stats = accessStages[i];
+    json += "\"" + String(ACCESS_STAGE_NAMES[i]) + "\":{\"n\":" + String(stats.count);
+    json += ",\"media_us\":" + String(stats.count ? (uint32_t)(stats.totalUs / stats.count) : 0);
+    json += ",\"max_us\":" + String(stats.maxUs) + "},";
+  }
+  json += "\"en_cola\":" + String(accessHead - accessTail) + ",\"desbordes\":" + String(accessOverflow) + "}";
+  xSemaphoreGive(accessMutex);
+  return json;
+}
+
+// === RÉPLICA DE USUARIOS ===
+
+String usersLogIdHex(uint32_t id) {
+  char hex[9];
+  snprintf(hex, sizeof(hex), "%08lx", (unsigned long)id);
+  return String(hex);
+}
+
+void usersLogMark(uint32_t version, uint32_t offset) {
+  uint32_t index = version - usersLogBase - 1;
+  if (index % USERS_LOG_MARK_EVERY == 0 && index / USERS_LOG_MARK_EVERY < sizeof(usersLogMarks) / sizeof(usersLogMarks[0])) {
+    usersLogMarks[index / USERS_LOG_MARK_EVERY] = offset;
+  }
+}
+
+// Diario nuevo con otra identidad: los nodos que copian de este piden la tabla completa
+void usersLogCreate() {
+  usersLogId = esp_random() | 1;
+  usersLogBase = 1;
+  usersVersion = 1;
+  File file = SD.open(USERS_LOG_FILE, FILE_WRITE);
+  if (file) {
+    file.println("#usersync," + usersLogIdHex(usersLogId) + "," + String(usersLogBase));
+    file.close();
+  } else {
+    Serial.println("[SD] Error al crear el diario de usuarios");
+  }
+}
+
+// La clave del par queda en claro: quien lea la SD puede consultar al par
+void saveUserSync() {
+  File file = SD.open(USERS_SYNC_FILE, FILE_WRITE);
+  if (!file) {
+    Serial.println("[SD] Error al guardar el estado de la réplica");
+    return;
+  }
+  file.println(userSync.peer + "," + userSync.password + "," + usersLogIdHex(userSync.peerId) + "," + String(userSync.cursor));
+  file.close();
+}
+
+// Recorre el diario para recuperar la versión y las marcas; si no cuadra
+// (cabecera rota, versiones no consecutivas) se empieza otro
+void initUsersLog() {
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+  bool ok = false;
+  File file = SD.open(USERS_LOG_FILE, FILE_READ);
+  if (file) {
+    LineReader reader(file);
+    unsigned long id = 0, base = 0;
+    ok = reader.next() && reader.complete && sscanf(reader.line, "#usersync,%lx,%lu", &id, &base) == 2 && id != 0;
+    usersLogId = id;
+    usersLogBase = base;
+    usersVersion = base;
+    // Una última línea sin salto (escritura cortada) no cuenta
+    while (ok && reader.next() && reader.complete) {
+      if (reader.truncated) {
+        ok = false;
+        break;
+      }
+      const char* line = reader.line;
+      uint32_t version = strtoul(line + 2, nullptr, 10);
+      if (reader.length < 4 || (line[0] != 'A' && line[0] != 'B') || line[1] != ',' || version != usersVersion + 1) {
+        ok = false;
+        break;
+      }
+      usersLogMark(version, reader.offset);
+      usersVersion = version;
+    }
+    ok = ok && !reader.failed;
+    file.close();
+  }
+  if (!ok) usersLogCreate();
+
+  file = SD.open(USERS_SYNC_FILE, FILE_READ);
+  if (file) {
+    LineReader reader(file);
+    char* fields[4];
+    if (reader.next() && reader.complete && !reader.truncated && splitFields(reader.line, fields, 4) == 4) {
+      userSync.peer = fields[0];
+      userSync.password = fields[1];
+      userSync.peerId = strtoul(fields[2], nullptr, 16);
+      userSync.cursor = strtoul(fields[3], nullptr, 10);
+    }
+    file.close();
+  }
+  Serial.printf("[SYNC] Diario de usuarios %s, versión %lu (%lu cambios)%s%s\n", usersLogIdHex(usersLogId).c_str(),
+                (unsigned long)usersVersion, (unsigned long)(usersVersion - usersLogBase),
+                userSync.peer.length() > 0 ? "; copia de " : "", userSync.peer.c_str());
+  xSemaphoreGive(usersWriteMutex);
+}
+
+// Reescribe el diario con los últimos USERS_LOG_KEEP registros (requiere usersWriteMutex)
+void usersLogCompact() {
+  uint32_t base = usersVersion - USERS_LOG_KEEP;
+  File in = SD.open(USERS_LOG_FILE, FILE_READ);
+  File out = SD.open(USERS_LOG_FILE ".tmp", FILE_WRITE);
+  if (!in || !out) {
+    if (in) in.close();
+    if (out) out.close();
+    Serial.println("[SD] Error al compactar el diario de usuarios");
+    return;
+  }
+  uint32_t skip = (base - usersLogBase) / USERS_LOG_MARK_EVERY;
+  uint32_t from = skip < sizeof(usersLogMarks) / sizeof(usersLogMarks[0]) ? usersLogMarks[skip] : 0;
+  uint32_t oldBase = usersLogBase;
+  uint32_t offset = out.println("#usersync," + usersLogIdHex(usersLogId) + "," + String(base));
+  usersLogBase = base;
+  LineReader reader(in, from);
+  while (reader.next() && reader.complete) {
+    if (reader.line[0] == '#' || reader.truncated) continue;
+    uint32_t version = strtoul(reader.line + 2, nullptr, 10);
+    if (version <= base) continue;
+    usersLogMark(version, offset);
+    offset += out.println(reader.line);
+  }
+  in.close();
+  out.close();
+  SD.remove(USERS_LOG_FILE);
+  SD.rename(USERS_LOG_FILE ".tmp", USERS_LOG_FILE);
+  Serial.printf("[SYNC] Diario compactado: versiones %lu-%lu (antes desde %lu)\n", (unsigned long)base + 1,
+                (unsigned long)usersVersion, (unsigned long)oldBase + 1);
+}
+
+std::vector<uint16_t> usersByName(const UserTable* table) {
+  std::vector<uint16_t> order(table->size());
+  for (int i = 0; i < table->size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [table](uint16_t a, uint16_t b) {
+    return strcmp(table->users[a].name.c_str(), table->users[b].name.c_str()) < 0;
+  });
+  return order;
+}
+
+// Apunta en el diario la diferencia entre dos instantáneas, comparadas por
+// nombre. La llama modifyUsers con usersWriteMutex, así que el diario sigue el
+// orden de publicación sea cual sea el origen del cambio (web, importación, réplica)
+void usersLogAppend(const UserTable* before, const UserTable* after) {
+  if (usersLogId == 0) return; // Arranque: aún no hay diario
+  std::vector<uint16_t> oldOrder = usersByName(before);
+  std::vector<uint16_t> newOrder = usersByName(after);
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  File file;
+  uint32_t offset = 0;
+  bool failed = false;
+  auto put = [&](char kind, const String& rest) {
+    if (failed) return;
+    if (!file) {
+      file = SD.open(USERS_LOG_FILE, FILE_APPEND);
+      if (!file) {
+        failed = true;
+        return;
+      }
+      offset = file.size();
+    }
+    usersVersion++;
+    usersLogMark(usersVersion, offset);
+    offset += file.println(String(kind) + "," + String(usersVersion) + "," + rest);
+  };
+  size_t i = 0, j = 0;
+  while (i < oldOrder.size() || j < newOrder.size()) {
+    const User* oldUser = i < oldOrder.size() ? &before->users[oldOrder[i]] : nullptr;
+    const User* newUser = j < newOrder.size() ? &after->users[newOrder[j]] : nullptr;
+    int cmp = !oldUser ? 1 : (!newUser ? -1 : strcmp(oldUser->name.c_str(), newUser->name.c_str()));
+    if (cmp < 0) {
+      put('B', oldUser->name);
+      i++;
+    } else if (cmp > 0) {
+      put('A', userFileLine(*newUser));
+      j++;
+    } else {
+      if (oldUser->pin != newUser->pin || oldUser->uid != newUser->uid || oldUser->schedule != newUser->schedule ||
+          oldUser->scheduleText != newUser->scheduleText) {
+        put('A', userFileLine(*newUser));
+      }
+      i++;
+      j++;
+    }
+  }
+  if (file) file.close();
+  if (failed) {
+    // Sin el cambio en el diario, las copias no lo verían nunca: mejor que pidan la tabla completa
+    Serial.println("[SD] Error al escribir el diario de usuarios");
+    usersLogCreate();
+  } else if (usersVersion - usersLogBase > (uint32_t)USERS_LOG_MAX) {
+    usersLogCompact();
+  }
+}
+
+// POST /api/users/changes (password, id=<diario>, since=<versión>): los cambios
+// posteriores a "since" en texto plano, con una cabecera
+// "#usersync,<diario>,<hasta>,<actual>,delta|completo". Hasta USERS_SYNC_BATCH
+// cambios por respuesta; si hasta < actual, el cliente vuelve a pedir
+void handleUsersChanges(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /api/users/changes");
+  if (!checkApiPassword(request, true)) {
+    request->send(401, "application/json", "{\"error\":\"Contraseña incorrecta\"}");
+    return;
+  }
+  uint32_t id = request->hasParam("id", true) ? strtoul(request->getParam("id", true)->value().c_str(), nullptr, 16) : 0;
+  uint32_t since = request->hasParam("since", true) ? strtoul(request->getParam("since", true)->value().c_str(), nullptr, 10) : 0;
+
+  xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+  String head = "#usersync," + usersLogIdHex(usersLogId) + ",";
+  if (id != usersLogId || since < usersLogBase || since > usersVersion) {
+    // Instantánea y versión se leen juntas: ningún escritor publica mientras tanto
+    std::shared_ptr<UserExport> exp = std::make_shared<UserExport>();
+    exp->syncVersion = usersVersion;
+    exp->syncHeader = head + String(usersVersion) + "," + String(usersVersion) + ",completo\n";
+    xSemaphoreGive(usersWriteMutex);
+    request->send(beginUserExport(request, exp, "text/plain"));
+    return;
+  }
+
+  String body;
+  uint32_t through = since;
+  if (since < usersVersion) {
+    uint32_t mark = std::min((since - usersLogBase) / USERS_LOG_MARK_EVERY,
+                             (usersVersion - usersLogBase - 1) / USERS_LOG_MARK_EVERY);
+    mark = std::min(mark, (uint32_t)(sizeof(usersLogMarks) / sizeof(usersLogMarks[0]) - 1));
+    configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+    File file = SD.open(USERS_LOG_FILE, FILE_READ);
+    if (file) {
+      int count = 0;
+      LineReader reader(file, usersLogMarks[mark]);
+      while (count < USERS_SYNC_BATCH && reader.next() && reader.complete) {
+        if (reader.line[0] == '#' || reader.truncated) continue;
+        uint32_t version = strtoul(reader.line + 2, nullptr, 10);
+        if (version <= since) continue;
+        body += reader.line;
+        body += "\n";
+        through = version;
+        count++;
+      }
+      file.close();
+    }
+  }
+  String response = head + String(through) + "," + String(usersVersion) + ",delta\n" + body;
+  xSemaphoreGive(usersWriteMutex);
+  request->send(200, "text/plain", response);
+}
+
+size_t UserSyncSink::write(uint8_t c) {
+  if (c == '\n') {
+    line[length] = '\0';
+    parseLine();
+    length = 0;
+  } else if (length < LOG_LINE_MAX - 1) {
+    line[length++] = (char)c;
+  }
+  return 1;
+}
+
+size_t UserSyncSink::write(const uint8_t* data, size_t size) {
+  for (size_t i = 0; i < size; i++) write(data[i]);
+  return size;
+}
+
+void UserSyncSink::parseLine() {
+  if (length > 0 && line[length - 1] == '\r') line[--length] = '\0';
+  if (length == 0 || bad) return;
+  if (!header) {
+    unsigned long peerId = 0, peerThrough = 0, peerCurrent = 0;
+    char mode[12] = "";
+    header = sscanf(line, "#usersync,%lx,%lu,%lu,%11s", &peerId, &peerThrough, &peerCurrent, mode) == 4;
+    bad = !header;
+    if (header) {
+      id = peerId;
+      through = peerThrough;
+      current = peerCurrent;
+      full = strcmp(mode, "completo") == 0;
+    }
+    return;
+  }
+  // Campos separados por comas, cortados en el mismo búfer
+  char* fields[6] = {line};
+  int count = 1;
+  for (char* p = line; count < 6 && (p = strchr(p, ',')); count++) {
+    *p++ = '\0';
+    fields[count] = p;
+  }
+  UserChange change;
+  change.version = count > 1 ? strtoul(fields[1], nullptr, 10) : 0;
+  change.erase = fields[0][0] == 'B';
+  if (change.erase && count >= 3) {
+    change.user.name = fields[2];
+  } else if (fields[0][0] == 'A' && count >= 5) {
+    change.user = userFromFields(fields[2], fields[3], fields[4], count == 6 ? fields[5] : "");
+  } else {
+    bad = true;
+    return;
+  }
+  changes.push_back(change);
+}
+
+// Aplica una respuesta del par en una sola publicación RCU y una sola escritura
+// de /users.txt: los lectores ven la tabla de antes o la de después, nunca a medias
+bool applyUserChanges(const UserSyncSink& sink) {
+  return modifyUsers([&](std::vector<User>& users) {
+    if (sink.full) users.clear();
+    std::vector<uint16_t> byName(users.size());
+    for (size_t i = 0; i < users.size(); i++) byName[i] = i;
+    std::sort(byName.begin(), byName.end(), [&](uint16_t a, uint16_t b) {
+      return strcmp(users[a].name.c_str(), users[b].name.c_str()) < 0;
+    });
+    std::vector<bool> erased(users.size(), false);
+    for (const UserChange& change : sink.changes) {
+      auto it = std::lower_bound(byName.begin(), byName.end(), change.user.name, [&](uint16_t a, const String& name) {
+        return strcmp(users[a].name.c_str(), name.c_str()) < 0;
+      });
+      bool found = it != byName.end() && users[*it].name == change.user.name;
+      if (change.erase) {
+        if (found) {
+          erased[*it] = true;
+          byName.erase(it);
+        }
+      } else if (found) {
+        users[*it] = change.user;
+      } else {
+        users.push_back(change.user);
+        erased.push_back(false);
+        byName.insert(it, users.size() - 1);
+      }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < users.size(); i++) {
+      if (!erased[i]) users[kept++] = users[i];
+    }
+    users.resize(kept);
+    return (int)users.size() <= MAX_USERS;
+  }, saveUsersFile);
+}
+
+// Pide al par los cambios posteriores al cursor y deja la respuesta para
+// loop(); devuelve false si no hay par configurado
+bool fetchUserChanges() {
+  xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+  String peer = userSync.peer;
+  String password = userSync.password;
+  uint32_t peerId = userSync.peerId;
+  uint32_t cursor = userSync.cursor;
+  xSemaphoreGive(usersWriteMutex);
+  if (peer.length() == 0) return false;
+
+  unsigned long start = millis();
+  UserSyncPull* pull = new UserSyncPull;
+  pull->peer = peer;
+  HTTPClient http;
+  http.setConnectTimeout(USERS_SYNC_TIMEOUT_MS);
+  http.setTimeout(USERS_SYNC_TIMEOUT_MS);
+  if (http.begin(peer + "/api/users/changes")) {
+    // La clave en el cuerpo: la URL acaba en los registros de proxies y servidores
+    http.addHeader("Content-Type", "application/x-www-form-urlencoded");
+    pull->code = http.POST("password=" + urlEncode(password) + "&id=" + usersLogIdHex(peerId) + "&since=" + String(cursor));
+    if (pull->code == HTTP_CODE_OK) pull->received = http.writeToStream(&pull->sink);
+    http.end();
+  }
+  pull->elapsed = millis() - start;
+
+  xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+  userSyncPending = pull;
+  xSemaphoreGive(usersWriteMutex);
+  powerWake();
+  return true;
+}
+
+// Espera a que loop() aplique la respuesta; devuelve true si el par tiene más
+// pendientes. Un aviso de /api/users/sync puede despertarla antes de tiempo
+bool waitUserChangesApplied() {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+    bool done = userSyncPending == nullptr;
+    bool more = userSyncMore;
+    xSemaphoreGive(usersWriteMutex);
+    if (done) return more;
+  }
+}
+
+// En loop(): aplica la respuesta que dejó userSyncTask y guarda /users.sync. El
+// bus SPI se reconfigura al pasar del lector a la SD, así que solo se toca desde
+// loop(), nunca desde la tarea de la réplica
+void updateUserSync() {
+  xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+  UserSyncPull* pull = userSyncPending;
+  if (!pull && userSync.dirty) {
+    userSync.dirty = false;
+    configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+    saveUserSync();
+  }
+  xSemaphoreGive(usersWriteMutex);
+  if (!pull) return;
+
+  const UserSyncSink& sink = pull->sink;
+  const String& peer = pull->peer;
+  int code = pull->code;
+  bool ok = code == HTTP_CODE_OK && pull->received >= 0 && sink.header && !sink.bad;
+  bool applied = ok && ((!sink.full && sink.changes.empty()) || applyUserChanges(sink));
+
+  xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+  bool wasFailing = userSync.failing;
+  userSync.failing = !applied;
+  userSync.pulls++;
+  userSync.lastCode = code;
+  userSync.lastMs = pull->elapsed;
+  if (pull->received > 0) userSync.bytes += pull->received;
+  bool moved = applied && userSync.peer == peer && (sink.id != userSync.peerId || sink.through != userSync.cursor);
+  if (!applied) userSync.errors++;
+  if (moved) {
+    userSync.changes += sink.changes.size();
+    userSync.peerId = sink.id;
+    userSync.cursor = sink.through;
+  }
+  if (moved || userSync.dirty) {
+    userSync.dirty = false;
+    configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+    saveUserSync();
+  }
+  userSyncMore = moved && sink.through < sink.current;
+  userSyncPending = nullptr;
+  xSemaphoreGive(usersWriteMutex);
+
+  if (!applied) {
+    // Con el par caído solo se avisa del primer fallo
+    if (!wasFailing) Serial.printf("[SYNC] Error al copiar de %s (HTTP %d%s)\n", peer.c_str(), code, ok ? ", tabla no válida" : "");
+  } else if (!sink.changes.empty() || sink.full) {
+    Serial.printf("[SYNC] %u cambios de %s%s: versión %lu de %lu, %d B en %lu ms\n", (unsigned)sink.changes.size(),
+                  peer.c_str(), sink.full ? " (tabla completa)" : "", (unsigned long)sink.through,
+                  (unsigned long)sink.current, pull->received, pull->elapsed);
+  }
+  delete pull;
+  if (userSyncTaskHandle) xTaskNotifyGive(userSyncTaskHandle);
+}
+
+// Consulta al par cada USERS_SYNC_INTERVAL_MS y, si va por delante más de un
+// lote, sigue pidiendo hasta alcanzarlo. Con el par caído cada consulta puede
+// esperar la conexión y la lectura (USERS_SYNC_TIMEOUT_MS cada una), así que va
+// en su propia tarea y loop() sigue atendiendo la puerta, el lector y el relé;
+// loop() aplica cada lote y la tarea espera a que termine antes de pedir otro
+void userSyncTask(void*) {
+  for (;;) {
+    for (int round = 0; round < USERS_SYNC_ROUNDS && fetchUserChanges() && waitUserChangesApplied(); round++) {
+    }
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(USERS_SYNC_INTERVAL_MS)); // /api/users/sync la adelanta
+  }
+}
+
+void initUserSync() {
+  xTaskCreatePinnedToCore(userSyncTask, "usersync", 8192, nullptr, 1, &userSyncTaskHandle, 1);
+}
+
+// GET /api/users/sync?password=...: estado de la réplica. POST con password,
+// peer=http://10.0.0.20 y clave=... en el cuerpo: cambia el par (vacío = sin
+// réplica) y empieza desde cero
+void handleUsersSync(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /api/users/sync");
+  bool post = request->method() == HTTP_POST;
+  if (!checkApiPassword(request, post)) {
+    request->send(401, "application/json", "{\"error\":\"Contraseña incorrecta\"}");
+    return;
+  }
+  if (post && request->hasParam("peer", true)) {
+    String peer = request->getParam("peer", true)->value();
+    String password = request->hasParam("clave", true) ? request->getParam("clave", true)->value() : ADMIN_PASSWORD;
+    peer.trim();
+    while (peer.endsWith("/")) peer.remove(peer.length() - 1);
+    if (peer.indexOf(',') >= 0 || password.indexOf(',') >= 0) {
+      request->send(400, "application/json", "{\"error\":\"El par y la clave no pueden llevar comas\"}");
+      return;
+    }
+    xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+    userSync.peer = peer;
+    userSync.password = password;
+    userSync.peerId = 0;
+    userSync.cursor = 0;
+    userSync.dirty = true; // Lo guarda loop()
+    xSemaphoreGive(usersWriteMutex);
+    powerWake();
+    if (userSyncTaskHandle) xTaskNotifyGive(userSyncTaskHandle); // Primera consulta enseguida
+    Serial.println("[SYNC] Par configurado: " + (peer.length() > 0 ? peer : String("ninguno")));
+  }
+  xSemaphoreTake(usersWriteMutex, portMAX_DELAY);
+  String json = "{\"id\":\"" + usersLogIdHex(usersLogId) + "\",\"version\":" + String(usersVersion) +
+                ",\"base\":" + String(usersLogBase) + ",\"par\":\"" + jsonEscape(userSync.peer) +
+                "\",\"id_par\":\"" + usersLogIdHex(userSync.peerId) + "\",\"version_par\":" + String(userSync.cursor) +
+                ",\"consultas\":" + String(userSync.pulls) + ",\"cambios\":" + String(userSync.changes) +
+                ",\"errores\":" + String(userSync.errors) + ",\"bytes\":" + String(userSync.bytes) +
+                ",\"ultimo_http\":" + String(userSync.lastCode) + ",\"ultimo_ms\":" + String(userSync.lastMs) + "}";
+  xSemaphoreGive(usersWriteMutex);
+  request->send(200, "application/json", json);
+}
+
+// === CONSULTA DEL REGISTRO DE ACCESOS ===
+
+// Días desde 1970-01-01 para una fecha del calendario gregoriano
+int32_t logDaysFromCivil(int year, int month, int day) {
+  year -= month <= 2;
+  int32_t era = (year >= 0 ? year : year - 399) / 400;
+  uint32_t yoe = (uint32_t)(year - era * 400);
+  uint32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int32_t)doe - 719468;
+}
+
+// "AAAA-MM-DD HH:MM:SS" (o solo la fecha) a segundos en hora local; 0 si no es válida.
+// Se trabaja siempre en hora local para no depender de la zona horaria al reconstruir.
+uint32_t logParseTimestamp(const char* text) {
+  int year, month, day, hour = 0, minute = 0, second = 0;
+  int fields = sscanf(text, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second);
+  if (fields != 3 && fields != 6) return 0;
+  if (year < 2000 || month < 1 || month > 12 || day < 1 || day > 31) return 0;
+  return (uint32_t)logDaysFromCivil(year, month, day) * 86400UL + hour * 3600UL + minute * 60UL + second;
+}
+
+uint32_t logUserHash(const char* name) {
+  uint32_t hash = 2166136261UL;
+  for (; *name; name++) {
+    hash ^= (uint8_t)tolower((uint8_t)*name);
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+int logMethodCode(const char* method) {
+  for (int i = 0; i < LOG_METHOD_COUNT; i++) {
+    if (strcasecmp(method, LOG_METHOD_NAMES[i]) == 0) return i;
+  }
+  return LOG_METHOD_OTHER;
+}
+
+int logStatusCode(const char* status) {
+  if (strncmp(status, "Acceso concedido", 16) == 0) return LOG_STATUS_GRANTED;
+  if (strncmp(status, "Acceso denegado", 15) == 0) return LOG_STATUS_DENIED;
+  if (strncmp(status, "Intento de intrusi", 18) == 0) return LOG_STATUS_INTRUSION;
+  return LOG_STATUS_OTHER;
+}
+
+LogPosting logMakePosting(uint32_t offset, uint16_t length, const char* timestamp, const char* method,
+                          const char* userName, const char* status) {
+  LogPosting posting;
+  posting.offset = offset;
+  posting.time = logParseTimestamp(timestamp);
+  posting.userHash = logUserHash(userName);
+  posting.length = length;
+  posting.method = logMethodCode(method);
+  posting.status = logStatusCode(status);
+  return posting;
+}
+
+// Separa una línea del registro en sus cinco campos
+bool logSplitLine(const String& line, String fields[5]) {
+  int start = 0;
+  for (int i = 0; i < 4; i++) {
+    int comma = line.indexOf(',', start);
+    if (comma < 0) return false;
+    fields[i] = line.substring(start, comma);
+    start = comma + 1;
+  }
+  fields[4] = line.substring(start);
+  return true;
+}
+
+void logUserIndexPath(char* path, uint32_t userHash) {
+  sprintf(path, LOG_INDEX_DIR "/u%02u.idx", (unsigned)(userHash % LOG_USER_BUCKETS));
+}
+
+void logStatusIndexPath(char* path, int status) {
+  sprintf(path, LOG_INDEX_DIR "/s%d.idx", status);
+}
+
+bool logIndexWrite(const char* path, const LogPosting* postings, int count) {
+  File file = SD.open(path, FILE_APPEND);
+  if (!file) return false;
+  size_t bytes = sizeof(LogPosting) * count;
+  bool ok = file.write((const uint8_t*)postings, bytes) == bytes;
+  file.close();
+  return ok;
+}
+
+// Llamado por logAccess con logMutex tomado. La lista general se escribe la
+// última: si algo falla, al arrancar no cuadrará con el registro y se reconstruye.
+void logIndexAppend(const LogPosting& posting) {
+  char path[24];
+  trace(TRACE_SD_WRITE_START, TRACE_SD_LOG_INDEX);
+  logUserIndexPath(path, posting.userHash);
+  bool ok = logIndexWrite(path, &posting, 1);
+  logStatusIndexPath(path, posting.status);
+  ok = ok && logIndexWrite(path, &posting, 1);
+  ok = ok && logIndexWrite(LOG_INDEX_ALL, &posting, 1);
+  trace(TRACE_SD_WRITE_END, TRACE_SD_LOG_INDEX);
+  if (!ok) {
+    logIndexReady = false;
+    Serial.println("[LOG] Error al actualizar los índices; se reconstruirán al reiniciar");
+  }
+}
+
+// Reconstruye todas las listas recorriendo el registro (archivado y vivo) una
+// vez. Cada lista acumula unas pocas entradas en RAM antes de escribirlas.
+bool rebuildLogIndex() {
+  const int LISTS = 1 + LOG_USER_BUCKETS + LOG_STATUS_COUNT;
+  const int BATCH = 8;
+  char path[24];
+
+  SD.mkdir(LOG_INDEX_DIR);
+  SD.remove(LOG_INDEX_ALL);
+  for (int i = 0; i < LOG_USER_BUCKETS; i++) {
+    logUserIndexPath(path, i);
+    SD.remove(path);
+  }
+  for (int i = 0; i < LOG_STATUS_COUNT; i++) {
+    logStatusIndexPath(path, i);
+    SD.remove(path);
+  }
+
+  LogPosting* batches = new (std::nothrow) LogPosting[LISTS * BATCH];
+  int* pending = new (std::nothrow) int[LISTS]();
+  if (!batches || !pending) {
+    delete[] batches;
+    delete[] pending;
+    return false;
+  }
+
+  // Lista 0: general; 1..32: usuarios; después: estados
+  auto flush = [&](int list) {
+    if (pending[list] == 0) return true;
+    if (list == 0) {
+      strcpy(path, LOG_INDEX_ALL);
+    } else if (list <= LOG_USER_BUCKETS) {
+      logUserIndexPath(path, list - 1);
+    } else {
+      logStatusIndexPath(path, list - 1 - LOG_USER_BUCKETS);
+    }
+    bool ok = logIndexWrite(path, &batches[list * BATCH], pending[list]);
+    pending[list] = 0;
+    return ok;
+  };
+  auto add = [&](int list, const LogPosting& posting) {
+    batches[list * BATCH + pending[list]++] = posting;
+    return pending[list] < BATCH || flush(list);
+  };
+
+  bool ok = true;
+  uint32_t entries = 0;
+  uint32_t bytes = logLogicalEnd();
+  unsigned long start = millis();
+  LogReader reader;
+  bool read = logForEachLine(reader, 0, bytes, [&](uint32_t offset, char* text, int length) {
+    char* fields[5];
+    if (length == 0 || logIsHeader(text) || splitFields(text, fields, 5) < 5) return true;
+    LogPosting posting = logMakePosting(offset, length, fields[0], fields[1], fields[3], fields[4]);
+    ok = add(1 + posting.userHash % LOG_USER_BUCKETS, posting) &&
+         add(1 + LOG_USER_BUCKETS + posting.status, posting) &&
+         add(0, posting);
+    entries++;
+    return ok;
+  });
+  logReaderClose(reader);
+  ok = ok && read;
+  for (int list = 1; ok && list < LISTS; list++) ok = flush(list);
+  ok = ok && flush(0);
+
+  delete[] batches;
+  delete[] pending;
+  unsigned long elapsed = max(1UL, millis() - start);
+  Serial.printf("[LOG] Índices del registro reconstruidos (%lu entradas, %lu B en %lu ms, %.2f MB/s)\n",
+                (unsigned long)entries, (unsigned long)bytes, elapsed, bytes / 1000.0 / elapsed);
+  return ok;
+}
+
+// Comprueba que la última entrada indexada termina justo donde termina el
+// registro; si no (archivo editado, escrito por otra versión o corte de
+// corriente a mitad de logAccess), reconstruye.
+void initLogIndex() {
+  logMutex = xSemaphoreCreateMutex();
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+
+  File log = SD.open(SD_FILE, FILE_READ);
+  if (!log) {
+    Serial.println("[LOG] Registro no disponible; consultas desactivadas");
+    return;
+  }
+  log.close();
+  uint32_t logEnd = logLogicalEnd();
+
+  bool consistent = false;
+  File index = SD.open(LOG_INDEX_ALL, FILE_READ);
+  if (index) {
+    size_t size = index.size();
+    LogPosting last;
+    if (size % sizeof(LogPosting) == 0 && size >= sizeof(LogPosting) &&
+        index.seek(size - sizeof(LogPosting)) &&
+        index.read((uint8_t*)&last, sizeof(last)) == sizeof(last)) {
+      // println añade "\r\n"; tras una rotación el registro vivo puede tener solo la cabecera
+      uint32_t lastEnd = last.offset + last.length + 2;
+      consistent = lastEnd == logEnd || (lastEnd == logLiveBase && logLiveSize == strlen(LOG_HEADER) + 2);
+    }
+    index.close();
+  }
+
+  logIndexReady = consistent || rebuildLogIndex();
+  if (consistent) Serial.println("[LOG] Índices del registro al día");
+  if (!logIndexReady) Serial.println("[LOG] Error al reconstruir los índices del registro");
+}
+
+bool logPostingMatches(const LogQuery& query, const LogPosting& posting, uint32_t userHash) {
+  if (query.method >= 0 && posting.method != query.method) return false;
+  if (query.status >= 0 && posting.status != query.status) return false;
+  if (query.user.length() > 0 && posting.userHash != userHash) return false;
+  bool dated = query.from > 0 || query.to < UINT32_MAX;
+  if (dated && (posting.time == 0 || posting.time < query.from || posting.time > query.to)) return false;
+  return true;
+}
+
+// Recorre la lista más selectiva de más reciente a más antigua leyendo bloques
+// de entradas y solo las líneas del registro que coinciden. Como las listas
+// están en orden de escritura, se detiene al pasar de la fecha inicial.
+// Devuelve el cursor de la siguiente página o -1 si no hay más resultados.
+int32_t runLogQuery(const LogQuery& query, const std::function<void(const String&)>& emit) {
+  const int BLOCK = 32;
+  char path[24];
+  uint32_t userHash = logUserHash(query.user.c_str());
+  if (query.user.length() > 0) {
+    logUserIndexPath(path, userHash);
+  } else if (query.status >= 0) {
+    logStatusIndexPath(path, query.status);
+  } else {
+    strcpy(path, LOG_INDEX_ALL);
+  }
+
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  File index = SD.open(path, FILE_READ);
+  LogReader reader;
+  int32_t next = -1;
+  if (index) {
+    int32_t count = index.size() / sizeof(LogPosting);
+    int32_t position = query.cursor >= 0 ? min(query.cursor, count) : count;
+    int matched = 0;
+    LogPosting block[BLOCK];
+    char line[LOG_LINE_MAX + 1];
+    bool done = false;
+    while (!done && position > 0) {
+      int32_t first = max<int32_t>(0, position - BLOCK);
+      int n = position - first;
+      index.seek(first * sizeof(LogPosting));
+      if (index.read((uint8_t*)block, n * sizeof(LogPosting)) != n * sizeof(LogPosting)) break;
+      for (int i = n - 1; i >= 0; i--) {
+        const LogPosting& posting = block[i];
+        position = first + i;
+        if (posting.time != 0 && posting.time < query.from) {
+          done = true;
+          break;
+        }
+        if (!logPostingMatches(query, posting, userHash)) continue;
+        int length = min<int>(posting.length, LOG_LINE_MAX);
+        if (logRead(reader, posting.offset, (uint8_t*)line, length) != (size_t)length) continue;
+        line[length] = '\0';
+        String text(line);
+        if (query.user.length() > 0) {
+          String fields[5];
+          if (!logSplitLine(text, fields) || !fields[3].equalsIgnoreCase(query.user)) continue; // Colisión de hash
+        }
+        emit(text);
+        if (++matched >= query.limit) {
+          next = position > 0 ? position : -1;
+          done = true;
+          break;
+        }
+      }
+    }
+  }
+  if (index) index.close();
+  logReaderClose(reader);
+  xSemaphoreGive(logMutex);
+  return next;
+}
+
+// Lee los filtros de la petición; devuelve false con el motivo si alguno no es válido
+// post: los filtros llegan en el cuerpo (formulario de /log) en vez de en la URL
+bool parseLogQuery(AsyncWebServerRequest *request, LogQuery& query, String& error, bool post) {
+  auto param = [&](const char* name) { return request->hasParam(name, post) ? request->getParam(name, post)->value() : String(); };
+  query.user = param("user");
+  query.user.trim();
+  String method = param("method");
+  if (method.length() > 0) {
+    query.method = logMethodCode(method.c_str());
+    if (query.method == LOG_METHOD_OTHER && !method.equalsIgnoreCase(LOG_METHOD_NAMES[LOG_METHOD_OTHER])) {
+      error = "Método desconocido: " + method;
+      return false;
+    }
+  }
+  String status = param("status");
+  if (status.length() > 0) {
+    for (int i = 0; i < LOG_STATUS_COUNT; i++) {
+      if (status.equalsIgnoreCase(LOG_STATUS_NAMES[i])) query.status = i;
+    }
+    if (query.status < 0) {
+      error = "Estado desconocido: " + status;
+      return false;
+    }
+  }
+  String from = param("from");
+  if (from.length() > 0) {
+    query.from = logParseTimestamp(from.c_str());
+    if (query.from == 0) {
+      error = "Fecha inicial no válida (AAAA-MM-DD)";
+      return false;
+    }
+  }
+  String to = param("to");
+  if (to.length() > 0) {
+    uint32_t end = logParseTimestamp(to.c_str());
+    if (end == 0) {
+      error = "Fecha final no válida (AAAA-MM-DD)";
+      return false;
+    }
+    query.to = end + 86399; // Incluye el día completo
+  }
+  if (request->hasParam("limit", post)) {
+    query.limit = constrain((int)param("limit").toInt(), 1, LOG_QUERY_MAX);
+  }
+  if (request->hasParam("cursor", post)) {
+    query.cursor = param("cursor").toInt();
+  }
+  return true;
+}
+
+String urlEncode(const String& value) {
+  const char* hex = "0123456789ABCDEF";
+  String out;
+  for (unsigned int i = 0; i < value.length(); i++) {
+    uint8_t c = value[i];
+    if (isalnum(c) || c == '-' || c == '_' || c == '.') {
+      out += (char)c;
+    } else {
+      out += '%';
+      out += hex[c >> 4];
+      out += hex[c & 15];
+    }
+  }
+  return out;
+}
+
+// El formulario va por POST: la contraseña no queda en la URL (historial, registros
+// del proxy, Referer). Todo lo que se devuelve en la página pasa por htmlEscape()
+void handleLogQuery(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /log");
+  auto param = [&](const char* name) { return request->hasParam(name, true) ? request->getParam(name, true)->value() : String(); };
+  String password = param("password");
+  String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+  html += "<title>Panel de Control</title>";
+  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+  html += "<style>body{font-family:Arial; text-align:center;} .card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px auto; display:inline-block;}";
+  html += "input,select{padding:5px; margin:5px;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
+  html += "table{border-collapse:collapse; width:80%; margin:20px auto;} th,td{border:1px solid #ddd; padding:8px;} th{background:#4CAF50; color:white;}";
+  html += "</style></head><body>";
+  html += "<h1>Consultar Registro de Accesos</h1>";
+
+  String user = param("user");
+  String method = param("method");
+  String status = param("status");
+  String from = param("from");
+  String to = param("to");
+
+  html += "<div class='card'><form action='/log' method='POST'>";
+  html += "<input type='password' name='password' placeholder='Contraseña' value='" + htmlEscape(password) + "'>";
+  html += "<input type='text' name='user' placeholder='Usuario' value='" + htmlEscape(user) + "'>";
+  html += "<select name='method'><option value=''>Cualquier método</option>";
+  for (int i = 0; i < LOG_METHOD_COUNT; i++) {
+    html += "<option value='" + String(LOG_METHOD_NAMES[i]) + "'" + (method.equalsIgnoreCase(LOG_METHOD_NAMES[i]) ? " selected" : "") + ">" + LOG_METHOD_NAMES[i] + "</option>";
+  }
+  html += "</select><select name='status'><option value=''>Cualquier estado</option>";
+  for (int i = 0; i < LOG_STATUS_COUNT; i++) {
+    html += "<option value='" + String(LOG_STATUS_NAMES[i]) + "'" + (status.equalsIgnoreCase(LOG_STATUS_NAMES[i]) ? " selected" : "") + ">" + LOG_STATUS_NAMES[i] + "</option>";
+  }
+  html += "</select><br>Desde <input type='date' name='from' value='" + htmlEscape(from) + "'>";
+  html += "Hasta <input type='date' name='to' value='" + htmlEscape(to) + "'><br>";
+  html += "<button type='submit'>Buscar</button></form></div>";
+
+  if (password.length() > 0) {
+    LogQuery query;
+    String error;
+    if (password != ADMIN_PASSWORD) {
+      html += "<p style='color:red;'>Contraseña incorrecta</p>";
+    } else if (!logIndexReady) {
+      html += "<p style='color:red;'>Índice del registro no disponible</p>";
+    } else if (!parseLogQuery(request, query, error, true)) {
+      html += "<p style='color:red;'>" + htmlEscape(error) + "</p>";
+    } else {
+      html += "<table><tr><th>Fecha y Hora</th><th>Método</th><th>ID</th><th>Usuario</th><th>Estado</th></tr>";
+      int rows = 0;
+      int32_t next = runLogQuery(query, [&](const String& line) {
+        String fields[5];
+        if (!logSplitLine(line, fields)) return;
+        html += "<tr>";
+        for (int i = 0; i < 5; i++) html += "<td>" + htmlEscape(fields[i]) + "</td>";
+        html += "</tr>";
+        rows++;
+      });
+      html += "</table>";
+      if (rows == 0) html += "<p>Sin resultados</p>";
+      if (next >= 0) {
+        // Siguiente página: el mismo formulario con el cursor, nunca un enlace con la contraseña
+        html += "<form action='/log' method='POST'>";
+        const char* names[] = {"password", "user", "method", "status", "from", "to"};
+        const String* values[] = {&password, &user, &method, &status, &from, &to};
+        for (int i = 0; i < 6; i++) {
+          html += "<input type='hidden' name='" + String(names[i]) + "' value='" + htmlEscape(*values[i]) + "'>";
+        }
+        html += "<input type='hidden' name='cursor' value='" + String(next) + "'>";
+        html += "<button type='submit'>Página siguiente</button></form>";
+      }
+    }
+  }
+  html += "<p><a href='/'><button>Volver al Inicio</button></a></p>";
+  html += "</body></html>";
+  request->send(200, "text/html", html);
+}
+
+void handleLogApi(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /api/log");
+  if (!checkApiPassword(request)) {
+    request->send(401, "application/json", "{\"error\":\"Contraseña incorrecta\"}");
+    return;
+  }
+  if (!logIndexReady) {
+    request->send(503, "application/json", "{\"error\":\"Índice del registro no disponible\"}");
+    return;
+  }
+  LogQuery query;
+  String error;
+  if (!parseLogQuery(request, query, error, false)) {
+    request->send(400, "application/json", "{\"error\":\"" + jsonEscape(error) + "\"}");
+    return;
+  }
+
+  String json = "{\"resultados\":[";
+  bool first = true;
+  int32_t next = runLogQuery(query, [&](const String& line) {
+    String fields[5];
+    if (!logSplitLine(line, fields)) return;
+    if (!first) json += ",";
+    first = false;
+    json += "{\"fecha\":\"" + jsonEscape(fields[0]) + "\",\"metodo\":\"" + jsonEscape(fields[1]) +
+            "\",\"id\":\"" + jsonEscape(fields[2]) + "\",\"usuario\":\"" + jsonEscape(fields[3]) +
+            "\",\"estado\":\"" + jsonEscape(fields[4]) + "\"}";
+  });
+  json += "],\"siguiente\":" + String(next) + "}";
+  request->send(200, "application/json", json);
+}
+
+// === ESTADÍSTICAS DE ACCESOS ===
+
+// Hora local actual en el mismo formato que LogPosting::time; 0 si aún no hay NTP
+uint32_t localEpochNow() {
+  time_t now = time(nullptr);
+  struct tm timeinfo;
+  if (now < 1600000000 || !localtime_r(&now, &timeinfo)) return 0;
+  return (uint32_t)logDaysFromCivil(timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday) * 86400UL +
+         timeinfo.tm_hour * 3600UL + timeinfo.tm_min * 60UL + timeinfo.tm_sec;
+}
+
+// 1970-01-01 fue jueves: sumando 3 las semanas empiezan en lunes
+uint32_t statsWeekOf(uint32_t day) {
+  return (day + 3) / 7;
+}
+
+void statsResetPeriod(AccessCounters& counters, bool week) {
+  counters.todayGranted = counters.todayDenied = 0;
+  if (week) counters.weekGranted = counters.weekDenied = 0;
+}
+
+// Pone a cero los contadores de hoy (y de la semana si cambia) al pasar a otro día
+void statsRollTo(uint32_t day) {
+  if (day <= accessStats.day) return;
+  bool newWeek = statsWeekOf(day) != accessStats.week;
+  for (int i = 0; i < LOG_METHOD_COUNT; i++) statsResetPeriod(accessStats.methods[i], newWeek);
+  statsResetPeriod(accessStats.overflow, newWeek);
+  for (int i = 0; i < STATS_USER_SLOTS; i++) {
+    if (accessStats.users[i].hash != 0) statsResetPeriod(accessStats.users[i].counters, newWeek);
+  }
+  memset(accessStats.hourToday, 0, sizeof(accessStats.hourToday));
+  accessStats.intrusionsToday = 0;
+  if (newWeek) accessStats.intrusionsWeek = 0;
+  accessStats.day = day;
+  accessStats.week = statsWeekOf(day);
+  accessStatsDirty = true;
+}
+
+uint32_t statsNameHash(const char* name) {
+  uint32_t hash = logUserHash(name);
+  return hash != 0 ? hash : 1;
+}
+
+// Tabla hash con sondeo lineal; devuelve la casilla del nombre o, si no está,
+// la libre donde iría (nullptr si la tabla está llena). Se compara el nombre
+// completo para que dos usuarios con el mismo hash no se mezclen.
+UserCounters* statsUserSlot(const char* name) {
+  uint32_t hash = statsNameHash(name);
+  for (int i = 0; i < STATS_USER_SLOTS; i++) {
+    UserCounters& entry = accessStats.users[(hash + i) % STATS_USER_SLOTS];
+    if (entry.hash == 0) return &entry;
+    if (entry.hash == hash && strncasecmp(entry.name, name, USER_NAME_SIZE - 1) == 0) return &entry;
+  }
+  return nullptr;
+}
+
+// Se llena hasta 3/4 para que las búsquedas sigan siendo cortas
+AccessCounters* statsUserCounters(const char* name, bool create) {
+  UserCounters* entry = statsUserSlot(name);
+  if (entry && entry->hash != 0) return &entry->counters;
+  if (!create || !entry || accessStats.usedSlots >= STATS_USER_SLOTS * 3 / 4) return nullptr;
+  entry->hash = statsNameHash(name);
+  strlcpy(entry->name, name, sizeof(entry->name));
+  accessStats.usedSlots++;
+  accessStatsDirty = true;
+  return &entry->counters;
+}
+
+// Libera una casilla desplazando hacia atrás las que la seguían en la misma
+// secuencia de sondeo, para no dejar marcas de borrado
+void statsFreeSlot(int slot) {
+  int hole = slot;
+  for (int i = 1; i < STATS_USER_SLOTS; i++) {
+    int at = (slot + i) % STATS_USER_SLOTS;
+    UserCounters& entry = accessStats.users[at];
+    if (entry.hash == 0) break;
+    int home = entry.hash % STATS_USER_SLOTS;
+    if ((at - home + STATS_USER_SLOTS) % STATS_USER_SLOTS >= (at - hole + STATS_USER_SLOTS) % STATS_USER_SLOTS) {
+      accessStats.users[hole] = entry;
+      hole = at;
     }
+  }
+  memset(&accessStats.users[hole], 0, sizeof(UserCounters));
+  accessStats.usedSlots--;
+  accessStatsDirty = true;
+}
 
-    // Handle /abrir command
-    if (telegramState == IDLE && text == "/abrir" && chat_id == CHAT_ID) {
-      telegramState = WAITING_FOR_NAME;
-      telegramChatId = chat_id;
-      telegramTimeout = millis() + TELEGRAM_TIMEOUT_MS;
-      sendTelegramNotification("Por favor, ingresa el nombre de usuario.", chat_id);
-      Serial.println("[TELEGRAM] Solicitud de apertura recibida, esperando nombre");
-    } else if (telegramState == WAITING_FOR_NAME && chat_id == telegramChatId) {
-      telegramUserName = text;
-      bool userFound = false;
-      bool hasPin = false;
-      int userIndex = -1;
+// Deja en la tabla exactamente los usuarios de la lista más "N/A": las casillas
+// de los borrados (o de un nombre anterior) se liberan y sus accesos futuros
+// van a "otros". Requiere logMutex.
+void statsSyncUsers(const UserTable* users) {
+  std::vector<std::pair<uint32_t, int>> byHash;
+  byHash.reserve(users->size());
+  for (int i = 0; i < users->size(); i++) {
+    byHash.push_back({statsNameHash(users->users[i].name.c_str()), i});
+  }
+  std::sort(byHash.begin(), byHash.end());
 
-      for (int j = 0; j < numAuthorizedUsers; j++) {
-        if (telegramUserName == authorizedUsers[j].name) {
-          userFound = true;
-          if (authorizedUsers[j].requiresPin()) {
-            hasPin = true;
-            userIndex = j;
-          }
-          break;
-        }
-      }
+  int freed = 0;
+  for (int slot = 0; slot < STATS_USER_SLOTS;) {
+    const UserCounters& entry = accessStats.users[slot];
+    bool keep = entry.hash == 0 || strcmp(entry.name, "N/A") == 0;
+    auto match = std::lower_bound(byHash.begin(), byHash.end(), std::make_pair(entry.hash, 0));
+    for (; !keep && match != byHash.end() && match->first == entry.hash; ++match) {
+      keep = strncasecmp(entry.name, users->users[match->second].name.c_str(), USER_NAME_SIZE - 1) == 0;
+    }
+    if (keep) {
+      slot++;
+    } else {
+      statsFreeSlot(slot); // La casilla recibe otra entrada: se vuelve a mirar
+      freed++;
+    }
+  }
+  for (int i = 0; i < users->size(); i++) statsUserCounters(users->users[i].name.c_str(), true);
+  statsUserCounters("N/A", true);
+  if (freed > 0) Serial.printf("[STATS] Liberadas %d casillas de usuarios borrados\n", freed);
+}
 
-      if (!userFound) {
-        logAccess("TELEGRAM", "N/A", "Acceso denegado", telegramUserName);
-        sendTelegramNotification("Usuario *" + telegramUserName + "* no encontrado.", chat_id);
-        telegramState = IDLE;
-      } else if (!hasPin) {
-        logAccess("TELEGRAM", "N/A", "Acceso denegado", telegramUserName);
-        sendTelegramNotification("El usuario *" + telegramUserName + "* no tiene un PIN configurado.", chat_id);
-        telegramState = IDLE;
-      } else {
-        telegramState = WAITING_FOR_PIN;
-        telegramTimeout = millis() + TELEGRAM_TIMEOUT_MS;
-        sendTelegramNotification("Por favor, ingresa el PIN de 4 dígitos para *" + telegramUserName + "*.", chat_id);
-        Serial.println("[TELEGRAM] Nombre recibido: " + telegramUserName + ", esperando PIN");
-      }
-    } else if (telegramState == WAITING_FOR_PIN && chat_id == telegramChatId) {
-      String enteredPin = text;
-      bool authorized = false;
-      String userName = telegramUserName;
+void statsCount(AccessCounters& counters, bool granted, bool today, bool week) {
+  if (granted) {
+    if (today && counters.todayGranted < UINT16_MAX) counters.todayGranted++;
+    if (week && counters.weekGranted < UINT16_MAX) counters.weekGranted++;
+    counters.allGranted++;
+  } else {
+    if (today && counters.todayDenied < UINT16_MAX) counters.todayDenied++;
+    if (week && counters.weekDenied < UINT16_MAX) counters.weekDenied++;
+    counters.allDenied++;
+  }
+}
 
-      if (enteredPin.length() == 4 && enteredPin.toInt() >= 0 && enteredPin.toInt() <= 9999) {
-        for (int j = 0; j < numAuthorizedUsers; j++) {
-          if (telegramUserName == authorizedUsers[j].name && enteredPin == authorizedUsers[j].pin) {
-            authorized = true;
-            break;
-          }
-        }
+// Suma una entrada del registro; las entradas sin hora solo cuentan en el total
+void statsRecord(const LogPosting& posting, const char* userName) {
+  bool today = false, week = false;
+  if (posting.time != 0) {
+    uint32_t day = posting.time / 86400;
+    statsRollTo(day);
+    today = day == accessStats.day;
+    week = statsWeekOf(day) == accessStats.week;
+    int hour = (posting.time / 3600) % 24;
+    accessStats.hourAll[hour]++;
+    if (today) accessStats.hourToday[hour]++;
+  }
+
+  if (posting.status == LOG_STATUS_INTRUSION) {
+    if (today) accessStats.intrusionsToday++;
+    if (week) accessStats.intrusionsWeek++;
+    accessStats.intrusionsAll++;
+  } else if (posting.status == LOG_STATUS_GRANTED || posting.status == LOG_STATUS_DENIED) {
+    bool granted = posting.status == LOG_STATUS_GRANTED;
+    statsCount(accessStats.methods[posting.method], granted, today, week);
+    AccessCounters* counters = statsUserCounters(userName, false);
+    statsCount(counters ? *counters : accessStats.overflow, granted, today, week);
+  }
+
+  accessStats.logEnd = posting.offset + posting.length + 2; // println añade "\r\n"
+  accessStatsDirty = true;
+}
+
+void statsClear() {
+  memset(&accessStats, 0, sizeof(accessStats));
+  accessStats.magic = STATS_MAGIC;
+  accessStats.version = STATS_VERSION;
+}
+
+// Se escribe en un temporal y se renombra para no dejar nunca un archivo a medias
+void checkpointAccessStats() {
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  trace(TRACE_SD_WRITE_START, TRACE_SD_STATS);
+  File file = SD.open(STATS_FILE ".tmp", FILE_WRITE);
+  if (!file) {
+    Serial.println("[STATS] Error al guardar estadísticas");
+    return;
+  }
+  bool ok = file.write((const uint8_t*)&accessStats, sizeof(accessStats)) == sizeof(accessStats);
+  file.close();
+  trace(TRACE_SD_WRITE_END, TRACE_SD_STATS);
+  if (ok) {
+    SD.remove(STATS_FILE);
+    ok = SD.rename(STATS_FILE ".tmp", STATS_FILE);
+  }
+  if (ok) accessStatsDirty = false;
+}
+
+// Carga el último punto de control y suma las entradas escritas después. Las
+// casillas se crean antes a partir de la lista de usuarios; las entradas se
+// leen del registro porque los índices solo guardan el hash del nombre.
+void initAccessStats() {
+  statsClear();
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+
+  uint32_t logSize = logLogicalEnd();
+  File file = SD.open(STATS_FILE, FILE_READ);
+  if (file) {
+    bool ok = file.size() == sizeof(accessStats) &&
+              file.read((uint8_t*)&accessStats, sizeof(accessStats)) == sizeof(accessStats) &&
+              accessStats.magic == STATS_MAGIC && accessStats.version == STATS_VERSION &&
+              accessStats.logEnd <= logSize;
+    file.close();
+    if (!ok) {
+      Serial.println("[STATS] Punto de control no válido; se recalculan desde el registro");
+      statsClear();
+    }
+  }
+
+  {
+    UserSnapshot users;
+    statsSyncUsers(users.get());
+  }
+
+  uint32_t replayed = 0;
+  LogReader reader;
+  logForEachLine(reader, accessStats.logEnd, logSize, [&](uint32_t offset, char* text, int length) {
+    char* fields[5];
+    if (length == 0 || logIsHeader(text) || splitFields(text, fields, 5) < 5) return true;
+    statsRecord(logMakePosting(offset, length, fields[0], fields[1], fields[3], fields[4]), fields[3]);
+    replayed++;
+    return true;
+  });
+  logReaderClose(reader);
+  if (accessStatsDirty) checkpointAccessStats();
+  lastStatsCheckpoint = millis();
+  Serial.println("[STATS] Estadísticas cargadas (" + String(replayed) + " entradas nuevas desde el último guardado)");
+}
+
+// Llamado desde loop(): cambio de día sin accesos y guardado periódico
+void updateAccessStats() {
+  if (millis() - lastStatsCheckpoint < STATS_CHECKPOINT_MS) return;
+  lastStatsCheckpoint = millis();
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  uint32_t now = localEpochNow();
+  if (now != 0) statsRollTo(now / 86400);
+  if (accessStatsDirty) checkpointAccessStats();
+  xSemaphoreGive(logMutex);
+}
+
+String statsCountersJson(const AccessCounters& counters) {
+  return "{\"hoy\":[" + String(counters.todayGranted) + "," + String(counters.todayDenied) +
+         "],\"semana\":[" + String(counters.weekGranted) + "," + String(counters.weekDenied) +
+         "],\"total\":[" + String(counters.allGranted) + "," + String(counters.allDenied) + "]}";
+}
+
+String statsCountersRow(const String& label, const AccessCounters& counters) {
+  return "<tr><td>" + label + "</td><td>" + String(counters.todayGranted) + " / " + String(counters.todayDenied) +
+         "</td><td>" + String(counters.weekGranted) + " / " + String(counters.weekDenied) +
+         "</td><td>" + String(counters.allGranted) + " / " + String(counters.allDenied) + "</td></tr>";
+}
+
+void handleStats(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /stats");
+  String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
+  html += "<title>Panel de Control</title>";
+  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+  html += "<style>body{font-family:Arial; text-align:center;} .card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px; display:inline-block; width:200px;}";
+  html += "input[type=password]{width:200px; padding:5px; margin:5px;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
+  html += "table{border-collapse:collapse; width:80%; margin:20px auto;} th,td{border:1px solid #ddd; padding:8px;} th{background:#4CAF50; color:white;}";
+  html += ".bars{display:flex; align-items:flex-end; justify-content:center; height:120px;} .bar{width:20px; margin:1px; background:#4CAF50;}";
+  html += "</style></head><body>";
+  html += "<h1>Estadísticas de Accesos</h1>";
+
+  // Como en /log, la contraseña va en el cuerpo del POST y no queda en la URL
+  if (!checkApiPassword(request, true)) {
+    html += "<div class='card'><form action='/stats' method='POST'>";
+    html += "<input type='password' name='password' placeholder='Contraseña'>";
+    html += "<button type='submit'>Ver</button></form></div>";
+    if (request->hasParam("password", true)) html += "<p style='color:red;'>Contraseña incorrecta</p>";
+  } else {
+    xSemaphoreTake(logMutex, portMAX_DELAY);
+    html += "<div class='card'><h2>Intrusiones</h2>Hoy: " + String(accessStats.intrusionsToday) +
+            "<br>Semana: " + String(accessStats.intrusionsWeek) + "<br>Total: " + String(accessStats.intrusionsAll) + "</div>";
+    uint32_t raw, stored;
+    int compressed = logArchiveTotals(raw, stored);
+    html += "<div class='card'><h2>Archivo</h2>Segmentos: " + String(compressed) + " de " + String(logSegmentCount) +
+            " comprimidos<br>" + String(raw / 1024) + " KB en " + String(stored / 1024) + " KB";
+    if (stored > 0) html += " (" + String((float)raw / stored) + "x)";
+    html += "</div>";
+
+    html += "<h2>Por Método (concedidos / denegados)</h2>";
+    html += "<table><tr><th>Método</th><th>Hoy</th><th>Semana</th><th>Total</th></tr>";
+    for (int i = 0; i < LOG_METHOD_COUNT; i++) html += statsCountersRow(LOG_METHOD_NAMES[i], accessStats.methods[i]);
+    html += "</table>";
+
+    html += "<h2>Por Usuario (concedidos / denegados)</h2>";
+    html += "<table><tr><th>Usuario</th><th>Hoy</th><th>Semana</th><th>Total</th></tr>";
+    {
+      UserSnapshot users;
+      for (int i = 0; i < users.size(); i++) {
+        AccessCounters* counters = statsUserCounters(users[i].name.c_str(), false);
+        if (counters) html += statsCountersRow(htmlEscape(users[i].name), *counters);
       }
+    }
+    AccessCounters* unknown = statsUserCounters("N/A", false);
+    if (unknown) html += statsCountersRow("Sin usuario", *unknown);
+    if (accessStats.overflow.allGranted + accessStats.overflow.allDenied > 0) html += statsCountersRow("Otros", accessStats.overflow);
+    html += "</table>";
 
-      if (authorized) {
-        relayState = true;
-        digitalWrite(RELAY_PIN, HIGH);
-        relayTimerEnd = millis() + 10000;
-        logAccess("TELEGRAM", enteredPin, "Acceso concedido", userName);
-        sendTelegramNotification("[ACCESO] Concedido por Telegram para *" + userName + "*.", chat_id);
-        Serial.println("[TELEGRAM] Acceso concedido para: " + userName);
+    html += "<h2>Tráfico por Hora (hoy)</h2><div class='bars'>";
+    uint32_t peak = 1;
+    for (int h = 0; h < 24; h++) peak = max(peak, accessStats.hourToday[h]);
+    for (int h = 0; h < 24; h++) {
+      html += "<div class='bar' title='" + String(h) + ":00 - " + String(accessStats.hourToday[h]) + "' style='height:" +
+              String(accessStats.hourToday[h] * 100 / peak) + "%;'></div>";
+    }
+    html += "</div>";
+    xSemaphoreGive(logMutex);
+  }
+  html += "<p><a href='/'><button>Volver al Inicio</button></a></p>";
+  html += "</body></html>";
+  request->send(200, "text/html", html);
+}
+
+void handleStatsApi(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /api/stats");
+  if (!checkApiPassword(request)) {
+    request->send(401, "application/json", "{\"error\":\"Contraseña incorrecta\"}");
+    return;
+  }
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  String json = "{\"intrusiones\":{\"hoy\":" + String(accessStats.intrusionsToday) + ",\"semana\":" +
+                String(accessStats.intrusionsWeek) + ",\"total\":" + String(accessStats.intrusionsAll) + "},\"metodos\":{";
+  for (int i = 0; i < LOG_METHOD_COUNT; i++) {
+    if (i > 0) json += ",";
+    json += "\"" + String(LOG_METHOD_NAMES[i]) + "\":" + statsCountersJson(accessStats.methods[i]);
+  }
+  json += "},\"usuarios\":{";
+  bool first = true;
+  {
+    UserSnapshot users;
+    for (int i = 0; i < users.size(); i++) {
+      AccessCounters* counters = statsUserCounters(users[i].name.c_str(), false);
+      if (!counters) continue;
+      if (!first) json += ",";
+      first = false;
+      json += "\"" + jsonEscape(users[i].name) + "\":" + statsCountersJson(*counters);
+    }
+  }
+  json += "},\"otros\":" + statsCountersJson(accessStats.overflow);
+  for (int pass = 0; pass < 2; pass++) {
+    const uint32_t* hours = pass == 0 ? accessStats.hourToday : accessStats.hourAll;
+    json += pass == 0 ? ",\"horas_hoy\":[" : ",\"horas_total\":[";
+    for (int h = 0; h < 24; h++) {
+      if (h > 0) json += ",";
+      json += String(hours[h]);
+    }
+    json += "]";
+  }
+  json += ",\"archivo\":" + logArchiveJson();
+  json += ",\"mqtt\":" + mqttStatsJson();
+  json += ",\"tuberia\":" + accessPipelineJson();
+  json += ",\"energia\":{\"modo\":\"" + String(POWER_MODE_NAMES[POWER_MODE]) + "\",\"espera_pct\":" + String(100.0f * powerSleptMs / std::max(1UL, millis())) + "}}";
+  xSemaphoreGive(logMutex);
+  request->send(200, "application/json", json);
+}
+
+// === REGISTRO DE TRAZAS (CAJA NEGRA) ===
+
+const char* resetReasonName(esp_reset_reason_t reason) {
+  switch (reason) {
+    case ESP_RST_POWERON: return "Encendido";
+    case ESP_RST_EXT: return "Pin externo";
+    case ESP_RST_SW: return "Software";
+    case ESP_RST_PANIC: return "Pánico";
+    case ESP_RST_INT_WDT: return "Watchdog de interrupciones";
+    case ESP_RST_TASK_WDT: return "Watchdog de tareas";
+    case ESP_RST_WDT: return "Otro watchdog";
+    case ESP_RST_DEEPSLEEP: return "Salida de sueño profundo";
+    case ESP_RST_BROWNOUT: return "Caída de tensión";
+    case ESP_RST_SDIO: return "SDIO";
+    default: return "Desconocido";
+  }
+}
+
+// Tras un encendido la memoria RTC contiene basura; en cualquier otro reinicio
+// se conservan los eventos anteriores y se añade uno de arranque
+void initTrace() {
+  lastResetReason = esp_reset_reason();
+  if (traceRing.magic != TRACE_MAGIC || lastResetReason == ESP_RST_POWERON) {
+    memset(&traceRing, 0, sizeof(traceRing));
+    traceRing.magic = TRACE_MAGIC;
+  }
+  traceRing.boots++;
+  trace(TRACE_BOOT, lastResetReason);
+  Serial.println("[TRAZA] Motivo del reinicio: " + String(resetReasonName(lastResetReason)) +
+                 " (arranque " + String(traceRing.boots) + ")");
+}
+
+// Apenas un cerrojo de pocos ciclos y cuatro escrituras: apto para el camino
+// crítico y para cualquier tarea
+void trace(TraceId id, uint16_t arg) {
+  uint32_t ms = millis();
+  portENTER_CRITICAL(&traceMux);
+  TraceEvent& event = traceRing.events[traceRing.head & (TRACE_CAPACITY - 1)];
+  traceRing.head++;
+  event.ms = ms;
+  event.id = id;
+  event.boot = traceRing.boots;
+  event.arg = arg;
+  portEXIT_CRITICAL(&traceMux);
+}
+
+void handleDebugTrace(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /debug/trace");
+  if (!checkApiPassword(request)) {
+    request->send(401, "text/plain", "Contraseña incorrecta");
+    return;
+  }
+
+  // Copia estable del anillo antes de formatear
+  std::unique_ptr<TraceEvent[]> events(new (std::nothrow) TraceEvent[TRACE_CAPACITY]);
+  if (!events) {
+    request->send(503, "text/plain", "Memoria insuficiente");
+    return;
+  }
+  portENTER_CRITICAL(&traceMux);
+  uint32_t head = traceRing.head;
+  uint32_t boots = traceRing.boots;
+  memcpy(events.get(), traceRing.events, sizeof(traceRing.events));
+  portEXIT_CRITICAL(&traceMux);
+
+  String text = "Motivo del último reinicio: " + String(resetReasonName(lastResetReason)) + "\n";
+  text += "Arranques desde el encendido: " + String(boots) + "\n";
+  text += "Heap libre: " + String(ESP.getFreeHeap()) + " (mínimo " + String(ESP.getMinFreeHeap()) +
+          "), mayor bloque: " + String(ESP.getMaxAllocHeap()) + "\n";
+  text += "Eventos: " + String(min<uint32_t>(head, TRACE_CAPACITY)) + " de " + String(head) + "\n";
+  text += "arranque\tms\tevento\targ\n";
+  for (uint32_t i = head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0; i < head; i++) {
+    const TraceEvent& event = events[i & (TRACE_CAPACITY - 1)];
+    text += String(event.boot) + "\t" + String(event.ms) + "\t";
+    text += event.id < TRACE_ID_COUNT ? TRACE_NAMES[event.id] : "?";
+    text += "\t" + String(event.arg) + "\n";
+  }
+  AsyncWebServerResponse *response = request->beginResponse(200, "text/plain; charset=utf-8", text);
+  response->addHeader("Content-Disposition", "attachment; filename=trace.txt");
+  request->send(response);
+}
+
+// === CONSULTAS POR TELEGRAM ===
+// Todas se responden con lo que ya está en memoria (historial, contadores,
+// tabla de usuarios): leer la SD aquí bloquearía loop() y el lector RFID.
+
+// Corta el texto por líneas en mensajes que Telegram acepte; el teclado va en el
+// último. Con messageId se reescribe el mensaje de la página anterior.
+void sendTelegramChunked(const String& chatId, const String& text, const String& keyboard, int messageId) {
+  unsigned int start = 0;
+  while (start < text.length()) {
+    unsigned int end = text.length();
+    if (end - start > TELEGRAM_MESSAGE_MAX) {
+      end = start + TELEGRAM_MESSAGE_MAX;
+      int newline = text.lastIndexOf('\n', end - 1);
+      if (newline > (int)start) {
+        end = newline + 1;
       } else {
-        logAccess("TELEGRAM", enteredPin, "Acceso denegado", userName);
-        sendTelegramNotification("PIN incorrecto o inválido para *" + userName + "*. Acceso denegado.", chat_id);
-        Serial.println("[TELEGRAM] Acceso denegado para: " + userName + ", PIN: " + enteredPin);
+        while (end > start + 1 && ((uint8_t)text[end] & 0xC0) == 0x80) end--; // No partir un carácter UTF-8
       }
-      telegramState = IDLE;
     }
+    String chunk = text.substring(start, end);
+    bool last = end >= text.length();
+    trace(TRACE_TELEGRAM_SEND_START);
+    bool sent = last && keyboard.length() > 0 ? bot.sendMessageWithInlineKeyboard(chatId, chunk, "", keyboard, messageId)
+                                              : bot.sendMessage(chatId, chunk, "");
+    trace(TRACE_TELEGRAM_SEND_END, sent);
+    if (!sent) {
+      Serial.println("[TELEGRAM] Error al enviar respuesta a chat: " + chatId);
+      return;
+    }
+    start = end;
   }
 }
 
-void updateRGBStatus() {
-  static LEDState lastLEDState = RED;
-  static bool ledOn = false;
-  unsigned long currentMillis = millis();
-  LEDState newLEDState;
-  long blinkInterval = 0; // Intervalo dinámico según el estado
+// Teclado "Anterior / Siguiente"; el número de página se añade al prefijo
+String telegramPageKeyboard(const String& prefix, int page, int pages) {
+  if (pages <= 1) return "";
+  String keyboard = "[[";
+  if (page > 0) keyboard += "{\"text\":\"◀ Anterior\",\"callback_data\":\"" + prefix + String(page - 1) + "\"}";
+  if (page + 1 < pages) {
+    if (page > 0) keyboard += ",";
+    keyboard += "{\"text\":\"Siguiente ▶\",\"callback_data\":\"" + prefix + String(page + 1) + "\"}";
+  }
+  keyboard += "]]";
+  return keyboard;
+}
 
-  if (doorOpen && !relayState) {
-    newLEDState = BLINKING_RED;
-    blinkInterval = BLINK_INTERVAL_RED; // 200ms para rojo parpadeante
-    if (currentMillis - previousMillis >= blinkInterval) {
-      previousMillis = currentMillis;
-      ledOn = !ledOn;
-      if (ledOn) {
-        setLEDColor(strip.Color(255, 0, 0));
-      } else {
-        setLEDColor(strip.Color(0, 0, 0));
+String telegramCountersText(const AccessCounters& counters) {
+  return "Hoy: " + String(counters.todayGranted) + " / " + String(counters.todayDenied) +
+         "\nSemana: " + String(counters.weekGranted) + " / " + String(counters.weekDenied) +
+         "\nTotal: " + String(counters.allGranted) + " / " + String(counters.allDenied) + "\n";
+}
+
+// "Fecha,Método,ID,Usuario,Estado" en una línea legible
+String telegramLogLine(const char* line) {
+  String fields[5];
+  if (!logSplitLine(String(line), fields)) return String(line);
+  return fields[0] + " · " + fields[1] + " · " + fields[3] + " · " + fields[4];
+}
+
+void telegramLog(const String& chatId, int count, int page, int messageId) {
+  if (historyCount == 0) {
+    sendTelegramChunked(chatId, "No hay accesos registrados.");
+    return;
+  }
+  bool truncated = count > historyCount;
+  count = constrain(count, 1, historyCount);
+  int pages = (count + TELEGRAM_LOG_PAGE - 1) / TELEGRAM_LOG_PAGE;
+  page = constrain(page, 0, pages - 1);
+  String text = "Últimos " + String(count) + " accesos";
+  if (pages > 1) text += " (página " + String(page + 1) + "/" + String(pages) + ")";
+  text += ":\n\n";
+  for (int k = page * TELEGRAM_LOG_PAGE; k < min(count, (page + 1) * TELEGRAM_LOG_PAGE); k++) {
+    text += telegramLogLine(accessHistory[historyCount - 1 - k]) + "\n";
+  }
+  if (truncated) text += "\nEn memoria solo están los últimos " + String(historyCount) + "; el resto, en /log del panel web.";
+  sendTelegramChunked(chatId, text, telegramPageKeyboard("log:" + String(count) + ":", page, pages), messageId);
+}
+
+void telegramWho(const String& chatId, const String& name) {
+  if (name.length() == 0) {
+    sendTelegramChunked(chatId, "Uso: /who <usuario>");
+    return;
+  }
+  String text;
+  {
+    UserSnapshot users;
+    int index = -1;
+    for (int i = 0; i < users.size(); i++) {
+      if (name.equalsIgnoreCase(users[i].name)) {
+        index = i;
+        break;
       }
     }
-  } else if (!relayState) {
-    newLEDState = RED;
-    setLEDColor(strip.Color(255, 0, 0));
-  } else if (relayState && !doorOpen) {
-    newLEDState = GREEN;
-    blinkInterval = BLINK_INTERVAL_GREEN; // 300ms para verde parpadeante
-    if (currentMillis - previousMillis >= blinkInterval) {
-      previousMillis = currentMillis;
-      ledOn = !ledOn;
-      if (ledOn) {
-        setLEDColor(strip.Color(0, 255, 0));
-      } else {
-        setLEDColor(strip.Color(0, 0, 0));
+    if (index < 0) {
+      sendTelegramChunked(chatId, "Usuario " + name + " no encontrado.");
+      return;
+    }
+    const User& user = users[index];
+    text = "Usuario: " + user.name + "\n";
+    text += "Tarjeta: " + (user.requiresRFID() ? user.uid : String("no")) + "\n";
+    text += "PIN: " + String(user.requiresPin() ? "sí" : "no") + "\n";
+    text += "Horario: " + (user.schedule == SCHEDULE_UNKNOWN ? user.scheduleText + " (desconocido, sin acceso)" : String(scheduleName(user.schedule))) + "\n";
+
+    AccessCounters counters = {};
+    xSemaphoreTake(logMutex, portMAX_DELAY);
+    AccessCounters* found = statsUserCounters(user.name.c_str(), false);
+    if (found) counters = *found;
+    xSemaphoreGive(logMutex);
+    text += "\nAccesos (concedidos / denegados):\n" + telegramCountersText(counters);
+
+    for (int i = historyCount - 1; i >= 0; i--) {
+      String fields[5];
+      if (logSplitLine(String(accessHistory[i]), fields) && fields[3] == user.name) {
+        text += "\nÚltimo acceso reciente: " + telegramLogLine(accessHistory[i]) + "\n";
+        break;
       }
     }
+  }
+  sendTelegramChunked(chatId, text);
+}
+
+void telegramStats(const String& chatId) {
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  String text = "Intrusiones: hoy " + String(accessStats.intrusionsToday) + ", semana " +
+                String(accessStats.intrusionsWeek) + ", total " + String(accessStats.intrusionsAll) + "\n";
+  text += "\nPor método (concedidos / denegados):\n";
+  for (int i = 0; i < LOG_METHOD_COUNT; i++) {
+    const AccessCounters& counters = accessStats.methods[i];
+    if (counters.allGranted + counters.allDenied == 0) continue;
+    text += "\n" + String(LOG_METHOD_NAMES[i]) + "\n" + telegramCountersText(counters);
+  }
+  int busiest = 0;
+  for (int h = 1; h < 24; h++) {
+    if (accessStats.hourToday[h] > accessStats.hourToday[busiest]) busiest = h;
+  }
+  if (accessStats.hourToday[busiest] > 0) {
+    text += "\nHora con más tráfico hoy: " + String(busiest) + ":00 (" + String(accessStats.hourToday[busiest]) + " accesos)\n";
+  }
+  xSemaphoreGive(logMutex);
+  sendTelegramChunked(chatId, text);
+}
+
+void telegramStatus(const String& chatId) {
+  char timestamp[20];
+  getCurrentTime(timestamp, sizeof(timestamp));
+  unsigned long seconds = millis() / 1000;
+  String text = "Puerta: " + String(doorOpen ? "ABIERTA" : "CERRADA") + "\n";
+  text += "Relé: " + String(relayState ? "activo" : "inactivo");
+  if (relayState && relayTimerEnd > millis()) text += " (quedan " + String((relayTimerEnd - millis() + 999) / 1000) + " s)";
+  text += "\nHora: " + String(timestamp) + "\n";
+  text += "Encendido desde hace: " + String(seconds / 86400) + " d " + String(seconds / 3600 % 24) + " h " +
+          String(seconds / 60 % 60) + " min\n";
+  text += "Último reinicio: " + String(resetReasonName(lastResetReason)) + "\n";
+  text += "WiFi: " + WiFi.localIP().toString() + " (" + String(WiFi.RSSI()) + " dBm)\n";
+  text += "Memoria libre: " + String(ESP.getFreeHeap()) + " B (mínimo " + String(ESP.getMinFreeHeap()) + " B)\n";
+  {
+    UserSnapshot users;
+    text += "Usuarios: " + String(users.size()) + "\n";
+  }
+  text += "Índice del registro: " + String(logIndexReady ? "listo" : "no disponible") + "\n";
+  sendTelegramChunked(chatId, text);
+}
+
+void telegramUsers(const String& chatId, int page, int messageId) {
+  UserSnapshot users;
+  if (users.size() == 0) {
+    sendTelegramChunked(chatId, "No hay usuarios registrados.");
+    return;
+  }
+  int pages = (users.size() + TELEGRAM_USERS_PAGE - 1) / TELEGRAM_USERS_PAGE;
+  page = constrain(page, 0, pages - 1);
+  String text = "Usuarios (" + String(users.size()) + ")";
+  if (pages > 1) text += ", página " + String(page + 1) + "/" + String(pages);
+  text += ":\n\n";
+  for (int i = page * TELEGRAM_USERS_PAGE; i < min(users.size(), (page + 1) * TELEGRAM_USERS_PAGE); i++) {
+    const User& user = users[i];
+    text += String(i + 1) + ". " + user.name;
+    if (user.requiresRFID()) text += " · tarjeta";
+    if (user.requiresPin()) text += " · PIN";
+    if (user.schedule != 0) text += " · " + userScheduleName(user) + (user.schedule == SCHEDULE_UNKNOWN ? " (desconocido)" : "");
+    text += "\n";
+  }
+  sendTelegramChunked(chatId, text, telegramPageKeyboard("users:", page, pages), messageId);
+}
+
+// Devuelve true si el texto era una consulta y ya se ha respondido
+bool handleTelegramQuery(const String& chatId, const String& text) {
+  int space = text.indexOf(' ');
+  String command = space < 0 ? text : text.substring(0, space);
+  String argument = space < 0 ? "" : text.substring(space + 1);
+  argument.trim();
+  int at = command.indexOf('@'); // "/log@bot" en grupos
+  if (at > 0) command = command.substring(0, at);
+
+  if (command == "/log") {
+    telegramLog(chatId, argument.length() > 0 ? argument.toInt() : TELEGRAM_LOG_DEFAULT, 0, 0);
+  } else if (command == "/who") {
+    telegramWho(chatId, argument);
+  } else if (command == "/stats") {
+    telegramStats(chatId);
+  } else if (command == "/status") {
+    telegramStatus(chatId);
+  } else if (command == "/users") {
+    telegramUsers(chatId, 0, 0);
   } else {
-    newLEDState = YELLOW;
-    setLEDColor(strip.Color(255, 255, 0));
+    return false;
   }
+  Serial.println("[TELEGRAM] Consulta atendida: " + command);
+  return true;
+}
 
-  if (newLEDState != lastLEDState) {
-    switch (newLEDState) {
-      case RED:
-        Serial.println("[LED] Estado cambiado a Rojo (Acceso restringido)");
-        break;
-      case GREEN:
-        Serial.println("[LED] Estado cambiado a Verde Parpadeante (Acceso concedido)");
-        break;
-      case YELLOW:
-        Serial.println("[LED] Estado cambiado a Amarillo (Puerta abierta)");
-        break;
-      case BLINKING_RED:
-        Serial.println("[LED] Estado cambiado a Rojo Parpadeante (Intrusión detectada)");
-        break;
+// callback_data: "log:<n>:<página>" o "users:<página>"
+void handleTelegramCallback(const telegramMessage& message) {
+  bot.answerCallbackQuery(message.query_id);
+  const String& data = message.text;
+  if (data.startsWith("log:")) {
+    int colon = data.indexOf(':', 4);
+    if (colon < 0) return;
+    telegramLog(message.chat_id, data.substring(4, colon).toInt(), data.substring(colon + 1).toInt(), message.message_id);
+  } else if (data.startsWith("users:")) {
+    telegramUsers(message.chat_id, data.substring(6).toInt(), message.message_id);
+  }
+}
+
+// === AGRUPACIÓN DE NOTIFICACIONES ===
+
+void initNotifications() {
+  notifyMutex = xSemaphoreCreateMutex();
+  notifyDigestSince = millis();
+  notifyLastSend = millis();
+}
+
+// Cola de salida con prioridad; si se llena se descarta el mensaje menos
+// importante y más reciente
+void notifyEnqueue(NotifyPriority priority, const char* text) {
+  int slot = -1;
+  for (int i = 0; i < NOTIFY_OUTBOX && slot < 0; i++) {
+    if (!notifyOutbox[i].used) slot = i;
+  }
+  if (slot < 0) {
+    for (int i = 0; i < NOTIFY_OUTBOX; i++) {
+      const NotifyMessage& m = notifyOutbox[i];
+      if (m.priority > priority && (slot < 0 || m.priority > notifyOutbox[slot].priority ||
+                                    (m.priority == notifyOutbox[slot].priority && m.seq > notifyOutbox[slot].seq))) {
+        slot = i;
+      }
     }
-    lastLEDState = newLEDState;
-    currentLEDState = newLEDState;
+    notifyDropped++;
+    if (slot < 0) return;
   }
+  NotifyMessage& m = notifyOutbox[slot];
+  strlcpy(m.text, text, sizeof(m.text));
+  m.priority = priority;
+  m.seq = notifySeq++;
+  m.used = true;
 }
 
-void checkRelayTimer() {
-  if (relayState && relayTimerEnd > 0 && millis() >= relayTimerEnd) {
-    relayState = false;
-    digitalWrite(RELAY_PIN, LOW);
-    relayTimerEnd = 0;
-    Serial.println("[RELE] Temporizador finalizado - Acceso desactivado");
+// Cierra la ventana de un grupo y encola el resumen si hubo repeticiones
+void notifyCloseGroup(NotifyGroup& group, unsigned long now) {
+  if (group.repeats > 0) {
+    char text[MESSAGE_SIZE];
+    // El recuento incluye el primer evento, que ya salió al abrir la ventana
+    snprintf(text, sizeof(text), "[ACCESO] %u %s en %lu s", group.repeats + 1, group.summary, (now - group.since + 999) / 1000);
+    notifyEnqueue(NOTIFY_NORMAL, text);
   }
+  group.active = false;
 }
 
-void checkDoorStatus() {
-  static bool lastDoorState = false;
-  bool currentState = digitalRead(DOOR_SENSOR_PIN) == HIGH;
-  if (currentState != lastDoorState) {
-    doorOpen = currentState;
-    Serial.print("[PUERTA] Estado cambiado a: ");
-    Serial.println(doorOpen ? "ABIERTA" : "CERRADA");
-    if (doorOpen && !relayState) {
-      sendTelegramNotification("*🚨 ¡ALERTA DE INTRUSIÓN! 🚨*\nPuerta abierta sin autorización.");
-      logAccess("SENSOR", "N/A", "Intento de intrusión", "Ladrón");
+void notifyAddToDigest(const char* message) {
+  if (notifyDigestCount >= NOTIFY_DIGEST_LINES) {
+    notifyDigestOverflow++;
+    return;
+  }
+  char timestamp[20];
+  getCurrentTime(timestamp, sizeof(timestamp));
+  snprintf(notifyDigest[notifyDigestCount++], MESSAGE_SIZE, "%s %s", timestamp + 11, message); // Solo HH:MM:SS
+}
+
+// URGENT: se envía ya, sin esperar turno. Con clave (URGENT o NORMAL): el primer
+// evento se envía y los repetidos dentro de la ventana se cuentan para un único
+// resumen. LOW: al resumen periódico.
+void notifyEvent(NotifyPriority priority, const char* message, const char* key, const char* summary) {
+  if (priority == NOTIFY_URGENT && !key) {
+    sendTelegramNotification(message);
+    return;
+  }
+  bool sendNow = false;
+  xSemaphoreTake(notifyMutex, portMAX_DELAY);
+  if (priority == NOTIFY_LOW) {
+    notifyAddToDigest(message);
+  } else if (!key) {
+    notifyEnqueue(priority, message);
+  } else {
+    unsigned long now = millis();
+    NotifyGroup* group = nullptr;
+    NotifyGroup* oldest = &notifyGroups[0];
+    for (int i = 0; i < NOTIFY_GROUPS; i++) {
+      NotifyGroup& g = notifyGroups[i];
+      if (g.active && strcmp(g.key, key) == 0) group = &g;
+      if (!g.active || (oldest->active && g.since < oldest->since)) oldest = &g;
     }
-    lastDoorState = currentState;
+    if (group && now - group->since < NOTIFY_COALESCE_MS) {
+      if (group->repeats < UINT16_MAX) group->repeats++;
+    } else {
+      if (group) notifyCloseGroup(*group, now);
+      group = group ? group : oldest;
+      if (group->active) notifyCloseGroup(*group, now);
+      strlcpy(group->key, key, sizeof(group->key));
+      strlcpy(group->summary, summary ? summary : message, sizeof(group->summary));
+      group->since = now;
+      group->repeats = 0;
+      group->active = true;
+      if (priority == NOTIFY_URGENT) sendNow = true;
+      else notifyEnqueue(priority, message);
+    }
+  }
+  xSemaphoreGive(notifyMutex);
+  if (sendNow) sendTelegramNotification(message); // Fuera del cerrojo: bloquea cientos de ms
+}
+
+// Llamado desde loop(): cierra ventanas vencidas, prepara el resumen y envía
+// como mucho un mensaje por intervalo, primero los de mayor prioridad
+void updateNotifications() {
+  unsigned long now = millis();
+  char* digest = notifyDigestText;
+  size_t used = 0;
+  char text[MESSAGE_SIZE] = "";
+  xSemaphoreTake(notifyMutex, portMAX_DELAY);
+  for (int i = 0; i < NOTIFY_GROUPS; i++) {
+    if (notifyGroups[i].active && now - notifyGroups[i].since >= NOTIFY_COALESCE_MS) notifyCloseGroup(notifyGroups[i], now);
+  }
+  if (now - notifyDigestSince >= NOTIFY_DIGEST_MS) {
+    if (notifyDigestCount > 0) {
+      // Cabe entero: cada línea ocupa como mucho MESSAGE_SIZE con su salto
+      used = snprintf(digest, sizeof(notifyDigestText), "[RESUMEN] %d eventos en los últimos %lu min:\n",
+                      notifyDigestCount + notifyDigestOverflow, NOTIFY_DIGEST_MS / 60000);
+      for (int i = 0; i < notifyDigestCount; i++) {
+        used += snprintf(digest + used, sizeof(notifyDigestText) - used, "%s\n", notifyDigest[i]);
+      }
+      if (notifyDigestOverflow > 0) {
+        used += snprintf(digest + used, sizeof(notifyDigestText) - used, "... y %d más", notifyDigestOverflow);
+      }
+    }
+    notifyDigestCount = 0;
+    notifyDigestOverflow = 0;
+    notifyDigestSince = now;
+  }
+  if (used == 0 && now - notifyLastSend >= NOTIFY_SEND_INTERVAL_MS) {
+    int next = -1;
+    for (int i = 0; i < NOTIFY_OUTBOX; i++) {
+      const NotifyMessage& m = notifyOutbox[i];
+      if (m.used && (next < 0 || m.priority < notifyOutbox[next].priority ||
+                     (m.priority == notifyOutbox[next].priority && m.seq < notifyOutbox[next].seq))) {
+        next = i;
+      }
+    }
+    if (next >= 0) {
+      strlcpy(text, notifyOutbox[next].text, sizeof(text));
+      notifyOutbox[next].used = false;
+    }
+  }
+  xSemaphoreGive(notifyMutex);
+
+  // El envío bloquea cientos de ms: siempre fuera del cerrojo
+  if (used > 0) {
+    sendTelegramNotification(digest);
+    notifyLastSend = millis();
+  } else if (text[0] != '\0') {
+    sendTelegramNotification(text);
+    notifyLastSend = millis();
   }
 }
 
-void blinkLED(int times) {
-  targetBlinks = times;
-  blinkCount = 0;
-  ledState = false;
-  lastBlink = millis();
+// === FLUJO DE EVENTOS MQTT ===
+
+void mqttOnConnect(bool sessionPresent) {
+  xSemaphoreTake(mqttMutex, portMAX_DELAY);
+  mqttConnected = true;
+  mqttConnecting = false;
+  mqttAnnounce = true;
+  mqttRetryMs = MQTT_RETRY_MIN_MS;
+  uint32_t pending = mqttHead - mqttSent;
+  xSemaphoreGive(mqttMutex);
+  Serial.printf("[MQTT] Conectado a %s:%u (%lu B pendientes)\n", MQTT_HOST, MQTT_PORT, (unsigned long)pending);
+  powerWake();
 }
 
-void handleRoot(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud recibida para /");
-  String html = "<!DOCTYPE html><html lang='es'><head>";
-  html += "<meta charset='UTF-8'>";
-  html += "<title>Panel de Control</title>";
-  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-  html += "<style>body{font-family:Arial; text-align:center;} .card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px; display:inline-block; width:200px;}";
-  html += "input[type=number],input[type=text]{width:100px; padding:5px; margin:5px;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
-  html += "table{border-collapse:collapse; width:80%; margin:20px auto;} th,td{border:1px solid #ddd; padding:8px;} th{background:#4CAF50; color:white;}";
-  html += "</style>";
-  html += "<meta http-equiv='refresh' content='4'></head><body>";
-  html += "<h1>Control de Acceso ESP32</h1>";
-  html += "<div class='card'><h2>Estado de la Puerta</h2><div style='color:" + String(doorOpen ? "red" : "green") + ";font-size:24px;'>" + String(doorOpen ? "ABIERTA" : "CERRADA") + "</div></div>";
-  html += "<div class='card'><h2>Temporizador de Acceso</h2>";
-  html += "<input type='number' id='timerInput' min='1' max='3600' placeholder='Segundos'>";
-  html += "<button onclick=\"window.location.href='/setTimer?time='+document.getElementById('timerInput').value;\">Activar Acceso</button></div>";
-  html += "<div class='card'><h2>Añadir Usuario</h2>";
-  html += "<a href='/addUser'><button>Añadir Nuevo Usuario</button></a></div>";
-  html += "<div class='card'><h2>Ingresar PIN</h2>";
-  html += "<a href='/enterPin'><button>Ingresar PIN</button></a></div>";
-  html += "<div class='card'><h2>Lista de Usuarios</h2>";
-  html += "<a href='/users'><button>Ver Usuarios</button></a></div>";
-  html += "<div><h2>Últimos Accesos</h2>";
-  html += "<table><tr><th>Fecha y Hora</th><th>Método</th><th>ID</th><th>Usuario</th><th>Estado</th></tr>";
-  int startIndex = max(0, historyCount - 15); // Start from the last 15 entries
-  for (int i = historyCount - 1; i >= startIndex; i--) {
-    int comma1 = accessHistory[i].indexOf(',');
-    int comma2 = accessHistory[i].indexOf(',', comma1 + 1);
-    int comma3 = accessHistory[i].indexOf(',', comma2 + 1);
-    int comma4 = accessHistory[i].indexOf(',', comma3 + 1);
-    String timestamp = accessHistory[i].substring(0, comma1);
-    String method = accessHistory[i].substring(comma1 + 1, comma2);
-    String id = accessHistory[i].substring(comma2 + 1, comma3);
-    String user = accessHistory[i].substring(comma3 + 1, comma4);
-    String status = accessHistory[i].substring(comma4 + 1);
-    html += "<tr><td>" + timestamp + "</td><td>" + method + "</td><td>" + id + "</td><td>" + user + "</td><td>" + status + "</td></tr>";
+// Lo enviado y no confirmado vuelve a la cola: puede llegar dos veces, nunca ninguna
+void mqttOnDisconnect(AsyncMqttClientDisconnectReason reason) {
+  xSemaphoreTake(mqttMutex, portMAX_DELAY);
+  if (mqttConnected) mqttReconnects++;
+  mqttConnected = false;
+  mqttConnecting = false;
+  mqttSession++;
+  mqttSent = mqttAcked;
+  mqttInflightCount = 0;
+  mqttRetryAt = millis() + mqttRetryMs;
+  unsigned long retry = mqttRetryMs;
+  mqttRetryMs = std::min(mqttRetryMs * 2, MQTT_RETRY_MAX_MS);
+  xSemaphoreGive(mqttMutex);
+  Serial.printf("[MQTT] Desconectado (motivo %d), reintento en %lu s\n", (int)reason, retry / 1000);
+  powerWake();
+}
+
+// Las confirmaciones llegan en orden, pero se marcan por identificador y el
+// anillo solo avanza por el prefijo confirmado
+void mqttOnPublish(uint16_t packetId) {
+  xSemaphoreTake(mqttMutex, portMAX_DELAY);
+  for (int i = 0; i < mqttInflightCount; i++) {
+    MqttInflight& m = mqttInflight[(mqttInflightFirst + i) % MQTT_INFLIGHT];
+    if (m.packetId == packetId) m.acked = true;
   }
-  html += "</table></div>";
-  html += "</body></html>";
-  request->send(200, "text/html", html);
+  while (mqttInflightCount > 0 && mqttInflight[mqttInflightFirst].acked) {
+    uint32_t end = mqttInflight[mqttInflightFirst].end;
+    if ((int32_t)(end - mqttAcked) > 0) mqttAcked = end;
+    mqttInflightFirst = (mqttInflightFirst + 1) % MQTT_INFLIGHT;
+    mqttInflightCount--;
+  }
+  xSemaphoreGive(mqttMutex);
+  powerWake();
 }
 
-void handleSetTimer(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud recibida para /setTimer");
-  if (request->hasParam("time")) {
-    String timeStr = request->getParam("time")->value();
-    int seconds = timeStr.toInt();
-    if (seconds > 0 && seconds <= 3600) {
-      relayState = true;
-      digitalWrite(RELAY_PIN, HIGH);
-      relayTimerEnd = millis() + (seconds * 1000UL);
-      logAccess("WEB", "N/A", "Acceso concedido", "N/A");
-      sendTelegramNotification("[WEB] Acceso concedido por " + String(seconds) + " segundos");
-    }
+void initMqtt() {
+  if (MQTT_HOST[0] == '\0') {
+    Serial.println("[MQTT] Sin broker configurado: flujo de eventos desactivado");
+    return;
   }
-  request->redirect("/");
+  mqttMutex = xSemaphoreCreateMutex();
+  mqttClient.setServer(MQTT_HOST, MQTT_PORT);
+  mqttClient.setClientId(MQTT_CLIENT_ID);
+  if (MQTT_USER[0]) mqttClient.setCredentials(MQTT_USER, MQTT_PASSWORD);
+  mqttClient.setWill(MQTT_STATUS_TOPIC, 1, true, "offline");
+  mqttClient.onConnect(mqttOnConnect);
+  mqttClient.onDisconnect(mqttOnDisconnect);
+  mqttClient.onPublish(mqttOnPublish);
+  mqttConnecting = true;
+  mqttClient.connect(); // No bloquea: el resultado llega por onConnect/onDisconnect
 }
 
-void handleAddUser(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud recibida para /addUser");
-  String html = "<!DOCTYPE html><html lang='es'><head>";
-  html += "<meta charset='UTF-8'>";
-  html += "<title>Panel de Control</title>";
-  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-  html += "<style>";
-  html += "body { font-family: Arial, sans-serif; text-align: center; margin: 20px; }";
-  html += ".card { background: #f5f5f5; border-radius: 10px; padding: 20px; margin: 20px auto; max-width: 400px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }";
-  html += "label { display: block; margin: 10px 0 5px; font-weight: bold; }";
-  html += "input[type=text], input[type=number] { width: 100%; padding: 8px; margin: 5px 0; border: 1px solid #ccc; border-radius: 4px; box-sizing: border-box; }";
-  html += "input[type=checkbox] { margin: 10px 5px; }";
-  html += "button { padding: 10px 20px; background: #4CAF50; color: white; border: none; border-radius: 5px; cursor: pointer; margin-top: 10px; }";
-  html += "button:hover { background: #45a049; }";
-  html += "p { color: #555; }";
-  html += "</style></head><body>";
-  html += "<h1>Añadir Nuevo Usuario</h1>";
-  html += "<div class='card'>";
-  html += "<form action='/addUser' method='POST'>";
-  html += "<label for='name'>Nombre:</label>";
-  html += "<input type='text' id='name' name='name' placeholder='Nombre del usuario' required><br>";
-  html += "<label>Métodos de autenticación:</label><br>";
-  html += "<input type='checkbox' id='usePin' name='usePin' checked>";
-  html += "<label for='usePin'>Usar PIN</label><br>";
-  html += "<input type='number' id='pinField' name='pin' placeholder='PIN (4 dígitos)' min='0000' max='9999'><br>";
-  html += "<input type='checkbox' id='useRFID' name='useRFID'>";
-  html += "<label for='useRFID'>Usar RFID</label><br>";
-  html += "<p id='rfidInfo' style='display:none;'>Pase la tarjeta RFID después de enviar el formulario.</p>";
-  html += "<button type='submit'>Registrar Usuario</button>";
-  html += "</form>";
-  html += "<a href='/'><button type='button'>Volver</button></a>";
-  html += "</div>";
-  html += "<script>";
-  html += "document.getElementById('usePin').addEventListener('change', function() {";
-  html += "  document.getElementById('pinField').disabled = !this.checked;";
-  html += "  if (!this.checked && !document.getElementById('useRFID').checked) {";
-  html += "    document.getElementById('useRFID').checked = true;";
-  html += "    document.getElementById('rfidInfo').style.display = 'block';";
-  html += "  }";
-  html += "});";
-  html += "document.getElementById('useRFID').addEventListener('change', function() {";
-  html += "  document.getElementById('rfidInfo').style.display = this.checked ? 'block' : 'none';";
-  html += "  if (!this.checked && !document.getElementById('usePin').checked) {";
-  html += "    document.getElementById('usePin').checked = true;";
-  html += "    document.getElementById('pinField').disabled = false;";
-  html += "  }";
-  html += "});";
-  html += "</script>";
-  html += "</body></html>";
-  request->send(200, "text/html", html);
+// Añade "clave":"valor" al objeto en construcción, escapando el valor; lo que no
+// cabe se recorta para que el JSON siga siendo válido
+void mqttField(char* out, size_t size, int& length, const char* key, const char* value) {
+  int start = length;
+  int n = snprintf(out + start, size - start, "%s\"%s\":\"", start > 0 ? "," : "", key);
+  if (n < 0 || start + n + 2 > (int)size) {
+    out[start] = '\0';
+    return;
+  }
+  length += n;
+  for (const char* p = value; *p; p++) {
+    char c = (uint8_t)*p < 0x20 ? ' ' : *p;
+    bool escape = c == '"' || c == '\\';
+    if (length + (escape ? 2 : 1) + 2 > (int)size) break; // Sitio para la comilla y el '\0'
+    if (escape) out[length++] = '\\';
+    out[length++] = c;
+  }
+  out[length++] = '"';
+  out[length] = '\0';
 }
 
-void handleAddUserPost(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud POST recibida para /addUser");
-  if (!request->hasParam("name", true)) {
-    Serial.println("[WEB] Error: Nombre no proporcionado");
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: Nombre obligatorio</h1><a href='/addUser'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
+// Encola un evento desde cualquier tarea. Si el anillo está lleno se descartan
+// los más antiguos: un corte largo pierde historia, no los últimos eventos
+void mqttEvent(MqttKind kind, const char* fields) {
+  if (!mqttMutex) return;
+  char event[MQTT_EVENT_MAX];
+  xSemaphoreTake(mqttMutex, portMAX_DELAY);
+  int length = snprintf(event, sizeof(event), "{\"seq\":%lu,\"arranque\":%lu,\"ts\":%ld,\"tipo\":\"%s\",",
+                        (unsigned long)mqttSeq + 1, (unsigned long)traceRing.boots, (long)time(nullptr),
+                        MQTT_KIND_NAMES[kind]);
+  int fieldsLength = strlen(fields);
+  if (length < 0 || length + fieldsLength + 1 >= (int)sizeof(event)) {
+    mqttDropped++;
+    xSemaphoreGive(mqttMutex);
     return;
   }
+  memcpy(event + length, fields, fieldsLength);
+  length += fieldsLength;
+  event[length++] = '}';
+  mqttSeq++;
+  while (mqttHead - mqttAcked + length + 2 > MQTT_BUFFER_BYTES) {
+    mqttAcked += 2 + (uint8_t)mqttRing[(mqttAcked + 1) % MQTT_BUFFER_BYTES];
+    mqttDropped++;
+  }
+  if ((int32_t)(mqttAcked - mqttSent) > 0) mqttSent = mqttAcked;
+  mqttRing[mqttHead++ % MQTT_BUFFER_BYTES] = kind;
+  mqttRing[mqttHead++ % MQTT_BUFFER_BYTES] = (char)length;
+  for (int i = 0; i < length; i++) mqttRing[mqttHead++ % MQTT_BUFFER_BYTES] = event[i];
+  xSemaphoreGive(mqttMutex);
+  powerWake();
+}
 
-  String name = request->getParam("name", true)->value();
-  bool usePin = request->hasParam("usePin", true);
-  String pin = usePin ? request->getParam("pin", true)->value() : "";
-  bool useRFID = request->hasParam("useRFID", true);
+void mqttRelayEvent(bool on, const char* method) {
+  if (!mqttMutex) return;
+  char fields[MQTT_FIELDS_MAX];
+  int used = 0;
+  mqttField(fields, sizeof(fields), used, "estado", on ? "on" : "off");
+  if (method) mqttField(fields, sizeof(fields), used, "metodo", method);
+  mqttEvent(MQTT_RELAY, fields);
+}
 
-  if (!usePin && !useRFID) {
-    Serial.println("[WEB] Error: No se seleccionó ningún método de autenticación");
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: Seleccione al menos un método de autenticación</h1><a href='/addUser'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
+// Llamado en cada vuelta de loop(): reconecta con espera creciente y publica lo
+// pendiente. Un mensaje lleva los eventos seguidos del mismo tipo que quepan en
+// MQTT_BATCH_BYTES; con QoS 1 se publican hasta MQTT_INFLIGHT sin esperar a las
+// confirmaciones, así que en una ráfaga los eventos se van juntando solos
+void updateMqtt() {
+  if (!mqttMutex) return;
+  xSemaphoreTake(mqttMutex, portMAX_DELAY);
+  bool connected = mqttConnected;
+  bool reconnect = !mqttConnected && !mqttConnecting && (long)(millis() - mqttRetryAt) >= 0;
+  if (reconnect) mqttConnecting = true;
+  bool announce = mqttAnnounce;
+  mqttAnnounce = false;
+  xSemaphoreGive(mqttMutex);
+
+  if (reconnect) {
+    if (WiFi.status() == WL_CONNECTED) {
+      mqttClient.connect();
+    } else {
+      mqttOnDisconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+    }
     return;
   }
+  if (!connected) return;
+  if (announce) mqttClient.publish(MQTT_STATUS_TOPIC, 1, true, "online");
 
-  if (usePin && (pin.length() != 4 || pin.toInt() < 0 || pin.toInt() > 9999)) {
-    Serial.println("[WEB] Error: PIN inválido");
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: PIN debe ser de 4 dígitos</h1><a href='/addUser'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
-    return;
+  // Con QoS 0 no hay confirmaciones que frenen: como mucho MQTT_INFLIGHT mensajes por vuelta
+  for (int round = 0; round < MQTT_INFLIGHT; round++) {
+    xSemaphoreTake(mqttMutex, portMAX_DELAY);
+    if (mqttSent == mqttHead || mqttInflightCount >= MQTT_INFLIGHT) {
+      xSemaphoreGive(mqttMutex);
+      break;
+    }
+    uint32_t session = mqttSession;
+    uint32_t pos = mqttSent;
+    uint8_t kind = mqttRing[pos % MQTT_BUFFER_BYTES];
+    int length = 0;
+    int events = 0;
+    mqttBatch[length++] = '[';
+    while (pos != mqttHead && (uint8_t)mqttRing[pos % MQTT_BUFFER_BYTES] == kind) {
+      int eventLength = (uint8_t)mqttRing[(pos + 1) % MQTT_BUFFER_BYTES];
+      if (length + (events > 0 ? 1 : 0) + eventLength + 1 > MQTT_BATCH_BYTES) break; // +1: el ']'
+      if (events > 0) mqttBatch[length++] = ',';
+      for (int i = 0; i < eventLength; i++) mqttBatch[length++] = mqttRing[(pos + 2 + i) % MQTT_BUFFER_BYTES];
+      pos += 2 + eventLength;
+      events++;
+    }
+    mqttBatch[length++] = ']';
+    xSemaphoreGive(mqttMutex);
+
+    // El cliente copia el mensaje; 0 = sin conexión o sin sitio en su cola
+    uint16_t packetId = mqttClient.publish(MQTT_TOPICS[kind], MQTT_QOS, false, mqttBatch, length);
+
+    xSemaphoreTake(mqttMutex, portMAX_DELAY);
+    bool sent = packetId != 0 && session == mqttSession;
+    if (sent) {
+      mqttSent = pos;
+      if ((int32_t)(mqttAcked - mqttSent) > 0) mqttSent = mqttAcked;
+      if (MQTT_QOS == 0) {
+        if ((int32_t)(pos - mqttAcked) > 0) mqttAcked = pos;
+      } else {
+        mqttInflight[(mqttInflightFirst + mqttInflightCount) % MQTT_INFLIGHT] = {packetId, pos, false};
+        mqttInflightCount++;
+      }
+      mqttMessages++;
+      mqttEventsSent += events;
+    }
+    xSemaphoreGive(mqttMutex);
+    if (!sent) break;
   }
+}
 
-  tempName = name;
-  tempPin = pin;
-  tempUID = "";
+String mqttStatsJson() {
+  if (!mqttMutex) return "null";
+  xSemaphoreTake(mqttMutex, portMAX_DELAY);
+  String json = "{\"conectado\":" + String(mqttConnected ? "true" : "false") + ",\"qos\":" + String(MQTT_QOS) +
+                ",\"eventos\":" + String(mqttSeq) + ",\"enviados\":" + String(mqttEventsSent) +
+                ",\"mensajes\":" + String(mqttMessages) + ",\"pendientes_bytes\":" + String(mqttHead - mqttAcked) +
+                ",\"descartados\":" + String(mqttDropped) + ",\"reconexiones\":" + String(mqttReconnects) + "}";
+  xSemaphoreGive(mqttMutex);
+  return json;
+}
 
-  if (useRFID) {
-    waitingForRFID = true;
-    rfidTimeout = millis() + RFID_TIMEOUT_MS;
-    Serial.println("[WEB] Esperando tarjeta RFID para usuario: " + name);
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;}</style>";
-    html += "</head><body><h1>Escanea la tarjeta RFID ahora</h1><p>Tiempo restante: 30 segundos</p><script>setTimeout(() => {window.location.href='/users'}, 30000);</script></body></html>";
-    request->send(200, "text/html", html);
+// === COMPRESIÓN DEFLATE ===
+// El tdefl de miniz que trae la ROM del ESP32 necesita más de 200 KB de heap;
+// este compresor ocupa unos 22 KB. Con ventana pequeña y códigos fijos
+// comprime algo menos que zlib, pero el registro repite tanto (fechas,
+// métodos, nombres, UIDs) que la diferencia es pequeña.
+
+void deflatePutBits(Deflater& d, uint32_t value, int count) {
+  d.bits |= value << d.bitCount;
+  d.bitCount += count;
+  while (d.bitCount >= 8) {
+    d.out[d.outLen++] = d.bits & 0xFF;
+    d.bits >>= 8;
+    d.bitCount -= 8;
+  }
+}
+
+// Los códigos Huffman van con el bit más significativo primero
+void deflatePutCode(Deflater& d, uint32_t code, int length) {
+  uint32_t reversed = 0;
+  for (int i = 0; i < length; i++) {
+    reversed = (reversed << 1) | (code & 1);
+    code >>= 1;
+  }
+  deflatePutBits(d, reversed, length);
+}
+
+// Tabla fija de literales/longitudes (RFC 1951, 3.2.6)
+void deflatePutSymbol(Deflater& d, int symbol) {
+  if (symbol < 144) {
+    deflatePutCode(d, 0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    deflatePutCode(d, 0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    deflatePutCode(d, symbol - 256, 7);
   } else {
-    addUser(tempName, tempPin, tempUID);
-    sendTelegramNotification("[WEB] Nuevo usuario registrado: " + tempName);
-    request->redirect("/users");
+    deflatePutCode(d, 0xC0 + symbol - 280, 8);
   }
 }
 
-void handleEnterPin(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud recibida para /enterPin");
-  String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-  html += "<title>Panel de Control</title>";
-  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-  html += "<style>body{font-family:Arial; text-align:center;} .card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px; display:inline-block; width:300px;}";
-  html += "input[type=number]{width:200px; padding:5px; margin:5px;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
-  html += "</style></head><body>";
-  html += "<h1>Ingresar PIN</h1>";
-  html += "<div class='card'>";
-  html += "<form action='/enterPin' method='POST'>";
-  html += "<label>PIN (4 dígitos):</label><br><input type='number' name='pin' min='0000' max='9999' placeholder='Ingresar PIN' required><br>";
-  html += "<button type='submit'>Validar PIN</button>";
-  html += "</form>";
-  html += "<a href='/'><button type='button'>Volver</button></a>";
-  html += "</div>";
-  html += "</body></html>";
-  request->send(200, "text/html", html);
+void deflatePutMatch(Deflater& d, int length, int distance) {
+  int i = 28;
+  while (DEFLATE_LENGTH_BASE[i] > length) i--;
+  deflatePutSymbol(d, 257 + i);
+  deflatePutBits(d, length - DEFLATE_LENGTH_BASE[i], DEFLATE_LENGTH_EXTRA[i]);
+  int j = 29;
+  while (DEFLATE_DIST_BASE[j] > distance) j--;
+  deflatePutCode(d, j, 5);
+  deflatePutBits(d, distance - DEFLATE_DIST_BASE[j], DEFLATE_DIST_EXTRA[j]);
 }
 
-void handleEnterPinPost(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud POST recibida para /enterPin");
-  if (request->hasParam("pin", true)) {
-    String enteredPin = request->getParam("pin", true)->value();
-    String userName = "N/A";
-    bool authorized = false;
+uint32_t deflateHash(const uint8_t* p) {
+  uint32_t key = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+  return (uint32_t)(key * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
 
-    if (enteredPin.length() == 4 && enteredPin.toInt() >= 0 && enteredPin.toInt() <= 9999) {
-      for (int i = 0; i < numAuthorizedUsers; i++) {
-        if (enteredPin == authorizedUsers[i].pin) {
-          authorized = true;
-          userName = authorizedUsers[i].name;
-          break;
+void deflateInsert(Deflater& d, int position) {
+  uint32_t hash = deflateHash(d.window + position);
+  d.prev[position & (DEFLATE_WINDOW - 1)] = d.head[hash];
+  d.head[hash] = position;
+}
+
+// Codifica dejando DEFLATE_MAX_MATCH bytes sin tocar para que la siguiente
+// escritura pueda alargar la coincidencia; con final, hasta el último byte
+void deflateRun(Deflater& d, bool final) {
+  int limit = final ? d.fill : d.fill - DEFLATE_MAX_MATCH;
+  while (d.pos < limit) {
+    int available = d.fill - d.pos;
+    int best = 0, bestDistance = 0;
+    if (available >= DEFLATE_MIN_MATCH) {
+      int maxLength = min(available, DEFLATE_MAX_MATCH);
+      int candidate = d.head[deflateHash(d.window + d.pos)];
+      for (int chain = DEFLATE_MAX_CHAIN; candidate >= 0 && chain > 0; chain--) {
+        int distance = d.pos - candidate;
+        if (distance <= 0 || distance > DEFLATE_WINDOW) break;
+        if (d.window[candidate + best] == d.window[d.pos + best]) {
+          int length = 0;
+          while (length < maxLength && d.window[candidate + length] == d.window[d.pos + length]) length++;
+          if (length > best) {
+            best = length;
+            bestDistance = distance;
+            if (length == maxLength) break;
+          }
         }
+        int next = d.prev[candidate & (DEFLATE_WINDOW - 1)];
+        if (next >= candidate) break; // Entrada reutilizada por una posición más nueva
+        candidate = next;
       }
-      if (authorized) {
-        relayState = true;
-        digitalWrite(RELAY_PIN, HIGH);
-        relayTimerEnd = millis() + 10000;
-        logAccess("PIN", enteredPin, "Acceso concedido", userName);
-        sendTelegramNotification("[ACCESO] Concedido por PIN: " + userName);
-        request->redirect("/"); // Redirect to home page on successful PIN entry
-      } else {
-        logAccess("PIN", enteredPin, "Acceso denegado", userName);
-        sendTelegramNotification("[ACCESO] Denegado por PIN");
-        String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-        html += "<title>Panel de Control</title>";
-        html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-        html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-        html += "</head><body><h1>Acceso denegado</h1><p>PIN incorrecto.</p><a href='/enterPin'><button>Volver</button></a></body></html>";
-        request->send(200, "text/html", html);
+    }
+    if (best >= DEFLATE_MIN_MATCH) {
+      deflatePutMatch(d, best, bestDistance);
+      for (int i = 0; i < best; i++, d.pos++) {
+        if (d.pos + DEFLATE_MIN_MATCH <= d.fill) deflateInsert(d, d.pos);
       }
     } else {
-      String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-      html += "<title>Panel de Control</title>";
-      html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-      html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-      html += "</head><body><h1>Error: PIN debe ser de 4 dígitos</h1><a href='/enterPin'><button>Volver</button></a></body></html>";
-      request->send(200, "text/html", html);
+      deflatePutSymbol(d, d.window[d.pos]);
+      if (available >= DEFLATE_MIN_MATCH) deflateInsert(d, d.pos);
+      d.pos++;
     }
-  } else {
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: PIN no proporcionado</h1><a href='/enterPin'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
   }
 }
 
-void handleUsers(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud recibida para /users");
-  String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-  html += "<title>Panel de Control</title>";
-  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-  html += "<style>body{font-family:Arial; text-align:center;} .card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px; display:inline-block; width:300px;}";
-  html += "input[type=password]{width:200px; padding:5px; margin:5px;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
-  html += "</style></head><body>";
-  html += "<h1>Acceso a Lista de Usuarios</h1>";
-  html += "<div class='card'>";
-  html += "<form action='/users' method='POST'>";
-  html += "<label>Contraseña:</label><br><input type='password' name='password' required><br>";
-  html += "<button type='submit'>Acceder</button>";
-  html += "</form>";
-  html += "<a href='/'><button>Volver</button></a>";
-  html += "</div></body></html>";
-  request->send(200, "text/html", html);
+// Desplaza la ventana media vuelta cuando ya no caben más datos
+void deflateSlide(Deflater& d) {
+  memmove(d.window, d.window + DEFLATE_WINDOW, d.fill - DEFLATE_WINDOW);
+  d.fill -= DEFLATE_WINDOW;
+  d.pos -= DEFLATE_WINDOW;
+  for (int i = 0; i < (1 << DEFLATE_HASH_BITS); i++) d.head[i] = d.head[i] >= DEFLATE_WINDOW ? d.head[i] - DEFLATE_WINDOW : -1;
+  for (int i = 0; i < DEFLATE_WINDOW; i++) d.prev[i] = d.prev[i] >= DEFLATE_WINDOW ? d.prev[i] - DEFLATE_WINDOW : -1;
+}
+
+// Todo el flujo es un único bloque final con códigos fijos. Sus 3 bits de
+// cabecera quedan en el acumulador, así que quien llama puede añadir su propia
+// cabecera (gzip, zlib) a out justo después.
+void deflateBegin(Deflater& d) {
+  memset(d.head, 0xFF, sizeof(d.head));
+  memset(d.prev, 0xFF, sizeof(d.prev));
+  d.fill = d.pos = 0;
+  d.bits = 0;
+  d.bitCount = 0;
+  d.outLen = 0;
+  deflatePutBits(d, 1, 1); // BFINAL
+  deflatePutBits(d, 1, 2); // BTYPE = 01: Huffman fijo
+}
+
+void deflateWrite(Deflater& d, const uint8_t* data, int length) {
+  if (d.fill + length > 2 * DEFLATE_WINDOW) deflateSlide(d);
+  memcpy(d.window + d.fill, data, length);
+  d.fill += length;
+  deflateRun(d, false);
+}
+
+void deflateFinish(Deflater& d) {
+  deflateRun(d, true);
+  deflatePutSymbol(d, 256); // Fin de bloque
+  if (d.bitCount > 0) deflatePutBits(d, 0, 8 - d.bitCount);
+}
+
+// CRC-32 de gzip con una tabla de 16 entradas (medio byte por paso)
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length) {
+  static const uint32_t TABLE[16] = {0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4,
+                                     0x4DB26158, 0x5005713C, 0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+                                     0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    crc = (crc >> 4) ^ TABLE[crc & 15];
+    crc = (crc >> 4) ^ TABLE[crc & 15];
+  }
+  return ~crc;
+}
+
+// === EXPORTACIÓN COMPRIMIDA DEL REGISTRO ===
+
+LogExport::~LogExport() {
+  logExportActive = false;
+}
+
+void logExportFeed(LogExport& exp, const uint8_t* data, int length) {
+  deflateWrite(exp.deflater, data, length);
+  exp.crc = crc32Update(exp.crc, data, length);
+  for (int i = 0; i < length; i++) {
+    exp.adlerA = (exp.adlerA + data[i]) % 65521;
+    exp.adlerB = (exp.adlerB + exp.adlerA) % 65521;
+  }
+  exp.inputBytes += length;
+}
+
+// El registro está en orden de escritura: la primera línea posterior a la
+// fecha final termina la exportación
+void logExportLine(LogExport& exp) {
+  exp.line[exp.lineLength] = '\0';
+  int length = exp.lineLength;
+  exp.lineLength = 0;
+  if (logIsHeader(exp.line)) return; // Cada segmento archivado empieza con la cabecera
+  if (exp.from > 0 || exp.to < UINT32_MAX) {
+    uint32_t time = logParseTimestamp(exp.line);
+    if (time > exp.to) exp.stopped = true;
+    if (time == 0 || time < exp.from || time > exp.to) return;
+  }
+  logExportFeed(exp, (const uint8_t*)exp.line, length);
 }
 
-void handleUsersPost(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud POST recibida para /users");
-  if (request->hasParam("password", true)) {
-    String pwd = request->getParam("password", true)->value();
-    if (pwd == ADMIN_PASSWORD) {
-      String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-      html += "<title>Panel de Control</title>";
-      html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-      html += "<style>body{font-family:Arial; text-align:center;}";
-      html += ".card{background:#f2f2f2; border-radius:10px; padding:20px; margin:10px auto; max-width:600px;}";
-      html += "table{border-collapse:collapse; width:100%; margin:20px 0;} th,td{border:1px solid #ddd; padding:8px;}";
-      html += "th{background:#4CAF50; color:white;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}";
-      html += "button.delete{background:#ff4444;} button.delete:hover{background:#cc0000;}";
-      html += "</style></head><body>";
-      html += "<h1>Lista de Usuarios</h1>";
-      html += "<div class='card'>";
-      html += "<table><tr><th>Nombre</th><th>PIN</th><th>UID RFID</th><th>Acciones</th></tr>";
-      for (int i = 0; i < numAuthorizedUsers; i++) {
-        html += "<tr>";
-        html += "<td>" + authorizedUsers[i].name + "</td>";
-        html += "<td>" + (authorizedUsers[i].pin.length() > 0 ? authorizedUsers[i].pin : "N/A") + "</td>";
-        html += "<td>" + (authorizedUsers[i].uid.length() > 0 ? authorizedUsers[i].uid : "N/A") + "</td>";
-        html += "<td>";
-        html += "<a href='/editUser?index=" + String(i) + "'><button>Editar</button></a> ";
-        html += "<a href='/deleteUser?index=" + String(i) + "'><button class='delete'>Eliminar</button></a>";
-        html += "</td></tr>";
-      }
-      html += "</table>";
-      html += "<a href='/'><button>Volver</button></a>";
-      html += "</div></body></html>";
-      request->send(200, "text/html", html);
-    } else {
-      String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-      html += "<title>Panel de Control</title>";
-      html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-      html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-      html += "</head><body><h1>Contraseña incorrecta</h1><a href='/users'><button>Volver</button></a></body></html>";
-      request->send(200, "text/html", html);
+void logExportPutWord(Deflater& d, uint32_t value, bool bigEndian) {
+  for (int i = 0; i < 4; i++) d.out[d.outLen++] = (value >> (bigEndian ? 24 - 8 * i : 8 * i)) & 0xFF;
+}
+
+// Lee el siguiente trozo del registro (con logMutex solo durante la lectura),
+// lo filtra y lo comprime; al terminar cierra el flujo y añade la cola
+void logExportStep(LogExport& exp) {
+  if (exp.position < exp.end && !exp.stopped) {
+    xSemaphoreTake(logMutex, portMAX_DELAY);
+    configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+    int n = logRead(exp.reader, exp.position, exp.buffer, min<uint32_t>(DEFLATE_IN_MAX, exp.end - exp.position));
+    logReaderClose(exp.reader); // No se deja nada abierto: el registro vivo puede rotar entre trozos
+    xSemaphoreGive(logMutex);
+    if (n == 0) {
+      Serial.println("[EXPORT] Error al leer el registro; exportación truncada");
+      exp.stopped = true;
+      return;
     }
+    exp.position += n;
+    for (int i = 0; i < n && !exp.stopped; i++) {
+      exp.line[exp.lineLength++] = exp.buffer[i];
+      if (exp.buffer[i] == '\n' || exp.lineLength == LOG_LINE_MAX + 2) logExportLine(exp);
+    }
+    return;
+  }
+  Deflater& d = exp.deflater;
+  deflateFinish(d);
+  if (exp.gzip) {
+    logExportPutWord(d, exp.crc, false);
+    logExportPutWord(d, exp.inputBytes, false);
   } else {
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: Contraseña no proporcionada</h1><a href='/users'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
+    logExportPutWord(d, (exp.adlerB << 16) | exp.adlerA, true);
   }
+  exp.finished = true;
 }
 
-void handleEditUserGet(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud recibida para /editUser");
-  if (!request->hasParam("index")) {
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: Índice no proporcionado</h1><a href='/users'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
-    return;
+// Primer byte a exportar para la fecha inicial: búsqueda binaria en la lista
+// general del índice, que está en orden de escritura
+uint32_t logExportStartOffset(uint32_t from) {
+  uint32_t offset = 0;
+  File index = SD.open(LOG_INDEX_ALL, FILE_READ);
+  if (!index) return 0;
+  int32_t low = 0, high = index.size() / sizeof(LogPosting);
+  LogPosting posting;
+  while (low < high) {
+    int32_t mid = (low + high) / 2;
+    if (!index.seek(mid * sizeof(LogPosting)) || index.read((uint8_t*)&posting, sizeof(posting)) != sizeof(posting)) break;
+    if (posting.time < from) {
+      low = mid + 1;
+    } else {
+      high = mid;
+      offset = posting.offset;
+    }
   }
+  if (low >= (int32_t)(index.size() / sizeof(LogPosting))) offset = UINT32_MAX; // Nada a partir de esa fecha
+  index.close();
+  return offset;
+}
 
-  int index = request->getParam("index")->value().toInt();
-  if (index < 0 || index >= numAuthorizedUsers) {
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: Índice inválido</h1><a href='/users'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
+void handleLogExport(AsyncWebServerRequest *request) {
+  Serial.println("[WEB] Solicitud recibida para /api/export");
+  if (!checkApiPassword(request)) {
+    request->send(401, "application/json", "{\"error\":\"Contraseña incorrecta\"}");
     return;
   }
-
-  String html = "<!DOCTYPE html><html lang='es'><head>";
-  html += "<meta charset='UTF-8'>";
-  html += "<title>Panel de Control</title>";
-  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-  html += "<style>";
-  html += "body { font-family: Arial, sans-serif; text-align: center; margin: 20px; }";
-  html += ".card { background: #f5f5f5; border-radius: 10px; padding: 20px; margin: 20px auto; max-width: 400px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }";
-  html += "label { display: block; margin: 10px 0 5px; font-weight: bold; }";
-  html += "input[type=text], input[type=number] { width: 100%; padding: 8px; margin: 5px 0; border: 1px solid #ccc; border-radius: 4px; box-sizing: border-box; }";
-  html += "input[type=checkbox] { margin: 10px 5px; }";
-  html += "button { padding: 10px 20px; background: #4CAF50; color: white; border: none; border-radius: 5px; cursor: pointer; margin-top: 10px; }";
-  html += "button:hover { background: #45a049; }";
-  html += "p { color: #555; }";
-  html += "</style></head><body>";
-  html += "<h1>Editar Usuario</h1>";
-  html += "<div class='card'>";
-  html += "<form action='/editUser' method='POST'>";
-  html += "<input type='hidden' name='index' value='" + String(index) + "'>";
-  html += "<label for='name'>Nombre:</label>";
-  html += "<input type='text' id='name' name='name' value='" + authorizedUsers[index].name + "' required><br>";
-  html += "<label>Métodos de autenticación:</label><br>";
-  html += "<input type='checkbox' id='usePin' name='usePin' " + String(authorizedUsers[index].pin.length() > 0 ? "checked" : "") + ">";
-  html += "<label for='usePin'>Usar PIN</label><br>";
-  html += "<input type='number' id='pinField' name='pin' value='" + authorizedUsers[index].pin + "' placeholder='PIN (4 dígitos)' min='0000' max='9999'><br>";
-  html += "<input type='checkbox' id='useRFID' name='useRFID' " + String(authorizedUsers[index].uid.length() > 0 ? "checked" : "") + ">";
-  html += "<label for='useRFID'>Usar RFID</label><br>";
-  html += "<p id='rfidInfo' style='display:" + String(authorizedUsers[index].uid.length() > 0 ? "block" : "none") + ";'>Pase la tarjeta RFID después de enviar el formulario.</p>";
-  html += "<button type='submit'>Actualizar Usuario</button>";
-  html += "</form>";
-  html += "<a href='/users'><button type='button'>Volver</button></a>";
-  html += "</div>";
-  html += "<script>";
-  html += "document.getElementById('usePin').addEventListener('change', function() {";
-  html += "  document.getElementById('pinField').disabled = !this.checked;";
-  html += "  if (!this.checked && !document.getElementById('useRFID').checked) {";
-  html += "    document.getElementById('useRFID').checked = true;";
-  html += "    document.getElementById('rfidInfo').style.display = 'block';";
-  html += "  }";
-  html += "});";
-  html += "document.getElementById('useRFID').addEventListener('change', function() {";
-  html += "  document.getElementById('rfidInfo').style.display = this.checked ? 'block' : 'none';";
-  html += "  if (!this.checked && !document.getElementById('usePin').checked) {";
-  html += "    document.getElementById('usePin').checked = true;";
-  html += "    document.getElementById('pinField').disabled = false;";
-  html += "  }";
-  html += "});";
-  html += "</script>";
-  html += "</body></html>";
-  request->send(200, "text/html", html);
-}
-
-void handleEditUserPost(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud POST recibida para /editUser");
-  if (!request->hasParam("index", true) || !request->hasParam("name", true)) {
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: Parámetros incompletos</h1><a href='/users'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
+  uint32_t from = 0, to = UINT32_MAX;
+  if (request->hasParam("from") && request->getParam("from")->value().length() > 0) {
+    from = logParseTimestamp(request->getParam("from")->value().c_str());
+    if (from == 0) {
+      request->send(400, "application/json", "{\"error\":\"Fecha inicial no válida (AAAA-MM-DD)\"}");
+      return;
+    }
+  }
+  if (request->hasParam("to") && request->getParam("to")->value().length() > 0) {
+    to = logParseTimestamp(request->getParam("to")->value().c_str());
+    if (to == 0) {
+      request->send(400, "application/json", "{\"error\":\"Fecha final no válida (AAAA-MM-DD)\"}");
+      return;
+    }
+    to += 86399; // Incluye el día completo
+  }
+  bool gzip = !(request->hasParam("encoding") && request->getParam("encoding")->value() == "deflate");
+  if (logExportActive.exchange(true)) {
+    request->send(503, "application/json", "{\"error\":\"Ya hay una exportación en curso\"}");
     return;
   }
 
-  int index = request->getParam("index", true)->value().toInt();
-  String name = request->getParam("name", true)->value();
-  bool usePin = request->hasParam("usePin", true);
-  String pin = usePin ? request->getParam("pin", true)->value() : "";
-  bool useRFID = request->hasParam("useRFID", true);
-  String uid = authorizedUsers[index].uid; // Preserve existing UID unless RFID is re-scanned
-
-  if (!usePin && !useRFID) {
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: Seleccione al menos un método de autenticación</h1><a href='/editUser?index=" + String(index) + "'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
+  std::shared_ptr<LogExport> exp(new (std::nothrow) LogExport());
+  if (!exp) {
+    logExportActive = false;
+    request->send(503, "application/json", "{\"error\":\"Memoria insuficiente\"}");
     return;
   }
+  exp->gzip = gzip;
+  exp->from = from;
+  exp->to = to;
+  exp->started = millis();
 
-  if (usePin && (pin.length() != 4 || pin.toInt() < 0 || pin.toInt() > 9999)) {
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: PIN debe ser de 4 dígitos</h1><a href='/editUser?index=" + String(index) + "'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
+  // La cabecera del CSV se exporta siempre una vez; con fecha inicial se
+  // salta directamente a la primera entrada de ese día
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  exp->end = logLogicalEnd();
+  bool opened = logForEachLine(exp->reader, 0, exp->end, [&](uint32_t offset, const char* line, int length) {
+    exp->lineLength = min<int>(snprintf(exp->line, sizeof(exp->line), "%s\r\n", line), sizeof(exp->line) - 1);
+    return false;
+  });
+  logReaderClose(exp->reader);
+  uint32_t start = from > 0 && logIndexReady ? logExportStartOffset(from) : 0;
+  xSemaphoreGive(logMutex);
+  if (!opened || exp->lineLength == 0) {
+    request->send(503, "application/json", "{\"error\":\"Registro no disponible\"}");
     return;
   }
 
-  if (useRFID && uid.length() == 0) {
-    waitingForRFID = true;
-    rfidTimeout = millis() + RFID_TIMEOUT_MS;
-    tempName = name;
-    tempPin = pin;
-    tempUID = "";
-    Serial.println("[WEB] Esperando tarjeta RFID para editar usuario: " + name);
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;}</style>";
-    html += "</head><body><h1>Escanea la tarjeta RFID ahora</h1><p>Tiempo restante: 30 segundos</p><script>setTimeout(() => {window.location.href='/users'}, 30000);</script></body></html>";
-    request->send(200, "text/html", html);
+  Deflater& d = exp->deflater;
+  deflateBegin(d);
+  if (gzip) {
+    const uint8_t header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3}; // Deflate, sin nombre ni fecha, Unix
+    memcpy(d.out, header, sizeof(header));
+    d.outLen = sizeof(header);
   } else {
-    updateUser(index, name, pin, uid);
-    sendTelegramNotification("[WEB] Usuario actualizado: " + name);
-    request->redirect("/users");
+    d.out[0] = 0x78; // Ventana de 32 KB (la nuestra es menor), nivel rápido
+    d.out[1] = 0x01;
+    d.outLen = 2;
   }
+  logExportFeed(*exp, (const uint8_t*)exp->line, exp->lineLength);
+  exp->lineLength = 0;
+  exp->outputBytes = d.outLen;
+  exp->position = min(start, exp->end);
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse("text/csv; charset=utf-8",
+    [exp](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t written = 0;
+      while (written < maxLen) {
+        Deflater& d = exp->deflater;
+        if (exp->outPos < d.outLen) {
+          size_t n = min(maxLen - written, (size_t)(d.outLen - exp->outPos));
+          memcpy(buffer + written, d.out + exp->outPos, n);
+          exp->outPos += n;
+          written += n;
+          continue;
+        }
+        if (exp->finished) break;
+        d.outLen = 0;
+        exp->outPos = 0;
+        logExportStep(*exp);
+        exp->outputBytes += d.outLen;
+        if (exp->finished) {
+          Serial.printf("[EXPORT] %u bytes -> %u bytes (%.1fx) en %lu ms\n", exp->inputBytes, exp->outputBytes,
+                        exp->outputBytes ? (float)exp->inputBytes / exp->outputBytes : 0.0f, millis() - exp->started);
+        }
+      }
+      return written;
+    });
+  response->addHeader("Content-Encoding", gzip ? "gzip" : "deflate");
+  response->addHeader("Content-Disposition", "attachment; filename=access_log.csv");
+  request->send(response);
 }
 
-void handleDeleteUser(AsyncWebServerRequest *request) {
-  Serial.println("[WEB] Solicitud recibida para /deleteUser");
-  if (request->hasParam("index")) {
-    int index = request->getParam("index")->value().toInt();
-    if (index >= 0 && index < numAuthorizedUsers) {
-      String userName = authorizedUsers[index].name;
-      deleteUser(index);
-      sendTelegramNotification("[WEB] Usuario eliminado: " + userName);
-      request->redirect("/users");
+// === ARCHIVO COMPRIMIDO DEL REGISTRO ===
+
+LogReader::~LogReader() {
+  if (file) file.close();
+  delete[] block;
+}
+
+void logSegmentPath(char* path, int segment, const char* extension) {
+  sprintf(path, LOG_ARCHIVE_DIR "/s%04u.%.3s", (unsigned)segment % 10000, extension);
+}
+
+uint32_t logLogicalEnd() {
+  return logLiveBase + logLiveSize;
+}
+
+bool logIsHeader(const char* line) {
+  return strncmp(line, LOG_HEADER, strlen(LOG_HEADER)) == 0;
+}
+
+// Segmento que contiene la posición lógica; -1 si está en el registro vivo.
+// Un segmento ilegible queda vacío y comparte inicio con el siguiente.
+int logSegmentOf(uint32_t offset) {
+  if (offset >= logLiveBase || logSegmentCount == 0) return -1;
+  int low = 0, high = logSegmentCount - 1;
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (logSegments[mid].start <= offset) {
+      low = mid;
     } else {
-      String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-      html += "<title>Panel de Control</title>";
-      html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-      html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-      html += "</head><body><h1>Error: Índice inválido</h1><a href='/users'><button>Volver</button></a></body></html>";
-      request->send(400, "text/html", html);
+      high = mid - 1;
     }
+  }
+  return low;
+}
+
+bool logReaderOpen(LogReader& reader, int segment) {
+  bool compressed = segment >= 0 && logSegments[segment].compressed;
+  if (reader.file && reader.segment == segment && reader.compressed == compressed) return true;
+  if (reader.file) reader.file.close();
+  char path[24];
+  if (segment < 0) {
+    strcpy(path, SD_FILE);
   } else {
-    String html = "<!DOCTYPE html><html lang='es'><head><meta charset='UTF-8'>";
-    html += "<title>Panel de Control</title>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{font-family:Arial; text-align:center;} button{padding:10px 20px; border-radius:5px; border:none; background:#4CAF50; color:white; cursor:pointer;}</style>";
-    html += "</head><body><h1>Error: Índice no proporcionado</h1><a href='/users'><button>Volver</button></a></body></html>";
-    request->send(400, "text/html", html);
+    logSegmentPath(path, segment, compressed ? "lz" : "txt");
   }
+  reader.file = SD.open(path, FILE_READ);
+  reader.segment = segment;
+  reader.compressed = compressed;
+  if (reader.file && compressed &&
+      (reader.file.read((uint8_t*)&reader.header, sizeof(reader.header)) != sizeof(reader.header) ||
+       reader.header.magic != LOG_ARCHIVE_MAGIC)) {
+    reader.file.close();
+  }
+  return (bool)reader.file;
 }
 
-String getCurrentTime() {
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) {
-    Serial.println("[NTP] Error al obtener la hora");
-    return "N/A";
+void logReaderClose(LogReader& reader) {
+  if (reader.file) reader.file.close();
+  reader.segment = -2;
+}
+
+// Siguientes count bits del bloque, del menos significativo al más; -1 si se acaban
+int32_t logReaderBits(LogReader& reader, int count) {
+  while (reader.bitCount < count) {
+    uint8_t* input = reader.block + LOG_ARCHIVE_BLOCK;
+    if (reader.inPos == reader.inLength) {
+      if (reader.inRemaining == 0) return -1;
+      int n = min<uint32_t>(LOG_ARCHIVE_INPUT, reader.inRemaining);
+      if (reader.file.read(input, n) != (size_t)n) return -1;
+      reader.inRemaining -= n;
+      reader.inLength = n;
+      reader.inPos = 0;
+    }
+    reader.bits |= (uint32_t)input[reader.inPos++] << reader.bitCount;
+    reader.bitCount += 8;
   }
-  char buffer[20];
-  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &timeinfo);
-  return String(buffer);
+  int32_t value = reader.bits & ((1UL << count) - 1);
+  reader.bits >>= count;
+  reader.bitCount -= count;
+  return value;
 }
 
-void logAccess(const String& method, const String& id, const String& status, const String& userName) {
-  String timestamp = getCurrentTime();
-  String entry = timestamp + "," + method + "," + id + "," + userName + "," + status;
+// Código Huffman de longitud fija (bit más significativo primero)
+int32_t logReaderCode(LogReader& reader, int length) {
+  int32_t code = 0;
+  for (int i = 0; i < length; i++) {
+    int32_t bit = logReaderBits(reader, 1);
+    if (bit < 0) return -1;
+    code = (code << 1) | bit;
+  }
+  return code;
+}
 
-  if (historyCount < 15) {
-    accessHistory[historyCount] = entry;
-    historyCount++;
-  } else {
-    for (int i = 0; i < 14; i++) {
-      accessHistory[i] = accessHistory[i + 1];
+// Símbolo de literal/longitud con la tabla fija: 7, 8 o 9 bits según el prefijo
+int logReaderSymbol(LogReader& reader) {
+  int32_t code = logReaderCode(reader, 7);
+  if (code < 0) return -1;
+  if (code <= 0x17) return 256 + code;
+  int32_t bit = logReaderBits(reader, 1);
+  if (bit < 0) return -1;
+  code = (code << 1) | bit;
+  if (code <= 0xBF) return code - 0x30;
+  if (code <= 0xC7) return 280 + code - 0xC0;
+  bit = logReaderBits(reader, 1);
+  if (bit < 0) return -1;
+  return 144 + ((code << 1) | bit) - 0x190;
+}
+
+// Descomprime en reader.block el bloque en la posición actual del archivo. Solo
+// entiende lo que genera deflateBegin/deflateFinish: un bloque con códigos fijos.
+// Devuelve los bytes obtenidos o -1 si los datos no son válidos.
+int logInflateBlock(LogReader& reader, uint32_t compressedLength) {
+  reader.inLength = reader.inPos = 0;
+  reader.inRemaining = compressedLength;
+  reader.bits = 0;
+  reader.bitCount = 0;
+  if (logReaderBits(reader, 3) != 3) return -1; // BFINAL + Huffman fijo
+  int out = 0;
+  while (true) {
+    int symbol = logReaderSymbol(reader);
+    if (symbol < 0 || symbol > 285) return -1;
+    if (symbol < 256) {
+      if (out == LOG_ARCHIVE_BLOCK) return -1;
+      reader.block[out++] = symbol;
+      continue;
+    }
+    if (symbol == 256) return out;
+    int i = symbol - 257;
+    int32_t extra = logReaderBits(reader, DEFLATE_LENGTH_EXTRA[i]);
+    int32_t code = logReaderCode(reader, 5);
+    if (extra < 0 || code < 0 || code >= 30) return -1;
+    int32_t distanceExtra = logReaderBits(reader, DEFLATE_DIST_EXTRA[code]);
+    int length = DEFLATE_LENGTH_BASE[i] + extra;
+    int distance = DEFLATE_DIST_BASE[code] + distanceExtra;
+    if (distanceExtra < 0 || distance > out || out + length > LOG_ARCHIVE_BLOCK) return -1;
+    for (int k = 0; k < length; k++, out++) reader.block[out] = reader.block[out - distance];
+  }
+}
+
+// Busca en la tabla del segmento el bloque que contiene la posición y lo descomprime
+bool logReaderLoadBlock(LogReader& reader, int segment, uint32_t offset) {
+  if (!reader.block) {
+    reader.block = new (std::nothrow) uint8_t[LOG_ARCHIVE_BLOCK + LOG_ARCHIVE_INPUT];
+    if (!reader.block) return false;
+  }
+  reader.blockLength = 0;
+  if (!logReaderOpen(reader, segment) || reader.header.blockCount == 0) return false;
+  uint32_t relative = offset - logSegments[segment].start;
+  LogArchiveBlock entry;
+  auto readEntry = [&](uint32_t i) {
+    return reader.file.seek(reader.header.tableOffset + i * sizeof(LogArchiveBlock)) &&
+           reader.file.read((uint8_t*)&entry, sizeof(entry)) == sizeof(entry);
+  };
+  int32_t low = 0, high = reader.header.blockCount - 1;
+  while (low < high) {
+    int32_t mid = (low + high + 1) / 2;
+    if (!readEntry(mid)) return false;
+    if (entry.rawOffset <= relative) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  if (!readEntry(low) || relative >= entry.rawOffset + entry.rawLength || !reader.file.seek(entry.fileOffset)) return false;
+
+  unsigned long started = micros();
+  int length = logInflateBlock(reader, entry.compressedLength);
+  logArchiveInflateUs += micros() - started;
+  if (length != entry.rawLength || crc32Update(0, reader.block, length) != entry.crc) {
+    Serial.printf("[ARCHIVO] Bloque dañado en el segmento %d (posición %u)\n", segment, entry.rawOffset);
+    return false;
+  }
+  logArchiveInflateBytes += length;
+  reader.blockStart = logSegments[segment].start + entry.rawOffset;
+  reader.blockLength = length;
+  return true;
+}
+
+// Lee a partir de una posición lógica sin pasar del final de un segmento o de un
+// bloque comprimido; devuelve los bytes leídos (0 al final o si hay error). Con
+// logMutex tomado: la tabla de segmentos cambia al rotar y al comprimir.
+size_t logRead(LogReader& reader, uint32_t offset, uint8_t* out, size_t length) {
+  int segment = logSegmentOf(offset);
+  if (segment >= 0 && logSegments[segment].compressed) {
+    if (offset < reader.blockStart || offset >= reader.blockStart + reader.blockLength) {
+      if (!logReaderLoadBlock(reader, segment, offset)) return 0;
     }
-    accessHistory[14] = entry;
+    size_t n = min<size_t>(length, reader.blockStart + reader.blockLength - offset);
+    memcpy(out, reader.block + (offset - reader.blockStart), n);
+    return n;
+  }
+  if (!logReaderOpen(reader, segment)) return 0;
+  uint32_t base = segment < 0 ? logLiveBase : logSegments[segment].start;
+  if (segment >= 0) length = min<size_t>(length, base + logSegments[segment].rawSize - offset);
+  if (!reader.file.seek(offset - base)) return 0;
+  return reader.file.read(out, length);
+}
+
+// Recorre las líneas completas entre dos posiciones lógicas, sin el "\r\n". Si
+// from cae a mitad de una línea, esa línea se salta, igual que las que no caben
+// en un bloque (nunca las escribe logAccess). visit recibe una vista
+// sobre el bloque del LineReader (la puede partir en el sitio) y devuelve false
+// para parar; el resultado es false solo si falla una lectura.
+bool logForEachLine(LogReader& reader, uint32_t from, uint32_t to,
+                    const std::function<bool(uint32_t, char*, int)>& visit) {
+  LineReader lines([&reader](uint32_t offset, uint8_t* out, size_t length) {
+    return logRead(reader, offset, out, length);
+  }, from, to);
+  while (lines.next() && lines.complete) {
+    if (lines.truncated) continue;
+    if (!visit(lines.offset, lines.line, lines.length)) return true;
   }
+  return !lines.failed;
+}
 
+// Recorre los segmentos en orden y termina lo que una compresión o una
+// rotación interrumpidas dejaran a medias. Se llama antes de cargar el
+// historial y los índices, que ya trabajan con posiciones lógicas.
+void initLogArchive() {
   configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
-  File file = SD.open(SD_FILE, FILE_APPEND);
+  SD.mkdir(LOG_ARCHIVE_DIR);
+  char text[24], archive[24], temporary[24];
+  uint32_t start = 0, stored = 0;
+  int compressed = 0;
+  logSegmentCount = 0;
+  while (logSegmentCount < LOG_ARCHIVE_MAX_SEGMENTS) {
+    int i = logSegmentCount;
+    logSegmentPath(text, i, "txt");
+    logSegmentPath(archive, i, "lz");
+    logSegmentPath(temporary, i, "tmp");
+    if (SD.exists(temporary)) SD.remove(temporary); // Compresión interrumpida: se repite
+    bool hasText = SD.exists(text);
+    bool hasArchive = SD.exists(archive);
+    if (!hasText && !hasArchive) break;
+
+    LogSegment& segment = logSegments[logSegmentCount++];
+    segment = {start, 0, 0, false};
+    if (hasArchive) {
+      File file = SD.open(archive, FILE_READ);
+      LogArchiveHeader header;
+      bool valid = file && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+                   header.magic == LOG_ARCHIVE_MAGIC;
+      if (valid) {
+        segment.rawSize = header.rawSize;
+        segment.storedSize = file.size();
+        segment.compressed = true;
+      }
+      if (file) file.close();
+      if (valid && hasText) {
+        SD.remove(text); // La compresión terminó pero no llegó a borrar el original
+        hasText = false;
+      } else if (!valid && !hasText) {
+        Serial.printf("[ARCHIVO] Segmento %d ilegible; se omite\n", i);
+        segment.compressed = true; // Vacío: logSegmentOf nunca lo elige
+        continue;
+      } else if (!valid) {
+        SD.remove(archive);
+      }
+    }
+    if (hasText) {
+      File file = SD.open(text, FILE_READ);
+      segment.rawSize = segment.storedSize = file ? file.size() : 0;
+      if (file) file.close();
+    }
+    if (segment.compressed) compressed++;
+    start += segment.rawSize;
+    stored += segment.storedSize;
+  }
+  logLiveBase = start;
+
+  File live = SD.open(SD_FILE, FILE_READ);
+  logLiveSize = live ? live.size() : 0;
+  if (live) live.close();
+  if (logSegmentCount > 0) {
+    Serial.printf("[ARCHIVO] %d segmentos (%d comprimidos): %u KB de registro en %u KB\n", logSegmentCount,
+                  compressed, start / 1024, stored / 1024);
+  }
+}
+
+// Cierra el registro vivo como siguiente segmento y empieza uno nuevo con la
+// cabecera. Un renombrado no mueve datos, así que la rotación es inmediata.
+void logRotate() {
+  char path[24];
+  logSegmentPath(path, logSegmentCount, "txt");
+  if (!SD.rename(SD_FILE, path)) {
+    Serial.println("[ARCHIVO] Error al cerrar el segmento del registro");
+    logArchiveRetryAt = millis() + LOG_ARCHIVE_RETRY_MS;
+    return;
+  }
+  logSegments[logSegmentCount++] = {logLiveBase, logLiveSize, logLiveSize, false};
+  logLiveBase += logLiveSize;
+  logLiveSize = 0;
+  trace(TRACE_SD_WRITE_START, TRACE_SD_ARCHIVE);
+  File file = SD.open(SD_FILE, FILE_WRITE);
   if (file) {
-    file.println(entry);
+    file.println(LOG_HEADER);
+    logLiveSize = file.size();
     file.close();
-    Serial.println("[LOG] Registro almacenado: " + entry);
+  }
+  trace(TRACE_SD_WRITE_END, TRACE_SD_ARCHIVE);
+  Serial.printf("[ARCHIVO] Registro cerrado como segmento %d (%u bytes)\n", logSegmentCount - 1,
+                logSegments[logSegmentCount - 1].rawSize);
+}
+
+void logCompactAbort(const char* reason) {
+  char path[24];
+  Serial.printf("[ARCHIVO] Compresión del segmento %d cancelada: %s\n", logCompactor->segment, reason);
+  if (logCompactor->source) logCompactor->source.close();
+  if (logCompactor->target) logCompactor->target.close();
+  logSegmentPath(path, logCompactor->segment, "tmp");
+  SD.remove(path);
+  delete logCompactor;
+  logCompactor = nullptr;
+  logArchiveRetryAt = millis() + LOG_ARCHIVE_RETRY_MS;
+}
+
+void logCompactBegin(int segment) {
+  char path[24];
+  logCompactor = new (std::nothrow) LogCompactor();
+  if (!logCompactor) {
+    logArchiveRetryAt = millis() + LOG_ARCHIVE_RETRY_MS;
+    return;
+  }
+  LogCompactor& c = *logCompactor;
+  c.segment = segment;
+  // Cada bloque lleva al menos LOG_ARCHIVE_BLOCK menos una línea
+  c.blockCapacity = logSegments[segment].rawSize / (LOG_ARCHIVE_BLOCK - LOG_LINE_MAX - 2) + 1;
+  c.blocks = new (std::nothrow) LogArchiveBlock[c.blockCapacity];
+  logSegmentPath(path, segment, "txt");
+  c.source = SD.open(path, FILE_READ);
+  logSegmentPath(path, segment, "tmp");
+  c.target = SD.open(path, FILE_WRITE);
+  if (!c.blocks || !c.source || !c.target) {
+    logCompactAbort("memoria o SD no disponibles");
+    return;
+  }
+  LogArchiveHeader header = {LOG_ARCHIVE_MAGIC, logSegments[segment].rawSize, 0, 0}; // Se completa al final
+  c.target.write((const uint8_t*)&header, sizeof(header));
+  c.stored = sizeof(header);
+}
+
+// Comprime un bloque de líneas completas; el bloque es independiente de los
+// demás para poder leerlo sin descomprimir el resto del segmento
+bool logCompactBlock(LogCompactor& c) {
+  const LogSegment& segment = logSegments[c.segment];
+  int n = min<uint32_t>(LOG_ARCHIVE_BLOCK, segment.rawSize - c.position);
+  if (!c.source.seek(c.position) || c.source.read(c.raw, n) != (size_t)n) return false;
+  if (c.position + n < segment.rawSize) {
+    int cut = n;
+    while (cut > 0 && c.raw[cut - 1] != '\n') cut--;
+    if (cut > 0) n = cut;
+  }
+  if (c.blockCount == c.blockCapacity) return false;
+
+  LogArchiveBlock& block = c.blocks[c.blockCount];
+  block.rawOffset = c.position;
+  block.rawLength = n;
+  block.fileOffset = c.stored;
+  block.crc = crc32Update(0, c.raw, n);
+  Deflater& d = c.deflater;
+  uint32_t written = 0;
+  auto drain = [&]() {
+    bool ok = c.target.write(d.out, d.outLen) == (size_t)d.outLen;
+    written += d.outLen;
+    d.outLen = 0;
+    return ok;
+  };
+  bool ok = true;
+  unsigned long started = micros();
+  deflateBegin(d);
+  for (int i = 0; ok && i < n; i += DEFLATE_IN_MAX) {
+    deflateWrite(d, c.raw + i, min(DEFLATE_IN_MAX, n - i));
+    c.cpuUs += micros() - started;
+    ok = drain();
+    started = micros();
+  }
+  deflateFinish(d);
+  c.cpuUs += micros() - started;
+  ok = ok && drain();
+  block.compressedLength = written;
+  c.stored += written;
+  c.position += n;
+  c.blockCount++;
+  return ok;
+}
+
+// Escribe la tabla de bloques y la cabecera definitiva, y sustituye el segmento
+// sin comprimir por el archivo comprimido. El renombrado es el punto de no retorno.
+void logCompactFinish() {
+  LogCompactor& c = *logCompactor;
+  LogSegment& segment = logSegments[c.segment];
+  LogArchiveHeader header = {LOG_ARCHIVE_MAGIC, segment.rawSize, c.blockCount, c.stored};
+  size_t tableBytes = c.blockCount * sizeof(LogArchiveBlock);
+  bool ok = c.target.write((const uint8_t*)c.blocks, tableBytes) == tableBytes &&
+            c.target.seek(0) && c.target.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+  if (!ok) {
+    logCompactAbort("error de escritura");
+    return;
+  }
+  c.source.close();
+  c.target.close();
+  char text[24], archive[24], temporary[24];
+  logSegmentPath(text, c.segment, "txt");
+  logSegmentPath(archive, c.segment, "lz");
+  logSegmentPath(temporary, c.segment, "tmp");
+  SD.remove(archive);
+  if (!SD.rename(temporary, archive)) {
+    logCompactAbort("error al renombrar");
+    return;
+  }
+  SD.remove(text);
+  segment.compressed = true;
+  segment.storedSize = c.stored + tableBytes;
+  logArchiveDeflateUs += c.cpuUs;
+  logArchiveDeflateBytes += segment.rawSize;
+  Serial.printf("[ARCHIVO] Segmento %d comprimido: %u -> %u bytes (%.1fx), %u bloques, %lu ms de CPU\n", c.segment,
+                segment.rawSize, segment.storedSize,
+                segment.storedSize ? (float)segment.rawSize / segment.storedSize : 0.0f, c.blockCount,
+                (unsigned long)c.cpuUs / 1000);
+  delete logCompactor;
+  logCompactor = nullptr;
+}
+
+// Llamado desde loop(): rota el registro vivo cuando se llena y comprime los
+// segmentos cerrados de bloque en bloque, un bloque (unos pocos ms) por llamada,
+// para no retener logMutex ni el bucle principal más que una escritura normal
+void updateLogArchive() {
+  if (!logMutex || (long)(millis() - logArchiveRetryAt) < 0) return;
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  configureSPIPins(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+  if (logCompactor) {
+    trace(TRACE_SD_WRITE_START, TRACE_SD_ARCHIVE);
+    if (logCompactor->position < logSegments[logCompactor->segment].rawSize) {
+      if (!logCompactBlock(*logCompactor)) logCompactAbort("error de lectura o escritura");
+    } else {
+      logCompactFinish();
+    }
+    trace(TRACE_SD_WRITE_END, TRACE_SD_ARCHIVE);
+  } else if (logLiveSize >= LOG_SEGMENT_BYTES && logSegmentCount < LOG_ARCHIVE_MAX_SEGMENTS) {
+    logRotate();
   } else {
-    Serial.println("[SD] Error al escribir en archivo de log");
+    for (int i = 0; i < logSegmentCount; i++) {
+      if (!logSegments[i].compressed) {
+        logCompactBegin(i);
+        break;
+      }
+    }
   }
-}
\ No newline at end of file
+  xSemaphoreGive(logMutex);
+}
+
+// Segmentos comprimidos y lo que ocupan antes y después
+int logArchiveTotals(uint32_t& raw, uint32_t& stored) {
+  int compressed = 0;
+  raw = stored = 0;
+  for (int i = 0; i < logSegmentCount; i++) {
+    if (!logSegments[i].compressed) continue;
+    compressed++;
+    raw += logSegments[i].rawSize;
+    stored += logSegments[i].storedSize;
+  }
+  return compressed;
+}
+
+uint32_t logArchiveUsPerKB(uint32_t us, uint32_t bytes) {
+  return bytes ? (uint32_t)((uint64_t)us * 1024 / bytes) : 0;
+}
+
+// Resumen para /api/stats: ocupación del archivo y coste de CPU por KB desde el arranque
+String logArchiveJson() {
+  uint32_t raw, stored;
+  int compressed = logArchiveTotals(raw, stored);
+  String json = "{\"segmentos\":" + String(logSegmentCount) + ",\"comprimidos\":" + String(compressed) +
+                ",\"bytes\":" + String(raw) + ",\"bytes_sd\":" + String(stored) +
+                ",\"ratio\":" + String(stored ? (float)raw / stored : 0.0f) +
+                ",\"registro_vivo\":" + String(logLiveSize);
+  json += ",\"compresion_us_kb\":" + String(logArchiveUsPerKB(logArchiveDeflateUs, logArchiveDeflateBytes));
+  json += ",\"descompresion_us_kb\":" + String(logArchiveUsPerKB(logArchiveInflateUs, logArchiveInflateBytes));
+  json += "}";
+  return json;
+}
@@ -0,0 +1,713 @@
+// Arnés de reproducción de escenarios: ejecuta setup() y loop() del firmware
+// sobre un reloj virtual, inyecta tarjetas, cambios de la puerta, peticiones
+// web y mensajes de Telegram, y resume latencias y memoria al terminar.
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include "shim/sim.h"
+
+void setup();
+void loop();
+extern AsyncWebServer server;
+void simFireTimers();
+String accessPipelineJson();
+
+namespace {
+
+const uint64_t US_PER_S = 1000000ULL;
+
+enum EventKind { EV_DOOR, EV_WEB, EV_PIN, EV_MQTT, EV_PEER };
+
+struct Event {
+  uint64_t atUs;
+  EventKind kind;
+  bool open = false;
+  WebRequestMethod method = HTTP_GET;
+  std::string url;
+  std::string body;
+  sim::PeerUser peer; // EV_PEER: alta (open) o baja de peer.name
+};
+
+struct UserLine {
+  std::string name;
+  std::string pin;
+  std::string uid;
+  std::string schedule;
+};
+
+struct Scenario {
+  int64_t startEpoch = 0;
+  uint64_t endUs = 0;
+  uint64_t cardPresenceUs = 300000; // Lo que suele tardar alguien en retirar la tarjeta
+  std::string chatId = "xxxx";
+  std::vector<UserLine> users;
+  std::vector<Event> events;
+  std::vector<sim::Card> cards;
+  std::vector<sim::TelegramIn> telegram;
+};
+
+// Métricas recogidas durante la reproducción
+struct Report {
+  std::vector<uint64_t> unlock[sim::INPUT_KIND_COUNT];
+  std::vector<uint64_t> firstNotify[sim::INPUT_KIND_COUNT];
+  std::map<std::string, std::vector<uint64_t>> web;
+  std::vector<uint64_t> loopUs;
+  uint64_t notifiedInput = UINT64_MAX;
+  uint64_t relayOn = 0;
+  uint64_t loops = 0;
+  uint64_t allocSetup = 0;
+  uint64_t allocLoop = 0;
+  uint64_t allocWeb = 0;
+  uint64_t allocSwipe = 0;
+  uint64_t swipeLoops = 0;
+  size_t heapAfterSetup = 0;
+  uint64_t setupEndUs = 0;
+  uint64_t radioAfterSetupUs = 0;
+  uint64_t webUnanswered = 0;
+};
+
+Report report;
+bool showTelegram = false;
+bool keepSd = false; // --conservar: la SD de la ejecución anterior, como tras un reinicio
+double swipeAllocLimit = -1; // --limite-reservas: media máxima por lectura de tarjeta (< 0 = sin comprobar)
+
+// Lo que reserva el propio arnés no cuenta como memoria del firmware
+struct Untracked {
+  bool previous = sim::tracking;
+  Untracked() { sim::tracking = false; }
+  ~Untracked() { sim::tracking = previous; }
+};
+
+const char* INPUT_NAMES[sim::INPUT_KIND_COUNT] = {"-", "RFID", "PIN", "Telegram", "Web"};
+
+void onRelay(bool on) {
+  if (!on) return;
+  Untracked untracked;
+  report.relayOn++;
+  if (sim::lastInput.kind == sim::INPUT_NONE) return;
+  report.unlock[sim::lastInput.kind].push_back(sim::nowUs() - sim::lastInput.atUs);
+}
+
+// Primera notificación enviada después de cada entrada: lo que tarda en enterarse el administrador
+void onTelegramSent(const std::string& chatId, const std::string& text) {
+  Untracked untracked;
+  if (showTelegram) printf("[SIM] Telegram -> %s:\n%s\n", chatId.c_str(), text.c_str());
+  if (sim::lastInput.kind == sim::INPUT_NONE || report.notifiedInput == sim::lastInput.atUs) return;
+  report.notifiedInput = sim::lastInput.atUs;
+  report.firstNotify[sim::lastInput.kind].push_back(sim::nowUs() - sim::lastInput.atUs);
+}
+
+// === LECTURA DEL ESCENARIO ===
+
+[[noreturn]] void fail(int lineNo, const std::string& message) {
+  fprintf(stderr, "escenario:%d: %s\n", lineNo, message.c_str());
+  exit(1);
+}
+
+int64_t parseDateTime(const std::string& date, const std::string& time, int lineNo) {
+  struct tm info = {};
+  if (sscanf(date.c_str(), "%d-%d-%d", &info.tm_year, &info.tm_mon, &info.tm_mday) != 3 ||
+      sscanf(time.c_str(), "%d:%d:%d", &info.tm_hour, &info.tm_min, &info.tm_sec) != 3) {
+    fail(lineNo, "fecha u hora no válida: " + date + " " + time);
+  }
+  info.tm_year -= 1900;
+  info.tm_mon -= 1;
+  return timegm(&info);
+}
+
+// HH:MM:SS[.mmm] relativo al día de inicio; admite horas > 23 para escenarios de varios días
+uint64_t parseClock(const std::string& text, const Scenario& scenario, int lineNo) {
+  int h, m;
+  double s;
+  if (sscanf(text.c_str(), "%d:%d:%lf", &h, &m, &s) != 3) fail(lineNo, "hora no válida: " + text);
+  int64_t dayStart = scenario.startEpoch - scenario.startEpoch % 86400;
+  int64_t ms = (int64_t)(dayStart - scenario.startEpoch) * 1000 + ((int64_t)h * 3600 + m * 60) * 1000 + (int64_t)(s * 1000 + 0.5);
+  if (ms < 0) fail(lineNo, "evento anterior al inicio: " + text);
+  return (uint64_t)ms * 1000;
+}
+
+std::string restOf(std::istringstream& in) {
+  std::string rest;
+  std::getline(in, rest);
+  size_t first = rest.find_first_not_of(' ');
+  return first == std::string::npos ? "" : rest.substr(first);
+}
+
+bool parseUid(const std::string& text, sim::Card& card) {
+  std::istringstream in(text);
+  std::string byteText;
+  card.size = 0;
+  while (in >> byteText && card.size < sizeof(card.uid)) card.uid[card.size++] = (uint8_t)strtol(byteText.c_str(), nullptr, 16);
+  return card.size > 0;
+}
+
+std::string normalizeUid(const std::string& text) {
+  sim::Card card;
+  parseUid(text, card);
+  std::string out;
+  char hex[4];
+  for (int i = 0; i < card.size; i++) {
+    snprintf(hex, sizeof(hex), i ? " %02X" : "%02X", card.uid[i]);
+    out += hex;
+  }
+  return out;
+}
+
+void setConfig(const std::string& key, double value, Scenario& scenario, int lineNo) {
+  if (key == "sd_abrir_us") sim::costs.sdOpenUs = value;
+  else if (key == "sd_kb_us") sim::costs.sdKiBUs = value;
+  else if (key == "sd_orden_us") sim::costs.sdCommandUs = value;
+  else if (key == "sd_llamada_us") sim::costs.sdCallUs = value;
+  else if (key == "spi_us") sim::costs.spiTransactionUs = value;
+  else if (key == "corriente_cpu_ma") sim::currents.cpuMa = value;
+  else if (key == "corriente_radio_ma") sim::currents.radioMa = value;
+  else if (key == "corriente_espera_ma") sim::currents.waitMa = value;
+  else if (key == "corriente_sueno_ma") sim::currents.sleepMa = value;
+  else if (key == "despertar_us") sim::currents.wakeUs = value;
+  else if (key == "telegram_envio_ms") sim::costs.telegramSendUs = value * 1000;
+  else if (key == "telegram_consulta_ms") sim::costs.telegramPollUs = value * 1000;
+  else if (key == "serie_baudios") sim::costs.serialBaud = value;
+  else if (key == "mqtt_rtt_ms") sim::costs.mqttRttUs = value * 1000;
+  else if (key == "mqtt_radio_us") sim::costs.mqttRadioUs = value;
+  else if (key == "red_rtt_ms") sim::costs.netRttUs = value * 1000;
+  else if (key == "red_kb_us") sim::costs.netKiBUs = value;
+  else if (key == "tarjeta_presencia_ms") scenario.cardPresenceUs = value * 1000;
+  else fail(lineNo, "configuración desconocida: " + key);
+}
+
+Scenario loadScenario(const char* path) {
+  std::ifstream in(path);
+  if (!in) {
+    fprintf(stderr, "No se puede abrir el escenario %s\n", path);
+    exit(1);
+  }
+  Scenario scenario;
+  std::string line;
+  int lineNo = 0;
+  bool started = false;
+  while (std::getline(in, line)) {
+    lineNo++;
+    size_t hash = line.find('#');
+    if (hash != std::string::npos) line.resize(hash);
+    std::istringstream words(line);
+    std::string first;
+    if (!(words >> first)) continue;
+
+    if (first == "inicio") {
+      std::string date, time;
+      words >> date >> time;
+      scenario.startEpoch = parseDateTime(date, time, lineNo);
+      started = true;
+      continue;
+    }
+    if (first == "config") {
+      std::string key, value;
+      words >> key >> value;
+      if (key == "telegram_chat") {
+        scenario.chatId = value;
+      } else {
+        setConfig(key, atof(value.c_str()), scenario, lineNo);
+      }
+      continue;
+    }
+    if (first == "usuario") {
+      UserLine user;
+      std::string pin, uidAndSchedule;
+      words >> user.name >> pin;
+      user.pin = pin == "-" ? "" : pin;
+      uidAndSchedule = restOf(words);
+      size_t at = uidAndSchedule.find('@');
+      user.uid = normalizeUid(uidAndSchedule.substr(0, at));
+      if (at != std::string::npos) user.schedule = uidAndSchedule.substr(at + 1);
+      scenario.users.push_back(user);
+      continue;
+    }
+
+    if (!started) fail(lineNo, "falta la línea 'inicio' antes de los eventos");
+    uint64_t at = parseClock(first, scenario, lineNo);
+    std::string kind;
+    words >> kind;
+    if (kind == "fin") {
+      scenario.endUs = at;
+    } else if (kind == "tarjeta") {
+      sim::Card card;
+      if (!parseUid(restOf(words), card)) fail(lineNo, "UID vacío");
+      card.fromUs = at;
+      card.untilUs = at + scenario.cardPresenceUs;
+      scenario.cards.push_back(card);
+    } else if (kind == "puerta") {
+      std::string state;
+      words >> state;
+      if (state != "abierta" && state != "cerrada") fail(lineNo, "estado de puerta no válido: " + state);
+      Event event{at, EV_DOOR};
+      event.open = state == "abierta";
+      scenario.events.push_back(event);
+    } else if (kind == "mqtt") {
+      std::string state;
+      words >> state;
+      if (state != "caida" && state != "vuelve") fail(lineNo, "estado del broker no válido: " + state);
+      Event event{at, EV_MQTT};
+      event.open = state == "vuelve";
+      scenario.events.push_back(event);
+    } else if (kind == "par") {
+      std::string action;
+      Event event{at, EV_PEER};
+      words >> action >> event.peer.name;
+      if (action == "alta") {
+        std::string pin, uidAndSchedule;
+        words >> pin;
+        event.peer.pin = pin == "-" ? "" : pin;
+        uidAndSchedule = restOf(words);
+        size_t hash = uidAndSchedule.find('@');
+        event.peer.uid = normalizeUid(uidAndSchedule.substr(0, hash));
+        if (hash != std::string::npos) event.peer.schedule = uidAndSchedule.substr(hash + 1);
+        event.open = true;
+      } else if (action == "caido" || action == "vuelve") {
+        event.url = action;
+      } else if (action != "baja") {
+        fail(lineNo, "acción del par no válida: " + action);
+      }
+      if (event.peer.name.empty() && event.url.empty()) fail(lineNo, "falta el nombre del usuario del par");
+      scenario.events.push_back(event);
+    } else if (kind == "pin") {
+      Event event{at, EV_PIN, false, HTTP_POST, "/enterPin"};
+      words >> event.body;
+      event.body = "pin=" + event.body;
+      scenario.events.push_back(event);
+    } else if (kind == "telegram") {
+      scenario.telegram.push_back({scenario.chatId, restOf(words), "", at});
+    } else if (kind == "boton") {
+      scenario.telegram.push_back({scenario.chatId, restOf(words), "q" + std::to_string(lineNo), at});
+    } else if (kind == "web") {
+      std::string method, url, body;
+      words >> method >> url >> body;
+      if (body[0] == '@') {
+        // Cuerpo tomado de un archivo, relativo al escenario
+        body = "@" + (std::filesystem::path(path).parent_path() / body.substr(1)).string();
+      }
+      Event event{at, EV_WEB, false, method == "POST" ? HTTP_POST : HTTP_GET, url, body};
+      scenario.events.push_back(event);
+    } else {
+      fail(lineNo, "evento desconocido: " + kind);
+    }
+  }
+  if (!started) fail(lineNo, "el escenario no tiene línea 'inicio'");
+  auto byTime = [](const auto& a, const auto& b) { return a.atUs < b.atUs; };
+  std::stable_sort(scenario.events.begin(), scenario.events.end(), byTime);
+  std::stable_sort(scenario.telegram.begin(), scenario.telegram.end(), byTime);
+  std::stable_sort(scenario.cards.begin(), scenario.cards.end(), [](const sim::Card& a, const sim::Card& b) { return a.fromUs < b.fromUs; });
+  if (scenario.endUs == 0) {
+    uint64_t last = 0;
+    if (!scenario.events.empty()) last = std::max(last, scenario.events.back().atUs);
+    if (!scenario.cards.empty()) last = std::max(last, scenario.cards.back().untilUs);
+    if (!scenario.telegram.empty()) last = std::max(last, scenario.telegram.back().atUs);
+    scenario.endUs = last + 60 * US_PER_S;
+  }
+  return scenario;
+}
+
+// === GENERADOR DE ESCENARIOS ===
+// Un día laborable: picos de entrada y salida, tarjetas desconocidas, puertas
+// que se abren tras cada acceso, alguna intrusión, PIN por web, aperturas por
+// Telegram y paneles abiertos que refrescan la página principal.
+
+void generateScenario(const char* path, unsigned seed, int userCount, int viewers) {
+  std::mt19937 rng(seed);
+  auto uniform = [&](double a, double b) { return std::uniform_real_distribution<double>(a, b)(rng); };
+  auto chance = [&](double p) { return uniform(0, 1) < p; };
+  std::ofstream out(path);
+  if (!out) {
+    fprintf(stderr, "No se puede escribir %s\n", path);
+    exit(1);
+  }
+
+  struct Line {
+    double at;
+    std::string text;
+  };
+  std::vector<Line> lines;
+  std::vector<std::string> uids;
+  std::vector<std::string> pins;
+
+  out << "# Generado con --generar (semilla " << seed << ", " << userCount << " usuarios, " << viewers << " paneles)\n";
+  out << "inicio 2025-06-25 06:00:00\n";
+  char buffer[160];
+  for (int i = 0; i < userCount; i++) {
+    snprintf(buffer, sizeof(buffer), "%02X %02X %02X %02X", (unsigned)rng() & 0xFF, (unsigned)rng() & 0xFF,
+             (unsigned)rng() & 0xFF, (unsigned)rng() & 0xFF);
+    uids.push_back(buffer);
+    pins.push_back(std::to_string(1000 + rng() % 9000));
+    out << "usuario usuario" << i << " " << pins.back() << " " << uids.back() << "\n";
+  }
+
+  auto pushDoorCycle = [&](double at) {
+    double open = at + uniform(1.5, 4);
+    lines.push_back({open, "puerta abierta"});
+    lines.push_back({open + uniform(3, 9), "puerta cerrada"});
+  };
+
+  for (int i = 0; i < userCount; i++) {
+    // Entrada hacia las 8:30 y salida hacia las 17:30, con algo de dispersión
+    double peaks[] = {std::normal_distribution<double>(8.5 * 3600, 1200)(rng),
+                      std::normal_distribution<double>(13.8 * 3600, 900)(rng),
+                      std::normal_distribution<double>(17.5 * 3600, 1500)(rng)};
+    for (double at : peaks) {
+      if (!chance(0.9)) continue;
+      if (chance(0.12)) {
+        lines.push_back({at, "pin " + pins[i]});
+      } else {
+        lines.push_back({at, "tarjeta " + uids[i]});
+      }
+      pushDoorCycle(at);
+      // Pasadas dobles: la misma tarjeta otra vez al momento
+      if (chance(0.05)) lines.push_back({at + uniform(0.3, 1.2), "tarjeta " + uids[i]});
+    }
+  }
+
+  for (int i = 0; i < userCount / 10 + 2; i++) {
+    snprintf(buffer, sizeof(buffer), "tarjeta %02X %02X %02X %02X", (unsigned)rng() & 0xFF, (unsigned)rng() & 0xFF,
+             (unsigned)rng() & 0xFF, (unsigned)rng() & 0xFF);
+    lines.push_back({uniform(7 * 3600, 20 * 3600), buffer});
+  }
+  for (int i = 0; i < 3; i++) {
+    double at = uniform(6 * 3600, 23 * 3600); // El escenario empieza a las 6:00
+    lines.push_back({at, "puerta abierta"});
+    lines.push_back({at + uniform(5, 40), "puerta cerrada"});
+  }
+  for (int i = 0; i < std::max(2, userCount / 20); i++) {
+    double at = uniform(9 * 3600, 19 * 3600);
+    int user = rng() % userCount;
+    lines.push_back({at, "telegram /abrir"});
+    lines.push_back({at + uniform(3, 10), "telegram usuario" + std::to_string(user)});
+    lines.push_back({at + uniform(12, 20), "telegram " + pins[user]});
+    pushDoorCycle(at + 22);
+  }
+  for (int v = 0; v < viewers; v++) {
+    // Un panel abierto durante la jornada refresca / cada 4 segundos
+    double from = uniform(8 * 3600, 10 * 3600);
+    double to = from + uniform(2 * 3600, 6 * 3600);
+    for (double at = from; at < to; at += 4) lines.push_back({at, "web GET /"});
+    lines.push_back({from + 60, "web GET /api/stats?password=admin"});
+    lines.push_back({from + 120, "web GET /api/log?password=admin&limit=50"});
+  }
+
+  std::stable_sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) { return a.at < b.at; });
+  for (const Line& line : lines) {
+    double at = std::max(0.0, line.at);
+    snprintf(buffer, sizeof(buffer), "%02d:%02d:%06.3f ", (int)at / 3600, (int)at / 60 % 60, fmod(at, 60));
+    out << buffer << line.text << "\n";
+  }
+  out << "23:59:00 fin\n";
+  printf("Escenario generado en %s (%zu eventos)\n", path, lines.size());
+}
+
+// === REPRODUCCIÓN ===
+
+void prepareSd(const Scenario& scenario) {
+  if (keepSd && std::filesystem::exists(sim::sdRoot + "/users.txt")) return;
+  std::filesystem::remove_all(sim::sdRoot);
+  std::filesystem::create_directories(sim::sdRoot);
+  std::ofstream users(sim::sdRoot + "/users.txt");
+  users << "Nombre,PIN,UID,Horario\n";
+  for (const UserLine& user : scenario.users) {
+    users << user.name << "," << user.pin << "," << user.uid << "," << user.schedule << "\n";
+  }
+}
+
+void runWeb(const Event& event) {
+  AsyncWebServerRequest* request = new AsyncWebServerRequest(event.method, event.url.c_str(), "application/x-www-form-urlencoded");
+  // Los campos del formulario se pasan como "a=1&b=2" igual que en la URL
+  std::string upload;
+  if (!event.body.empty() && event.body[0] == '@') {
+    std::ifstream file(event.body.substr(1), std::ios::binary);
+    if (!file) fprintf(stderr, "No se puede leer %s\n", event.body.c_str() + 1);
+    upload.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  } else if (!event.body.empty()) {
+    AsyncWebServerRequest form(HTTP_GET, ("/?" + event.body).c_str());
+    for (const char* name : {"pin", "password", "name", "index", "schedule", "time", "usePin", "peer", "clave"}) {
+      if (form.hasParam(name)) request->addParam(name, form.getParam(name)->value());
+    }
+  }
+  const AsyncCallbackWebHandler* handler = server.find(request->path(), event.method);
+  std::string key = std::string(event.method == HTTP_POST ? "POST " : "GET ") + request->path().c_str();
+  uint64_t allocs = sim::allocations;
+  if (handler) {
+    if (event.kind == EV_PIN) sim::lastInput = {sim::INPUT_PIN, event.atUs};
+    else if (request->path() == "/setTimer") sim::lastInput = {sim::INPUT_WEB, event.atUs};
+    sim::tracking = true;
+    // El cuerpo llega en segmentos TCP de 1436 bytes, como en AsyncTCP
+    for (size_t at = 0; handler->onBody && at < upload.size(); at += 1436) {
+      size_t n = std::min<size_t>(1436, upload.size() - at);
+      handler->onBody(request, (uint8_t*)&upload[at], n, at, upload.size());
+    }
+    handler->onRequest(request);
+    sim::tracking = false;
+  } else {
+    request->send(404);
+  }
+  if (!request->answered) report.webUnanswered++;
+  delete request;
+  report.allocWeb += sim::allocations - allocs;
+  report.web[key].push_back(sim::nowUs() - event.atUs);
+}
+
+uint64_t percentile(std::vector<uint64_t> values, double p) {
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  size_t index = std::min(values.size() - 1, (size_t)(p * (values.size() - 1) + 0.5));
+  return values[index];
+}
+
+void printDistribution(const char* label, const std::vector<uint64_t>& values) {
+  if (values.empty()) return;
+  printf("  %-22s n=%-6zu p50=%9.1f  p90=%9.1f  p99=%9.1f  max=%9.1f ms\n", label, values.size(),
+         percentile(values, 0.50) / 1000.0, percentile(values, 0.90) / 1000.0, percentile(values, 0.99) / 1000.0,
+         percentile(values, 1.0) / 1000.0);
+}
+
+void printReport(const Scenario& scenario, double wallSeconds) {
+  printf("\n=== INFORME DE REPRODUCCIÓN ===\n");
+  printf("Tiempo simulado: %.1f h (%.2f s reales), %llu iteraciones de loop()\n", sim::nowUs() / 3.6e9, wallSeconds,
+         (unsigned long long)report.loops);
+
+  printf("\nLatencia hasta activar el relé (desde la entrada):\n");
+  for (int k = 1; k < sim::INPUT_KIND_COUNT; k++) printDistribution(INPUT_NAMES[k], report.unlock[k]);
+  printf("\nDetección de tarjetas (desde que llegan al lector hasta leer el UID):\n");
+  printDistribution("RFID", sim::cardDetectUs);
+  printf("\nLatencia hasta la primera notificación de Telegram:\n");
+  for (int k = 1; k < sim::INPUT_KIND_COUNT; k++) printDistribution(INPUT_NAMES[k], report.firstNotify[k]);
+  {
+    Untracked untracked;
+    printf("\nTubería de accesos (medida por el firmware, cada etapa desde el final de la anterior):\n  %s\n",
+           accessPipelineJson().c_str());
+  }
+  printf("\nDuración de loop() (iteraciones que consumieron tiempo):\n");
+  printDistribution("loop()", report.loopUs);
+  printf("\nPeticiones web (espera + servicio):\n");
+  for (const auto& route : report.web) printDistribution(route.first.c_str(), route.second);
+
+  printf("\nEventos perdidos:\n");
+  printf("  Tarjetas retiradas sin leer: %llu de %zu (leídas %llu)\n", (unsigned long long)sim::counters.droppedCards,
+         scenario.cards.size(), (unsigned long long)sim::counters.cardsRead);
+  printf("  Cambios de puerta no vistos: %llu de %llu\n", (unsigned long long)sim::counters.droppedDoorEdges,
+         (unsigned long long)sim::counters.doorEdges);
+  printf("  Mensajes de Telegram sin entregar: %zu\n", sim::telegramInbox.size());
+  printf("  Peticiones web sin respuesta: %llu\n", (unsigned long long)report.webUnanswered);
+
+  printf("\nMemoria:\n");
+  printf("  Heap tras setup(): %zu B, pico: %zu B, al final: %zu B\n", report.heapAfterSetup, sim::heapPeak, sim::heapCurrent);
+  printf("  Reservas: setup %llu, loop() %llu, web %llu\n", (unsigned long long)report.allocSetup,
+         (unsigned long long)report.allocLoop, (unsigned long long)report.allocWeb);
+  if (report.swipeLoops) {
+    printf("  Reservas por lectura de tarjeta: %.1f", (double)report.allocSwipe / report.swipeLoops);
+    if (swipeAllocLimit >= 0) printf(" (límite %.1f)", swipeAllocLimit);
+    printf("\n");
+  }
+
+  printf("\nPeriféricos:\n");
+  printf("  Relé activado %llu veces; Telegram: %llu envíos, %llu consultas\n", (unsigned long long)report.relayOn,
+         (unsigned long long)sim::counters.telegramSent, (unsigned long long)sim::counters.telegramPolls);
+  printf("  SD: %llu aperturas, %.1f KiB escritos, %.1f KiB leídos\n", (unsigned long long)sim::counters.sdOpens,
+         sim::counters.sdBytesWritten / 1024.0, sim::counters.sdBytesRead / 1024.0);
+  printf("  Serie: %.1f KiB\n", sim::counters.serialBytes / 1024.0);
+  if (sim::counters.mqttConnects > 0) {
+    uint64_t lost = 0;
+    for (size_t seq = 1; seq < sim::mqttSeen.size(); seq++) lost += sim::mqttSeen[seq] == 0;
+    printf("  MQTT: %llu mensajes (%.1f eventos/mensaje, %.1f KiB), %llu conexiones; eventos recibidos %llu, "
+           "perdidos %llu, duplicados %llu\n",
+           (unsigned long long)sim::counters.mqttMessages,
+           (double)(sim::counters.mqttEvents + sim::counters.mqttDuplicates) / std::max<uint64_t>(1, sim::counters.mqttMessages),
+           sim::counters.mqttBytes / 1024.0, (unsigned long long)sim::counters.mqttConnects,
+           (unsigned long long)sim::counters.mqttEvents, (unsigned long long)lost,
+           (unsigned long long)sim::counters.mqttDuplicates);
+  }
+  if (sim::counters.httpRequests > 0) {
+    // La copia local coincide si /users.txt tiene exactamente los usuarios del par
+    std::vector<std::string> local, remote;
+    std::ifstream users(sim::sdRoot + "/users.txt");
+    std::string line;
+    for (std::getline(users, line); std::getline(users, line);) {
+      if (!line.empty() && line.back() == '\r') line.pop_back(); // println() escribe CRLF
+      if (!line.empty()) local.push_back(line);
+    }
+    for (const sim::PeerUser& user : sim::peerTable()) {
+      remote.push_back(user.name + "," + user.pin + "," + user.uid + "," + user.schedule);
+    }
+    std::sort(local.begin(), local.end());
+    std::sort(remote.begin(), remote.end());
+    printf("  Réplica: %llu consultas al par (%llu con la tabla completa, %.1f KiB); par en la versión %u con %zu "
+           "usuarios, copia local %s\n",
+           (unsigned long long)sim::counters.httpRequests, (unsigned long long)sim::counters.httpFull,
+           sim::counters.httpBytes / 1024.0, sim::peerVersion(), remote.size(), local == remote ? "idéntica" : "DISTINTA");
+  }
+  double seconds = sim::nowUs() / 1e6;
+  // Lo que no es radio ni espera es CPU trabajando, incluidas las vueltas ociosas de loop() en modo activo
+  double total = sim::nowUs() - report.setupEndUs;
+  double radio = sim::counters.radioUs - report.radioAfterSetupUs;
+  double wait = sim::counters.waitUs;
+  if (sim::lightSleep) wait = std::max(0.0, wait - sim::counters.wakeups * sim::currents.wakeUs);
+  double cpu = std::max(0.0, total - radio - wait);
+  double waitMa = sim::lightSleep ? sim::currents.sleepMa : sim::currents.waitMa;
+  if (total > 0) {
+    printf("  Energía (estimada): %.1f mA de media (CPU %.1f%%, radio %.1f%%, %s %.1f%%), %.2f despertares/s\n",
+           (cpu * sim::currents.cpuMa + radio * sim::currents.radioMa + wait * waitMa) / total, 100 * cpu / total,
+           100 * radio / total, sim::lightSleep ? "sueño ligero" : "espera", 100 * wait / total,
+           sim::counters.wakeups / (total / 1e6));
+  }
+  printf("  RC522: %llu transacciones SPI (%.0f/s en reposo), %.1f%% del tiempo esperando al lector\n",
+         (unsigned long long)sim::counters.rfidSpi, (sim::counters.rfidSpi - sim::counters.rfidSpiRead) / seconds,
+         100.0 * sim::counters.rfidBusyUs / sim::nowUs());
+}
+
+// La media de reservas en las vueltas de loop() que leen una tarjeta no debe
+// pasar del límite; devuelve false (y el arnés sale con 2) si lo pasa
+bool checkSwipeAllocations() {
+  if (swipeAllocLimit < 0 || report.swipeLoops == 0) return true;
+  double perSwipe = (double)report.allocSwipe / report.swipeLoops;
+  if (perSwipe <= swipeAllocLimit) return true;
+  fprintf(stderr, "Reservas por lectura de tarjeta: %.1f, por encima del límite de %.1f\n", perSwipe, swipeAllocLimit);
+  return false;
+}
+
+void replay(const Scenario& scenario) {
+  sim::epochAtZero = scenario.startEpoch;
+  sim::onRelay = onRelay;
+  sim::onTelegramSent = onTelegramSent;
+  for (const sim::Card& card : scenario.cards) sim::cards.push_back(card);
+  for (const sim::TelegramIn& message : scenario.telegram) sim::telegramInbox.push_back(message);
+  sim::pinLevel[sim::doorPin] = LOW; // Puerta cerrada
+
+  auto wallStart = std::chrono::steady_clock::now();
+  sim::tracking = true;
+  setup();
+  sim::tracking = false;
+  report.allocSetup = sim::allocations;
+  report.heapAfterSetup = sim::heapCurrent;
+  report.setupEndUs = sim::nowUs();
+  report.radioAfterSetupUs = sim::counters.radioUs;
+  sim::lastInput = {};
+
+  size_t next = 0;
+  std::deque<const Event*> inbound; // Peticiones esperando a que la WiFi escuche
+  while (sim::nowUs() < scenario.endUs) {
+    // Las peticiones web llegan por la tarea de AsyncTCP: aquí se atienden entre iteraciones
+    while (next < scenario.events.size() && scenario.events[next].atUs <= sim::nowUs()) {
+      const Event& event = scenario.events[next++];
+      if (event.kind == EV_DOOR) {
+        int level = event.open ? HIGH : LOW;
+        if (sim::pinLevel[sim::doorPin] != level) {
+          sim::pinLevel[sim::doorPin] = level;
+          sim::doorEdgesPending++;
+          sim::counters.doorEdges++;
+        }
+      } else if (event.kind == EV_MQTT) {
+        sim::tracking = true;
+        sim::setMqttBroker(event.open);
+        sim::tracking = false;
+      } else if (event.kind == EV_PEER) {
+        if (!event.url.empty()) sim::peerUp = event.url == "vuelve";
+        else if (event.open) sim::peerSet(event.peer);
+        else sim::peerErase(event.peer.name);
+      } else {
+        inbound.push_back(&event);
+      }
+    }
+    // Con ahorro de energía la WiFi solo escucha en las balizas: la petición llega en la siguiente.
+    // Una por iteración: la tarea de AsyncTCP y loop() se reparten la CPU
+    if (!inbound.empty()) {
+      uint64_t listen = sim::wifiListenUs;
+      uint64_t arrival = listen ? (inbound.front()->atUs + listen - 1) / listen * listen : inbound.front()->atUs;
+      if (arrival <= sim::nowUs()) {
+        runWeb(*inbound.front());
+        inbound.pop_front();
+      }
+    }
+    sim::tracking = true;
+    simFireTimers();
+    sim::serviceInterrupts();
+    sim::serviceMqtt();
+    sim::serviceTasks();
+    sim::tracking = false;
+
+    // loop() bloqueada en ulTaskNotifyTake(): no se la llama hasta el plazo o una notificación
+    if (sim::sleepUntilUs) {
+      if (!sim::loopNotifications && sim::nowUs() < sim::sleepUntilUs) {
+        sim::advanceUs(1000);
+        sim::counters.waitUs += 1000;
+        continue;
+      }
+      sim::sleepUntilUs = 0;
+      sim::loopNotifications = 0; // ulTaskNotifyTake(pdTRUE, ...) las consume al volver
+      sim::counters.wakeups++;
+    }
+
+    uint64_t start = sim::nowUs();
+    uint64_t allocs = sim::allocations;
+    uint64_t cardsBefore = sim::counters.cardsRead;
+    sim::tracking = true;
+    loop();
+    sim::tracking = false;
+    report.loops++;
+    report.allocLoop += sim::allocations - allocs;
+    if (sim::counters.cardsRead != cardsBefore) {
+      report.swipeLoops++;
+      report.allocSwipe += sim::allocations - allocs;
+    }
+    if (sim::nowUs() != start) {
+      report.loopUs.push_back(sim::nowUs() - start);
+    } else {
+      sim::advanceUs(1000); // Una vuelta ociosa de loop() se resuelve a 1 ms
+    }
+  }
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  printReport(scenario, wall);
+}
+
+void usage() {
+  fprintf(stderr,
+          "Uso:\n"
+          "  replay [--sd DIR] [--conservar] [--serie] [--telegram] [--volcar DIR] [--limite-reservas N] ESCENARIO\n"
+          "  replay --generar ARCHIVO [--semilla N] [--usuarios N] [--paneles N]\n");
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  setenv("TZ", "UTC0", 1); // El escenario ya está en hora local
+  tzset();
+  const char* scenarioPath = nullptr;
+  const char* generatePath = nullptr;
+  unsigned seed = 1;
+  int users = 40;
+  int viewers = 2;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--sd" && i + 1 < argc) sim::sdRoot = argv[++i];
+    else if (arg == "--serie") sim::serialEcho = true;
+    else if (arg == "--telegram") showTelegram = true;
+    else if (arg == "--conservar") keepSd = true;
+    else if (arg == "--volcar" && i + 1 < argc) sim::dumpDir = argv[++i];
+    else if (arg == "--limite-reservas" && i + 1 < argc) swipeAllocLimit = atof(argv[++i]);
+    else if (arg == "--generar" && i + 1 < argc) generatePath = argv[++i];
+    else if (arg == "--semilla" && i + 1 < argc) seed = atoi(argv[++i]);
+    else if (arg == "--usuarios" && i + 1 < argc) users = std::max(1, atoi(argv[++i]));
+    else if (arg == "--paneles" && i + 1 < argc) viewers = std::max(0, atoi(argv[++i]));
+    else if (arg[0] != '-' && !scenarioPath) scenarioPath = argv[i];
+    else usage();
+  }
+  if (generatePath) {
+    generateScenario(generatePath, seed, users, viewers);
+    return 0;
+  }
+  if (!scenarioPath) usage();
+  Scenario scenario = loadScenario(scenarioPath);
+  prepareSd(scenario);
+  replay(scenario);
+  return checkSwipeAllocations() ? 0 : 2;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <Arduino.h>
+#include <vector>
+#define NEO_GRB 0x52
+#define NEO_KHZ800 0x0000
+class Adafruit_NeoPixel {
+ public:
+  Adafruit_NeoPixel(uint16_t n, int16_t pin, int type) : pixels(n) {}
+  void begin() {}
+  void show();
+  void setBrightness(uint8_t) {}
+  void setPixelColor(uint16_t n, uint32_t color) { if (n < pixels.size()) pixels[n] = color; }
+  uint32_t getPixelColor(uint16_t n) const { return n < pixels.size() ? pixels[n] : 0; }
+  void fill(uint32_t color, uint16_t first = 0, uint16_t count = 0) {
+    for (size_t i = first; i < pixels.size() && (count == 0 || i < (size_t)first + count); i++) pixels[i] = color;
+  }
+  void clear() { fill(0); }
+  uint16_t numPixels() const { return pixels.size(); }
+  bool canShow() const { return true; }
+  static uint32_t Color(uint8_t r, uint8_t g, uint8_t b) { return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b; }
+
+ private:
+  std::vector<uint32_t> pixels;
+};
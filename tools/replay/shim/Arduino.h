@@ -0,0 +1,288 @@
+// Sustituto mínimo del núcleo Arduino-ESP32 para compilar src/main.cpp en Linux.
+// Solo cubre lo que usa el firmware; el tiempo es el reloj virtual de sim.h.
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <strings.h>
+
+typedef uint8_t byte;
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define HEX 16
+#define DEC 10
+#define RISING 1
+#define FALLING 2
+#define CHANGE 3
+#define ONLOW 4
+#define ONHIGH 5
+#define PROGMEM
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define RTC_DATA_ATTR
+#define F(x) x
+#ifndef constrain
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#endif
+using std::max;
+using std::min;
+
+// strlcpy forma parte de newlib en el ESP32 pero glibc solo la trae desde 2.38
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+#define SIM_NEEDS_STRLCPY 1
+extern "C" size_t strlcpy(char* dst, const char* src, size_t size);
+#endif
+
+class String {
+ public:
+  String() {}
+  String(const char* c) : s(c ? c : "") {}
+  String(const std::string& c) : s(c) {}
+  String(char c) : s(1, c) {}
+  String(int v, int base = DEC) : s(format((long long)v, base)) {}
+  String(unsigned v, int base = DEC) : s(formatUnsigned(v, base)) {}
+  String(long v, int base = DEC) : s(format(v, base)) {}
+  String(unsigned long v, int base = DEC) : s(formatUnsigned(v, base)) {}
+  String(long long v, int base = DEC) : s(format(v, base)) {}
+  String(unsigned long long v, int base = DEC) : s(formatUnsigned(v, base)) {}
+  String(unsigned char v, int base = DEC) : s(formatUnsigned(v, base)) {}
+  String(float v, unsigned decimals = 2) : String((double)v, decimals) {}
+  String(double v, unsigned decimals = 2) {
+    char buffer[48];
+    snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, v);
+    s = buffer;
+  }
+
+  unsigned length() const { return s.size(); }
+  const char* c_str() const { return s.c_str(); }
+  bool reserve(unsigned n) { s.reserve(n); return true; }
+  bool isEmpty() const { return s.empty(); }
+
+  String& operator+=(const String& o) { s += o.s; return *this; }
+  String& operator+=(const char* o) { s += o ? o : ""; return *this; }
+  String& operator+=(char o) { s += o; return *this; }
+  String& operator+=(int o) { s += std::to_string(o); return *this; }
+  String& operator+=(unsigned o) { s += std::to_string(o); return *this; }
+  String& operator+=(long o) { s += std::to_string(o); return *this; }
+  String& operator+=(unsigned long o) { s += std::to_string(o); return *this; }
+  bool concat(const char* c, unsigned n) { s.append(c, n); return true; }
+  bool concat(const String& c) { s += c.s; return true; }
+  bool concat(const char* c) { s += c; return true; }
+  bool concat(char c) { s += c; return true; }
+
+  bool operator==(const String& o) const { return s == o.s; }
+  bool operator==(const char* o) const { return s == (o ? o : ""); }
+  bool operator!=(const String& o) const { return s != o.s; }
+  bool operator!=(const char* o) const { return !(*this == o); }
+  bool operator<(const String& o) const { return s < o.s; }
+  bool equals(const String& o) const { return s == o.s; }
+  bool equalsIgnoreCase(const String& o) const { return strcasecmp(s.c_str(), o.s.c_str()) == 0; }
+  int compareTo(const String& o) const { return s.compare(o.s); }
+
+  char operator[](unsigned i) const { return i < s.size() ? s[i] : 0; }
+  char& operator[](unsigned i) { return s[i]; }
+  char charAt(unsigned i) const { return (*this)[i]; }
+  void setCharAt(unsigned i, char c) { if (i < s.size()) s[i] = c; }
+
+  int indexOf(char c, unsigned from = 0) const { return found(s.find(c, from)); }
+  int indexOf(const String& c, unsigned from = 0) const { return found(s.find(c.s, from)); }
+  int lastIndexOf(char c) const { return found(s.rfind(c)); }
+  int lastIndexOf(char c, unsigned from) const { return found(s.rfind(c, from)); }
+  int lastIndexOf(const String& c) const { return found(s.rfind(c.s)); }
+  String substring(unsigned from) const { return from >= s.size() ? String() : String(s.substr(from)); }
+  String substring(unsigned from, unsigned to) const {
+    if (from > to) std::swap(from, to);
+    if (from >= s.size()) return String();
+    return String(s.substr(from, to - from));
+  }
+  bool startsWith(const String& p) const { return s.compare(0, p.s.size(), p.s) == 0; }
+  bool endsWith(const String& p) const {
+    return s.size() >= p.s.size() && s.compare(s.size() - p.s.size(), p.s.size(), p.s) == 0;
+  }
+
+  void trim() {
+    size_t end = s.size();
+    while (end > 0 && isspace((unsigned char)s[end - 1])) end--;
+    size_t start = 0;
+    while (start < end && isspace((unsigned char)s[start])) start++;
+    s = s.substr(start, end - start);
+  }
+  void toUpperCase() { for (auto& c : s) c = toupper((unsigned char)c); }
+  void toLowerCase() { for (auto& c : s) c = tolower((unsigned char)c); }
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+  void replace(const String& from, const String& to) {
+    if (from.s.empty()) return;
+    size_t p = 0;
+    while ((p = s.find(from.s, p)) != std::string::npos) {
+      s.replace(p, from.s.size(), to.s);
+      p += to.s.size();
+    }
+  }
+  void remove(unsigned i) { if (i < s.size()) s.erase(i); }
+  void remove(unsigned i, unsigned n) { if (i < s.size()) s.erase(i, n); }
+
+  std::string s;
+
+ private:
+  static int found(size_t p) { return p == std::string::npos ? -1 : (int)p; }
+  static std::string format(long long v, int base) {
+    if (base == DEC) return std::to_string(v);
+    return formatUnsigned((unsigned long long)v, base);
+  }
+  static std::string formatUnsigned(unsigned long long v, int base) {
+    if (base == DEC) return std::to_string(v);
+    char buffer[72];
+    int pos = sizeof(buffer) - 1;
+    buffer[pos] = '\0';
+    do {
+      int digit = v % base;
+      buffer[--pos] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+      v /= base;
+    } while (v > 0);
+    return buffer + pos;
+  }
+};
+
+inline String operator+(const String& a, const String& b) { return String(a.s + b.s); }
+inline String operator+(const String& a, const char* b) { return String(a.s + (b ? b : "")); }
+inline String operator+(const char* a, const String& b) { return String((a ? a : "") + b.s); }
+inline String operator+(const String& a, char b) { return String(a.s + b); }
+inline String operator+(const String& a, int b) { return String(a.s + std::to_string(b)); }
+inline String operator+(const String& a, unsigned b) { return String(a.s + std::to_string(b)); }
+inline String operator+(const String& a, long b) { return String(a.s + std::to_string(b)); }
+inline String operator+(const String& a, unsigned long b) { return String(a.s + std::to_string(b)); }
+
+class Print;
+class Printable {
+ public:
+  virtual ~Printable() {}
+  virtual size_t printTo(Print& p) const = 0;
+};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char* text) { return text ? write((const uint8_t*)text, strlen(text)) : 0; }
+  size_t write(const char* text, size_t size) { return write((const uint8_t*)text, size); }
+
+  size_t print(const String& v) { return write(v.c_str(), v.length()); }
+  size_t print(const char* v) { return write(v); }
+  size_t print(char v) { return write((uint8_t)v); }
+  size_t print(int v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned v, int base = DEC) { return print(String(v, base)); }
+  size_t print(long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(long long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned long long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned char v, int base = DEC) { return print(String(v, base)); }
+  size_t print(double v, int decimals = 2) { return print(String(v, (unsigned)decimals)); }
+  size_t print(const Printable& v) { return v.printTo(*this); }
+  size_t println() { return write("\r\n"); }
+  template <class T>
+  size_t println(const T& v) { size_t n = print(v); return n + println(); }
+  template <class T>
+  size_t println(const T& v, int base) { size_t n = print(v, base); return n + println(); }
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (n < 0) return 0;
+    return write(buffer, std::min<size_t>(n, sizeof(buffer) - 1));
+  }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  void setTimeout(unsigned long) {}
+  String readStringUntil(char terminator) {
+    std::string out;
+    int c;
+    while ((c = read()) >= 0 && c != terminator) out += (char)c;
+    return String(out);
+  }
+  String readString() {
+    std::string out;
+    int c;
+    while ((c = read()) >= 0) out += (char)c;
+    return String(out);
+  }
+  size_t readBytes(uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    int c;
+    while (n < size && (c = read()) >= 0) buffer[n++] = (uint8_t)c;
+    return n;
+  }
+  size_t readBytes(char* buffer, size_t size) { return readBytes((uint8_t*)buffer, size); }
+};
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long) {}
+  void flush() {}
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned us);
+void yield();
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int level);
+int digitalRead(int pin);
+void attachInterrupt(int pin, void (*handler)(), int mode);
+void detachInterrupt(int pin);
+inline int digitalPinToInterrupt(int pin) { return pin; }
+long random(long max);
+long random(long min, long max);
+uint32_t esp_random();
+
+bool getLocalTime(struct tm* info, uint32_t ms = 5000);
+void configTime(long gmtOffset, int daylightOffset, const char* server1, const char* server2 = nullptr, const char* server3 = nullptr);
+
+class EspClass {
+ public:
+  uint32_t getFreeHeap();
+  uint32_t getMinFreeHeap();
+  uint32_t getMaxAllocHeap();
+  uint32_t getCpuFreqMHz() { return 240; }
+  void restart();
+  uint64_t getEfuseMac() { return 0x0000AABBCCDDEEFFULL; }
+};
+extern EspClass ESP;
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "esp_system.h"
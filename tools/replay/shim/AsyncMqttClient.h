@@ -0,0 +1,52 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+
+enum class AsyncMqttClientDisconnectReason : uint8_t {
+  TCP_DISCONNECTED = 0,
+  MQTT_UNACCEPTABLE_PROTOCOL_VERSION = 1,
+  MQTT_IDENTIFIER_REJECTED = 2,
+  MQTT_SERVER_UNAVAILABLE = 3,
+  MQTT_MALFORMED_CREDENTIALS = 4,
+  MQTT_NOT_AUTHORIZED = 5,
+};
+
+// Cliente simulado: conecta con el broker de sim (ver sim::mqttBrokerUp), que
+// guarda cada mensaje publicado y confirma los de QoS 1 tras sim::costs.mqttRttUs.
+// Las llamadas de vuelta se ejecutan en sim::serviceMqtt(), entre iteraciones
+class AsyncMqttClient {
+ public:
+  typedef std::function<void(bool sessionPresent)> OnConnectUserCallback;
+  typedef std::function<void(AsyncMqttClientDisconnectReason reason)> OnDisconnectUserCallback;
+  typedef std::function<void(uint16_t packetId)> OnPublishUserCallback;
+
+  AsyncMqttClient& setKeepAlive(uint16_t keepAlive) { return *this; }
+  AsyncMqttClient& setClientId(const char* clientId) { return *this; }
+  AsyncMqttClient& setCleanSession(bool cleanSession) { return *this; }
+  AsyncMqttClient& setCredentials(const char* username, const char* password = nullptr) { return *this; }
+  AsyncMqttClient& setWill(const char* topic, uint8_t qos, bool retain, const char* payload = nullptr, size_t length = 0) {
+    return *this;
+  }
+  AsyncMqttClient& setServer(const char* host, uint16_t port) { return *this; }
+  AsyncMqttClient& onConnect(OnConnectUserCallback callback) {
+    connectCallback = callback;
+    return *this;
+  }
+  AsyncMqttClient& onDisconnect(OnDisconnectUserCallback callback) {
+    disconnectCallback = callback;
+    return *this;
+  }
+  AsyncMqttClient& onPublish(OnPublishUserCallback callback) {
+    publishCallback = callback;
+    return *this;
+  }
+  bool connected() const;
+  void connect();
+  void disconnect(bool force = false);
+  uint16_t publish(const char* topic, uint8_t qos, bool retain, const char* payload = nullptr, size_t length = 0,
+                   bool dup = false, uint16_t messageId = 0);
+
+  OnConnectUserCallback connectCallback;
+  OnDisconnectUserCallback disconnectCallback;
+  OnPublishUserCallback publishCallback;
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include <vector>
+
+enum WebRequestMethod { HTTP_GET = 1, HTTP_POST = 2, HTTP_ANY = 127 };
+
+class AsyncWebParameter {
+ public:
+  AsyncWebParameter(const String& name, const String& value) : _name(name), _value(value) {}
+  const String& name() const { return _name; }
+  const String& value() const { return _value; }
+
+ private:
+  String _name;
+  String _value;
+};
+
+typedef std::function<size_t(uint8_t*, size_t, size_t)> AwsResponseFiller;
+typedef std::function<void(void)> ArDisconnectHandler;
+
+class AsyncWebServerResponse {
+ public:
+  int code = 200;
+  String contentType;
+  String body;
+  AwsResponseFiller filler; // Respuestas por trozos
+  std::vector<std::pair<String, String>> headers;
+  void addHeader(const String& name, const String& value) { headers.push_back({name, value}); }
+};
+
+// Petición construida por el arnés; guarda la respuesta para que la mida
+class AsyncWebServerRequest {
+ public:
+  AsyncWebServerRequest(WebRequestMethod method, const String& url, const String& contentType = "");
+  ~AsyncWebServerRequest();
+  void* _tempObject = nullptr;
+
+  bool hasParam(const String& name, bool post = false, bool file = false) const;
+  AsyncWebParameter* getParam(const String& name, bool post = false, bool file = false) const;
+  void send(int code, const String& contentType = String(), const String& content = String());
+  void send(AsyncWebServerResponse* response);
+  void redirect(const String& url) { send(302, "text/plain", url); }
+  String contentType() const { return _contentType; }
+  size_t contentLength() const { return 0; }
+  String url() const { return _path; }
+  WebRequestMethod method() const { return _method; }
+  AsyncWebServerResponse* beginResponse(int code, const String& contentType = String(), const String& content = String());
+  AsyncWebServerResponse* beginChunkedResponse(const String& contentType, AwsResponseFiller filler);
+  void onDisconnect(ArDisconnectHandler handler) { _onDisconnect = handler; }
+
+  void addParam(const String& name, const String& value) { _params.push_back(new AsyncWebParameter(name, value)); }
+  const String& path() const { return _path; }
+
+  // Resultado
+  bool answered = false;
+  int responseCode = 0;
+  size_t responseBytes = 0;
+
+ private:
+  WebRequestMethod _method;
+  String _path;
+  String _contentType;
+  std::vector<AsyncWebParameter*> _params;
+  ArDisconnectHandler _onDisconnect;
+};
+
+typedef std::function<void(AsyncWebServerRequest*)> ArRequestHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest*, const String&, size_t, uint8_t*, size_t, bool)> ArUploadHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest*, uint8_t*, size_t, size_t, size_t)> ArBodyHandlerFunction;
+
+struct AsyncCallbackWebHandler {
+  String path;
+  WebRequestMethod method;
+  ArRequestHandlerFunction onRequest;
+  ArUploadHandlerFunction onUpload;
+  ArBodyHandlerFunction onBody;
+};
+
+class AsyncWebServer {
+ public:
+  AsyncWebServer(int port) {}
+  AsyncCallbackWebHandler& on(const char* path, WebRequestMethod method, ArRequestHandlerFunction onRequest,
+                              ArUploadHandlerFunction onUpload = nullptr, ArBodyHandlerFunction onBody = nullptr);
+  void begin() {}
+  const AsyncCallbackWebHandler* find(const String& path, WebRequestMethod method) const;
+
+ private:
+  std::vector<AsyncCallbackWebHandler*> handlers;
+};
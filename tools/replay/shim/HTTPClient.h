@@ -0,0 +1,28 @@
+#pragma once
+#include <Arduino.h>
+
+#define HTTP_CODE_OK 200
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+
+// Cliente simulado: cualquier URL llega al par de sim (ver sim::peerUp), que
+// contesta a POST /api/users/changes con su diario tras sim::costs.netRttUs. Si el
+// par está caído, POST() espera el plazo de conexión y falla
+class HTTPClient {
+ public:
+  bool begin(const String& url) {
+    this->url = url;
+    return true;
+  }
+  void setConnectTimeout(int32_t timeout) { connectTimeoutMs = timeout; }
+  void setTimeout(uint16_t timeout) {}
+  void addHeader(const String& name, const String& value) {}
+  int POST(const String& payload);
+  int writeToStream(Stream* stream);
+  String getString() { return String(body); }
+  void end() { body.clear(); }
+
+ private:
+  String url;
+  std::string body;
+  int32_t connectTimeoutMs = 5000; // Valor por defecto de HTTPClient
+};
@@ -0,0 +1,37 @@
+#pragma once
+#include <Arduino.h>
+// Lector simulado: las tarjetas del escenario aparecen en sim::cards y solo se
+// pueden leer durante su ventana de presencia
+class MFRC522 {
+ public:
+  enum PCD_Register : byte {
+    CommandReg = 0x01, ComIEnReg = 0x02, DivIEnReg = 0x03, ComIrqReg = 0x04, DivIrqReg = 0x05,
+    ErrorReg = 0x06, Status2Reg = 0x08, FIFODataReg = 0x09, FIFOLevelReg = 0x0A, ControlReg = 0x0C,
+    BitFramingReg = 0x0D, CollReg = 0x0E, ModeReg = 0x11, TxModeReg = 0x12, RxModeReg = 0x13,
+    TxControlReg = 0x14, TModeReg = 0x2A, TPrescalerReg = 0x2B, TReloadRegH = 0x2C, TReloadRegL = 0x2D,
+    VersionReg = 0x37
+  };
+  enum PCD_Command : byte { PCD_Idle = 0x00, PCD_Transceive = 0x0C, PCD_SoftReset = 0x0F };
+  enum PICC_Command : byte { PICC_CMD_REQA = 0x26, PICC_CMD_WUPA = 0x52 };
+  enum StatusCode : byte { STATUS_OK, STATUS_ERROR, STATUS_COLLISION, STATUS_TIMEOUT };
+  struct Uid {
+    byte size;
+    byte uidByte[10];
+    byte sak;
+  };
+  Uid uid = {};
+
+  MFRC522(byte ss, byte rst) {}
+  void PCD_Init();
+  byte PCD_ReadRegister(PCD_Register reg);
+  void PCD_WriteRegister(PCD_Register reg, byte value);
+  void PCD_SetRegisterBitMask(PCD_Register reg, byte mask);
+  void PCD_ClearRegisterBitMask(PCD_Register reg, byte mask);
+  bool PICC_IsNewCardPresent();
+  bool PICC_ReadCardSerial();
+  StatusCode PICC_HaltA() { return STATUS_OK; }
+  void PCD_StopCrypto1() {}
+  StatusCode PICC_RequestA(byte* buffer, byte* size);
+  void PCD_AntennaOn() {}
+  void PCD_AntennaOff() {}
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <Arduino.h>
+#include <memory>
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+// Archivo respaldado por un archivo real bajo sim::sdRoot. Se copia por valor
+// como el File de Arduino y se cierra al soltar la última copia.
+class File : public Stream {
+ public:
+  File() {}
+  explicit File(std::shared_ptr<FILE> handle, const String& path) : handle(handle), path(path) {}
+  operator bool() const { return (bool)handle; }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t read(uint8_t* buffer, size_t size);
+  bool seek(uint32_t position);
+  size_t position();
+  size_t size();
+  void flush();
+  void close();
+  const char* name() { return path.c_str(); }
+  bool isDirectory() { return false; }
+  File openNextFile() { return File(); }
+
+ private:
+  std::shared_ptr<FILE> handle;
+  String path;
+};
+
+class SDFS {
+ public:
+  bool begin(int cs) { return true; }
+  File open(const char* path, const char* mode = FILE_READ, bool create = false);
+  File open(const String& path, const char* mode = FILE_READ, bool create = false) { return open(path.c_str(), mode, create); }
+  bool exists(const char* path);
+  bool exists(const String& path) { return exists(path.c_str()); }
+  bool remove(const char* path);
+  bool remove(const String& path) { return remove(path.c_str()); }
+  bool rename(const char* from, const char* to);
+  bool rename(const String& from, const String& to) { return rename(from.c_str(), to.c_str()); }
+  bool mkdir(const char* path);
+  bool mkdir(const String& path) { return mkdir(path.c_str()); }
+  uint64_t totalBytes() { return 4ULL << 30; }
+  uint64_t usedBytes();
+};
+extern SDFS SD;
@@ -0,0 +1,33 @@
+#pragma once
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#define TELEGRAM_CERTIFICATE_ROOT ""
+#define HANDLE_MESSAGES 10
+
+struct telegramMessage {
+  String text;
+  String chat_id;
+  String chat_title;
+  String from_id;
+  String from_name;
+  String date;
+  String type;
+  String query_id;
+  int update_id = 0;
+  int message_id = 0;
+};
+
+// Bot simulado: getUpdates entrega lo que el escenario dejó en sim::telegramInbox
+// y cada envío cuesta sim::costs.telegramSendUs de reloj virtual
+class UniversalTelegramBot {
+ public:
+  UniversalTelegramBot(const String& token, Client& client) {}
+  int getUpdates(long offset);
+  bool sendMessage(const String& chatId, const String& text, const String& parseMode = "");
+  bool sendMessageWithInlineKeyboard(const String& chatId, const String& text, const String& parseMode,
+                                     const String& keyboard, int messageId = 0);
+  bool answerCallbackQuery(const String& queryId, const String& text = "", bool showAlert = false,
+                           const String& url = "", int cacheTime = 0);
+  telegramMessage messages[HANDLE_MESSAGES];
+  long last_message_received = 0;
+};
@@ -0,0 +1,29 @@
+#pragma once
+#include <Arduino.h>
+#define WL_CONNECTED 3
+typedef enum { WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM } wifi_ps_type_t;
+class IPAddress : public Printable {
+ public:
+  String toString() const { return "192.168.1.50"; }
+  size_t printTo(Print& p) const override { return p.print(toString()); }
+};
+class Client : public Stream {
+ public:
+  size_t write(uint8_t) override { return 1; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+class WiFiClient : public Client {};
+class WiFiClass {
+ public:
+  void begin(const char*, const char*) {}
+  int status() { return WL_CONNECTED; }
+  IPAddress localIP() { return IPAddress(); }
+  String macAddress() { return "AA:BB:CC:DD:EE:FF"; }
+  int RSSI() { return -55; }
+  // Con ahorro de energía, la WiFi solo escucha en las balizas DTIM (ver sim::wifiListenUs)
+  bool setSleep(bool enabled) { return setSleep(enabled ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE); }
+  bool setSleep(wifi_ps_type_t type);
+};
+extern WiFiClass WiFi;
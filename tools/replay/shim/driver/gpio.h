@@ -0,0 +1,13 @@
+#pragma once
+#include <esp_err.h>
+typedef int gpio_num_t;
+typedef enum {
+  GPIO_INTR_DISABLE = 0,
+  GPIO_INTR_POSEDGE = 1,
+  GPIO_INTR_NEGEDGE = 2,
+  GPIO_INTR_ANYEDGE = 3,
+  GPIO_INTR_LOW_LEVEL = 4,
+  GPIO_INTR_HIGH_LEVEL = 5
+} gpio_int_type_t;
+// Cambia el tipo de interrupción del pin (como en el ESP32, el mismo que despierta del sueño ligero)
+esp_err_t gpio_wakeup_enable(gpio_num_t pin, gpio_int_type_t type);
@@ -0,0 +1,8 @@
+#pragma once
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NOT_SUPPORTED 0x106
+inline const char* esp_err_to_name(esp_err_t err) {
+  return err == ESP_OK ? "ESP_OK" : err == ESP_ERR_NOT_SUPPORTED ? "ESP_ERR_NOT_SUPPORTED" : "ESP_FAIL";
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include <esp_err.h>
+// Gestión de energía: con light_sleep_enable, el arnés cuenta las esperas de loop()
+// como sueño ligero en lugar de CPU en reposo
+typedef struct {
+  int max_freq_mhz;
+  int min_freq_mhz;
+  bool light_sleep_enable;
+} esp_pm_config_esp32_t;
+esp_err_t esp_pm_configure(const void* config);
@@ -0,0 +1,3 @@
+#pragma once
+#include <esp_err.h>
+esp_err_t esp_sleep_enable_gpio_wakeup();
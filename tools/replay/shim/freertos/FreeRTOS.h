@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+#define portMAX_DELAY 0xffffffffu
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portTICK_PERIOD_MS 1
+// El arnés es de un solo hilo: las secciones críticas no necesitan nada
+typedef struct { int unused; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+inline void portENTER_CRITICAL(portMUX_TYPE*) {}
+inline void portEXIT_CRITICAL(portMUX_TYPE*) {}
+inline void portENTER_CRITICAL_ISR(portMUX_TYPE*) {}
+inline void portEXIT_CRITICAL_ISR(portMUX_TYPE*) {}
+#define portYIELD_FROM_ISR(...)
@@ -0,0 +1,10 @@
+#pragma once
+#include "FreeRTOS.h"
+typedef struct SimQueue* QueueHandle_t;
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t wait);
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* item, TickType_t wait);
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void* item, BaseType_t* woken);
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue);
@@ -0,0 +1,18 @@
+#pragma once
+#include "FreeRTOS.h"
+typedef struct SimTask* TaskHandle_t;
+#define tskNO_AFFINITY 0x7fffffff
+// Las tareas se registran pero no se ejecutan (salvo la de la réplica, ver sim.cpp)
+BaseType_t xTaskCreatePinnedToCore(void (*code)(void*), const char* name, uint32_t stack, void* parameter,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core);
+BaseType_t xTaskCreate(void (*code)(void*), const char* name, uint32_t stack, void* parameter,
+                       UBaseType_t priority, TaskHandle_t* handle);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelayUntil(TickType_t* previous, TickType_t increment);
+TickType_t xTaskGetTickCount();
+void vTaskDelete(TaskHandle_t task);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* woken);
@@ -0,0 +1,5 @@
+#pragma once
+#include <driver/gpio.h>
+struct gpio_dev_t {};
+extern gpio_dev_t GPIO;
+void gpio_ll_wakeup_enable(gpio_dev_t* hw, gpio_num_t pin, gpio_int_type_t type);
@@ -0,0 +1,168 @@
+// Estado del simulador compartido entre las cabeceras de sustitución y el
+// arnés de reproducción. El firmware no lo incluye nunca directamente.
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+// Reloj virtual en microsegundos; solo avanza con delay(), con los costes
+// simulados de los periféricos y cuando el arnés salta al siguiente evento
+uint64_t nowUs();
+void advanceUs(uint64_t us);
+
+// Hora de pared correspondiente al instante virtual 0 y si ya se "sincronizó" por NTP
+extern int64_t epochAtZero;
+extern bool wallClockValid;
+
+// Costes simulados (microsegundos)
+struct Costs {
+  uint32_t sdOpenUs = 1500;       // Abrir/cerrar un archivo en FAT
+  uint32_t sdKiBUs = 400;         // Leer o escribir 1 KiB
+  uint32_t sdCommandUs = 150;     // Una orden de lectura a la tarjeta (un sector o varios seguidos)
+  uint32_t sdCallUs = 3;          // Cada llamada a File::read(): VFS, cerrojo y FatFs
+  uint32_t spiTransactionUs = 15; // Un acceso a un registro del RC522
+  uint32_t telegramSendUs = 350000;
+  uint32_t telegramPollUs = 250000;
+  uint32_t serialBaud = 115200;   // 0 = la salida serie no cuesta tiempo
+  uint32_t mqttRttUs = 20000;     // Ida y vuelta al broker: conexión y confirmación de QoS 1
+  uint32_t mqttRadioUs = 1000;    // Radio ocupada por cada mensaje publicado
+  uint32_t netRttUs = 30000;      // Ida y vuelta de una petición HTTP al par de la réplica
+  uint32_t netKiBUs = 1000;       // Recibir 1 KiB del par (unos 8 Mbit/s útiles)
+};
+extern Costs costs;
+
+// Consumo típico de un ESP32-WROOM-32 a 3,3 V (hoja de datos y guía de ahorro de
+// energía de Espressif), en mA: sirven para comparar modos, no sustituyen a medir la placa
+struct Currents {
+  double cpuMa = 50;    // CPU a 240 MHz trabajando (o girando en loop()), WiFi en modem sleep
+  double radioMa = 130; // Transmitiendo o recibiendo (consultas y envíos de Telegram)
+  double waitMa = 20;   // loop() bloqueada con la CPU a 40-80 MHz, WiFi en modem sleep
+  double sleepMa = 2;   // Sueño ligero automático, media con las escuchas de balizas DTIM3
+  double wakeUs = 1000; // Salir del sueño ligero y volver a entrar, a corriente de CPU
+};
+extern Currents currents;
+
+// Pines
+extern int pinLevel[64];
+extern int relayPin;
+extern int doorPin;
+extern int rfidIrqPin;
+
+// Lector RFID: una tarjeta solo se puede leer mientras está delante del lector
+struct Card {
+  uint8_t uid[10];
+  uint8_t size;
+  uint64_t fromUs;
+  uint64_t untilUs;
+};
+extern std::deque<Card> cards;
+
+// Telegram
+struct TelegramIn {
+  std::string chatId;
+  std::string text;
+  std::string queryId; // No vacío para pulsaciones de teclado en línea
+  uint64_t atUs;
+};
+extern std::deque<TelegramIn> telegramInbox;
+
+// Broker MQTT: guarda lo publicado y cuenta los eventos por su "seq"
+extern bool mqttBrokerUp;
+extern std::vector<uint8_t> mqttSeen; // Veces que llegó cada seq
+void setMqttBroker(bool up);          // Al caer, corta la conexión del cliente
+void serviceMqtt();                   // Conexiones y confirmaciones que ya tocan
+
+// Par de la réplica de usuarios: otro controlador con su propio diario de cambios,
+// que se modifica desde el escenario y responde a /api/users/changes
+struct PeerUser {
+  std::string name;
+  std::string pin;
+  std::string uid;
+  std::string schedule;
+};
+extern bool peerUp;
+void peerSet(const PeerUser& user);       // Alta o modificación: un registro "A"
+void peerErase(const std::string& name);  // Baja: un registro "B"
+const std::vector<PeerUser>& peerTable();
+uint32_t peerVersion();
+
+// Entrada que provocó la última acción: el arnés la usa para atribuir la apertura
+enum InputKind { INPUT_NONE, INPUT_CARD, INPUT_PIN, INPUT_TELEGRAM, INPUT_WEB, INPUT_KIND_COUNT };
+struct InputRef {
+  InputKind kind = INPUT_NONE;
+  uint64_t atUs = 0;
+};
+extern InputRef lastInput;
+
+// Desde que la tarjeta llega al lector hasta que el firmware lee su UID
+extern std::vector<uint64_t> cardDetectUs;
+
+// Tareas que corren fuera de loop() (solo la de la réplica). blockUs() bloquea la
+// tarea en curso hasta el plazo y devuelve el control al arnés; llamada desde
+// loop(), el tiempo simplemente pasa. serviceTasks() reanuda la que ya toca
+void blockUs(uint64_t us);
+void serviceTasks();
+
+// Llama a las rutinas de interrupción de los pines cuyo nivel cambió: la puerta y la
+// IRQ del RC522 (si su temporizador venció o una tarjeta respondió al REQA)
+void serviceInterrupts();
+
+// Energía: loop() bloqueada en ulTaskNotifyTake() hasta sleepUntilUs o hasta una
+// notificación; mientras, el arnés no la llama y cuenta el tiempo como espera
+extern uint64_t sleepUntilUs;
+extern uint32_t loopNotifications;
+extern bool lightSleep;        // esp_pm_configure() con light_sleep_enable
+extern uint64_t wifiListenUs;  // Intervalo de escucha de la WiFi: lo que puede tardar en llegar una petición
+
+// Contadores que el arnés resume al final
+struct Counters {
+  uint64_t droppedCards = 0;
+  uint64_t cardsRead = 0;
+  uint64_t doorEdges = 0;
+  uint64_t droppedDoorEdges = 0;
+  uint64_t telegramSent = 0;
+  uint64_t telegramPolls = 0;
+  uint64_t sdOpens = 0;
+  uint64_t sdBytesWritten = 0;
+  uint64_t sdBytesRead = 0;
+  uint64_t serialBytes = 0;
+  uint64_t pixelPushes = 0;
+  uint64_t rfidSpi = 0;      // Transacciones SPI con el RC522
+  uint64_t rfidSpiRead = 0;  // ...de ellas, leyendo una tarjeta (anticolisión y selección)
+  uint64_t rfidBusyUs = 0;   // Tiempo que el firmware pasó esperando al RC522
+  uint64_t radioUs = 0;      // Telegram
+  uint64_t waitUs = 0;       // loop() bloqueada esperando un evento o un plazo
+  uint64_t wakeups = 0;      // Esperas terminadas (por plazo o por notificación)
+  uint64_t mqttMessages = 0;
+  uint64_t mqttBytes = 0;
+  uint64_t mqttEvents = 0;     // Eventos distintos recibidos por el broker
+  uint64_t mqttDuplicates = 0; // Reenvíos de eventos que ya habían llegado
+  uint64_t mqttConnects = 0;
+  uint64_t httpRequests = 0;   // Peticiones del firmware al par de la réplica
+  uint64_t httpBytes = 0;
+  uint64_t httpFull = 0;       // ...de ellas, respondidas con la tabla completa
+};
+extern Counters counters;
+
+// Memoria: todas las reservas con new pasan por el contador
+extern size_t heapCurrent;
+extern size_t heapPeak;
+extern uint64_t allocations;
+extern bool tracking; // Solo se cuentan las reservas hechas desde el firmware
+const size_t HEAP_SIZE = 320 * 1024; // Heap típico disponible en un ESP32 con WiFi
+
+// Raíz en el disco del anfitrión que hace de tarjeta SD
+extern std::string sdRoot;
+extern bool serialEcho;
+extern std::string dumpDir; // Si no está vacío, cada respuesta web se guarda en DIR/NNN_ruta
+
+// Notificaciones del firmware hacia el arnés
+extern void (*onRelay)(bool on);
+extern void (*onTelegramSent)(const std::string& chatId, const std::string& text);
+extern int doorEdgesPending;
+
+}  // namespace sim
@@ -0,0 +1,1025 @@
+// Implementación de las cabeceras de sustitución sobre el reloj virtual
+#include <Arduino.h>
+#include <Adafruit_NeoPixel.h>
+#include <ESPAsyncWebServer.h>
+#include <MFRC522.h>
+#include <SD.h>
+#include <SPI.h>
+#include <UniversalTelegramBot.h>
+#include <AsyncMqttClient.h>
+#include <HTTPClient.h>
+#include <WiFi.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <hal/gpio_ll.h>
+#include <sys/stat.h>
+#include <ucontext.h>
+#include <new>
+#include "shim/sim.h"
+
+namespace sim {
+
+static uint64_t clockUs = 0;
+int64_t epochAtZero = 0;
+bool wallClockValid = false;
+Costs costs;
+int pinLevel[64] = {};
+int relayPin = 4;
+int doorPin = 23;
+int rfidIrqPin = 34;
+std::deque<Card> cards;
+std::deque<TelegramIn> telegramInbox;
+InputRef lastInput;
+std::vector<uint64_t> cardDetectUs;
+Counters counters;
+Currents currents;
+uint64_t sleepUntilUs = 0;
+uint32_t loopNotifications = 0;
+bool lightSleep = false;
+uint64_t wifiListenUs = 102400; // Arduino arranca la WiFi con WIFI_PS_MIN_MODEM: DTIM1
+size_t heapCurrent = 0;
+size_t heapPeak = 0;
+uint64_t allocations = 0;
+bool tracking = false;
+std::string sdRoot = "sd_replay";
+bool serialEcho = false;
+std::string dumpDir;
+void (*onRelay)(bool on) = nullptr;
+void (*onTelegramSent)(const std::string& chatId, const std::string& text) = nullptr;
+int doorEdgesPending = 0;
+
+uint64_t nowUs() { return clockUs; }
+void advanceUs(uint64_t us) { clockUs += us; }
+
+}  // namespace sim
+
+// === MEMORIA ===
+// Cada bloque lleva delante su tamaño (0 si no se contó) para poder restarlo al liberarlo
+
+namespace {
+const size_t HEADER = alignof(std::max_align_t);
+
+void* trackedAlloc(size_t size) {
+  void* raw = malloc(size + HEADER);
+  if (!raw) throw std::bad_alloc();
+  *(size_t*)raw = sim::tracking ? size : 0;
+  if (sim::tracking) {
+    sim::heapCurrent += size;
+    sim::heapPeak = std::max(sim::heapPeak, sim::heapCurrent);
+    sim::allocations++;
+  }
+  return (uint8_t*)raw + HEADER;
+}
+
+void trackedFree(void* ptr) {
+  if (!ptr) return;
+  void* raw = (uint8_t*)ptr - HEADER;
+  sim::heapCurrent -= *(size_t*)raw;
+  free(raw);
+}
+}  // namespace
+
+void* operator new(size_t size) { return trackedAlloc(size); }
+void* operator new[](size_t size) { return trackedAlloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  try { return trackedAlloc(size); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  try { return trackedAlloc(size); } catch (...) { return nullptr; }
+}
+void operator delete(void* ptr) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { trackedFree(ptr); }
+
+#ifdef SIM_NEEDS_STRLCPY
+extern "C" size_t strlcpy(char* dst, const char* src, size_t size) {
+  size_t length = strlen(src);
+  if (size > 0) {
+    size_t n = std::min(length, size - 1);
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return length;
+}
+#endif
+
+// El firmware lee la hora con time(); esta definición sustituye a la de libc
+extern "C" time_t time(time_t* out) {
+  time_t now = (sim::wallClockValid ? sim::epochAtZero : 0) + (time_t)(sim::nowUs() / 1000000);
+  if (out) *out = now;
+  return now;
+}
+
+// === NÚCLEO ARDUINO ===
+
+HardwareSerial Serial;
+EspClass ESP;
+SPIClass SPI;
+WiFiClass WiFi;
+SDFS SD;
+
+size_t HardwareSerial::write(uint8_t c) { return write(&c, 1); }
+
+// A 115200 baudios cada byte tarda ~87 us y el ESP32 bloquea al llenarse la FIFO
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  sim::counters.serialBytes += size;
+  if (sim::costs.serialBaud) sim::advanceUs(size * 10ULL * 1000000ULL / sim::costs.serialBaud);
+  if (sim::serialEcho) fwrite(buffer, 1, size, stdout);
+  return size;
+}
+
+unsigned long millis() { return sim::nowUs() / 1000; }
+unsigned long micros() { return sim::nowUs(); }
+void delay(unsigned long ms) { sim::advanceUs(ms * 1000ULL); }
+void delayMicroseconds(unsigned us) { sim::advanceUs(us); }
+void yield() {}
+void pinMode(int pin, int mode) {
+  if (mode == INPUT_PULLUP && pin != sim::doorPin) sim::pinLevel[pin] = HIGH;
+}
+
+void digitalWrite(int pin, int level) {
+  bool changed = sim::pinLevel[pin] != level;
+  sim::pinLevel[pin] = level;
+  if (pin == sim::relayPin && changed && sim::onRelay) sim::onRelay(level == HIGH);
+}
+
+// Si la puerta cambió dos veces desde la última lectura, el firmware no vio ninguno de los dos cambios
+int digitalRead(int pin) {
+  if (pin == sim::doorPin) {
+    int missed = sim::doorEdgesPending - (sim::doorEdgesPending % 2);
+    sim::counters.droppedDoorEdges += missed;
+    sim::doorEdgesPending = 0;
+  }
+  return sim::pinLevel[pin];
+}
+
+// Las rutinas de interrupción se llaman entre iteraciones de loop(), como los
+// temporizadores. Las de nivel (ONLOW/ONHIGH) se disparan una vez por vuelta del
+// arnés mientras dure el nivel: el firmware tiene que invertirlas en la rutina
+struct SimIsr {
+  void (*handler)() = nullptr;
+  int mode = 0;
+  int level = -1; // Último nivel visto; -1 hasta la primera vuelta
+};
+static SimIsr isrs[64];
+static std::vector<int> isrPins; // Pines con rutina, para no recorrer los 64 en cada vuelta
+void attachInterrupt(int pin, void (*handler)(), int mode) {
+  if (pin < 0 || pin >= 64) return;
+  if (!isrs[pin].handler) isrPins.push_back(pin);
+  isrs[pin].handler = handler;
+  isrs[pin].mode = mode;
+  isrs[pin].level = -1;
+}
+void detachInterrupt(int pin) {
+  if (pin < 0 || pin >= 64 || !isrs[pin].handler) return;
+  isrs[pin].handler = nullptr;
+  isrPins.erase(std::find(isrPins.begin(), isrPins.end(), pin));
+}
+esp_err_t gpio_wakeup_enable(gpio_num_t pin, gpio_int_type_t type) {
+  if (pin >= 0 && pin < 64) isrs[pin].mode = type; // GPIO_INTR_* coincide con RISING..ONHIGH
+  return ESP_OK;
+}
+gpio_dev_t GPIO;
+void gpio_ll_wakeup_enable(gpio_dev_t*, gpio_num_t pin, gpio_int_type_t type) { gpio_wakeup_enable(pin, type); }
+esp_err_t esp_sleep_enable_gpio_wakeup() { return ESP_OK; }
+esp_err_t esp_pm_configure(const void* config) {
+  sim::lightSleep = static_cast<const esp_pm_config_esp32_t*>(config)->light_sleep_enable;
+  return ESP_OK;
+}
+bool WiFiClass::setSleep(wifi_ps_type_t type) {
+  sim::wifiListenUs = type == WIFI_PS_NONE ? 0 : type == WIFI_PS_MIN_MODEM ? 102400 : 3 * 102400;
+  return true;
+}
+long random(long max) { return max > 0 ? rand() % max : 0; }
+long random(long min, long max) { return max > min ? min + rand() % (max - min) : min; }
+uint32_t esp_random() { return ((uint32_t)rand() << 16) ^ (uint32_t)rand(); }
+
+bool getLocalTime(struct tm* info, uint32_t ms) {
+  if (!sim::wallClockValid) {
+    sim::advanceUs(ms * 1000ULL); // La función real espera a que llegue la hora
+    return false;
+  }
+  time_t now = time(nullptr);
+  localtime_r(&now, info);
+  return true;
+}
+
+void configTime(long, int, const char*, const char*, const char*) { sim::wallClockValid = true; }
+
+uint32_t EspClass::getFreeHeap() { return sim::HEAP_SIZE - std::min(sim::heapCurrent, sim::HEAP_SIZE); }
+uint32_t EspClass::getMinFreeHeap() { return sim::HEAP_SIZE - std::min(sim::heapPeak, sim::HEAP_SIZE); }
+uint32_t EspClass::getMaxAllocHeap() { return getFreeHeap(); }
+void EspClass::restart() {
+  fprintf(stderr, "[SIM] ESP.restart() llamado\n");
+  exit(2);
+}
+esp_reset_reason_t esp_reset_reason() { return ESP_RST_POWERON; }
+uint32_t esp_get_free_heap_size() { return ESP.getFreeHeap(); }
+
+// === FREERTOS (un solo hilo) ===
+
+struct SimSemaphore {
+  int count;
+  bool mutex;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return new SimSemaphore{1, true}; }
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return new SimSemaphore{1, true}; }
+SemaphoreHandle_t xSemaphoreCreateBinary() { return new SimSemaphore{0, false}; }
+
+// Con un solo hilo, tomar un mutex ya tomado sería un interbloqueo en el ESP32
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait) {
+  if (semaphore->count > 0) {
+    semaphore->count--;
+    return pdTRUE;
+  }
+  if (semaphore->mutex && wait == portMAX_DELAY) {
+    fprintf(stderr, "[SIM] Interbloqueo: mutex tomado dos veces por el mismo hilo\n");
+    abort();
+  }
+  sim::advanceUs(wait * 1000ULL);
+  return pdFALSE;
+}
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  semaphore->count++;
+  return pdTRUE;
+}
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t) {
+  semaphore->count--;
+  return pdTRUE;
+}
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore) {
+  semaphore->count++;
+  return pdTRUE;
+}
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t*) { return xSemaphoreGive(semaphore); }
+
+// La tarea de la réplica ("usersync") sí corre, en su propia pila y nunca a la vez
+// que loop(): vuelve al arnés cuando se bloquea (vTaskDelay, ulTaskNotifyTake o
+// esperando a la red) y sim::serviceTasks() la reanuda cuando vence su plazo. Así
+// sus esperas no retienen loop(). Las demás tareas (LED) solo se registran
+struct SimThread {
+  ucontext_t context;
+  ucontext_t caller;
+  void (*code)(void*);
+  void* parameter;
+  uint64_t wakeUs;
+  uint32_t notifications;
+  std::vector<uint8_t> stack;
+};
+static SimThread* syncThread = nullptr;
+static SimThread* runningThread = nullptr;
+
+static void simThreadEntry() {
+  runningThread->code(runningThread->parameter);
+  for (;;) sim::blockUs(UINT64_MAX); // Una tarea de FreeRTOS no vuelve nunca
+}
+
+namespace sim {
+
+void blockUs(uint64_t us) {
+  SimThread* thread = runningThread;
+  if (!thread) {
+    advanceUs(us);
+    return;
+  }
+  thread->wakeUs = us > UINT64_MAX - nowUs() ? UINT64_MAX : nowUs() + us;
+  runningThread = nullptr;
+  swapcontext(&thread->context, &thread->caller);
+}
+
+void serviceTasks() {
+  SimThread* thread = syncThread;
+  if (!thread || nowUs() < thread->wakeUs) return;
+  runningThread = thread;
+  swapcontext(&thread->caller, &thread->context);
+}
+
+}  // namespace sim
+
+BaseType_t xTaskCreatePinnedToCore(void (*code)(void*), const char* name, uint32_t, void* parameter, UBaseType_t,
+                                   TaskHandle_t* handle, BaseType_t) {
+  if (handle) *handle = nullptr;
+  if (strcmp(name, "usersync") != 0 || syncThread) return pdPASS;
+  SimThread* thread = new SimThread(); // Vive hasta el final: nunca se borra
+  thread->code = code;
+  thread->parameter = parameter;
+  thread->wakeUs = sim::nowUs();
+  thread->notifications = 0;
+  thread->stack.resize(256 * 1024); // La pila del anfitrión necesita más que los 8 KiB del ESP32
+  getcontext(&thread->context);
+  thread->context.uc_stack.ss_sp = thread->stack.data();
+  thread->context.uc_stack.ss_size = thread->stack.size();
+  thread->context.uc_link = nullptr;
+  makecontext(&thread->context, simThreadEntry, 0);
+  syncThread = thread;
+  if (handle) *handle = reinterpret_cast<SimTask*>(thread);
+  return pdPASS;
+}
+BaseType_t xTaskCreate(void (*code)(void*), const char* name, uint32_t stack, void* parameter, UBaseType_t priority, TaskHandle_t* handle) {
+  return xTaskCreatePinnedToCore(code, name, stack, parameter, priority, handle, tskNO_AFFINITY);
+}
+void vTaskDelay(TickType_t ticks) { sim::blockUs(ticks * 1000ULL); }
+void vTaskDelayUntil(TickType_t* previous, TickType_t increment) { *previous += increment; }
+TickType_t xTaskGetTickCount() { return millis(); }
+void vTaskDelete(TaskHandle_t) {}
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 0; }
+// Las notificaciones solo se modelan para la tarea de loop(), la única que corre.
+// Si no hay ninguna pendiente, ulTaskNotifyTake() vuelve enseguida y deja anotado
+// hasta cuándo espera; el arnés no vuelve a llamar a loop() hasta entonces
+static SimTask* const loopTask = reinterpret_cast<SimTask*>(&sim::loopNotifications);
+TaskHandle_t xTaskGetCurrentTaskHandle() { return runningThread ? reinterpret_cast<SimTask*>(runningThread) : loopTask; }
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) {
+  if (SimThread* thread = runningThread) {
+    if (!thread->notifications && wait) sim::blockUs(wait == portMAX_DELAY ? UINT64_MAX : wait * 1000ULL);
+    uint32_t count = thread->notifications;
+    thread->notifications = clear || !count ? 0 : count - 1;
+    return count;
+  }
+  uint32_t count = sim::loopNotifications;
+  if (count) {
+    sim::loopNotifications = clear ? 0 : count - 1;
+    return count;
+  }
+  if (wait) sim::sleepUntilUs = wait == portMAX_DELAY ? UINT64_MAX : sim::nowUs() + wait * 1000ULL;
+  return 0;
+}
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  if (task == loopTask) sim::loopNotifications++;
+  if (syncThread && task == reinterpret_cast<SimTask*>(syncThread)) {
+    syncThread->notifications++;
+    syncThread->wakeUs = std::min(syncThread->wakeUs, sim::nowUs()); // Sale de la espera en el siguiente servicio
+  }
+  return pdPASS;
+}
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* woken) {
+  xTaskNotifyGive(task);
+  if (woken) *woken = pdTRUE;
+}
+
+struct SimQueue {
+  size_t itemSize;
+  size_t capacity;
+  std::deque<std::vector<uint8_t>> items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) { return new SimQueue{itemSize, length, {}}; }
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t) {
+  if (queue->items.size() >= queue->capacity) return pdFALSE;
+  queue->items.emplace_back((const uint8_t*)item, (const uint8_t*)item + queue->itemSize);
+  return pdTRUE;
+}
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* item, TickType_t wait) { return xQueueSend(queue, item, wait); }
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void* item, BaseType_t*) { return xQueueSend(queue, item, 0); }
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t) {
+  if (queue->items.empty()) return pdFALSE;
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  queue->items.pop_front();
+  return pdTRUE;
+}
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) { return queue->items.size(); }
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) { return queue->capacity - queue->items.size(); }
+
+// Temporizadores: el arnés los dispara desde su bucle con simFireTimers()
+struct SimTimer {
+  esp_timer_create_args_t args;
+  uint64_t periodUs;
+  uint64_t dueUs;
+  bool active;
+};
+static std::vector<SimTimer*> timers;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle) {
+  *handle = new SimTimer{*args, 0, 0, false};
+  timers.push_back(*handle);
+  return ESP_OK;
+}
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t periodUs) {
+  timer->periodUs = periodUs;
+  timer->dueUs = sim::nowUs() + periodUs;
+  timer->active = true;
+  return ESP_OK;
+}
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeoutUs) {
+  timer->periodUs = 0;
+  timer->dueUs = sim::nowUs() + timeoutUs;
+  timer->active = true;
+  return ESP_OK;
+}
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  timer->active = false;
+  return ESP_OK;
+}
+int64_t esp_timer_get_time() { return sim::nowUs(); }
+
+void simFireTimers() {
+  for (SimTimer* timer : timers) {
+    while (timer->active && timer->dueUs <= sim::nowUs()) {
+      if (timer->periodUs) {
+        timer->dueUs += timer->periodUs;
+      } else {
+        timer->active = false;
+      }
+      timer->args.callback(timer->args.arg);
+    }
+  }
+}
+
+// === PERIFÉRICOS ===
+
+void Adafruit_NeoPixel::show() { sim::counters.pixelPushes++; }
+
+// El RC522 se modela a nivel de registros lo justo para las dos formas de detectar
+// tarjetas: el sondeo de la librería (REQA y espera activa leyendo ComIrqReg hasta
+// que responde la tarjeta o vence el temporizador) y el REQA armado a mano con la
+// IRQ del chip avisando del resultado
+namespace {
+const byte RC522_RX_IRQ = 0x20;
+const byte RC522_TIMER_IRQ = 0x01;
+byte rc522Command = MFRC522::PCD_Idle;
+byte rc522Irq = 0;        // ComIrqReg
+byte rc522IrqEnable = 0;  // ComIEnReg
+bool rc522Armed = false;  // REQA enviado, esperando respuesta
+uint16_t rc522Reload = 0; // TReloadReg: cuentas de 25 µs con el TPrescaler de PCD_Init
+uint64_t rc522ArmedUs = 0;
+
+void rc522Spi(uint32_t transactions) {
+  sim::counters.rfidSpi += transactions;
+  sim::counters.rfidBusyUs += (uint64_t)transactions * sim::costs.spiTransactionUs;
+  sim::advanceUs((uint64_t)transactions * sim::costs.spiTransactionUs);
+}
+
+void dropExpiredCards() {
+  while (!sim::cards.empty() && sim::cards.front().untilUs < sim::nowUs()) {
+    sim::cards.pop_front();
+    sim::counters.droppedCards++;
+  }
+}
+
+// Solo responde al REQA una tarjeta que ya estaba delante cuando se envió
+bool cardAnswers(uint64_t atUs) {
+  dropExpiredCards();
+  return !sim::cards.empty() && sim::cards.front().fromUs <= atUs && atUs <= sim::cards.front().untilUs;
+}
+
+void rc522Update() {
+  if (!rc522Armed) return;
+  if (cardAnswers(rc522ArmedUs)) {
+    if (sim::nowUs() < rc522ArmedUs + 1000) return; // REQA + ATQA, redondeado a la resolución de loop()
+    rc522Irq |= RC522_RX_IRQ;
+  } else {
+    if (sim::nowUs() < rc522ArmedUs + rc522Reload * 25ULL) return;
+    rc522Irq |= RC522_TIMER_IRQ;
+  }
+  rc522Armed = false;
+}
+}  // namespace
+
+void sim::serviceInterrupts() {
+  rc522Update();
+  // IRQ invertida: baja mientras haya una interrupción habilitada pendiente
+  sim::pinLevel[sim::rfidIrqPin] = (rc522Irq & rc522IrqEnable & 0x7F) ? LOW : HIGH;
+  for (size_t i = 0; i < isrPins.size(); i++) {
+    int pin = isrPins[i];
+    SimIsr& isr = isrs[pin];
+    int level = sim::pinLevel[pin];
+    int previous = isr.level;
+    isr.level = level;
+    bool fire = false;
+    switch (isr.mode) {
+      case RISING: fire = previous == LOW && level == HIGH; break;
+      case FALLING: fire = previous == HIGH && level == LOW; break;
+      case CHANGE: fire = previous >= 0 && previous != level; break;
+      case ONLOW: fire = level == LOW; break;
+      case ONHIGH: fire = level == HIGH; break;
+    }
+    if (fire) isr.handler();
+  }
+}
+
+void MFRC522::PCD_Init() {
+  rc522Command = PCD_Idle;
+  rc522Irq = 0;
+  rc522IrqEnable = 0;
+  rc522Armed = false;
+  rc522Reload = 1000; // 25 ms
+  rc522Spi(20);
+}
+
+byte MFRC522::PCD_ReadRegister(PCD_Register reg) {
+  rc522Spi(1);
+  rc522Update();
+  if (reg == VersionReg) return 0x92;
+  if (reg == ComIrqReg) return rc522Irq;
+  return 0;
+}
+
+void MFRC522::PCD_WriteRegister(PCD_Register reg, byte value) {
+  rc522Spi(1);
+  if (reg == ComIrqReg) {
+    if (value & 0x80) rc522Irq |= value & 0x7F;
+    else rc522Irq &= ~value;
+    // La línea sube en cuanto se borran las banderas: aunque loop() tarde en volver
+    // al arnés, la siguiente IRQ se ve como flanco de bajada, igual que en el chip
+    SimIsr& isr = isrs[sim::rfidIrqPin];
+    if (!(rc522Irq & rc522IrqEnable & 0x7F) && isr.level == LOW) isr.level = HIGH;
+  } else if (reg == ComIEnReg) {
+    rc522IrqEnable = value;
+  } else if (reg == TReloadRegH) {
+    rc522Reload = (rc522Reload & 0x00FF) | (value << 8);
+  } else if (reg == TReloadRegL) {
+    rc522Reload = (rc522Reload & 0xFF00) | value;
+  } else if (reg == CommandReg) {
+    rc522Command = value;
+    if (value == PCD_Idle) rc522Armed = false;
+  } else if (reg == BitFramingReg && (value & 0x80) && rc522Command == PCD_Transceive) {
+    rc522Armed = true;
+    rc522ArmedUs = sim::nowUs();
+  }
+}
+void MFRC522::PCD_SetRegisterBitMask(PCD_Register, byte) { rc522Spi(2); }
+void MFRC522::PCD_ClearRegisterBitMask(PCD_Register, byte) { rc522Spi(2); }
+
+// Como PICC_REQA de la librería: 8 accesos para preparar el REQA y después lecturas
+// de ComIrqReg sin pausa hasta la respuesta o hasta que vence el temporizador del chip.
+// Las tarjetas que se retiraron antes de que el firmware sondeara el lector se pierden
+bool MFRC522::PICC_IsNewCardPresent() {
+  rc522Spi(8);
+  uint64_t sentUs = sim::nowUs();
+  bool present = cardAnswers(sentUs);
+  uint64_t waitUs = present ? 1000 : rc522Reload * 25ULL;
+  uint32_t reads = std::max<uint64_t>(1, waitUs / sim::costs.spiTransactionUs);
+  sim::counters.rfidSpi += reads;
+  sim::counters.rfidBusyUs += waitUs;
+  sim::advanceUs(waitUs);
+  return present;
+}
+
+// Anticolisión y selección (cascada 1 o 2): dos intercambios con la tarjeta
+bool MFRC522::PICC_ReadCardSerial() {
+  uint64_t before = sim::counters.rfidSpi;
+  rc522Spi(40);
+  sim::counters.rfidSpiRead += sim::counters.rfidSpi - before;
+  if (sim::cards.empty()) return false;
+  const sim::Card& card = sim::cards.front();
+  uid.size = card.size;
+  memcpy(uid.uidByte, card.uid, card.size);
+  sim::lastInput = {sim::INPUT_CARD, card.fromUs};
+  bool tracked = sim::tracking; // La muestra es del arnés, no del firmware
+  sim::tracking = false;
+  sim::cardDetectUs.push_back(sim::nowUs() - card.fromUs);
+  sim::tracking = tracked;
+  sim::cards.pop_front();
+  sim::counters.cardsRead++;
+  return true;
+}
+
+MFRC522::StatusCode MFRC522::PICC_RequestA(byte*, byte*) {
+  return PICC_IsNewCardPresent() ? STATUS_OK : STATUS_TIMEOUT;
+}
+
+int UniversalTelegramBot::getUpdates(long offset) {
+  sim::advanceUs(sim::costs.telegramPollUs);
+  sim::counters.radioUs += sim::costs.telegramPollUs;
+  sim::counters.telegramPolls++;
+  int count = 0;
+  while (count < HANDLE_MESSAGES && !sim::telegramInbox.empty() && sim::telegramInbox.front().atUs <= sim::nowUs()) {
+    const sim::TelegramIn& in = sim::telegramInbox.front();
+    telegramMessage& message = messages[count++];
+    message = telegramMessage();
+    message.chat_id = in.chatId;
+    message.from_id = in.chatId;
+    message.text = in.text;
+    message.query_id = in.queryId;
+    message.type = in.queryId.empty() ? "message" : "callback_query";
+    message.update_id = ++last_message_received;
+    message.message_id = message.update_id;
+    sim::lastInput = {sim::INPUT_TELEGRAM, in.atUs};
+    sim::telegramInbox.pop_front();
+  }
+  return count;
+}
+
+bool UniversalTelegramBot::sendMessage(const String& chatId, const String& text, const String&) {
+  sim::advanceUs(sim::costs.telegramSendUs);
+  sim::counters.radioUs += sim::costs.telegramSendUs;
+  sim::counters.telegramSent++;
+  if (sim::onTelegramSent) sim::onTelegramSent(chatId.s, text.s);
+  return true;
+}
+
+bool UniversalTelegramBot::sendMessageWithInlineKeyboard(const String& chatId, const String& text, const String& parseMode,
+                                                         const String&, int) {
+  return sendMessage(chatId, text, parseMode);
+}
+
+bool UniversalTelegramBot::answerCallbackQuery(const String&, const String&, bool, const String&, int) {
+  sim::advanceUs(sim::costs.telegramSendUs);
+  sim::counters.radioUs += sim::costs.telegramSendUs;
+  return true;
+}
+
+// === BROKER MQTT ===
+
+namespace {
+
+struct MqttAck {
+  uint64_t atUs;
+  uint16_t packetId;
+};
+
+AsyncMqttClient* mqttClient = nullptr;
+bool mqttLinked = false;
+uint64_t mqttConnectAtUs = 0; // 0 = sin conexión en curso
+uint16_t mqttNextId = 0;
+std::deque<MqttAck> mqttAcks;
+
+void mqttDrop() {
+  mqttLinked = false;
+  mqttAcks.clear();
+  if (mqttClient && mqttClient->disconnectCallback) {
+    mqttClient->disconnectCallback(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+  }
+}
+
+}  // namespace
+
+namespace sim {
+
+bool mqttBrokerUp = true;
+std::vector<uint8_t> mqttSeen;
+
+void setMqttBroker(bool up) {
+  mqttBrokerUp = up;
+  if (!up && mqttLinked) mqttDrop();
+}
+
+void serviceMqtt() {
+  if (!mqttClient) return;
+  if (mqttConnectAtUs && mqttConnectAtUs <= nowUs()) {
+    mqttConnectAtUs = 0;
+    if (mqttBrokerUp) {
+      mqttLinked = true;
+      counters.mqttConnects++;
+      if (mqttClient->connectCallback) mqttClient->connectCallback(false);
+    } else {
+      mqttDrop();
+    }
+  }
+  while (mqttLinked && !mqttAcks.empty() && mqttAcks.front().atUs <= nowUs()) {
+    uint16_t packetId = mqttAcks.front().packetId;
+    mqttAcks.pop_front();
+    if (mqttClient->publishCallback) mqttClient->publishCallback(packetId);
+  }
+}
+
+}  // namespace sim
+
+bool AsyncMqttClient::connected() const { return mqttLinked; }
+
+void AsyncMqttClient::connect() {
+  mqttClient = this;
+  if (!mqttLinked && !mqttConnectAtUs) mqttConnectAtUs = sim::nowUs() + sim::costs.mqttRttUs;
+}
+
+void AsyncMqttClient::disconnect(bool) {
+  if (mqttLinked) mqttDrop();
+}
+
+uint16_t AsyncMqttClient::publish(const char* topic, uint8_t qos, bool, const char* payload, size_t length, bool, uint16_t) {
+  if (!mqttLinked) return 0;
+  sim::counters.mqttMessages++;
+  sim::counters.mqttBytes += length;
+  sim::counters.radioUs += sim::costs.mqttRadioUs;
+  std::string text(payload ? payload : "", length);
+  for (size_t at = text.find("\"seq\":"); at != std::string::npos; at = text.find("\"seq\":", at + 1)) {
+    size_t seq = strtoul(text.c_str() + at + 6, nullptr, 10);
+    if (seq >= sim::mqttSeen.size()) sim::mqttSeen.resize(seq + 1);
+    if (sim::mqttSeen[seq]++ > 0) sim::counters.mqttDuplicates++;
+    else sim::counters.mqttEvents++;
+  }
+  if (qos == 0) return 1;
+  if (++mqttNextId == 0) mqttNextId = 1;
+  mqttAcks.push_back({sim::nowUs() + sim::costs.mqttRttUs, mqttNextId});
+  return mqttNextId;
+}
+
+// === PAR DE LA RÉPLICA ===
+// Mismo protocolo que handleUsersChanges(): diario con versiones consecutivas
+// desde 1, lotes de 128 cambios y la tabla completa si el cliente no lo conoce
+
+namespace {
+
+const uint32_t PEER_LOG_ID = 0x5eed0001;
+const uint32_t PEER_BATCH = 128;
+std::vector<sim::PeerUser> peerUsers;
+std::vector<std::string> peerLog; // Versiones desde 2, como un diario recién creado: la v está en peerLog[v - 2]
+
+std::string peerLine(const sim::PeerUser& user) {
+  return user.name + "," + user.pin + "," + user.uid + "," + user.schedule;
+}
+
+std::string peerHeader(uint32_t through, const char* mode) {
+  char header[64];
+  snprintf(header, sizeof(header), "#usersync,%08x,%u,%u,%s\n", PEER_LOG_ID, through, sim::peerVersion(), mode);
+  return header;
+}
+
+// Campo de un formulario "a=1&b=2"
+std::string formValue(const std::string& form, const char* name) {
+  std::string key = std::string(name) + "=";
+  size_t at = ("&" + form).find("&" + key);
+  if (at == std::string::npos) return "";
+  at += key.size();
+  return form.substr(at, form.find('&', at) - at);
+}
+
+}  // namespace
+
+namespace sim {
+
+bool peerUp = true;
+
+void peerSet(const PeerUser& user) {
+  auto it = std::find_if(peerUsers.begin(), peerUsers.end(), [&](const PeerUser& u) { return u.name == user.name; });
+  if (it != peerUsers.end()) *it = user;
+  else peerUsers.push_back(user);
+  peerLog.push_back("A," + std::to_string(peerLog.size() + 2) + "," + peerLine(user));
+}
+
+void peerErase(const std::string& name) {
+  auto it = std::find_if(peerUsers.begin(), peerUsers.end(), [&](const PeerUser& u) { return u.name == name; });
+  if (it == peerUsers.end()) return;
+  peerUsers.erase(it);
+  peerLog.push_back("B," + std::to_string(peerLog.size() + 2) + "," + name);
+}
+
+const std::vector<PeerUser>& peerTable() { return peerUsers; }
+uint32_t peerVersion() { return peerLog.size() + 1; }
+
+}  // namespace sim
+
+// Con el par caído no hay respuesta al SYN: la conexión agota su plazo
+int HTTPClient::POST(const String& payload) {
+  sim::counters.httpRequests++;
+  if (!sim::peerUp) {
+    sim::blockUs(connectTimeoutMs * 1000ULL);
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+  sim::blockUs(sim::costs.netRttUs);
+  sim::counters.radioUs += sim::costs.netRttUs;
+  std::string target = url.s;
+  std::string form = payload.s;
+  if (target.find("/api/users/changes") == std::string::npos) return 404;
+  if (formValue(form, "password") != "admin") return 401;
+  uint32_t id = strtoul(formValue(form, "id").c_str(), nullptr, 16);
+  uint32_t since = strtoul(formValue(form, "since").c_str(), nullptr, 10);
+  uint32_t version = sim::peerVersion();
+  if (id != PEER_LOG_ID || since < 1 || since > version) {
+    sim::counters.httpFull++;
+    body = peerHeader(version, "completo");
+    for (const sim::PeerUser& user : peerUsers) body += "A," + std::to_string(version) + "," + peerLine(user) + "\n";
+  } else {
+    uint32_t through = std::min(version, since + PEER_BATCH);
+    body = peerHeader(through, "delta");
+    for (uint32_t v = since + 1; v <= through; v++) body += peerLog[v - 2] + "\n";
+  }
+  return HTTP_CODE_OK;
+}
+
+int HTTPClient::writeToStream(Stream* stream) {
+  size_t chargedUs = body.size() * sim::costs.netKiBUs / 1024;
+  sim::blockUs(chargedUs);
+  sim::counters.radioUs += chargedUs;
+  sim::counters.httpBytes += body.size();
+  stream->write((const uint8_t*)body.data(), body.size());
+  return body.size();
+}
+
+// === TARJETA SD ===
+
+static std::string hostPath(const char* path) { return sim::sdRoot + path; }
+
+static void chargeSd(size_t bytes) { sim::advanceUs(bytes * sim::costs.sdKiBUs / 1024); }
+
+File SDFS::open(const char* path, const char* mode, bool) {
+  sim::advanceUs(sim::costs.sdOpenUs);
+  sim::counters.sdOpens++;
+  std::string host = hostPath(path);
+  const char* hostMode = mode;
+  if (strcmp(mode, "r+") == 0) {
+    hostMode = "r+b";
+  } else if (mode[0] == 'w') {
+    hostMode = "w+b";
+  } else if (mode[0] == 'a') {
+    hostMode = "a+b";
+  } else {
+    hostMode = "rb";
+  }
+  FILE* f = fopen(host.c_str(), hostMode);
+  if (!f) return File();
+  return File(std::shared_ptr<FILE>(f, [](FILE* file) { fclose(file); }), path);
+}
+
+bool SDFS::exists(const char* path) {
+  struct stat info;
+  return stat(hostPath(path).c_str(), &info) == 0;
+}
+bool SDFS::remove(const char* path) { return ::remove(hostPath(path).c_str()) == 0; }
+bool SDFS::rename(const char* from, const char* to) { return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0; }
+bool SDFS::mkdir(const char* path) { return ::mkdir(hostPath(path).c_str(), 0755) == 0 || errno == EEXIST; }
+uint64_t SDFS::usedBytes() { return sim::counters.sdBytesWritten; }
+
+size_t File::write(const uint8_t* buffer, size_t size) {
+  if (!handle) return 0;
+  size_t n = fwrite(buffer, 1, size, handle.get());
+  sim::counters.sdBytesWritten += n;
+  chargeSd(n);
+  return n;
+}
+
+int File::available() {
+  if (!handle) return 0;
+  sim::advanceUs(sim::costs.sdCallUs);
+  long here = ftell(handle.get());
+  return (int)(size() - here);
+}
+
+// Byte a byte: cada llamada cuesta sdCallUs y cada sector nuevo, una orden y 512 bytes
+int File::read() {
+  if (!handle) return -1;
+  sim::advanceUs(sim::costs.sdCallUs);
+  long at = ftell(handle.get());
+  int c = fgetc(handle.get());
+  if (c >= 0) {
+    sim::counters.sdBytesRead++;
+    if (at % 512 == 0) {
+      sim::advanceUs(sim::costs.sdCommandUs);
+      chargeSd(512);
+    }
+  }
+  return c;
+}
+
+int File::peek() {
+  if (!handle) return -1;
+  int c = fgetc(handle.get());
+  if (c >= 0) ungetc(c, handle.get());
+  return c;
+}
+
+// Por bloques: una llamada y una lectura de varios sectores seguidos
+size_t File::read(uint8_t* buffer, size_t size) {
+  if (!handle) return 0;
+  sim::advanceUs(sim::costs.sdCallUs);
+  size_t n = fread(buffer, 1, size, handle.get());
+  sim::counters.sdBytesRead += n;
+  if (n > 0) sim::advanceUs(sim::costs.sdCommandUs);
+  chargeSd(n);
+  return n;
+}
+
+bool File::seek(uint32_t position) { return handle && fseek(handle.get(), position, SEEK_SET) == 0; }
+size_t File::position() { return handle ? ftell(handle.get()) : 0; }
+
+size_t File::size() {
+  if (!handle) return 0;
+  fflush(handle.get());
+  struct stat info;
+  return fstat(fileno(handle.get()), &info) == 0 ? info.st_size : 0;
+}
+
+void File::flush() {
+  if (handle) fflush(handle.get());
+}
+
+void File::close() {
+  if (handle) sim::advanceUs(sim::costs.sdOpenUs / 2);
+  handle.reset();
+}
+
+// === SERVIDOR WEB ===
+
+static String urlDecode(const String& text) {
+  std::string out;
+  for (size_t i = 0; i < text.length(); i++) {
+    char c = text[i];
+    if (c == '+') {
+      out += ' ';
+    } else if (c == '%' && i + 2 < text.length()) {
+      out += (char)strtol(text.substring(i + 1, i + 3).c_str(), nullptr, 16);
+      i += 2;
+    } else {
+      out += c;
+    }
+  }
+  return String(out);
+}
+
+AsyncWebServerRequest::AsyncWebServerRequest(WebRequestMethod method, const String& url, const String& contentType)
+    : _method(method), _contentType(contentType) {
+  int query = url.indexOf('?');
+  _path = query < 0 ? url : url.substring(0, query);
+  if (query < 0) return;
+  String rest = url.substring(query + 1);
+  while (rest.length() > 0) {
+    int amp = rest.indexOf('&');
+    String pair = amp < 0 ? rest : rest.substring(0, amp);
+    rest = amp < 0 ? String() : rest.substring(amp + 1);
+    int eq = pair.indexOf('=');
+    if (eq < 0) {
+      addParam(urlDecode(pair), "");
+    } else {
+      addParam(urlDecode(pair.substring(0, eq)), urlDecode(pair.substring(eq + 1)));
+    }
+  }
+}
+
+AsyncWebServerRequest::~AsyncWebServerRequest() {
+  if (_onDisconnect) _onDisconnect();
+  for (AsyncWebParameter* param : _params) delete param;
+  free(_tempObject); // Igual que la librería real
+}
+
+// El arnés no distingue parámetros de la URL y del cuerpo
+bool AsyncWebServerRequest::hasParam(const String& name, bool, bool) const { return getParam(name) != nullptr; }
+
+AsyncWebParameter* AsyncWebServerRequest::getParam(const String& name, bool, bool) const {
+  for (AsyncWebParameter* param : _params) {
+    if (param->name() == name) return param;
+  }
+  return nullptr;
+}
+
+// Guarda el cuerpo de la respuesta con --volcar para inspeccionarlo después
+static FILE* openDump(const String& path) {
+  static int sequence = 0;
+  if (sim::dumpDir.empty()) return nullptr;
+  std::string name = path.c_str();
+  for (char& c : name) {
+    if (c == '/' || c == '?' || c == '&' || c == '=') c = '_';
+  }
+  char prefix[16];
+  snprintf(prefix, sizeof(prefix), "/%03d", ++sequence);
+  return fopen((sim::dumpDir + prefix + name).c_str(), "wb");
+}
+
+void AsyncWebServerRequest::send(int code, const String& contentType, const String& content) {
+  answered = true;
+  responseCode = code;
+  responseBytes = content.length();
+  if (FILE* dump = openDump(_path)) {
+    fwrite(content.c_str(), 1, content.length(), dump);
+    fclose(dump);
+  }
+}
+
+// Las respuestas por trozos se vacían aquí mismo, como haría la pila TCP
+void AsyncWebServerRequest::send(AsyncWebServerResponse* response) {
+  answered = true;
+  responseCode = response->code;
+  responseBytes = response->body.length();
+  FILE* dump = openDump(_path);
+  if (response->filler) {
+    uint8_t buffer[1460];
+    size_t index = 0, n;
+    while ((n = response->filler(buffer, sizeof(buffer), index)) > 0) {
+      if (dump) fwrite(buffer, 1, n, dump);
+      index += n;
+    }
+    responseBytes = index;
+  } else if (dump) {
+    fwrite(response->body.c_str(), 1, response->body.length(), dump);
+  }
+  if (dump) fclose(dump);
+  delete response;
+}
+
+AsyncWebServerResponse* AsyncWebServerRequest::beginResponse(int code, const String& contentType, const String& content) {
+  AsyncWebServerResponse* response = new AsyncWebServerResponse();
+  response->code = code;
+  response->contentType = contentType;
+  response->body = content;
+  return response;
+}
+
+AsyncWebServerResponse* AsyncWebServerRequest::beginChunkedResponse(const String& contentType, AwsResponseFiller filler) {
+  AsyncWebServerResponse* response = new AsyncWebServerResponse();
+  response->contentType = contentType;
+  response->filler = filler;
+  return response;
+}
+
+AsyncCallbackWebHandler& AsyncWebServer::on(const char* path, WebRequestMethod method, ArRequestHandlerFunction onRequest,
+                                            ArUploadHandlerFunction onUpload, ArBodyHandlerFunction onBody) {
+  handlers.push_back(new AsyncCallbackWebHandler{path, method, onRequest, onUpload, onBody});
+  return *handlers.back();
+}
+
+const AsyncCallbackWebHandler* AsyncWebServer::find(const String& path, WebRequestMethod method) const {
+  for (const AsyncCallbackWebHandler* handler : handlers) {
+    if (handler->path == path && (handler->method & method)) return handler;
+  }
+  return nullptr;
+}